@@ -0,0 +1,409 @@
+#include <glib.h>
+#include <string.h>
+
+#include "alarm.h"
+#include "values.h"
+#include "profile.h"
+#include "debug.h"
+
+/** @file alarm.c
+ * @Brief Threshold alarm implementation
+ *
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define ALARM_WORDS ((ALARM_MAX_RULES + 31) / 32)
+
+/******************** LOCAL VARIABLE DECLARATION SECTION **********************/
+
+enum rule_state
+{
+    STATE_NORMAL,
+    STATE_PENDING_ON,       /* Condition holds, waiting for on delay */
+    STATE_ACTIVE,
+    STATE_PENDING_OFF       /* Cleared, waiting for off delay */
+};
+
+struct rule
+{
+    gchar name[VALUES_NAME_SIZE];
+    gint point;             /* -1 until the point exists */
+    gint next;              /* Next rule of the same point, -1 for last */
+    enum alarm_condition condition;
+    gdouble threshold;
+    gdouble hysteresis;
+    gint64 on_delay_us;
+    gint64 off_delay_us;
+    enum alarm_level level;
+    gboolean hide_normal;
+
+    enum rule_state state;
+    gint64 deadline_us;     /* End of running delay */
+};
+
+struct alarm
+{
+    struct rule *rules;
+    guint n_rules;
+    alarm_func changed;
+
+    /* Rules of each point as a linked list through rule.next */
+    gint first_rule[VALUES_MAX_POINTS];
+    guint8 level[VALUES_MAX_POINTS];
+    gboolean hide_normal[VALUES_MAX_POINTS];
+
+    /* Points with rules and their changes at last update */
+    gint watched[VALUES_MAX_POINTS];
+    guint n_watched;
+    guint32 seen_changes[VALUES_MAX_POINTS];
+    guint32 seen_generation;
+    guint seen_points;
+    guint n_unresolved;
+
+    /* Rules with a delay running */
+    guint32 pending[ALARM_WORDS];
+    guint timer;
+
+    guint32 generation;
+};
+
+/**
+ * Alarm state, NULL when there are no rules.
+ */
+static struct alarm *alarms = NULL;
+
+/******************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static void resolve(void);
+
+static gboolean condition_on(const struct rule *r, gdouble value);
+
+static gboolean condition_off(const struct rule *r, gdouble value);
+
+static void evaluate(guint index, gdouble value, gint64 now);
+
+static void update_level(gint point);
+
+static void schedule(gint64 now);
+
+static gboolean on_timer(gpointer data);
+
+/******************** LOCAL FUNCTION DEFINTION SECTION ************************/
+
+static void resolve(void)
+{
+    guint i = 0;
+
+    alarms->n_unresolved = 0;
+
+    for (; i < alarms->n_rules; i++) {
+        struct rule *r = &alarms->rules[i];
+
+        if (r->point >= 0) {
+            continue;
+        }
+
+        r->point = values_lookup(r->name);
+
+        if (r->point < 0) {
+            alarms->n_unresolved++;
+            continue;
+        }
+
+        /* First rule of the point, start watching it */
+        if (alarms->first_rule[r->point] < 0) {
+            alarms->watched[alarms->n_watched++] = r->point;
+
+            /* Force evaluation of the current value */
+            alarms->seen_changes[r->point] =
+                values_get(r->point)->changes - 1;
+        }
+
+        r->next = alarms->first_rule[r->point];
+        alarms->first_rule[r->point] = i;
+        alarms->hide_normal[r->point] |= r->hide_normal;
+    }
+
+    /* Make sure new points are looked at */
+    alarms->seen_generation = values_generation() - 1;
+}
+
+static gboolean condition_on(const struct rule *r, gdouble value)
+{
+    return r->condition == ALARM_ABOVE ? value > r->threshold :
+        value < r->threshold;
+}
+
+static gboolean condition_off(const struct rule *r, gdouble value)
+{
+    return r->condition == ALARM_ABOVE ?
+        value <= r->threshold - r->hysteresis :
+        value >= r->threshold + r->hysteresis;
+}
+
+static void evaluate(guint index, gdouble value, gint64 now)
+{
+    struct rule *r = &alarms->rules[index];
+
+    switch (r->state) {
+        case STATE_NORMAL:
+            if (condition_on(r, value)) {
+                r->state = STATE_PENDING_ON;
+                r->deadline_us = now + r->on_delay_us;
+            }
+            break;
+        case STATE_PENDING_ON:
+            if (!condition_on(r, value)) {
+                r->state = STATE_NORMAL;
+            }
+            break;
+        case STATE_ACTIVE:
+            if (condition_off(r, value)) {
+                r->state = STATE_PENDING_OFF;
+                r->deadline_us = now + r->off_delay_us;
+            }
+            break;
+        case STATE_PENDING_OFF:
+            if (!condition_off(r, value)) {
+                r->state = STATE_ACTIVE;
+            }
+            break;
+    }
+
+    if (r->state == STATE_PENDING_ON && now >= r->deadline_us) {
+        r->state = STATE_ACTIVE;
+    } else if (r->state == STATE_PENDING_OFF && now >= r->deadline_us) {
+        r->state = STATE_NORMAL;
+    }
+
+    if (r->state == STATE_PENDING_ON || r->state == STATE_PENDING_OFF) {
+        alarms->pending[index / 32] |= 1u << (index % 32);
+    } else {
+        alarms->pending[index / 32] &= ~(1u << (index % 32));
+    }
+}
+
+static void update_level(gint point)
+{
+    enum alarm_level level = ALARM_LEVEL_NONE;
+    gint i = alarms->first_rule[point];
+
+    for (; i >= 0; i = alarms->rules[i].next) {
+        const struct rule *r = &alarms->rules[i];
+
+        if (r->state == STATE_ACTIVE || r->state == STATE_PENDING_OFF) {
+            level = MAX(level, r->level);
+        }
+    }
+
+    if (level == alarms->level[point]) {
+        return;
+    }
+
+    DBG_LOG("Alarm level of %s %d -> %d", values_get(point)->name,
+        alarms->level[point], level);
+
+    alarms->level[point] = level;
+    alarms->generation++;
+
+    if (alarms->changed) {
+        alarms->changed(point, level);
+    }
+}
+
+static void schedule(gint64 now)
+{
+    gint64 deadline = G_MAXINT64;
+    guint word = 0;
+
+    if (alarms->timer) {
+        g_source_remove(alarms->timer);
+        alarms->timer = 0;
+    }
+
+    for (; word < ALARM_WORDS; word++) {
+        guint32 bits = alarms->pending[word];
+
+        while (bits) {
+            guint bit = __builtin_ctz(bits);
+            bits &= bits - 1;
+
+            deadline = MIN(deadline, alarms->rules[word * 32 + bit].deadline_us);
+        }
+    }
+
+    if (deadline == G_MAXINT64) {
+        return;
+    }
+
+    /* Round up, waking up early would only reschedule */
+    guint ms = (MAX(deadline - now, 0) + 999) / 1000;
+    alarms->timer = profile_timeout_add("alarm hold", ms, on_timer, NULL);
+}
+
+static gboolean on_timer(gpointer data)
+{
+    alarms->timer = 0;
+    alarm_update();
+
+    return G_SOURCE_REMOVE;
+}
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+guint alarm_init(const struct alarm_rule *rules, gsize n_rules,
+                 alarm_func changed)
+{
+    g_assert(rules || !n_rules);
+
+    alarm_cleanup();
+
+    if (n_rules > ALARM_MAX_RULES) {
+        ERR("Only the first %d alarm rules are used", ALARM_MAX_RULES);
+        n_rules = ALARM_MAX_RULES;
+    }
+
+    alarms = g_new0(struct alarm, 1);
+    alarms->rules   = g_new0(struct rule, n_rules);
+    alarms->n_rules = n_rules;
+    alarms->changed = changed;
+
+    guint i = 0;
+    for (; i < VALUES_MAX_POINTS; i++) {
+        alarms->first_rule[i] = -1;
+    }
+
+    for (i = 0; i < n_rules; i++) {
+        struct rule *r = &alarms->rules[i];
+
+        g_strlcpy(r->name, rules[i].point, sizeof(r->name));
+        r->point        = -1;
+        r->next         = -1;
+        r->condition    = rules[i].condition;
+        r->threshold    = rules[i].threshold;
+        r->hysteresis   = MAX(rules[i].hysteresis, 0);
+        r->on_delay_us  = (gint64) rules[i].on_delay_ms * 1000;
+        r->off_delay_us = (gint64) rules[i].off_delay_ms * 1000;
+        r->level        = rules[i].level;
+        r->hide_normal  = rules[i].hide_normal;
+    }
+
+    alarms->n_unresolved = n_rules;
+
+    return n_rules;
+}
+
+void alarm_cleanup(void)
+{
+    if (!alarms) {
+        return;
+    }
+
+    if (alarms->timer) {
+        g_source_remove(alarms->timer);
+    }
+
+    g_free(alarms->rules);
+    g_free(alarms);
+    alarms = NULL;
+}
+
+guint alarm_update(void)
+{
+    if (!alarms || !alarms->n_rules) {
+        return 0;
+    }
+
+    gint64 now = g_get_monotonic_time();
+    guint n_evaluated = 0;
+    guint i = 0;
+
+    if (alarms->n_unresolved && alarms->seen_points != values_count()) {
+        alarms->seen_points = values_count();
+        resolve();
+    }
+
+    /* Rules with a delay running, run before the changed points so a
+     * change can restart a delay after it expired.
+     */
+    for (; i < ALARM_WORDS; i++) {
+        guint32 bits = alarms->pending[i];
+
+        while (bits) {
+            guint bit = __builtin_ctz(bits);
+            guint index = i * 32 + bit;
+            const struct rule *r = &alarms->rules[index];
+
+            bits &= bits - 1;
+
+            if (now < r->deadline_us) {
+                continue;
+            }
+
+            evaluate(index, values_get(r->point)->number, now);
+            update_level(r->point);
+            n_evaluated++;
+        }
+    }
+
+    if (alarms->seen_generation != values_generation()) {
+        alarms->seen_generation = values_generation();
+
+        for (i = 0; i < alarms->n_watched; i++) {
+            gint point = alarms->watched[i];
+            const value_point *p = values_get(point);
+
+            if (alarms->seen_changes[point] == p->changes) {
+                continue;
+            }
+            alarms->seen_changes[point] = p->changes;
+
+            gint index = alarms->first_rule[point];
+            for (; index >= 0; index = alarms->rules[index].next) {
+                evaluate(index, p->number, now);
+                n_evaluated++;
+            }
+            update_level(point);
+        }
+    }
+
+    if (n_evaluated || !alarms->timer) {
+        schedule(now);
+    }
+
+    return n_evaluated;
+}
+
+enum alarm_level alarm_get_level(gint point)
+{
+    if (!alarms || point < 0 || point >= VALUES_MAX_POINTS) {
+        return ALARM_LEVEL_NONE;
+    }
+
+    return alarms->level[point];
+}
+
+gboolean alarm_has_rules(gint point)
+{
+    if (!alarms || point < 0 || point >= VALUES_MAX_POINTS) {
+        return FALSE;
+    }
+
+    return alarms->first_rule[point] >= 0;
+}
+
+gboolean alarm_get_visible(gint point)
+{
+    if (!alarms || point < 0 || point >= VALUES_MAX_POINTS) {
+        return TRUE;
+    }
+
+    return !alarms->hide_normal[point] ||
+        alarms->level[point] != ALARM_LEVEL_NONE;
+}
+
+guint32 alarm_generation(void)
+{
+    return alarms ? alarms->generation : 0;
+}
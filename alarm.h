@@ -0,0 +1,104 @@
+#ifndef INCLUSION_GUARD_ALARM_H
+#define INCLUSION_GUARD_ALARM_H
+
+#include <glib.h>
+
+/** @file alarm.h
+ * @Brief Threshold alarms on value cache points
+ *
+ * A rule raises an alarm when its point goes above or below a threshold
+ * and clears it once the value is back past the threshold by the
+ * hysteresis. Raising and clearing can be delayed, the condition then has
+ * to hold for the whole delay. A point can have several rules, its alarm
+ * level is the highest level of its active rules.
+ *
+ * Rules are only evaluated for points that changed and for rules with a
+ * delay running, unchanged points cost nothing.
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define ALARM_MAX_RULES (512)
+
+/******************** TYPE DEFINITION SECTION *********************************/
+
+enum alarm_condition
+{
+    ALARM_ABOVE,
+    ALARM_BELOW
+};
+
+enum alarm_level
+{
+    ALARM_LEVEL_NONE,
+    ALARM_LEVEL_WARNING,
+    ALARM_LEVEL_CRITICAL
+};
+
+/**
+ * Description of one alarm rule.
+ */
+struct alarm_rule
+{
+    const gchar *point;         /* Name of value cache point */
+    enum alarm_condition condition;
+    gdouble threshold;
+    gdouble hysteresis;         /* Clears at threshold -/+ hysteresis */
+    guint on_delay_ms;          /* Condition must hold this long to raise */
+    guint off_delay_ms;         /* and to clear */
+    enum alarm_level level;
+    gboolean hide_normal;       /* Only show the point while in alarm */
+};
+
+/**
+ * Called when the alarm level of a point changed.
+ */
+typedef void (*alarm_func)(gint point, enum alarm_level level);
+
+/******************** GLOBAL FUNCTION DECLARATION SECTION *********************/
+
+/**
+ * Set up rules. The descriptions are not referenced after the call.
+ *
+ * @param changed Called for each alarm level change, may be NULL.
+ *
+ * @return Number of rules used.
+ */
+guint alarm_init(const struct alarm_rule *rules, gsize n_rules,
+                 alarm_func changed);
+
+/**
+ * Release all rules.
+ */
+void alarm_cleanup(void);
+
+/**
+ * Evaluate rules of points that changed since the last call, call at the
+ * end of every poll cycle. Delays are handled by an internal timer.
+ *
+ * @return Number of rules evaluated.
+ */
+guint alarm_update(void);
+
+/**
+ * Get alarm level of a point.
+ */
+enum alarm_level alarm_get_level(gint point);
+
+/**
+ * Check if a point has any rules.
+ */
+gboolean alarm_has_rules(gint point);
+
+/**
+ * Check if a point should be shown, FALSE for points with a hide_normal
+ * rule that are not in alarm.
+ */
+gboolean alarm_get_visible(gint point);
+
+/**
+ * Get counter that is increased on every alarm level change.
+ */
+guint32 alarm_generation(void);
+
+#endif // INCLUSION_GUARD_ALARM_H
@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+
+#include "bench.h"
+
+/** @file bench.c
+ * @Brief Scaffolding shared by the host benchmarks and tools
+ *
+ */
+
+/******************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static void
+silent_log_handler(const gchar *log_domain, GLogLevelFlags log_level,
+                   const gchar *message, gpointer user_data);
+
+/******************** LOCAL FUNCTION DEFINTION SECTION ************************/
+
+static void
+silent_log_handler(const gchar *log_domain, GLogLevelFlags log_level,
+                   const gchar *message, gpointer user_data)
+{
+}
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+void bench_quiet_log(void)
+{
+    g_log_set_handler(NULL, G_LOG_LEVEL_MESSAGE | G_LOG_LEVEL_INFO |
+        G_LOG_LEVEL_DEBUG, silent_log_handler, NULL);
+}
+
+int bench_mute_stdout(void)
+{
+    fflush(stdout);
+
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    return saved;
+}
+
+void bench_unmute_stdout(int saved)
+{
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+int bench_open_pty(void)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (master < 0 || grantpt(master) || unlockpt(master)) {
+        perror("posix_openpt");
+        if (master >= 0) {
+            close(master);
+        }
+        return -1;
+    }
+
+    return master;
+}
+
+int bench_open_pts(int master, int flags)
+{
+    int fd = open(ptsname(master), O_RDWR | O_NOCTTY | flags);
+
+    if (fd < 0) {
+        perror("open pts");
+        return -1;
+    }
+
+    bench_make_raw(fd);
+
+    return fd;
+}
+
+void bench_make_raw(int fd)
+{
+    struct termios tio;
+
+    tcgetattr(fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+}
+
+void bench_write_paced(int fd, const void *buf, size_t len, guint char_us)
+{
+    size_t chunk = MAX(1000 / MAX(char_us, 1), 1);
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t w = write(fd, (const char *) buf + done,
+                          MIN(chunk, len - done));
+        if (w <= 0) {
+            break;
+        }
+        done += w;
+        g_usleep(w * char_us);
+    }
+}
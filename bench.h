@@ -0,0 +1,61 @@
+#ifndef INCLUSION_GUARD_BENCH_H
+#define INCLUSION_GUARD_BENCH_H
+
+/** @file bench.h
+ * @Brief Scaffolding shared by the host benchmarks and tools
+ *
+ * The benchmarks run the code under test against a simulated device on the
+ * other end of a pseudo terminal, with the logging of the code under test
+ * silenced so that only the report is printed. None of this is part of the
+ * application.
+ */
+
+#include <glib.h>
+#include <stddef.h>
+
+/******************** EXPORTED FUNCTION DECLARATION SECTION *******************/
+
+/**
+ * Drop messages, info and debug logs, warnings and errors still show.
+ */
+void bench_quiet_log(void);
+
+/**
+ * Redirect stdout to /dev/null, e.g. around code that dumps every frame.
+ *
+ * @return Saved stdout for bench_unmute_stdout().
+ */
+int bench_mute_stdout(void);
+
+/**
+ * Restore stdout saved by bench_mute_stdout().
+ */
+void bench_unmute_stdout(int saved);
+
+/**
+ * Open the master end of a new pseudo terminal, see ptsname() for the
+ * other end.
+ *
+ * @return Master fd, or -1 with the error printed.
+ */
+int bench_open_pty(void);
+
+/**
+ * Open the other end of master in raw mode, with extra open() flags.
+ *
+ * @return Fd, or -1 with the error printed.
+ */
+int bench_open_pts(int master, int flags);
+
+/**
+ * Put a terminal in raw mode.
+ */
+void bench_make_raw(int fd);
+
+/**
+ * Write buf as a line at char_us per character would, in pieces of about
+ * a millisecond, well within the RTU frame end silence.
+ */
+void bench_write_paced(int fd, const void *buf, size_t len, guint char_us);
+
+#endif // INCLUSION_GUARD_BENCH_H
@@ -0,0 +1,554 @@
+#define _GNU_SOURCE
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "bridge.h"
+#include "profile.h"
+#include "debug.h"
+
+/** @file bridge.c
+ * @Brief Raw serial port bridge implementation
+ *
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+/* Max fill and drain rounds per wakeup, before other sources get a turn */
+#define PUMP_MAX_ROUNDS (16)
+
+/* A wakeup that only found a trickle of bytes lets more gather before the
+ * next read, at 921600 baud that is about 90 bytes per wakeup instead of a
+ * few. The bytes found are passed on right away, a lone command is not
+ * delayed.
+ */
+#define PUMP_TRICKLE_SIZE (256)
+#define PUMP_GATHER_MS (1)
+
+/******************** LOCAL VARIABLE DECLARATION SECTION **********************/
+
+/**
+ * One direction of a session. Bytes are in the pipe in splice mode and in
+ * the ring buffer otherwise.
+ */
+struct pump
+{
+    int src;
+    int dst;
+    int pipe[2];            /* -1 in ring buffer mode */
+    guchar *ring;
+    gsize head;             /* Next byte to write out of the ring */
+    gsize queued;           /* Bytes in pipe or ring */
+    guint in_watch;
+    guint out_watch;
+    guint gather_timer;     /* Instead of in_watch while bytes gather */
+    guint64 *counter;       /* Bytes moved, in struct bridge_stats */
+};
+
+struct bridge
+{
+    int tcp_fd;
+    guint tcp_watch;
+    int unix_fd;
+    guint unix_watch;
+    gchar *path;
+
+    int port;               /* -1 while closed */
+    int client;             /* -1 without session */
+    struct pump to_port;
+    struct pump to_client;
+    gboolean splice;
+
+    bridge_func func;
+    gpointer data;
+
+    struct bridge_stats stats;
+};
+
+static struct bridge *bridge = NULL;
+
+/******************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static int listen_tcp(guint16 port);
+
+static int listen_unix(const gchar *path);
+
+static void pump_open(struct pump *p, int src, int dst, guint64 *counter);
+
+static void pump_close(struct pump *p);
+
+static void pump_to_ring(struct pump *p);
+
+static gsize pump_space(const struct pump *p);
+
+static gssize pump_fill(struct pump *p);
+
+static gssize pump_drain(struct pump *p);
+
+static gboolean pump_run(struct pump *p);
+
+static void set_watch(guint *watch, gboolean enable, int fd,
+                      GIOCondition condition, struct pump *p);
+
+static void end_session(const gchar *reason);
+
+static gboolean on_pump(gint fd, GIOCondition condition, gpointer data);
+
+static gboolean on_gather(gpointer data);
+
+static gboolean on_accept(gint fd, GIOCondition condition, gpointer data);
+
+/******************** LOCAL FUNCTION DEFINTION SECTION ************************/
+
+static int listen_tcp(guint16 port)
+{
+    struct sockaddr_in addr = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int on = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        ERR("Failed to create bridge socket: %s", strerror(errno));
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+        listen(fd, 2)) {
+        ERR("Failed to listen on port %u: %s", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int listen_unix(const gchar *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        ERR("Socket path %s too long", path);
+        return -1;
+    }
+    g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        ERR("Failed to create bridge socket: %s", strerror(errno));
+        return -1;
+    }
+
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+        listen(fd, 2)) {
+        ERR("Failed to listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void pump_open(struct pump *p, int src, int dst, guint64 *counter)
+{
+    memset(p, 0, sizeof(*p));
+    p->src     = src;
+    p->dst     = dst;
+    p->counter = counter;
+    p->pipe[0] = -1;
+    p->pipe[1] = -1;
+
+    if (!bridge->splice || pipe2(p->pipe, O_NONBLOCK | O_CLOEXEC)) {
+        pump_to_ring(p);
+        return;
+    }
+
+    /* Default pipe size is 64 kB on Linux, ask anyway */
+    fcntl(p->pipe[1], F_SETPIPE_SZ, BRIDGE_BUFFER_SIZE);
+}
+
+static void pump_close(struct pump *p)
+{
+    set_watch(&p->in_watch, FALSE, -1, 0, p);
+    set_watch(&p->out_watch, FALSE, -1, 0, p);
+
+    if (p->gather_timer) {
+        g_source_remove(p->gather_timer);
+        p->gather_timer = 0;
+    }
+
+    if (p->pipe[0] >= 0) {
+        close(p->pipe[0]);
+        close(p->pipe[1]);
+        p->pipe[0] = -1;
+        p->pipe[1] = -1;
+    }
+
+    g_free(p->ring);
+    p->ring = NULL;
+}
+
+/*
+ * Fall back to the ring buffer, bytes still in the pipe move along
+ */
+static void pump_to_ring(struct pump *p)
+{
+    p->ring = g_malloc(BRIDGE_BUFFER_SIZE);
+    p->head = 0;
+
+    if (p->pipe[0] < 0) {
+        return;
+    }
+
+    if (p->queued) {
+        ssize_t n = read(p->pipe[0], p->ring, p->queued);
+        p->queued = MAX(n, 0);
+    }
+
+    close(p->pipe[0]);
+    close(p->pipe[1]);
+    p->pipe[0] = -1;
+    p->pipe[1] = -1;
+}
+
+/*
+ * Bytes that can be taken in. A pipe is only filled when empty, page sized
+ * pipe buffers make its free space unknown.
+ */
+static gsize pump_space(const struct pump *p)
+{
+    if (p->pipe[0] >= 0) {
+        return p->queued ? 0 : BRIDGE_BUFFER_SIZE;
+    }
+
+    return BRIDGE_BUFFER_SIZE - p->queued;
+}
+
+static gssize pump_fill(struct pump *p)
+{
+    if (p->pipe[0] >= 0) {
+        ssize_t n = splice(p->src, NULL, p->pipe[1], NULL,
+            BRIDGE_BUFFER_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n >= 0 || errno != EINVAL) {
+            return n;
+        }
+
+        DBG_LOG("Source fd %d can not splice, using ring buffer", p->src);
+        pump_to_ring(p);
+    }
+
+    gsize tail = (p->head + p->queued) % BRIDGE_BUFFER_SIZE;
+    gsize len = MIN(BRIDGE_BUFFER_SIZE - p->queued,
+                    BRIDGE_BUFFER_SIZE - tail);
+
+    return read(p->src, p->ring + tail, len);
+}
+
+static gssize pump_drain(struct pump *p)
+{
+    ssize_t n;
+
+    if (p->pipe[0] >= 0) {
+        n = splice(p->pipe[0], NULL, p->dst, NULL, p->queued,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n > 0) {
+            *p->counter += n;
+            bridge->stats.spliced += n;
+        }
+
+        if (n >= 0 || errno != EINVAL) {
+            return n;
+        }
+
+        DBG_LOG("Destination fd %d can not splice, using ring buffer",
+            p->dst);
+        pump_to_ring(p);
+    }
+
+    n = write(p->dst, p->ring + p->head,
+              MIN(p->queued, BRIDGE_BUFFER_SIZE - p->head));
+
+    if (n > 0) {
+        *p->counter += n;
+        p->head = (p->head + n) % BRIDGE_BUFFER_SIZE;
+    }
+
+    return n;
+}
+
+/*
+ * Move what can be moved without blocking, then wait for whichever end
+ * holds things up. Returns FALSE when the session is over.
+ */
+static gboolean pump_run(struct pump *p)
+{
+    guint round = 0;
+    gboolean progress = TRUE;
+    gsize filled = 0;
+
+    for (; progress && round < PUMP_MAX_ROUNDS; round++) {
+        gssize n;
+
+        progress = FALSE;
+
+        if (p->queued) {
+            n = pump_drain(p);
+
+            if (n > 0) {
+                p->queued -= n;
+                progress = TRUE;
+            } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                return FALSE;
+            }
+        }
+
+        if (pump_space(p)) {
+            n = pump_fill(p);
+
+            if (n > 0) {
+                p->queued += n;
+                filled += n;
+                progress = TRUE;
+            } else if (!n || (errno != EAGAIN && errno != EINTR)) {
+                return FALSE;
+            }
+        }
+    }
+
+    gboolean gather = filled && filled < PUMP_TRICKLE_SIZE;
+
+    if (gather && !p->gather_timer) {
+        p->gather_timer = profile_timeout_add("bridge gather", PUMP_GATHER_MS,
+                                              on_gather, p);
+    }
+
+    set_watch(&p->in_watch, !gather && !p->gather_timer &&
+              pump_space(p) > 0, p->src, G_IO_IN | G_IO_HUP | G_IO_ERR, p);
+    set_watch(&p->out_watch, p->queued > 0, p->dst,
+              G_IO_OUT | G_IO_HUP | G_IO_ERR, p);
+
+    return TRUE;
+}
+
+static void set_watch(guint *watch, gboolean enable, int fd,
+                      GIOCondition condition, struct pump *p)
+{
+    if (enable && !*watch) {
+        *watch = profile_fd_add("bridge pump", fd, condition, on_pump, p);
+    } else if (!enable && *watch) {
+        g_source_remove(*watch);
+        *watch = 0;
+    }
+}
+
+static void end_session(const gchar *reason)
+{
+    pump_close(&bridge->to_port);
+    pump_close(&bridge->to_client);
+
+    close(bridge->client);
+    bridge->client = -1;
+
+    LOG("Bridge session ended, %s", reason);
+
+    if (bridge->func) {
+        bridge->func(FALSE, bridge->data);
+    }
+}
+
+static gboolean on_pump(gint fd, GIOCondition condition, gpointer data)
+{
+    struct pump *p = data;
+
+    if (!pump_run(p)) {
+        end_session("connection closed");
+    }
+
+    /* pump_run() and end_session() remove the watches they are done with */
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_gather(gpointer data)
+{
+    struct pump *p = data;
+
+    p->gather_timer = 0;
+
+    if (!pump_run(p)) {
+        end_session("connection closed");
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean on_accept(gint fd, GIOCondition condition, gpointer data)
+{
+    int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    int on = 1;
+
+    if (client < 0) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (bridge->client >= 0 || bridge->port < 0) {
+        ERR("Bridge %s, rejecting connection",
+            bridge->client >= 0 ? "busy" : "port closed");
+        bridge->stats.rejected++;
+        close(client);
+        return G_SOURCE_CONTINUE;
+    }
+
+    /* Interactive tools send short commands, do not hold them back */
+    if (fd == bridge->tcp_fd) {
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    bridge->client = client;
+    bridge->stats.sessions++;
+
+    LOG("Bridge session started");
+
+    /* Let the application leave the port before bytes start moving */
+    if (bridge->func) {
+        bridge->func(TRUE, bridge->data);
+    }
+
+    pump_open(&bridge->to_port, client, bridge->port, &bridge->stats.to_port);
+    pump_open(&bridge->to_client, bridge->port, client,
+              &bridge->stats.to_client);
+
+    if (!pump_run(&bridge->to_port) || !pump_run(&bridge->to_client)) {
+        end_session("failed to start");
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+gboolean bridge_init(guint16 tcp_port, const gchar *path, bridge_func func,
+                     gpointer data)
+{
+    if (bridge) {
+        return TRUE;
+    }
+
+    int tcp_fd = tcp_port ? listen_tcp(tcp_port) : -1;
+    int unix_fd = path ? listen_unix(path) : -1;
+
+    if ((tcp_port && tcp_fd < 0) || (path && unix_fd < 0)) {
+        if (tcp_fd >= 0) {
+            close(tcp_fd);
+        }
+        if (unix_fd >= 0) {
+            close(unix_fd);
+            unlink(path);
+        }
+        return FALSE;
+    }
+
+    /* splice() has no MSG_NOSIGNAL, a client going away must not kill us */
+    signal(SIGPIPE, SIG_IGN);
+
+    bridge = g_new0(struct bridge, 1);
+    bridge->tcp_fd  = tcp_fd;
+    bridge->unix_fd = unix_fd;
+    bridge->path    = g_strdup(path);
+    bridge->port    = -1;
+    bridge->client  = -1;
+    bridge->splice  = TRUE;
+    bridge->func    = func;
+    bridge->data    = data;
+
+    if (tcp_fd >= 0) {
+        bridge->tcp_watch = profile_fd_add("bridge accept", tcp_fd, G_IO_IN,
+                                           on_accept, NULL);
+        LOG("Bridging serial port on TCP port %u", tcp_port);
+    }
+    if (unix_fd >= 0) {
+        bridge->unix_watch = profile_fd_add("bridge accept", unix_fd, G_IO_IN,
+                                            on_accept, NULL);
+        LOG("Bridging serial port on %s", path);
+    }
+
+    return TRUE;
+}
+
+void bridge_cleanup(void)
+{
+    if (!bridge) {
+        return;
+    }
+
+    bridge->func = NULL;
+    bridge_set_fd(-1);
+
+    if (bridge->tcp_fd >= 0) {
+        g_source_remove(bridge->tcp_watch);
+        close(bridge->tcp_fd);
+    }
+    if (bridge->unix_fd >= 0) {
+        g_source_remove(bridge->unix_watch);
+        close(bridge->unix_fd);
+        unlink(bridge->path);
+    }
+
+    g_free(bridge->path);
+    g_free(bridge);
+    bridge = NULL;
+}
+
+void bridge_set_fd(int fd)
+{
+    if (!bridge) {
+        return;
+    }
+
+    if (fd < 0 && bridge->client >= 0) {
+        end_session("port closed");
+    }
+
+    bridge->port = fd;
+}
+
+void bridge_set_splice(gboolean enable)
+{
+    if (bridge) {
+        bridge->splice = enable;
+    }
+}
+
+gboolean bridge_active(void)
+{
+    return bridge && bridge->client >= 0;
+}
+
+void bridge_get_stats(struct bridge_stats *stats)
+{
+    g_assert(stats);
+
+    if (!bridge) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    *stats = bridge->stats;
+}
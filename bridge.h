@@ -0,0 +1,88 @@
+#ifndef INCLUSION_GUARD_BRIDGE_H
+#define INCLUSION_GUARD_BRIDGE_H
+
+#include <glib.h>
+
+/** @file bridge.h
+ * @Brief Raw serial port bridge for network tools
+ *
+ * Relays bytes between the serial port and one TCP or Unix stream socket
+ * client at a time, like ser2net in raw mode, so a vendor configuration
+ * tool can talk to the device without stopping the application. There is
+ * no authentication, the TCP port only listens on loopback.
+ *
+ * Each direction moves data with splice() through a pipe, the bytes never
+ * pass through user space. If either end does not support splice, the
+ * direction falls back to read() and write() through a ring buffer.
+ *
+ * While a session is active nothing else may use the port, the session
+ * function is the place to pause polling and port sharing. A session ends
+ * when the client disconnects or the port is closed.
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define BRIDGE_TCP_PORT (2001)
+#define BRIDGE_SOCKET_PATH "/tmp/rs232-raw.sock"
+
+/* Pipe or ring buffer size per direction */
+#define BRIDGE_BUFFER_SIZE (64 * 1024)
+
+/******************** TYPE DEFINITION SECTION *********************************/
+
+/**
+ * Bridge counters.
+ */
+struct bridge_stats
+{
+    guint64 sessions;
+    guint64 rejected;       /* Connections while busy or the port closed */
+    guint64 to_port;        /* Bytes from client to serial port */
+    guint64 to_client;      /* Bytes from serial port to client */
+    guint64 spliced;        /* Bytes of the above moved with splice() */
+};
+
+/**
+ * Called when a session starts and when it ends.
+ */
+typedef void (*bridge_func)(gboolean active, gpointer data);
+
+/******************** GLOBAL FUNCTION DECLARATION SECTION *********************/
+
+/**
+ * Start accepting clients on TCP port tcp_port of the loopback interface
+ * and on a Unix socket at path. Either one is left out if 0 or NULL. func can be NULL.
+ *
+ * @return TRUE on success, FALSE on any kind of error.
+ */
+gboolean bridge_init(guint16 tcp_port, const gchar *path, bridge_func func,
+                     gpointer data);
+
+/**
+ * End any session, stop listening and remove the socket.
+ */
+void bridge_cleanup(void);
+
+/**
+ * Set file descriptor of the serial port, -1 while it is closed. Closing
+ * the port ends the session.
+ */
+void bridge_set_fd(int fd);
+
+/**
+ * Use splice() where supported, TRUE by default. For comparison only, takes
+ * effect with the next session.
+ */
+void bridge_set_splice(gboolean enable);
+
+/**
+ * TRUE while a client session is active.
+ */
+gboolean bridge_active(void);
+
+/**
+ * Get bridge counters.
+ */
+void bridge_get_stats(struct bridge_stats *stats);
+
+#endif // INCLUSION_GUARD_BRIDGE_H
@@ -0,0 +1,423 @@
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "capture.h"
+#include "debug.h"
+
+/** @file capture.c
+ * @Brief Serial traffic capture ring buffer and capture file reader
+ *
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define CAPTURE_HEADER_SIZE (28)
+#define CAPTURE_MAX_RECORD (0xFFFF)
+
+/******************** LOCAL VARIABLE DECLARATION SECTION **********************/
+
+/**
+ * Record header as stored in the in-memory ring. Timestamps are kept
+ * absolute in the ring so that dropping the oldest record is trivial, the
+ * delta encoding is only applied when dumping to file.
+ */
+struct ring_hdr {
+    uint64_t ts_ns;
+    uint16_t len;
+    uint8_t dir;
+};
+
+struct capture_ring {
+    unsigned char *buf;
+    size_t size;
+    size_t head;    /* Write position */
+    size_t tail;    /* Oldest record */
+    size_t used;
+    unsigned int n_records;
+    unsigned int n_dropped;
+    GMutex lock;
+};
+
+struct capture_reader {
+    gchar *contents;
+    gsize length;
+    size_t pos;
+    uint64_t base_ts_ns;
+    uint64_t ts_ns;
+};
+
+/**
+ * Capture ring, NULL when capture is disabled.
+ */
+static struct capture_ring *ring = NULL;
+
+/******************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static uint64_t monotonic_ns(void);
+
+static void ring_write(struct capture_ring *r, const void *src, size_t n);
+
+static void ring_read(const struct capture_ring *r, size_t pos, void *dst,
+                      size_t n);
+
+static void ring_drop_oldest(struct capture_ring *r);
+
+static void ring_fwrite(const struct capture_ring *r, size_t pos, size_t n,
+                        FILE *fp);
+
+static size_t put_varint(unsigned char *p, uint64_t v);
+
+static gboolean get_varint(struct capture_reader *reader, uint64_t *v);
+
+static void put_le64(unsigned char *p, uint64_t v);
+
+static uint64_t get_le64(const unsigned char *p);
+
+/******************** LOCAL FUNCTION DEFINTION SECTION ************************/
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ring_write(struct capture_ring *r, const void *src, size_t n)
+{
+    const unsigned char *p = src;
+    size_t first = MIN(n, r->size - r->head);
+
+    memcpy(&r->buf[r->head], p, first);
+    memcpy(r->buf, p + first, n - first);
+
+    r->head = (r->head + n) % r->size;
+    r->used += n;
+}
+
+static void ring_read(const struct capture_ring *r, size_t pos, void *dst,
+                      size_t n)
+{
+    unsigned char *p = dst;
+    size_t first = MIN(n, r->size - pos);
+
+    memcpy(p, &r->buf[pos], first);
+    memcpy(p + first, r->buf, n - first);
+}
+
+static void ring_drop_oldest(struct capture_ring *r)
+{
+    struct ring_hdr hdr;
+    ring_read(r, r->tail, &hdr, sizeof(hdr));
+
+    size_t n = sizeof(hdr) + hdr.len;
+
+    r->tail = (r->tail + n) % r->size;
+    r->used -= n;
+    r->n_records--;
+    r->n_dropped++;
+}
+
+static void ring_fwrite(const struct capture_ring *r, size_t pos, size_t n,
+                        FILE *fp)
+{
+    size_t first = MIN(n, r->size - pos);
+
+    fwrite(&r->buf[pos], 1, first, fp);
+    fwrite(r->buf, 1, n - first, fp);
+}
+
+static size_t put_varint(unsigned char *p, uint64_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+
+    return n;
+}
+
+static gboolean get_varint(struct capture_reader *reader, uint64_t *v)
+{
+    const unsigned char *p = (const unsigned char *) reader->contents;
+    unsigned int shift = 0;
+
+    *v = 0;
+    while (reader->pos < reader->length && shift < 64) {
+        unsigned char c = p[reader->pos++];
+        *v |= (uint64_t) (c & 0x7F) << shift;
+
+        if (!(c & 0x80)) {
+            return TRUE;
+        }
+        shift += 7;
+    }
+
+    return FALSE;
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+    int i = 0;
+    for (; i < 8; i++) {
+        p[i] = (v >> (8 * i)) & 0xFF;
+    }
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    int i = 0;
+    for (; i < 8; i++) {
+        v |= (uint64_t) p[i] << (8 * i);
+    }
+
+    return v;
+}
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+gboolean capture_init(size_t ring_size)
+{
+    if (ring) {
+        capture_cleanup();
+    }
+
+    if (ring_size < sizeof(struct ring_hdr) + CAPTURE_MAX_RECORD) {
+        ERR("Capture ring of %zu bytes is too small", ring_size);
+        return FALSE;
+    }
+
+    struct capture_ring *r = g_new0(struct capture_ring, 1);
+    r->buf = g_try_malloc(ring_size);
+
+    if (!r->buf) {
+        ERR("Failed to allocate %zu bytes capture ring", ring_size);
+        g_free(r);
+        return FALSE;
+    }
+
+    r->size = ring_size;
+    g_mutex_init(&r->lock);
+    ring = r;
+
+    LOG("Serial capture enabled, ring size %zu bytes", ring_size);
+
+    return TRUE;
+}
+
+void capture_cleanup(void)
+{
+    if (!ring) {
+        return;
+    }
+
+    g_mutex_clear(&ring->lock);
+    g_free(ring->buf);
+    g_free(ring);
+    ring = NULL;
+}
+
+void capture_record(enum capture_dir dir, const unsigned char *buf, size_t len)
+{
+    if (!ring || !len) {
+        return;
+    }
+
+    struct ring_hdr hdr = {
+        .ts_ns = monotonic_ns(),
+        .len   = MIN(len, CAPTURE_MAX_RECORD),
+        .dir   = dir,
+    };
+    size_t n = sizeof(hdr) + hdr.len;
+
+    g_mutex_lock(&ring->lock);
+
+    while (ring->size - ring->used < n) {
+        ring_drop_oldest(ring);
+    }
+
+    ring_write(ring, &hdr, sizeof(hdr));
+    ring_write(ring, buf, hdr.len);
+    ring->n_records++;
+
+    g_mutex_unlock(&ring->lock);
+}
+
+int capture_dump(const char *path)
+{
+    g_assert(path);
+
+    if (!ring) {
+        return -1;
+    }
+
+    FILE *fp = fopen(path, "wb");
+
+    if (!fp) {
+        ERR("Failed to open capture file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    /* Copy the ring out, recording from the serial path and the slave
+     * thread must not wait for the file
+     */
+    struct capture_ring snap = { .buf = g_try_malloc(ring->size) };
+
+    if (!snap.buf) {
+        ERR("Failed to allocate %zu bytes for the capture dump", ring->size);
+        fclose(fp);
+        return -1;
+    }
+
+    g_mutex_lock(&ring->lock);
+    memcpy(snap.buf, ring->buf, ring->size);
+    snap.size      = ring->size;
+    snap.tail      = ring->tail;
+    snap.n_records = ring->n_records;
+    snap.n_dropped = ring->n_dropped;
+    g_mutex_unlock(&ring->lock);
+
+    /* Base time is the timestamp of the oldest record */
+    uint64_t base_ns = 0;
+    if (snap.n_records) {
+        struct ring_hdr hdr;
+        ring_read(&snap, snap.tail, &hdr, sizeof(hdr));
+        base_ns = hdr.ts_ns;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t real_ns = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+    real_ns -= monotonic_ns() - base_ns;
+
+    unsigned char header[CAPTURE_HEADER_SIZE] = {0,};
+    memcpy(header, CAPTURE_MAGIC, 8);
+    header[8] = CAPTURE_VERSION;
+    put_le64(&header[12], base_ns);
+    put_le64(&header[20], real_ns);
+    fwrite(header, 1, sizeof(header), fp);
+
+    size_t pos = snap.tail;
+    uint64_t prev_ns = base_ns;
+    unsigned int i = 0;
+
+    for (; i < snap.n_records; i++) {
+        struct ring_hdr hdr;
+        unsigned char rec_hdr[20];
+
+        ring_read(&snap, pos, &hdr, sizeof(hdr));
+        pos = (pos + sizeof(hdr)) % snap.size;
+
+        size_t n = put_varint(rec_hdr, (hdr.ts_ns - prev_ns) / 1000);
+        n += put_varint(&rec_hdr[n], ((uint64_t) hdr.len << 1) | hdr.dir);
+
+        /* Keep microsecond rounding from accumulating over the capture */
+        prev_ns += ((hdr.ts_ns - prev_ns) / 1000) * 1000;
+
+        fwrite(rec_hdr, 1, n, fp);
+        ring_fwrite(&snap, pos, hdr.len, fp);
+        pos = (pos + hdr.len) % snap.size;
+    }
+
+    unsigned int n_dropped = snap.n_dropped;
+
+    g_free(snap.buf);
+
+    if (fclose(fp)) {
+        ERR("Failed to write capture file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    LOG("Dumped %u capture records to %s (%u older records dropped)",
+        i, path, n_dropped);
+
+    return i;
+}
+
+struct capture_reader *capture_reader_open(const char *path)
+{
+    g_assert(path);
+
+    GError *error = NULL;
+    struct capture_reader *reader = g_new0(struct capture_reader, 1);
+
+    if (!g_file_get_contents(path, &reader->contents, &reader->length,
+                             &error)) {
+        ERR("Failed to read capture file: %s", error->message);
+        g_error_free(error);
+        g_free(reader);
+        return NULL;
+    }
+
+    const unsigned char *p = (const unsigned char *) reader->contents;
+
+    if (reader->length < CAPTURE_HEADER_SIZE ||
+        memcmp(p, CAPTURE_MAGIC, 8) || p[8] != CAPTURE_VERSION) {
+        ERR("%s is not a version %d capture file", path, CAPTURE_VERSION);
+        capture_reader_close(&reader);
+        return NULL;
+    }
+
+    reader->base_ts_ns = get_le64(&p[12]);
+    capture_reader_rewind(reader);
+
+    return reader;
+}
+
+gboolean capture_reader_next(struct capture_reader *reader,
+                             struct capture_record *record)
+{
+    g_assert(reader);
+    g_assert(record);
+
+    uint64_t delta_us;
+    uint64_t len_dir;
+
+    if (!get_varint(reader, &delta_us) || !get_varint(reader, &len_dir)) {
+        return FALSE;
+    }
+
+    size_t len = len_dir >> 1;
+    if (len > reader->length - reader->pos) {
+        ERR("Truncated capture record at offset %zu", reader->pos);
+        return FALSE;
+    }
+
+    reader->ts_ns += delta_us * 1000;
+
+    record->ts_ns = reader->ts_ns;
+    record->dir   = len_dir & 0x01;
+    record->len   = len;
+    record->data  = (const unsigned char *) &reader->contents[reader->pos];
+
+    reader->pos += len;
+
+    return TRUE;
+}
+
+void capture_reader_rewind(struct capture_reader *reader)
+{
+    g_assert(reader);
+
+    reader->pos   = CAPTURE_HEADER_SIZE;
+    reader->ts_ns = reader->base_ts_ns;
+}
+
+void capture_reader_close(struct capture_reader **reader)
+{
+    if (!reader || !*reader) {
+        return;
+    }
+
+    g_free((*reader)->contents);
+    g_free(*reader);
+    *reader = NULL;
+}
@@ -0,0 +1,108 @@
+#ifndef INCLUSION_GUARD_CAPTURE_H
+#define INCLUSION_GUARD_CAPTURE_H
+
+/** @file capture.h
+ * @Brief Binary capture of serial traffic for post mortem analysis and replay
+ *
+ * Every chunk of bytes written to or read from the serial port is recorded
+ * together with a CLOCK_MONOTONIC timestamp into a fixed size ring buffer.
+ * When the ring is full the oldest records are discarded. The ring can be
+ * dumped to a compact capture file at any time, see capture_dump().
+ *
+ * Capture file layout (all integers little endian):
+ *
+ *   header:  "RS232CAP" (8 bytes), uint8 version, uint8 flags,
+ *            uint16 reserved, uint64 monotonic base time in ns,
+ *            uint64 realtime base time in ns
+ *   record:  varint time delta to previous record in us,
+ *            varint (length << 1 | direction), payload bytes
+ *
+ * Varints are LEB128 encoded, so a typical record header is 3-4 bytes.
+ */
+
+#include <glib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/******************** CONSTANT AND MACRO SECTION ******************************/
+
+#define CAPTURE_MAGIC "RS232CAP"
+#define CAPTURE_VERSION (1)
+
+/******************** TYPE DEFINITION SECTION *********************************/
+
+/**
+ * Direction of captured traffic as seen from the camera.
+ */
+enum capture_dir {
+    CAPTURE_DIR_TX = 0,
+    CAPTURE_DIR_RX = 1
+};
+
+/**
+ * A single captured record as returned by capture_reader_next().
+ */
+struct capture_record {
+    uint64_t ts_ns;             /* Monotonic timestamp */
+    enum capture_dir dir;
+    size_t len;
+    const unsigned char *data;  /* Owned by the reader, valid until next */
+};
+
+/**
+ * Forward declaration of capture file reader.
+ */
+struct capture_reader;
+
+/******************** EXPORTED FUNCTION DECLARATION SECTION *******************/
+
+/**
+ * Enable capture into a ring buffer of ring_size bytes.
+ *
+ * @return TRUE on success, FALSE on any kind of error.
+ */
+gboolean capture_init(size_t ring_size);
+
+/**
+ * Disable capture and release the ring buffer.
+ */
+void capture_cleanup(void);
+
+/**
+ * Record a chunk of serial traffic. No-op when capture is not enabled.
+ */
+void capture_record(enum capture_dir dir, const unsigned char *buf, size_t len);
+
+/**
+ * Write the current ring contents to a capture file.
+ *
+ * @return Number of records written or -1 on error.
+ */
+int capture_dump(const char *path);
+
+/**
+ * Open a capture file for reading.
+ *
+ * @return Reader handle or NULL on error.
+ */
+struct capture_reader *capture_reader_open(const char *path);
+
+/**
+ * Fetch next record from a capture file.
+ *
+ * @return TRUE if a record was returned, FALSE at end of file or on error.
+ */
+gboolean capture_reader_next(struct capture_reader *reader,
+                             struct capture_record *record);
+
+/**
+ * Rewind reader to the first record.
+ */
+void capture_reader_rewind(struct capture_reader *reader);
+
+/**
+ * Close capture file reader.
+ */
+void capture_reader_close(struct capture_reader **reader);
+
+#endif // INCLUSION_GUARD_CAPTURE_H
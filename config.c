@@ -0,0 +1,460 @@
+#include <glib.h>
+#include <glib-unix.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "config.h"
+#include "profile.h"
+#include "debug.h"
+
+/** @file config.c
+ * @Brief Live configuration implementation
+ *
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define CONFIG_EVENT_BUFSIZE (4096)
+
+/******************** LOCAL VARIABLE DECLARATION SECTION **********************/
+
+struct config_watch
+{
+    gchar *path;
+    gchar *name;                /* Base name of path */
+    int fd;
+    guint watch;
+    config_func apply;
+
+    struct config defaults;
+    struct config running;
+};
+
+static const struct {
+    guint baud;
+    speed_t speed;
+} speeds[] = {
+    { 1200,   B1200 },
+    { 2400,   B2400 },
+    { 4800,   B4800 },
+    { 9600,   B9600 },
+    { 19200,  B19200 },
+    { 38400,  B38400 },
+    { 57600,  B57600 },
+    { 115200, B115200 },
+    { 230400, B230400 },
+    { 460800, B460800 },
+    { 921600, B921600 },
+};
+
+/**
+ * Configuration state, NULL before config_init().
+ */
+static struct config_watch *cfg = NULL;
+
+/******************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static gboolean parse_uint(const gchar *text, guint min, guint max,
+                           guint *value);
+
+static gboolean parse_registers(const gchar *text, struct config *config);
+
+static gboolean parse_slaves(const gchar *text, struct config *config);
+
+static gboolean parse_setting(const gchar *name, const gchar *value,
+                              struct config *config);
+
+static gboolean load(struct config *config);
+
+static void reload(void);
+
+static gboolean on_inotify(gint fd, GIOCondition condition, gpointer data);
+
+/******************** LOCAL FUNCTION DEFINTION SECTION ************************/
+
+static gboolean parse_uint(const gchar *text, guint min, guint max,
+                           guint *value)
+{
+    gchar *end;
+    guint64 v = g_ascii_strtoull(text, &end, 0);
+
+    if (end == text || *end || v < min || v > max) {
+        return FALSE;
+    }
+
+    *value = v;
+
+    return TRUE;
+}
+
+static gboolean parse_registers(const gchar *text, struct config *config)
+{
+    gchar **names = g_strsplit(text, ",", -1);
+    guint n = 0;
+    guint i = 0;
+
+    for (; names[i]; i++) {
+        gchar *name = g_strstrip(names[i]);
+
+        if (!*name || strlen(name) >= VALUES_NAME_SIZE ||
+            n == CONFIG_MAX_REGISTERS) {
+            g_strfreev(names);
+            return FALSE;
+        }
+
+        g_strlcpy(config->registers[n++], name, VALUES_NAME_SIZE);
+    }
+
+    g_strfreev(names);
+    config->n_registers = n;
+
+    return n > 0;
+}
+
+static gboolean parse_slaves(const gchar *text, struct config *config)
+{
+    gchar **addresses = g_strsplit(text, ",", -1);
+    guint n = 0;
+    guint i = 0;
+
+    for (; addresses[i]; i++) {
+        gchar *address = g_strstrip(addresses[i]);
+
+        /* A blank list polls only the slave at Address */
+        if (!*address && !i && !addresses[1]) {
+            break;
+        }
+
+        if (n == CONFIG_MAX_SLAVES ||
+            !parse_uint(address, 1, 247, &config->slaves[n++])) {
+            g_strfreev(addresses);
+            return FALSE;
+        }
+    }
+
+    g_strfreev(addresses);
+    config->n_slaves = n;
+
+    return TRUE;
+}
+
+static gboolean parse_setting(const gchar *name, const gchar *value,
+                              struct config *config)
+{
+    guint v;
+
+    if (!strcmp(name, "Device")) {
+        return g_strlcpy(config->device, value, sizeof(config->device)) <
+            sizeof(config->device) && *value;
+    } else if (!strcmp(name, "Baud")) {
+        if (!parse_uint(value, 1, G_MAXUINT, &v) ||
+            config_speed(v) == B0) {
+            return FALSE;
+        }
+        config->baud = v;
+    } else if (!strcmp(name, "Parity")) {
+        if (!g_ascii_strcasecmp(value, "none")) {
+            config->parity = PARITY_NONE;
+        } else if (!g_ascii_strcasecmp(value, "odd")) {
+            config->parity = PARITY_ODD;
+        } else if (!g_ascii_strcasecmp(value, "even")) {
+            config->parity = PARITY_EVEN;
+        } else {
+            return FALSE;
+        }
+    } else if (!strcmp(name, "Framing")) {
+        if (!g_ascii_strcasecmp(value, "rtu")) {
+            config->framing = MODBUS_FRAMING_RTU;
+        } else if (!g_ascii_strcasecmp(value, "ascii")) {
+            config->framing = MODBUS_FRAMING_ASCII;
+        } else {
+            return FALSE;
+        }
+    } else if (!strcmp(name, "Address")) {
+        return parse_uint(value, 1, 247, &config->address);
+    } else if (!strcmp(name, "PollInterval")) {
+        return parse_uint(value, 10, 3600000, &config->poll_interval_ms);
+    } else if (!strcmp(name, "RegisterStart")) {
+        return parse_uint(value, 0, G_MAXUINT16, &config->register_start);
+    } else if (!strcmp(name, "Registers")) {
+        return parse_registers(value, config);
+    } else if (!strcmp(name, "Slaves")) {
+        return parse_slaves(value, config);
+    } else if (!strcmp(name, "LatchRegister")) {
+        config->latch = g_ascii_strcasecmp(value, "none") != 0;
+        return !config->latch ||
+            parse_uint(value, 0, G_MAXUINT16, &config->latch_register);
+    } else if (!strcmp(name, "LatchValue")) {
+        return parse_uint(value, 0, G_MAXUINT16, &config->latch_value);
+    } else if (!strcmp(name, "LatchDelay")) {
+        return parse_uint(value, 1, 10000, &config->latch_delay_ms);
+    } else if (!strcmp(name, "OverlayTemplate")) {
+        return g_strlcpy(config->overlay_template, value,
+            sizeof(config->overlay_template)) <
+            sizeof(config->overlay_template);
+    } else {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Load file over the defaults, a missing file gives the defaults
+ */
+static gboolean load(struct config *config)
+{
+    gchar *text = NULL;
+    GError *error = NULL;
+
+    *config = cfg->defaults;
+
+    if (!g_file_get_contents(cfg->path, &text, NULL, &error)) {
+        gboolean missing = g_error_matches(error, G_FILE_ERROR,
+            G_FILE_ERROR_NOENT);
+
+        if (!missing) {
+            ERR("Failed to read %s: %s", cfg->path, error->message);
+        }
+        g_error_free(error);
+
+        return missing;
+    }
+
+    gboolean ok = config_parse(text, config);
+    g_free(text);
+
+    return ok;
+}
+
+static void reload(void)
+{
+    gint64 start = g_get_monotonic_time();
+    struct config config;
+
+    /* Gone again since the event, e.g. a save by rename and delete */
+    if (!g_file_test(cfg->path, G_FILE_TEST_EXISTS)) {
+        LOG("%s removed, keeping the running configuration", cfg->path);
+        return;
+    }
+
+    if (!load(&config)) {
+        ERR("Invalid configuration in %s, keeping the running one",
+            cfg->path);
+        return;
+    }
+
+    guint changed = config_diff(&cfg->running, &config);
+
+    if (!changed) {
+        LOG("Configuration in %s unchanged", cfg->path);
+        return;
+    }
+
+    cfg->running = config;
+    cfg->apply(&cfg->running, changed);
+
+    LOG("Configuration reloaded in %lld us, changed:%s%s%s",
+        (long long) (g_get_monotonic_time() - start),
+        changed & CONFIG_PORT ? " port" : "",
+        changed & CONFIG_PLAN ? " plan" : "",
+        changed & CONFIG_OVERLAY ? " overlay" : "");
+}
+
+static gboolean on_inotify(gint fd, GIOCondition condition, gpointer data)
+{
+    gchar buf[CONFIG_EVENT_BUFSIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    gboolean changed = FALSE;
+
+    ssize_t n = read(fd, buf, sizeof(buf));
+
+    gchar *p = buf;
+    while (n > 0 && p < buf + n) {
+        const struct inotify_event *event = (const struct inotify_event *) p;
+
+        if (event->len && event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO) &&
+            !strcmp(event->name, cfg->name)) {
+            changed = TRUE;
+        }
+        p += sizeof(struct inotify_event) + event->len;
+    }
+
+    /* Several events of one save are handled with a single reload */
+    if (changed) {
+        reload();
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+gboolean config_init(const gchar *path, const struct config *defaults,
+                     config_func apply)
+{
+    g_assert(path);
+    g_assert(defaults);
+    g_assert(apply);
+
+    config_cleanup();
+
+    cfg = g_new0(struct config_watch, 1);
+    cfg->path     = g_strdup(path);
+    cfg->name     = g_path_get_basename(path);
+    cfg->apply    = apply;
+    cfg->defaults = *defaults;
+    cfg->fd       = -1;
+
+    if (!load(&cfg->running)) {
+        ERR("Invalid configuration in %s, using defaults", path);
+        cfg->running = *defaults;
+    }
+
+    cfg->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    gchar *dir = g_path_get_dirname(path);
+
+    /* Watch the directory, editors often replace the file by renaming.
+     * Deleting it is not a change, it keeps the running configuration.
+     */
+    if (cfg->fd < 0 ||
+        inotify_add_watch(cfg->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        ERR("Failed to watch %s: %s", dir, strerror(errno));
+        g_free(dir);
+        return FALSE;
+    }
+
+    cfg->watch = profile_fd_add("config inotify", cfg->fd, G_IO_IN, on_inotify,
+                                NULL);
+
+    LOG("Watching configuration %s", path);
+    g_free(dir);
+
+    return TRUE;
+}
+
+void config_cleanup(void)
+{
+    if (!cfg) {
+        return;
+    }
+
+    if (cfg->watch) {
+        g_source_remove(cfg->watch);
+    }
+    if (cfg->fd >= 0) {
+        close(cfg->fd);
+    }
+
+    g_free(cfg->path);
+    g_free(cfg->name);
+    g_free(cfg);
+    cfg = NULL;
+}
+
+const struct config *config_get(void)
+{
+    g_assert(cfg);
+
+    return &cfg->running;
+}
+
+gboolean config_parse(const gchar *text, struct config *config)
+{
+    g_assert(text);
+    g_assert(config);
+
+    gchar **lines = g_strsplit(text, "\n", -1);
+    gboolean ok = TRUE;
+    guint i = 0;
+
+    for (; lines[i]; i++) {
+        gchar *line = g_strstrip(lines[i]);
+        gchar *eq = strchr(line, '=');
+
+        if (!*line || *line == '#') {
+            continue;
+        }
+
+        if (!eq) {
+            ERR("Line %u: expected Name=\"value\"", i + 1);
+            ok = FALSE;
+            continue;
+        }
+
+        *eq = '\0';
+        gchar *name = g_strstrip(line);
+        gchar *value = g_strstrip(eq + 1);
+        gsize len = strlen(value);
+
+        if (len >= 2 && value[0] == '"' && value[len - 1] == '"') {
+            value[len - 1] = '\0';
+            value++;
+        }
+
+        if (!parse_setting(name, value, config)) {
+            ERR("Line %u: invalid setting %s=\"%s\"", i + 1, name, value);
+            ok = FALSE;
+        }
+    }
+
+    g_strfreev(lines);
+
+    return ok;
+}
+
+guint config_diff(const struct config *a, const struct config *b)
+{
+    g_assert(a);
+    g_assert(b);
+
+    guint changed = 0;
+    guint i = 0;
+
+    if (strcmp(a->device, b->device) || a->baud != b->baud ||
+        a->parity != b->parity || a->address != b->address ||
+        a->framing != b->framing) {
+        changed |= CONFIG_PORT;
+    }
+
+    if (a->poll_interval_ms != b->poll_interval_ms ||
+        a->register_start != b->register_start ||
+        a->n_registers != b->n_registers ||
+        a->n_slaves != b->n_slaves ||
+        memcmp(a->slaves, b->slaves, a->n_slaves * sizeof(a->slaves[0])) ||
+        a->latch != b->latch || a->latch_register != b->latch_register ||
+        a->latch_value != b->latch_value ||
+        a->latch_delay_ms != b->latch_delay_ms) {
+        changed |= CONFIG_PLAN;
+    } else {
+        for (; i < a->n_registers; i++) {
+            if (strcmp(a->registers[i], b->registers[i])) {
+                changed |= CONFIG_PLAN;
+                break;
+            }
+        }
+    }
+
+    if (strcmp(a->overlay_template, b->overlay_template)) {
+        changed |= CONFIG_OVERLAY;
+    }
+
+    return changed;
+}
+
+speed_t config_speed(guint baud)
+{
+    guint i = 0;
+
+    for (; i < G_N_ELEMENTS(speeds); i++) {
+        if (speeds[i].baud == baud) {
+            return speeds[i].speed;
+        }
+    }
+
+    return B0;
+}
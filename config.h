@@ -0,0 +1,131 @@
+#ifndef INCLUSION_GUARD_CONFIG_H
+#define INCLUSION_GUARD_CONFIG_H
+
+#include <glib.h>
+
+#include "serial.h"
+#include "modbus.h"
+#include "values.h"
+#include "template.h"
+
+/** @file config.h
+ * @Brief Live configuration of port, poll plan and overlay
+ *
+ * Settings are read from a file in param.conf syntax, one Name="value" per
+ * line, lines starting with # are comments. Settings missing from the file
+ * keep their compiled-in defaults.
+ *
+ *   Device="/dev/ttyS1"            Port
+ *   Baud="9600"
+ *   Parity="even"                  none, odd or even
+ *   Address="1"                    Slave address
+ *   Framing="rtu"                  rtu or ascii
+ *   PollInterval="500"             Poll plan, in ms
+ *   RegisterStart="10"             First input register to read
+ *   Registers="REG1,REG2"          Point names of the registers read
+ *   Slaves="2,3"                   More slaves with the same registers,
+ *                                  stored as e.g. REG1.2
+ *   LatchRegister="none"           Register written by broadcast to latch
+ *                                  a snapshot on all slaves before reading
+ *   LatchValue="1"                 Value written to it
+ *   LatchDelay="50"                Time for the slaves to take the
+ *                                  snapshot, in ms
+ *   OverlayTemplate="..."          Overlay, see template.h
+ *
+ * The file is watched with inotify. A changed file is parsed, compared
+ * with the running configuration and only the parts that differ are handed
+ * to the apply function, so e.g. an overlay change never touches polling.
+ * A file that does not parse is rejected as a whole. Removing the file
+ * keeps the running configuration, the defaults only apply at startup.
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define CONFIG_DEVICE_SIZE (64)
+#define CONFIG_MAX_REGISTERS (32)
+#define CONFIG_MAX_SLAVES (16)
+
+/******************** TYPE DEFINITION SECTION *********************************/
+
+/**
+ * Parts of the configuration, or'ed together in a change mask.
+ */
+enum config_part
+{
+    CONFIG_PORT    = 1 << 0,
+    CONFIG_PLAN    = 1 << 1,
+    CONFIG_OVERLAY = 1 << 2,
+    CONFIG_ALL     = CONFIG_PORT | CONFIG_PLAN | CONFIG_OVERLAY
+};
+
+struct config
+{
+    /* CONFIG_PORT */
+    gchar device[CONFIG_DEVICE_SIZE];
+    guint baud;
+    enum parity parity;
+    guint address;
+    enum modbus_framing framing;
+
+    /* CONFIG_PLAN */
+    guint poll_interval_ms;
+    guint register_start;
+    gchar registers[CONFIG_MAX_REGISTERS][VALUES_NAME_SIZE];
+    guint n_registers;
+    guint slaves[CONFIG_MAX_SLAVES];
+    guint n_slaves;
+    gboolean latch;
+    guint latch_register;
+    guint latch_value;
+    guint latch_delay_ms;
+
+    /* CONFIG_OVERLAY */
+    gchar overlay_template[TEMPLATE_TEXT_SIZE];
+};
+
+/**
+ * Called with the new configuration and the mask of changed parts.
+ */
+typedef void (*config_func)(const struct config *config, guint changed);
+
+/******************** GLOBAL FUNCTION DECLARATION SECTION *********************/
+
+/**
+ * Load configuration from path over defaults and start watching the file.
+ * The file does not have to exist. apply is only called for later changes.
+ *
+ * @return TRUE if watching, FALSE on error. The defaults are used either way.
+ */
+gboolean config_init(const gchar *path, const struct config *defaults,
+                     config_func apply);
+
+/**
+ * Stop watching.
+ */
+void config_cleanup(void);
+
+/**
+ * Get running configuration.
+ */
+const struct config *config_get(void);
+
+/**
+ * Parse settings in text over config.
+ *
+ * @return FALSE if any line is invalid, config is then partially updated.
+ */
+gboolean config_parse(const gchar *text, struct config *config);
+
+/**
+ * Compare two configurations.
+ *
+ * @return Mask of enum config_part that differ.
+ */
+guint config_diff(const struct config *a, const struct config *b);
+
+/**
+ * Get baud rate constant for a numeric baud rate, B0 if not supported.
+ */
+speed_t config_speed(guint baud);
+
+#endif // INCLUSION_GUARD_CONFIG_H
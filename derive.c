@@ -0,0 +1,805 @@
+#include <glib.h>
+#include <glib/gprintf.h>
+#include <string.h>
+#include <math.h>
+
+#include "derive.h"
+#include "values.h"
+#include "debug.h"
+
+/** @file derive.c
+ * @Brief Derived channel implementation
+ *
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define DERIVE_WORDS ((DERIVE_MAX_CHANNELS + 31) / 32)
+
+/******************** LOCAL VARIABLE DECLARATION SECTION **********************/
+
+/**
+ * Bytecode instructions. OP_CONST and OP_LOAD are followed by a one byte
+ * index into the constant and input tables of the channel.
+ */
+enum derive_op
+{
+    OP_CONST,
+    OP_LOAD,
+    OP_NEG,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_AND,
+    OP_OR,
+    OP_SHL,
+    OP_SHR,
+    OP_ABS,
+    OP_SQRT,
+    OP_LOG,
+    OP_EXP,
+    OP_MIN,
+    OP_MAX,
+    OP_POW
+};
+
+struct function
+{
+    const gchar *name;
+    enum derive_op op;
+    guint n_args;
+};
+
+static const struct function functions[] = {
+    { "abs",  OP_ABS,  1 },
+    { "sqrt", OP_SQRT, 1 },
+    { "log",  OP_LOG,  1 },
+    { "exp",  OP_EXP,  1 },
+    { "min",  OP_MIN,  2 },
+    { "max",  OP_MAX,  2 },
+    { "pow",  OP_POW,  2 },
+};
+
+struct channel
+{
+    gchar name[VALUES_NAME_SIZE];
+    gint point;                     /* Output point */
+
+    guint8 code[DERIVE_MAX_CODE];
+    guint code_len;
+    gdouble constants[DERIVE_MAX_CONSTANTS];
+    guint n_constants;
+
+    gchar input_names[DERIVE_MAX_INPUTS][VALUES_NAME_SIZE];
+    gint inputs[DERIVE_MAX_INPUTS]; /* Point ids, -1 until they exist */
+    guint n_inputs;
+    gboolean resolved;              /* All inputs exist */
+};
+
+/**
+ * Expression compiler state.
+ */
+struct compiler
+{
+    const gchar *source;
+    const gchar *p;
+    struct channel *ch;
+    guint depth;
+    gboolean error;
+};
+
+struct derive
+{
+    struct channel *channels;
+    guint n_channels;
+    derive_func changed;
+
+    /* Channels to evaluate, set from changed inputs */
+    guint32 dirty[DERIVE_WORDS];
+
+    /* Channels reading each point, and the points that have readers */
+    guint32 readers[VALUES_MAX_POINTS][DERIVE_WORDS];
+    gint watched[VALUES_MAX_POINTS];
+    guint n_watched;
+
+    /* Point changes and qualities seen at last update, to find changed
+     * inputs
+     */
+    guint32 seen_changes[VALUES_MAX_POINTS];
+    guint8 seen_quality[VALUES_MAX_POINTS];
+    guint32 seen_generation;
+    guint seen_points;
+
+    guint n_unresolved;
+};
+
+/**
+ * Derived channel state, NULL when there are no channels.
+ */
+static struct derive *derive = NULL;
+
+/******************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static void compile_error(struct compiler *c, const gchar *what);
+
+static void skip_space(struct compiler *c);
+
+static gboolean accept(struct compiler *c, const gchar *token);
+
+static void emit(struct compiler *c, enum derive_op op, gint pop, gint push);
+
+static void emit_arg(struct compiler *c, enum derive_op op, guint arg);
+
+static void parse_expression(struct compiler *c);
+
+static void parse_and(struct compiler *c);
+
+static void parse_shift(struct compiler *c);
+
+static void parse_sum(struct compiler *c);
+
+static void parse_product(struct compiler *c);
+
+static void parse_unary(struct compiler *c);
+
+static void parse_primary(struct compiler *c);
+
+static void parse_name(struct compiler *c);
+
+static gboolean compile(struct channel *ch, const gchar *expression);
+
+static void resolve(void);
+
+static void mark_readers(gint point);
+
+static void see_point(gint point);
+
+static const value_status *worst_input(const struct channel *ch);
+
+static gboolean to_bits(gdouble value, guint32 *bits);
+
+static gdouble integer_op(enum derive_op op, gdouble a, gdouble b);
+
+static gdouble evaluate(const struct channel *ch);
+
+/******************** LOCAL FUNCTION DEFINTION SECTION ************************/
+
+static void compile_error(struct compiler *c, const gchar *what)
+{
+    if (!c->error) {
+        ERR("Derived channel %s: %s at offset %d", c->ch->name, what,
+            (int) (c->p - c->source));
+    }
+    c->error = TRUE;
+}
+
+static void skip_space(struct compiler *c)
+{
+    while (g_ascii_isspace(*c->p)) {
+        c->p++;
+    }
+}
+
+static gboolean accept(struct compiler *c, const gchar *token)
+{
+    gsize len = strlen(token);
+
+    skip_space(c);
+
+    if (strncmp(c->p, token, len)) {
+        return FALSE;
+    }
+
+    c->p += len;
+
+    return TRUE;
+}
+
+static void emit(struct compiler *c, enum derive_op op, gint pop, gint push)
+{
+    struct channel *ch = c->ch;
+
+    if (ch->code_len >= DERIVE_MAX_CODE) {
+        compile_error(c, "expression too long");
+        return;
+    }
+    ch->code[ch->code_len++] = op;
+
+    /* Track stack depth so evaluation never needs to check it */
+    c->depth += push - pop;
+    if (c->depth > DERIVE_MAX_STACK) {
+        compile_error(c, "expression too deep");
+    }
+}
+
+static void emit_arg(struct compiler *c, enum derive_op op, guint arg)
+{
+    emit(c, op, 0, 1);
+
+    if (c->ch->code_len >= DERIVE_MAX_CODE) {
+        compile_error(c, "expression too long");
+        return;
+    }
+    c->ch->code[c->ch->code_len++] = arg;
+}
+
+static void parse_expression(struct compiler *c)
+{
+    parse_and(c);
+
+    while (!c->error && accept(c, "|")) {
+        parse_and(c);
+        emit(c, OP_OR, 2, 1);
+    }
+}
+
+static void parse_and(struct compiler *c)
+{
+    parse_shift(c);
+
+    while (!c->error && accept(c, "&")) {
+        parse_shift(c);
+        emit(c, OP_AND, 2, 1);
+    }
+}
+
+static void parse_shift(struct compiler *c)
+{
+    parse_sum(c);
+
+    while (!c->error) {
+        if (accept(c, "<<")) {
+            parse_sum(c);
+            emit(c, OP_SHL, 2, 1);
+        } else if (accept(c, ">>")) {
+            parse_sum(c);
+            emit(c, OP_SHR, 2, 1);
+        } else {
+            break;
+        }
+    }
+}
+
+static void parse_sum(struct compiler *c)
+{
+    parse_product(c);
+
+    while (!c->error) {
+        if (accept(c, "+")) {
+            parse_product(c);
+            emit(c, OP_ADD, 2, 1);
+        } else if (accept(c, "-")) {
+            parse_product(c);
+            emit(c, OP_SUB, 2, 1);
+        } else {
+            break;
+        }
+    }
+}
+
+static void parse_product(struct compiler *c)
+{
+    parse_unary(c);
+
+    while (!c->error) {
+        if (accept(c, "*")) {
+            parse_unary(c);
+            emit(c, OP_MUL, 2, 1);
+        } else if (accept(c, "/")) {
+            parse_unary(c);
+            emit(c, OP_DIV, 2, 1);
+        } else if (accept(c, "%")) {
+            parse_unary(c);
+            emit(c, OP_MOD, 2, 1);
+        } else {
+            break;
+        }
+    }
+}
+
+static void parse_unary(struct compiler *c)
+{
+    if (accept(c, "-")) {
+        parse_unary(c);
+        emit(c, OP_NEG, 1, 1);
+    } else {
+        parse_primary(c);
+    }
+}
+
+static void parse_primary(struct compiler *c)
+{
+    skip_space(c);
+
+    if (c->error) {
+        return;
+    }
+
+    if (accept(c, "(")) {
+        parse_expression(c);
+        if (!accept(c, ")")) {
+            compile_error(c, "expected ')'");
+        }
+        return;
+    }
+
+    if (g_ascii_isdigit(*c->p) || *c->p == '.') {
+        gchar *end = NULL;
+        gdouble number = g_ascii_strtod(c->p, &end);
+
+        if (end == c->p) {
+            compile_error(c, "bad number");
+            return;
+        }
+        c->p = end;
+
+        struct channel *ch = c->ch;
+        guint i = 0;
+        for (; i < ch->n_constants && ch->constants[i] != number; i++);
+
+        if (i == DERIVE_MAX_CONSTANTS) {
+            compile_error(c, "too many constants");
+            return;
+        }
+        if (i == ch->n_constants) {
+            ch->constants[ch->n_constants++] = number;
+        }
+
+        emit_arg(c, OP_CONST, i);
+        return;
+    }
+
+    if (g_ascii_isalpha(*c->p) || *c->p == '_') {
+        parse_name(c);
+        return;
+    }
+
+    compile_error(c, "expected number, name or '('");
+}
+
+static void parse_name(struct compiler *c)
+{
+    const gchar *start = c->p;
+
+    while (g_ascii_isalnum(*c->p) || *c->p == '_') {
+        c->p++;
+    }
+    gsize len = c->p - start;
+
+    if (len >= VALUES_NAME_SIZE) {
+        compile_error(c, "name too long");
+        return;
+    }
+
+    /* Function call */
+    if (accept(c, "(")) {
+        guint i = 0;
+        for (; i < G_N_ELEMENTS(functions); i++) {
+            if (strlen(functions[i].name) == len &&
+                strncmp(functions[i].name, start, len) == 0) {
+                break;
+            }
+        }
+
+        if (i == G_N_ELEMENTS(functions)) {
+            compile_error(c, "unknown function");
+            return;
+        }
+
+        guint n = 0;
+        for (; n < functions[i].n_args && !c->error; n++) {
+            if (n && !accept(c, ",")) {
+                compile_error(c, "expected ','");
+                return;
+            }
+            parse_expression(c);
+        }
+
+        if (!accept(c, ")")) {
+            compile_error(c, "expected ')'");
+            return;
+        }
+
+        emit(c, functions[i].op, functions[i].n_args, 1);
+        return;
+    }
+
+    /* Point, each distinct name gets one input slot */
+    struct channel *ch = c->ch;
+    guint i = 0;
+    for (; i < ch->n_inputs; i++) {
+        if (strlen(ch->input_names[i]) == len &&
+            strncmp(ch->input_names[i], start, len) == 0) {
+            break;
+        }
+    }
+
+    if (i == DERIVE_MAX_INPUTS) {
+        compile_error(c, "too many inputs");
+        return;
+    }
+    if (i == ch->n_inputs) {
+        memcpy(ch->input_names[i], start, len);
+        ch->input_names[i][len] = '\0';
+        ch->inputs[i] = -1;
+        ch->n_inputs++;
+    }
+
+    emit_arg(c, OP_LOAD, i);
+}
+
+static gboolean compile(struct channel *ch, const gchar *expression)
+{
+    struct compiler c = {
+        .source = expression,
+        .p      = expression,
+        .ch     = ch,
+    };
+
+    parse_expression(&c);
+    skip_space(&c);
+
+    if (!c.error && *c.p) {
+        compile_error(&c, "unexpected character");
+    }
+
+    if (!c.error && c.depth != 1) {
+        compile_error(&c, "internal stack error");
+    }
+
+    return !c.error;
+}
+
+static void resolve(void)
+{
+    guint i = 0;
+
+    derive->n_unresolved = 0;
+
+    for (; i < derive->n_channels; i++) {
+        struct channel *ch = &derive->channels[i];
+        guint n_resolved = 0;
+        guint j = 0;
+
+        if (ch->resolved) {
+            continue;
+        }
+
+        for (; j < ch->n_inputs; j++) {
+            if (ch->inputs[j] < 0) {
+                ch->inputs[j] = values_lookup(ch->input_names[j]);
+            }
+            n_resolved += ch->inputs[j] >= 0;
+        }
+
+        if (n_resolved < ch->n_inputs) {
+            derive->n_unresolved++;
+            continue;
+        }
+
+        /* All inputs exist, register as reader and evaluate once */
+        for (j = 0; j < ch->n_inputs; j++) {
+            gint point = ch->inputs[j];
+            guint32 *readers = derive->readers[point];
+            guint k = 0;
+
+            for (; k < DERIVE_WORDS && !readers[k]; k++);
+            if (k == DERIVE_WORDS) {
+                derive->watched[derive->n_watched++] = point;
+                see_point(point);
+            }
+
+            readers[i / 32] |= 1u << (i % 32);
+        }
+
+        ch->resolved = TRUE;
+        derive->dirty[i / 32] |= 1u << (i % 32);
+    }
+}
+
+static void mark_readers(gint point)
+{
+    const guint32 *readers = derive->readers[point];
+    guint i = 0;
+
+    for (; i < DERIVE_WORDS; i++) {
+        derive->dirty[i] |= readers[i];
+    }
+}
+
+static void see_point(gint point)
+{
+    derive->seen_changes[point] = values_get(point)->changes;
+    derive->seen_quality[point] = values_get_status(point)->quality;
+}
+
+/*
+ * Input with the highest quality value, the good first input if all are good
+ */
+static const value_status *worst_input(const struct channel *ch)
+{
+    const value_status *worst = values_get_status(ch->inputs[0]);
+    guint i = 1;
+
+    for (; i < ch->n_inputs; i++) {
+        const value_status *status = values_get_status(ch->inputs[i]);
+
+        if (status->quality > worst->quality) {
+            worst = status;
+        }
+    }
+
+    return worst;
+}
+
+/**
+ * Integer part of value as unsigned 32 bits, FALSE for NaN, negative or
+ * too large values, casting those is undefined.
+ */
+static gboolean to_bits(gdouble value, guint32 *bits)
+{
+    if (!(value >= 0 && value < 4294967296.0)) {
+        return FALSE;
+    }
+
+    *bits = (guint32) value;
+
+    return TRUE;
+}
+
+/**
+ * & | << >> on unsigned 32 bit operands, NaN if either one is out of range
+ * or the shift is not below 32.
+ */
+static gdouble integer_op(enum derive_op op, gdouble a, gdouble b)
+{
+    guint32 x;
+    guint32 y;
+
+    if (!to_bits(a, &x) || !to_bits(b, &y)) {
+        return NAN;
+    }
+
+    switch (op) {
+        case OP_AND:
+            return x & y;
+        case OP_OR:
+            return x | y;
+        case OP_SHL:
+            if (y < 32) {
+                return (guint32) (x << y);
+            }
+            break;
+        case OP_SHR:
+            if (y < 32) {
+                return x >> y;
+            }
+            break;
+        default:
+            g_assert_not_reached();
+    }
+
+    return NAN;
+}
+
+static gdouble evaluate(const struct channel *ch)
+{
+    gdouble stack[DERIVE_MAX_STACK];
+    gint sp = -1;
+    guint pc = 0;
+
+    while (pc < ch->code_len) {
+        enum derive_op op = ch->code[pc++];
+
+        switch (op) {
+            case OP_CONST:
+                stack[++sp] = ch->constants[ch->code[pc++]];
+                break;
+            case OP_LOAD:
+                stack[++sp] = values_get(ch->inputs[ch->code[pc++]])->number;
+                break;
+            case OP_NEG:
+                stack[sp] = -stack[sp];
+                break;
+            case OP_ADD:
+                sp--;
+                stack[sp] += stack[sp + 1];
+                break;
+            case OP_SUB:
+                sp--;
+                stack[sp] -= stack[sp + 1];
+                break;
+            case OP_MUL:
+                sp--;
+                stack[sp] *= stack[sp + 1];
+                break;
+            case OP_DIV:
+                sp--;
+                stack[sp] /= stack[sp + 1];
+                break;
+            case OP_MOD:
+                sp--;
+                stack[sp] = fmod(stack[sp], stack[sp + 1]);
+                break;
+            case OP_AND:
+            case OP_OR:
+            case OP_SHL:
+            case OP_SHR:
+                sp--;
+                stack[sp] = integer_op(op, stack[sp], stack[sp + 1]);
+                break;
+            case OP_ABS:
+                stack[sp] = fabs(stack[sp]);
+                break;
+            case OP_SQRT:
+                stack[sp] = sqrt(stack[sp]);
+                break;
+            case OP_LOG:
+                stack[sp] = log(stack[sp]);
+                break;
+            case OP_EXP:
+                stack[sp] = exp(stack[sp]);
+                break;
+            case OP_MIN:
+                sp--;
+                stack[sp] = MIN(stack[sp], stack[sp + 1]);
+                break;
+            case OP_MAX:
+                sp--;
+                stack[sp] = MAX(stack[sp], stack[sp + 1]);
+                break;
+            case OP_POW:
+                sp--;
+                stack[sp] = pow(stack[sp], stack[sp + 1]);
+                break;
+        }
+    }
+
+    return stack[0];
+}
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+guint derive_init(const struct derive_channel *channels, gsize n_channels,
+                  derive_func changed)
+{
+    g_assert(channels || !n_channels);
+
+    derive_cleanup();
+
+    if (n_channels > DERIVE_MAX_CHANNELS) {
+        ERR("Only the first %d derived channels are used",
+            DERIVE_MAX_CHANNELS);
+        n_channels = DERIVE_MAX_CHANNELS;
+    }
+
+    derive = g_new0(struct derive, 1);
+    derive->channels = g_new0(struct channel, n_channels);
+    derive->changed  = changed;
+
+    gsize i = 0;
+    for (; i < n_channels; i++) {
+        struct channel *ch = &derive->channels[derive->n_channels];
+
+        memset(ch, 0, sizeof(*ch));
+        g_strlcpy(ch->name, channels[i].name, sizeof(ch->name));
+
+        if (!compile(ch, channels[i].expression)) {
+            continue;
+        }
+
+        /* Without a point to store to the channel is of no use */
+        ch->point = values_add_point(ch->name);
+        if (ch->point < 0) {
+            ERR("No room for derived channel %s", ch->name);
+            continue;
+        }
+        derive->n_channels++;
+    }
+
+    derive->seen_points = 0;
+    derive->n_unresolved = derive->n_channels;
+
+    LOG("Compiled %u of %u derived channels", derive->n_channels,
+        (guint) n_channels);
+
+    return derive->n_channels;
+}
+
+void derive_cleanup(void)
+{
+    if (!derive) {
+        return;
+    }
+
+    g_free(derive->channels);
+    g_free(derive);
+    derive = NULL;
+}
+
+guint derive_update(void)
+{
+    if (!derive || !derive->n_channels) {
+        return 0;
+    }
+
+    /* Look for missing inputs only when new points showed up */
+    if (derive->n_unresolved && derive->seen_points != values_count()) {
+        derive->seen_points = values_count();
+        resolve();
+    }
+
+    if (derive->seen_generation != values_generation()) {
+        derive->seen_generation = values_generation();
+
+        guint i = 0;
+        for (; i < derive->n_watched; i++) {
+            gint point = derive->watched[i];
+
+            if (derive->seen_changes[point] != values_get(point)->changes ||
+                derive->seen_quality[point] !=
+                    values_get_status(point)->quality) {
+                see_point(point);
+                mark_readers(point);
+            }
+        }
+    }
+
+    guint n_evaluated = 0;
+    guint word = 0;
+
+    /* Lowest channel first, a changed output may mark later channels which
+     * are picked up in the same pass. Marks on earlier channels, i.e. a
+     * channel reading itself or a later one, wait for the next update.
+     */
+    for (; word < DERIVE_WORDS; word++) {
+        guint32 mask = ~0u;
+
+        while (derive->dirty[word] & mask) {
+            guint bit = __builtin_ctz(derive->dirty[word] & mask);
+            struct channel *ch = &derive->channels[word * 32 + bit];
+
+            derive->dirty[word] &= ~(1u << bit);
+            mask = bit == 31 ? 0 : ~0u << (bit + 1);
+
+            const value_status *status = values_get_status(ch->point);
+            guint8 quality   = status->quality;
+            guint8 exception = status->exception;
+            gboolean changed = FALSE;
+
+            /* A channel is as good as its worst input, a bad one keeps its
+             * last good value like a failed read does
+             */
+            const value_status *worst = ch->n_inputs ? worst_input(ch) : NULL;
+            if (worst && worst->quality != VALUE_GOOD) {
+                values_set_quality(ch->point, worst->quality,
+                                   worst->exception);
+            } else {
+                gdouble value = evaluate(ch);
+                n_evaluated++;
+
+                if (!isfinite(value)) {
+                    continue;
+                }
+                changed = values_set_number(ch->point, value);
+            }
+
+            if (!changed && status->quality == quality &&
+                status->exception == exception) {
+                continue;
+            }
+
+            /* Readers of our own output see the change right away */
+            see_point(ch->point);
+            mark_readers(ch->point);
+
+            if (derive->changed) {
+                derive->changed(ch->point, values_get(ch->point)->number);
+            }
+        }
+    }
+
+    return n_evaluated;
+}
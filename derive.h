@@ -0,0 +1,85 @@
+#ifndef INCLUSION_GUARD_DERIVE_H
+#define INCLUSION_GUARD_DERIVE_H
+
+#include <glib.h>
+
+/** @file derive.h
+ * @Brief Derived channels computed from other value cache points
+ *
+ * Each channel is an expression over value cache points, compiled once into
+ * stack bytecode. After a poll cycle only channels with an input that
+ * changed are evaluated, the result is stored as a value cache point named
+ * after the channel. A channel may use channels defined before it, those are
+ * evaluated first in the same cycle. A channel with an input that is not
+ * good takes the worst quality of its inputs and keeps its last value.
+ *
+ * Expression syntax, with C precedence:
+ *
+ *   numbers      42, 0.5, 1e3, 0x1f
+ *   points       REG1, Humidity, any name of letters, digits and '_'
+ *   operators    + - * / % unary -, and on integers & | << >>
+ *   functions    abs(x) sqrt(x) log(x) exp(x) min(x, y) max(x, y) pow(x, y)
+ *
+ * The integer operators take the integer part of unsigned 32 bit operands.
+ * A result that is not a finite number, e.g. from a negative operand of &
+ * or a division by zero, leaves the channel unchanged.
+ *
+ * e.g. dew point from temperature T and relative humidity H:
+ *
+ *   243.04 * (log(H / 100) + 17.625 * T / (243.04 + T)) /
+ *   (17.625 - log(H / 100) - 17.625 * T / (243.04 + T))
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define DERIVE_MAX_CHANNELS (256)
+
+/* Per channel limits */
+#define DERIVE_MAX_CODE (64)
+#define DERIVE_MAX_CONSTANTS (8)
+#define DERIVE_MAX_INPUTS (8)
+#define DERIVE_MAX_STACK (16)
+
+/******************** TYPE DEFINITION SECTION *********************************/
+
+/**
+ * Description of one derived channel.
+ */
+struct derive_channel
+{
+    const gchar *name;          /* Name of value cache point to store to */
+    const gchar *expression;
+};
+
+/**
+ * Called for every derived value whose value or quality changed.
+ */
+typedef void (*derive_func)(gint point, gdouble value);
+
+/******************** GLOBAL FUNCTION DECLARATION SECTION *********************/
+
+/**
+ * Compile channels, channels that fail to compile are logged and left out.
+ * The descriptions are not referenced after the call.
+ *
+ * @param changed Called for each changed value, may be NULL.
+ *
+ * @return Number of channels compiled.
+ */
+guint derive_init(const struct derive_channel *channels, gsize n_channels,
+                  derive_func changed);
+
+/**
+ * Release all channels.
+ */
+void derive_cleanup(void);
+
+/**
+ * Evaluate channels whose inputs changed value or quality since the last
+ * call, call at the end of every poll cycle.
+ *
+ * @return Number of channels evaluated.
+ */
+guint derive_update(void);
+
+#endif // INCLUSION_GUARD_DERIVE_H
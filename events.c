@@ -0,0 +1,420 @@
+#include <glib.h>
+#include <glib/gprintf.h>
+#include <string.h>
+#include <axsdk/axevent.h>
+
+#include "events.h"
+#include "values.h"
+#include "debug.h"
+
+/** @file events.c
+ * @Brief Register change event implementation
+ *
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define EVENTS_WORDS ((VALUES_MAX_POINTS + 31) / 32)
+
+/* Retry interval while declarations are still in progress */
+#define EVENTS_RETRY_MS (200)
+
+/******************** LOCAL VARIABLE DECLARATION SECTION **********************/
+
+/**
+ * Event state of one register point.
+ */
+struct event_point
+{
+    gchar name[VALUES_NAME_SIZE];
+    guint32 value;          /* Latest recorded value, protected by lock */
+    guint8 quality;         /* Its enum value_quality, protected by lock */
+    guint32 flipped;        /* Bits changed since last batch, locked */
+
+    /* Only accessed from the event thread */
+    guint32 snapshot;       /* Value taken at last batch */
+    guint8 snapshot_quality;
+    guint32 changed;        /* Bits changed since last event */
+    guint32 sent_value;     /* Value of last event or declaration */
+    guint8 sent_quality;
+    gint64 sent_us;
+    guint declaration;
+    gboolean declared;
+    gboolean ready;         /* Declaration completed */
+};
+
+struct events
+{
+    GThread *thread;
+    GMainContext *context;
+    GMainLoop *loop;
+    AXEventHandler *handler;
+
+    GMutex lock;
+    guint32 dirty[EVENTS_WORDS];    /* Changed since last batch, locked */
+    guint32 pending[EVENTS_WORDS];  /* Waiting for debounce or declaration */
+    struct event_point points[VALUES_MAX_POINTS];
+
+    gint batch_queued;
+    GSource *retry;
+
+    guint n_events;
+    guint n_declarations;
+};
+
+/**
+ * Event state, NULL when events are not enabled.
+ */
+static struct events *events = NULL;
+
+/******************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static gpointer event_thread(gpointer data);
+
+static gboolean on_batch(gpointer data);
+
+static void on_declaration_complete(guint declaration, gpointer user_data);
+
+static gboolean declare_point(struct event_point *p);
+
+static gboolean send_point(struct event_point *p);
+
+static gboolean on_retry(gpointer data);
+
+static void schedule_retry(guint interval_ms);
+
+/******************** LOCAL FUNCTION DEFINTION SECTION ************************/
+
+static gpointer event_thread(gpointer data)
+{
+    struct events *ev = data;
+
+    /* axevent dispatches to the thread default context of its creator */
+    g_main_context_push_thread_default(ev->context);
+
+    ev->handler = ax_event_handler_new();
+
+    g_main_loop_run(ev->loop);
+
+    guint i = 0;
+    for (; i < VALUES_MAX_POINTS; i++) {
+        if (ev->points[i].declared) {
+            ax_event_handler_undeclare(ev->handler,
+                ev->points[i].declaration, NULL);
+        }
+    }
+
+    ax_event_handler_free(ev->handler);
+    ev->handler = NULL;
+
+    g_main_context_pop_thread_default(ev->context);
+
+    return NULL;
+}
+
+static void on_declaration_complete(guint declaration, gpointer user_data)
+{
+    struct event_point *p = user_data;
+
+    p->ready = TRUE;
+    DBG_LOG("Event declaration %u for %s complete", declaration, p->name);
+}
+
+static gboolean declare_point(struct event_point *p)
+{
+    GError *error = NULL;
+    AXEventKeyValueSet *set = ax_event_key_value_set_new();
+    gint value = p->snapshot;
+    gint changed = 0;
+    gint quality = p->snapshot_quality;
+
+    ax_event_key_value_set_add_key_value(set, "topic0", "tnsaxis",
+        "CameraApplicationPlatform", AX_VALUE_TYPE_STRING, NULL);
+    ax_event_key_value_set_add_key_value(set, "topic1", "tnsaxis",
+        "RS232", AX_VALUE_TYPE_STRING, NULL);
+    ax_event_key_value_set_add_key_value(set, "topic2", "tnsaxis",
+        "Register", AX_VALUE_TYPE_STRING, NULL);
+    ax_event_key_value_set_add_nice_names(set, "topic1", "tnsaxis",
+        NULL, "RS232", NULL);
+    ax_event_key_value_set_add_nice_names(set, "topic2", "tnsaxis",
+        NULL, "Register change", NULL);
+
+    ax_event_key_value_set_add_key_value(set, "Point", NULL, p->name,
+        AX_VALUE_TYPE_STRING, NULL);
+    ax_event_key_value_set_mark_as_source(set, "Point", NULL, NULL);
+
+    ax_event_key_value_set_add_key_value(set, "Value", NULL, &value,
+        AX_VALUE_TYPE_INT, NULL);
+    ax_event_key_value_set_mark_as_data(set, "Value", NULL, NULL);
+
+    ax_event_key_value_set_add_key_value(set, "Changed", NULL, &changed,
+        AX_VALUE_TYPE_INT, NULL);
+    ax_event_key_value_set_mark_as_data(set, "Changed", NULL, NULL);
+
+    ax_event_key_value_set_add_key_value(set, "Quality", NULL, &quality,
+        AX_VALUE_TYPE_INT, NULL);
+    ax_event_key_value_set_mark_as_data(set, "Quality", NULL, NULL);
+
+    gboolean ok = ax_event_handler_declare(events->handler, set,
+        FALSE /* stateful */, &p->declaration, on_declaration_complete,
+        p, &error);
+
+    ax_event_key_value_set_free(set);
+
+    if (!ok) {
+        ERR("Failed to declare event for %s: %s", p->name,
+            error ? error->message : "unknown error");
+        g_clear_error(&error);
+        return FALSE;
+    }
+
+    p->declared     = TRUE;
+    p->changed      = 0;
+    p->sent_value   = p->snapshot;
+    p->sent_quality = p->snapshot_quality;
+    p->sent_us      = g_get_monotonic_time();
+    events->n_declarations++;
+
+    return TRUE;
+}
+
+static gboolean send_point(struct event_point *p)
+{
+    GError *error = NULL;
+    AXEventKeyValueSet *set = ax_event_key_value_set_new();
+    gint value = p->snapshot;
+    gint changed = p->changed;
+    gint quality = p->snapshot_quality;
+
+    ax_event_key_value_set_add_key_value(set, "Point", NULL, p->name,
+        AX_VALUE_TYPE_STRING, NULL);
+    ax_event_key_value_set_add_key_value(set, "Value", NULL, &value,
+        AX_VALUE_TYPE_INT, NULL);
+    ax_event_key_value_set_add_key_value(set, "Changed", NULL, &changed,
+        AX_VALUE_TYPE_INT, NULL);
+    ax_event_key_value_set_add_key_value(set, "Quality", NULL, &quality,
+        AX_VALUE_TYPE_INT, NULL);
+
+    AXEvent *event = ax_event_new(set, NULL);
+    ax_event_key_value_set_free(set);
+
+    gboolean ok = ax_event_handler_send_event(events->handler,
+        p->declaration, event, &error);
+    ax_event_free(event);
+
+    if (!ok) {
+        ERR("Failed to send event for %s: %s", p->name,
+            error ? error->message : "unknown error");
+        g_clear_error(&error);
+        return FALSE;
+    }
+
+    p->changed      = 0;
+    p->sent_value   = p->snapshot;
+    p->sent_quality = p->snapshot_quality;
+    p->sent_us      = g_get_monotonic_time();
+    events->n_events++;
+
+    return TRUE;
+}
+
+static gboolean on_retry(gpointer data)
+{
+    g_source_unref(events->retry);
+    events->retry = NULL;
+
+    on_batch(NULL);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void schedule_retry(guint interval_ms)
+{
+    if (events->retry) {
+        return;
+    }
+
+    events->retry = g_timeout_source_new(MAX(interval_ms, 1));
+    g_source_set_callback(events->retry, on_retry, NULL, NULL);
+    g_source_attach(events->retry, events->context);
+}
+
+static gboolean on_batch(gpointer data)
+{
+    struct events *ev = events;
+    guint w;
+
+    g_atomic_int_set(&ev->batch_queued, 0);
+
+    /* Take over changes of the poll cycle(s) since last batch */
+    g_mutex_lock(&ev->lock);
+    for (w = 0; w < EVENTS_WORDS; w++) {
+        guint32 bits = ev->dirty[w];
+
+        ev->pending[w] |= bits;
+        ev->dirty[w] = 0;
+
+        while (bits) {
+            gint i = w * 32 + __builtin_ctz(bits);
+            ev->points[i].snapshot = ev->points[i].value;
+            ev->points[i].snapshot_quality = ev->points[i].quality;
+            ev->points[i].changed |= ev->points[i].flipped;
+            ev->points[i].flipped = 0;
+            bits &= bits - 1;
+        }
+    }
+    g_mutex_unlock(&ev->lock);
+
+    gint64 now = g_get_monotonic_time();
+    gint64 next_due = G_MAXINT64;
+    guint n_declared = 0;
+
+    for (w = 0; w < EVENTS_WORDS; w++) {
+        guint32 bits = ev->pending[w];
+
+        while (bits) {
+            gint i = w * 32 + __builtin_ctz(bits);
+            guint32 bit = bits & -bits;
+            struct event_point *p = &ev->points[i];
+            bits &= bits - 1;
+
+            if (!p->declared) {
+                /* The declaration carries the initial state */
+                if (n_declared < EVENTS_MAX_DECLARATIONS) {
+                    n_declared++;
+                    if (declare_point(p)) {
+                        ev->pending[w] &= ~bit;
+                        continue;
+                    }
+                }
+                next_due = MIN(next_due, now + EVENTS_RETRY_MS * 1000);
+                continue;
+            }
+
+            if (!p->ready) {
+                next_due = MIN(next_due, now + EVENTS_RETRY_MS * 1000);
+                continue;
+            }
+
+            /* Bits that flipped back still make an event */
+            if (!p->changed && p->snapshot_quality == p->sent_quality) {
+                ev->pending[w] &= ~bit;
+                continue;
+            }
+
+            gint64 due = p->sent_us + EVENTS_DEBOUNCE_MS * 1000;
+            if (due > now) {
+                next_due = MIN(next_due, due);
+                continue;
+            }
+
+            send_point(p);
+            ev->pending[w] &= ~bit;
+        }
+    }
+
+    if (next_due != G_MAXINT64) {
+        schedule_retry((next_due - now) / 1000);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+gboolean events_init(void)
+{
+    GError *error = NULL;
+
+    if (events) {
+        return TRUE;
+    }
+
+    struct events *ev = g_new0(struct events, 1);
+    g_mutex_init(&ev->lock);
+    ev->context = g_main_context_new();
+    ev->loop    = g_main_loop_new(ev->context, FALSE);
+
+    events = ev;
+
+    ev->thread = g_thread_try_new("events", event_thread, ev, &error);
+    if (!ev->thread) {
+        ERR("Failed to start event thread: %s", error->message);
+        g_error_free(error);
+        events = NULL;
+        g_main_loop_unref(ev->loop);
+        g_main_context_unref(ev->context);
+        g_mutex_clear(&ev->lock);
+        g_free(ev);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void events_cleanup(void)
+{
+    if (!events) {
+        return;
+    }
+
+    g_main_loop_quit(events->loop);
+    g_thread_join(events->thread);
+
+    LOG("Sent %u register events for %u declared points",
+        events->n_events, events->n_declarations);
+
+    if (events->retry) {
+        g_source_destroy(events->retry);
+        g_source_unref(events->retry);
+    }
+
+    g_main_loop_unref(events->loop);
+    g_main_context_unref(events->context);
+    g_mutex_clear(&events->lock);
+    g_free(events);
+    events = NULL;
+}
+
+void events_update(gint point, guint32 value)
+{
+    if (!events || point < 0 || point >= VALUES_MAX_POINTS) {
+        return;
+    }
+
+    struct event_point *p = &events->points[point];
+    const value_status *status = values_get_status(point);
+    guint8 quality = status ? status->quality : VALUE_GOOD;
+
+    g_mutex_lock(&events->lock);
+
+    gboolean first = p->name[0] == '\0';
+
+    if (first) {
+        const value_point *vp = values_get(point);
+        g_strlcpy(p->name, vp ? vp->name : "?", sizeof(p->name));
+    }
+
+    if (p->value != value || p->quality != quality || first) {
+        if (!first) {
+            p->flipped |= p->value ^ value;
+        }
+        p->value   = value;
+        p->quality = quality;
+        events->dirty[point / 32] |= 1U << (point % 32);
+    }
+
+    g_mutex_unlock(&events->lock);
+}
+
+void events_commit(void)
+{
+    if (!events) {
+        return;
+    }
+
+    /* One batch per cycle no matter how many points changed */
+    if (g_atomic_int_compare_and_exchange(&events->batch_queued, 0, 1)) {
+        g_main_context_invoke(events->context, on_batch, NULL);
+    }
+}
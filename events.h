@@ -0,0 +1,53 @@
+#ifndef INCLUSION_GUARD_EVENTS_H
+#define INCLUSION_GUARD_EVENTS_H
+
+#include <glib.h>
+
+/** @file events.h
+ * @Brief Publication of register changes as stateful axevent events
+ *
+ * Every register point gets a stateful event declaration with the point
+ * name as source and the register value, the bits that changed and the
+ * enum value_quality of the point as data. A read failing or the value
+ * going stale sends the last value with the new quality. The poll path
+ * only records values, declarations and events are handled by a separate
+ * thread. All changes of a poll cycle are sent as one batch and each point
+ * is sent at most once per debounce interval, so a burst of bit flips in a
+ * register results in one event carrying the final value and every flipped
+ * bit.
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+/* Minimum interval between two events for the same point */
+#define EVENTS_DEBOUNCE_MS (1000)
+
+/* Maximum number of new declarations made per batch */
+#define EVENTS_MAX_DECLARATIONS (16)
+
+/******************** GLOBAL FUNCTION DECLARATION SECTION *********************/
+
+/**
+ * Start event thread and connect to the event daemon.
+ *
+ * @return TRUE on success, FALSE on any kind of error.
+ */
+gboolean events_init(void);
+
+/**
+ * Stop event thread and undeclare all events.
+ */
+void events_cleanup(void);
+
+/**
+ * Record current value and quality of a register point, value cache id.
+ * Only stores them, safe to call from the poll path.
+ */
+void events_update(gint point, guint32 value);
+
+/**
+ * End of poll cycle, hands the recorded changes to the event thread.
+ */
+void events_commit(void);
+
+#endif // INCLUSION_GUARD_EVENTS_H
@@ -0,0 +1,350 @@
+#include <glib.h>
+#include <glib/gprintf.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "lineproto.h"
+#include "values.h"
+#include "capture.h"
+#include "debug.h"
+
+/** @file lineproto.c
+ * @Brief Streaming ASCII line protocol implementation
+ *
+ * The ring buffer is mapped twice back to back in virtual memory, so data
+ * that wraps around the end of the ring is still contiguous. A line is thus
+ * always handed to the field parser as a single pointer into the ring no
+ * matter where it starts. If the double mapping is unavailable, lines that
+ * wrap are copied into a scratch buffer instead.
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define LINEPROTO_MAX_FIELD_TEXT (64)
+
+/******************** LOCAL VARIABLE DECLARATION SECTION **********************/
+
+struct lineproto
+{
+    int fd;
+    unsigned char *ring;
+    gsize size;             /* Power of two */
+    gboolean mirrored;      /* Ring is mapped twice in a row */
+    unsigned char *scratch; /* Wrapped lines when not mirrored */
+
+    /* Free running positions, masked on access */
+    gsize head;             /* Next byte to write */
+    gsize tail;             /* Start of current line */
+    gsize scan;             /* Next byte to search for end of line */
+    gboolean discard;       /* Skip until end of an overlong line */
+
+    struct lineproto_field *fields;
+    gint *points;
+    gsize n_fields;
+
+    struct lineproto_stats stats;
+};
+
+/******************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static gboolean ring_map(struct lineproto *lp, gsize size);
+
+static void ring_unmap(struct lineproto *lp);
+
+static void parse_line(struct lineproto *lp, const gchar *line, gsize len);
+
+static void process_lines(struct lineproto *lp);
+
+/******************** LOCAL FUNCTION DEFINTION SECTION ************************/
+
+static gboolean ring_map(struct lineproto *lp, gsize size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    gsize n = page > 0 ? (gsize) page : 4096;
+
+    /* Must be a page multiple for the mapping and a power of two for masks */
+    while (n < size) {
+        n <<= 1;
+    }
+    lp->size = n;
+
+    char path[] = "/tmp/rs232-ring-XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd >= 0) {
+        unlink(path);
+
+        unsigned char *base = NULL;
+        if (ftruncate(fd, n) == 0) {
+            base = mmap(NULL, 2 * n, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+
+        if (base && base != MAP_FAILED &&
+            mmap(base, n, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+            mmap(base + n, n, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED) {
+            close(fd);
+            lp->ring = base;
+            lp->mirrored = TRUE;
+            return TRUE;
+        }
+
+        if (base && base != MAP_FAILED) {
+            munmap(base, 2 * n);
+        }
+        close(fd);
+    }
+
+    LOG("Mirrored ring buffer unavailable, wrapped lines will be copied");
+
+    lp->ring    = g_try_malloc(n);
+    lp->scratch = g_try_malloc(n);
+    lp->mirrored = FALSE;
+
+    return lp->ring && lp->scratch;
+}
+
+static void ring_unmap(struct lineproto *lp)
+{
+    if (lp->mirrored) {
+        munmap(lp->ring, 2 * lp->size);
+    } else {
+        g_free(lp->ring);
+        g_free(lp->scratch);
+    }
+
+    lp->ring    = NULL;
+    lp->scratch = NULL;
+}
+
+static void parse_line(struct lineproto *lp, const gchar *line, gsize len)
+{
+    /* Strip CR of CRLF terminated lines */
+    while (len && (line[len - 1] == '\r' || line[len - 1] == '\0')) {
+        len--;
+    }
+
+    if (!len) {
+        return;
+    }
+
+    lp->stats.lines++;
+
+    gsize i = 0;
+    for (; i < lp->n_fields; i++) {
+        const struct lineproto_field *field = &lp->fields[i];
+
+        if (field->match) {
+            gsize match_len = strlen(field->match);
+
+            if (match_len > len || memcmp(line, field->match, match_len)) {
+                continue;
+            }
+        }
+
+        /* Walk to the start of the wanted field */
+        const gchar *start = line;
+        const gchar *end = line + len;
+        guint index = field->index;
+
+        while (index && start < end) {
+            const gchar *delim = memchr(start, field->delimiter, end - start);
+
+            if (!delim) {
+                start = end;
+                break;
+            }
+            start = delim + 1;
+            index--;
+        }
+
+        if (index) {
+            continue;
+        }
+
+        const gchar *stop = memchr(start, field->delimiter, end - start);
+        if (!stop) {
+            stop = end;
+        }
+
+        /* Trim padding, common for numeric values from scales */
+        while (start < stop && g_ascii_isspace(*start)) {
+            start++;
+        }
+        while (stop > start && g_ascii_isspace(stop[-1])) {
+            stop--;
+        }
+
+        values_set_text(lp->points[i], start, stop - start);
+        lp->stats.fields++;
+    }
+}
+
+static void process_lines(struct lineproto *lp)
+{
+    gsize mask = lp->size - 1;
+
+    while (lp->scan != lp->head) {
+        gsize scan_off = lp->scan & mask;
+        gsize avail = lp->head - lp->scan;
+
+        /* Without mirror only search up to the physical end of the ring */
+        if (!lp->mirrored) {
+            avail = MIN(avail, lp->size - scan_off);
+        }
+
+        const unsigned char *nl = memchr(&lp->ring[scan_off], '\n', avail);
+
+        if (!nl) {
+            lp->scan += avail;
+            continue;
+        }
+
+        gsize eol = lp->scan + (nl - &lp->ring[scan_off]);
+        gsize len = eol - lp->tail;
+        gsize tail_off = lp->tail & mask;
+
+        if (lp->discard) {
+            lp->discard = FALSE;
+        } else if (lp->mirrored || tail_off + len <= lp->size) {
+            parse_line(lp, (const gchar *) &lp->ring[tail_off], len);
+        } else {
+            gsize first = lp->size - tail_off;
+            memcpy(lp->scratch, &lp->ring[tail_off], first);
+            memcpy(&lp->scratch[first], lp->ring, len - first);
+            parse_line(lp, (const gchar *) lp->scratch, len);
+        }
+
+        lp->tail = lp->scan = eol + 1;
+    }
+
+    /* Ring full without any line ending, drop the partial line */
+    if (lp->head - lp->tail == lp->size) {
+        lp->stats.overruns++;
+        lp->tail = lp->scan = lp->head;
+        lp->discard = TRUE;
+    }
+}
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+struct lineproto *lineproto_new(int fd,
+                                const struct lineproto_field *fields,
+                                gsize n_fields)
+{
+    g_assert(fields || !n_fields);
+
+    struct lineproto *lp = g_new0(struct lineproto, 1);
+    lp->fd = fd;
+
+    if (!ring_map(lp, LINEPROTO_RING_SIZE)) {
+        ERR("Failed to allocate line protocol ring buffer");
+        ring_unmap(lp);
+        g_free(lp);
+        return NULL;
+    }
+
+    lp->fields   = g_new0(struct lineproto_field, n_fields);
+    lp->points   = g_new0(gint, n_fields);
+    lp->n_fields = n_fields;
+
+    gsize i = 0;
+    for (; i < n_fields; i++) {
+        lp->fields[i] = fields[i];
+        lp->fields[i].name  = g_strdup(fields[i].name);
+        lp->fields[i].match = g_strdup(fields[i].match);
+        lp->points[i] = values_add_point(fields[i].name);
+    }
+
+    LOG("Line protocol started on fd=%d, %zu bytes %s ring, %zu fields",
+        fd, lp->size, lp->mirrored ? "mirrored" : "plain", n_fields);
+
+    return lp;
+}
+
+void lineproto_free(struct lineproto **lp)
+{
+    if (!lp || !*lp) {
+        return;
+    }
+
+    struct lineproto *l = *lp;
+
+    gsize i = 0;
+    for (; i < l->n_fields; i++) {
+        g_free((gchar *) l->fields[i].name);
+        g_free((gchar *) l->fields[i].match);
+    }
+
+    g_free(l->fields);
+    g_free(l->points);
+    ring_unmap(l);
+    g_free(l);
+    *lp = NULL;
+}
+
+gint lineproto_read(struct lineproto *lp)
+{
+    g_assert(lp);
+
+    guint64 lines = lp->stats.lines;
+    gsize mask = lp->size - 1;
+
+    for (;;) {
+        gsize head_off = lp->head & mask;
+        gsize space = lp->size - (lp->head - lp->tail);
+
+        if (!lp->mirrored) {
+            space = MIN(space, lp->size - head_off);
+        }
+
+        ssize_t r = read(lp->fd, &lp->ring[head_off], space);
+
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+
+        if (r < 0) {
+            ERR("Line protocol read failed: %s", strerror(errno));
+            return -1;
+        }
+
+        if (r == 0) {
+            break;
+        }
+
+        capture_record(CAPTURE_DIR_RX, &lp->ring[head_off], r);
+
+        lp->head += r;
+        lp->stats.bytes += r;
+
+        process_lines(lp);
+    }
+
+    return lp->stats.lines - lines;
+}
+
+int lineproto_get_fd(struct lineproto *lp)
+{
+    g_assert(lp);
+
+    return lp->fd;
+}
+
+void lineproto_get_stats(struct lineproto *lp, struct lineproto_stats *stats)
+{
+    g_assert(lp);
+    g_assert(stats);
+
+    *stats = lp->stats;
+}
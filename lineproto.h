@@ -0,0 +1,83 @@
+#ifndef INCLUSION_GUARD_LINEPROTO_H
+#define INCLUSION_GUARD_LINEPROTO_H
+
+#include <glib.h>
+
+/** @file lineproto.h
+ * @Brief Streaming ASCII line protocol engine
+ *
+ * For devices that continuously send ASCII lines, e.g. scales, NMEA GPS
+ * receivers and barcode readers. Received bytes are read straight into a
+ * ring buffer, lines are split in place and the configured fields are
+ * stored in the value cache, see values.h. Nothing is allocated per line.
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define LINEPROTO_RING_SIZE (16 * 1024)
+
+/******************** TYPE DEFINITION SECTION *********************************/
+
+/**
+ * Description of one field to extract from received lines.
+ */
+struct lineproto_field
+{
+    const gchar *name;      /* Name of value cache point */
+    const gchar *match;     /* Only lines starting with this, NULL for all */
+    gchar delimiter;        /* Field delimiter, e.g. ',' */
+    guint index;            /* Zero based field index, 0 is the first field */
+};
+
+/**
+ * Line protocol counters.
+ */
+struct lineproto_stats
+{
+    guint64 bytes;
+    guint64 lines;
+    guint64 fields;
+    guint64 overruns;       /* Lines dropped since longer than the ring */
+};
+
+/**
+ * Forward declaration of line protocol engine.
+ */
+struct lineproto;
+
+/******************** GLOBAL FUNCTION DECLARATION SECTION *********************/
+
+/**
+ * Create line protocol engine reading from fd. The field descriptions are
+ * copied.
+ *
+ * @return Engine or NULL on error.
+ */
+struct lineproto *lineproto_new(int fd,
+                                const struct lineproto_field *fields,
+                                gsize n_fields);
+
+/**
+ * Destroy line protocol engine. Does not close fd.
+ */
+void lineproto_free(struct lineproto **lp);
+
+/**
+ * Read all currently available bytes and process complete lines. Call when
+ * fd is readable.
+ *
+ * @return Number of lines processed or -1 on read error.
+ */
+gint lineproto_read(struct lineproto *lp);
+
+/**
+ * Get file descriptor of engine.
+ */
+int lineproto_get_fd(struct lineproto *lp);
+
+/**
+ * Get engine counters.
+ */
+void lineproto_get_stats(struct lineproto *lp, struct lineproto_stats *stats);
+
+#endif // INCLUSION_GUARD_LINEPROTO_H
@@ -13,6 +13,7 @@ typedef struct mdp_item_pair
 {
     gchar *name;
     gchar *value;
+    gint style;     /* enum overlay_style, 0 is normal */
 } mdp_item_pair;
 
 /**
@@ -10,12 +10,15 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include "modbus.h"
+#include "serial.h"
+#include "capture.h"
+#include "debug.h"
 
 /****************** CONSTANT AND MACRO SECTION ******************************/
 
- #define READ_RETRIES (10)
  #define BUFSIZE (1024)
  #define CHECK_CRC
 
@@ -24,7 +27,15 @@
 struct modbus {
     int fd;
     unsigned char device_address;
+    enum modbus_framing framing;
+    unsigned int response_timeout_ms;
+    unsigned int frame_end_ms;      /* RTU silence that ends a response */
     unsigned char buf[BUFSIZE];
+    size_t frame_len;
+    struct modbus_rx_time rx_time;
+    enum modbus_error error;
+    unsigned char exception;
+    uint16_t n_requested;   /* Registers of the last read request */
 };
 
 /****************** GLOBAL VARIABLE DECLARATION SECTION *********************/
@@ -63,6 +74,19 @@ static const uint16_t wCRCTable[] = {
     0X4400, 0X84C1, 0X8581, 0X4540, 0X8701, 0X47C0, 0X4680, 0X8641,
     0X8201, 0X42C0, 0X4380, 0X8341, 0X4100, 0X81C1, 0X8081, 0X4040 };
 
+static const char hex_digits[16] = "0123456789ABCDEF";
+
+/* Value of a hex digit, 0xFF for anything else */
+static const uint8_t hex_values[256] = {
+    [0 ... 255] = 0xFF,
+    ['0'] = 0x0, ['1'] = 0x1, ['2'] = 0x2, ['3'] = 0x3, ['4'] = 0x4,
+    ['5'] = 0x5, ['6'] = 0x6, ['7'] = 0x7, ['8'] = 0x8, ['9'] = 0x9,
+    ['A'] = 0xA, ['B'] = 0xB, ['C'] = 0xC, ['D'] = 0xD, ['E'] = 0xE,
+    ['F'] = 0xF,
+    ['a'] = 0xA, ['b'] = 0xB, ['c'] = 0xC, ['d'] = 0xD, ['e'] = 0xE,
+    ['f'] = 0xF,
+};
+
 /****************** EXPORTED FUNCTION DEFINITION SECTION *******************/
 
 uint16_t *modbus_parse_input_registers(struct modbus *modbus, size_t *n)
@@ -77,7 +101,50 @@ uint16_t *modbus_parse_input_registers(struct modbus *modbus, size_t *n)
         return NULL;
     }
 
-    unsigned char function_code = resp_buf[1];
+    /* Address, function code with the top bit set, exception code, CRC */
+    if (modbus->frame_len >= 5 && resp_buf[1] & 0x80) {
+        modbus->error = MODBUS_ERROR_EXCEPTION;
+        modbus->exception = resp_buf[2];
+        g_message("Exception 0x%02x on function 0x%02x", resp_buf[2],
+            resp_buf[1] & 0x7F);
+        return NULL;
+    }
+
+    uint16_t *regs = modbus_parse_registers_frame(resp_buf, modbus->frame_len,
+                                                  n);
+
+    /* A short reply is as malformed as a wrong byte count */
+    if (regs && *n != modbus->n_requested) {
+        DBG_LOG("Got %zu registers for %u requested", *n,
+            modbus->n_requested);
+        g_free(regs);
+        regs = NULL;
+        *n = 0;
+    }
+
+    if (!regs) {
+        modbus->error = MODBUS_ERROR_FRAME;
+    }
+
+    return regs;
+}
+
+uint16_t *modbus_parse_registers_frame(const unsigned char *frame,
+                                       size_t size,
+                                       size_t *n)
+{
+    g_assert(frame);
+    g_assert(n);
+
+    *n = 0;
+
+    /* Address, function code, byte count and CRC */
+    if (size < 5) {
+        DBG_LOG("Too short frame of %zu bytes", size);
+        return NULL;
+    }
+
+    unsigned char function_code = frame[1];
 
     uint16_t *regs = NULL;
     size_t nregs;
@@ -87,14 +154,21 @@ uint16_t *modbus_parse_input_registers(struct modbus *modbus, size_t *n)
     switch (function_code) {
         case 0x03: /* holding register */
         case 0x04: /* input register */
-            nregs = resp_buf[2] / 2;
+            /* Never trust the byte count on a noisy line */
+            if (frame[2] == 0 || frame[2] % 2 || 3 + frame[2] + 2 > size) {
+                DBG_LOG("Byte count %d does not match frame of %zu bytes",
+                    frame[2], size);
+                return NULL;
+            }
+
+            nregs = frame[2] / 2;
             *n = nregs;
             regs = g_new0(uint16_t, nregs);
 
             for (; i < nregs; i++) {
                 size_t low_byte  = 4 + 2 * i;
                 size_t high_byte = 3 + 2 * i;
-                regs[i] = (resp_buf[high_byte] << 8) | resp_buf[low_byte];
+                regs[i] = (frame[high_byte] << 8) | frame[low_byte];
             }
             break;
         default:
@@ -114,18 +188,85 @@ unsigned char *modbus_eat_buffer(struct modbus *modbus)
     int tot_read = 1;
     int fd = modbus->fd;
 
-    int retries = READ_RETRIES;
-    while (tot_read < BUFSIZE && retries--) {
-        int r = read(fd, &modbus->buf[tot_read], BUFSIZE - tot_read);
-        if (r > 0) {
-            tot_read += r;
-            g_message("read %d (%d) chars", r, tot_read);
-        } else {
-            usleep(1000);
+    modbus->frame_len = 0;
+    modbus->exception = 0;
+    memset(&modbus->rx_time, 0, sizeof(modbus->rx_time));
+
+    gboolean ascii = modbus->framing == MODBUS_FRAMING_ASCII;
+
+    /* Wake up on every byte so the first one is stamped when it arrives.
+     * An RTU frame ends with silence, an ASCII frame with its LF.
+     */
+    while (tot_read < BUFSIZE &&
+           !(ascii && tot_read > 1 && modbus->buf[tot_read - 1] == '\n')) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int timeout = tot_read == 1 ? modbus->response_timeout_ms :
+            ascii ? MODBUS_ASCII_CHAR_TIMEOUT_MS : modbus->frame_end_ms;
+
+        int r = poll(&pfd, 1, timeout);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            break;
+        }
+
+        /* Drain what is left before giving up on a hung up port */
+        if (!(pfd.revents & POLLIN) && (pfd.revents & (POLLHUP | POLLERR))) {
+            DBG_LOG("Port hung up after %d bytes", tot_read - 1);
+            break;
+        }
+
+        r = read(fd, &modbus->buf[tot_read], BUFSIZE - tot_read);
+        if (r < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
         }
+        if (r <= 0) {
+            DBG_LOG("Read failed after %d bytes: %s", tot_read - 1,
+                r ? strerror(errno) : "end of file");
+            break;
+        }
+
+        gint64 now = g_get_monotonic_time();
+        gint64 now_utc = g_get_real_time();
+
+        if (tot_read == 1) {
+            modbus->rx_time.first_us = now;
+            modbus->rx_time.first_utc_us = now_utc;
+        }
+        modbus->rx_time.last_us = now;
+        modbus->rx_time.last_utc_us = now_utc;
+
+        capture_record(CAPTURE_DIR_RX, &modbus->buf[tot_read], r);
+        tot_read += r;
     }
 
-    if (tot_read < 3) {
+    printf("Message contents: ");
+    int i = 1;
+    for (; i < tot_read; i++) {
+        printf("%d = 0x%02x, ", i - 1, modbus->buf[i]);
+    }
+    printf("\n");
+
+    unsigned char *frame = ascii ?
+        modbus_ascii_decode(&modbus->buf[1], tot_read - 1,
+                            &modbus->frame_len) :
+        modbus_decode_frame(modbus->buf, tot_read - 1, &modbus->frame_len);
+
+    modbus->error = frame ? MODBUS_ERROR_NONE :
+        tot_read == 1 ? MODBUS_ERROR_TIMEOUT : MODBUS_ERROR_CRC;
+
+    return frame;
+}
+
+unsigned char *modbus_decode_frame(unsigned char *buf, size_t n, size_t *size)
+{
+    g_assert(buf);
+    g_assert(size);
+
+    *size = 0;
+
+    if (n < 2) {
         g_message("Too small buffer, discard!");
         return NULL;
     }
@@ -133,45 +274,65 @@ unsigned char *modbus_eat_buffer(struct modbus *modbus)
     int msg_start = 1;
 
     /* Check if device address was in response or not */
-    if (modbus->buf[1] == modbus->device_address) {
-        tot_read -= 1;
-    } else {
+    if (buf[1] != buf[0]) {
         msg_start = 0;
-        g_message("added missing device address 0x%02x", modbus->device_address);
+        n += 1;
+        DBG_LOG("added missing device address 0x%02x", buf[0]);
     }
 
-    printf("Message contents: ");
-    int i = 0;
-    for (; i < tot_read; i++) {
-        printf("%d = 0x%02x, ", i, modbus->buf[msg_start+i]);
+    if (n < 3) {
+        g_message("Too small buffer, discard!");
+        return NULL;
     }
-    printf("\n");
 
     /* Verify CRC code */
     #ifdef CHECK_CRC
-        if (modbus_check_crc16(&modbus->buf[msg_start], tot_read) < 0) {
+        if (modbus_check_crc16(&buf[msg_start], n) < 0) {
             return NULL;
         }
     #endif
 
-    return &modbus->buf[msg_start];
+    *size = n;
+
+    return &buf[msg_start];
 }
 
 
-/* open serial port for read and write */
-static int open_serial_tty(const char *path)
+unsigned char *modbus_transact(struct modbus *modbus,
+                               unsigned char *req,
+                               size_t size,
+                               size_t *resp_size)
 {
-    int fd = open(path, O_RDWR | O_NOCTTY | O_NDELAY);
+    g_assert(modbus);
+    g_assert(resp_size);
 
-    if (fd < 0) {
-        perror("failed to open serial port");
-        g_assert(0);
-    } else {
-        g_message("%s() [%s:%d] - Opened serial port fd=%d",
-                        __FUNCTION__, __FILE__, __LINE__, fd);
+    *resp_size = 0;
+
+    if (modbus_send_frame(modbus, req, size)) {
+        return NULL;
     }
 
-    return fd;
+    unsigned char *resp = modbus_eat_buffer(modbus);
+
+    if (resp) {
+        *resp_size = modbus->frame_len;
+    }
+
+    return resp;
+}
+
+void modbus_set_response_timeout(struct modbus *modbus, unsigned int ms)
+{
+    g_assert(modbus);
+
+    modbus->response_timeout_ms = ms;
+}
+
+unsigned int modbus_get_response_timeout(struct modbus *modbus)
+{
+    g_assert(modbus);
+
+    return modbus->response_timeout_ms;
 }
 
 int modbus_get_fd(struct modbus *modbus)
@@ -181,6 +342,74 @@ int modbus_get_fd(struct modbus *modbus)
     return modbus->fd;
 }
 
+void modbus_get_rx_time(struct modbus *modbus, struct modbus_rx_time *time)
+{
+    g_assert(modbus);
+    g_assert(time);
+
+    *time = modbus->rx_time;
+}
+
+enum modbus_error modbus_get_error(struct modbus *modbus,
+                                   unsigned char *exception)
+{
+    g_assert(modbus);
+
+    if (exception) {
+        *exception = modbus->exception;
+    }
+
+    return modbus->error;
+}
+
+unsigned char modbus_get_device_address(struct modbus *modbus)
+{
+    g_assert(modbus);
+
+    return modbus->device_address;
+}
+
+void modbus_set_device_address(struct modbus *modbus, unsigned char address)
+{
+    g_assert(modbus);
+
+    modbus->device_address = address;
+    modbus->buf[0] = address;
+}
+
+int modbus_set_framing(struct modbus *modbus, enum modbus_framing framing)
+{
+    g_assert(modbus);
+
+    struct termios tio;
+
+    if (tcgetattr(modbus->fd, &tio)) {
+        g_message("tcgetattr() failed! %s", strerror(errno));
+        return -1;
+    }
+
+    /* ASCII frames are 7 bit characters. Not every port takes that, e.g.
+     * a pty, 8 bits still carry them.
+     */
+    tio.c_cflag &= ~CSIZE;
+    tio.c_cflag |= framing == MODBUS_FRAMING_ASCII ? CS7 : CS8;
+
+    if (tcsetattr(modbus->fd, TCSANOW, &tio)) {
+        g_message("Port keeps its character size! %s", strerror(errno));
+    }
+
+    modbus->framing = framing;
+
+    return 0;
+}
+
+enum modbus_framing modbus_get_framing(struct modbus *modbus)
+{
+    g_assert(modbus);
+
+    return modbus->framing;
+}
+
 int modbus_read_input_registers(struct modbus *modbus,
                                 uint16_t start,
                                 uint16_t n)
@@ -196,13 +425,40 @@ int modbus_read_input_registers(struct modbus *modbus,
     cmd_buf[4] = (n >> 8) & 0xFF;
     cmd_buf[5] = n & 0xFF;
 
-    if (modbus_write_message(modbus->fd, cmd_buf, sizeof(cmd_buf))) {
+    modbus->n_requested = n;
+
+    if (modbus_send_frame(modbus, cmd_buf, sizeof(cmd_buf))) {
         return -1;
     }
 
     return 0;
 }
 
+int modbus_broadcast_write_register(struct modbus *modbus,
+                                    uint16_t reg,
+                                    uint16_t value)
+{
+    g_assert(modbus);
+    unsigned char cmd_buf[8] = {0,};
+
+    cmd_buf[0] = MODBUS_BROADCAST_ADDRESS;
+    cmd_buf[1] = 0x06; /* Function code for write single register */
+
+    cmd_buf[2] = (reg >> 8) & 0xFF;
+    cmd_buf[3] = reg & 0xFF;
+    cmd_buf[4] = (value >> 8) & 0xFF;
+    cmd_buf[5] = value & 0xFF;
+
+    if (modbus_send_frame(modbus, cmd_buf, sizeof(cmd_buf))) {
+        return -1;
+    }
+
+    /* Slaves start processing once the whole frame is on the bus */
+    tcdrain(modbus->fd);
+
+    return 0;
+}
+
 /*
  * Close modbus device
  */
@@ -234,72 +490,34 @@ struct modbus *modbus_init_device(const char *path,
 {
     g_assert(path);
 
-    int fd = open_serial_tty(path);
+    int fd = serial_open_tty(path);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (serial_configure(fd, par, baud, stop_bit)) {
+        close(fd);
+        return NULL;
+    }
 
     /* Create device structure */
     struct modbus *modbus = g_new0(struct modbus, 1);
     modbus->device_address = device_address;
     modbus->fd = fd;
+    modbus->response_timeout_ms = MODBUS_RESPONSE_TIMEOUT_MS;
+
+    /* 3.5 characters of 11 bits, rounded up */
+    unsigned int bps = serial_speed_bps(baud);
+    modbus->frame_end_ms = bps ?
+        MAX((35 * 11 * 1000 + 10 * bps - 1) / (10 * bps),
+            MODBUS_FRAME_END_MS) : MODBUS_FRAME_END_MS;
 
     /* Make first character of receive buffer the device address in case
      * the device address was missing in a response.
      */
     modbus->buf[0] = device_address;
 
-    /* Configure serial port according to desired settings */
-    struct termios ts = {0,};
-
-    if (tcgetattr(fd, &ts)) {
-        perror("Failed to get serial port settings!");
-        g_assert(0);
-    }
-
-    /* Set input and output baud rate the same */
-    cfsetispeed(&ts, baud);
-    cfsetospeed(&ts, baud);
-
-    /* Only local ownership of port, allow read.*/
-    ts.c_cflag |= (CLOCAL | CREAD);
-
-    /* Add extra stop bit if requested */
-    if (stop_bit) {
-        ts.c_cflag |= CSTOPB;
-    } else {
-        ts.c_cflag &= ~CSTOPB;
-    }
-
-    /* Setup parity bit according to input configuration */
-    switch (par) {
-        case PARITY_NONE:
-            ts.c_cflag &= ~PARENB;
-            break;
-        case PARITY_ODD:
-            ts.c_cflag |= (PARENB | PARODD);
-            break;
-        case PARITY_EVEN:
-            ts.c_cflag |= PARENB;
-            ts.c_cflag &= ~PARODD;
-            break;
-        default:
-            g_assert(0);
-    }
-
-    /* Set 8 bit data size */
-    ts.c_cflag &= ~CSIZE; /* Mask the character size bits */
-    ts.c_cflag |= CS8;    /* Select 8 data bits */
-
-    /* Make raw */
-    ts.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
-
-    /* Raw output, no post processing of data */
-    ts.c_oflag &= ~OPOST;
-
-    /* Physically commit changes to serial port immediately */
-    if (tcsetattr(fd, TCSANOW, &ts)) {
-        perror("Failed to configure TTY terminal");
-        g_assert(0);
-    }
-
     return modbus;
 }
 
@@ -316,6 +534,10 @@ int modbus_write_message(int fd, unsigned char *msg, size_t size)
     /* Send the command down the line */
     int n = write(fd, msg, size);
 
+    if (n > 0) {
+        capture_record(CAPTURE_DIR_TX, msg, n);
+    }
+
     int i = 0;
     for (; i < size; i++) {
         printf("%d = 0x%02x, ", i, msg[i]);
@@ -333,13 +555,163 @@ int modbus_write_message(int fd, unsigned char *msg, size_t size)
     return 0;
 }
 
+/*
+ * Write frame with the framing of the device
+ */
+int modbus_send_frame(struct modbus *modbus, unsigned char *msg, size_t size)
+{
+    g_assert(modbus);
+    g_assert(size > 2);
+
+    /* Until a response is read, a failed send never gets one */
+    modbus->error = MODBUS_ERROR_TIMEOUT;
+    modbus->exception = 0;
+
+    if (modbus->framing == MODBUS_FRAMING_RTU) {
+        return modbus_write_message(modbus->fd, msg, size);
+    }
+
+    char text[MODBUS_ASCII_FRAME_SIZE];
+
+    g_assert(2 * size + 1 <= sizeof(text));
+
+    size_t len = modbus_ascii_encode(msg, size, text);
+    int n = write(modbus->fd, text, len);
+
+    if (n > 0) {
+        capture_record(CAPTURE_DIR_TX, (unsigned char *) text, n);
+    }
+
+    if (n < 0) {
+        g_message("write() of %zu characters failed! %s", len,
+            strerror(errno));
+        return -1;
+    }
+
+    g_message("Successfully wrote %d characters, LRC= %.2s", n,
+        &text[len - 4]);
+
+    return 0;
+}
+
+/*
+ * Encode frame as ASCII, the CRC bytes are replaced by the LRC
+ */
+size_t modbus_ascii_encode(const unsigned char *msg, size_t size, char *out)
+{
+    g_assert(msg);
+    g_assert(out);
+    g_assert(size > 2);
+
+    uint8_t lrc = modbus_gen_lrc(msg, size - 2);
+    char *p = out;
+    size_t i = 0;
+
+    *p++ = ':';
+    for (; i < size - 2; i++) {
+        *p++ = hex_digits[msg[i] >> 4];
+        *p++ = hex_digits[msg[i] & 0x0F];
+    }
+    *p++ = hex_digits[lrc >> 4];
+    *p++ = hex_digits[lrc & 0x0F];
+    *p++ = '\r';
+    *p++ = '\n';
+
+    return p - out;
+}
+
+/*
+ * Decode ASCII frame in place. Byte i is written at buf[i] after its digits
+ * at buf[2i + 1] and buf[2i + 2] have been read, so nothing is overwritten
+ * before it is used.
+ */
+unsigned char *modbus_ascii_decode(unsigned char *buf, size_t n,
+                                   size_t *size)
+{
+    g_assert(buf);
+    g_assert(size);
+
+    *size = 0;
+
+    unsigned char *start = memchr(buf, ':', n);
+    unsigned char *end = start ? memchr(start, '\n', n - (start - buf)) :
+        NULL;
+
+    if (!end) {
+        g_message("Incomplete ASCII frame, discard!");
+        return NULL;
+    }
+
+    /* ':', address, function code and LRC, CR LF */
+    size_t len = end + 1 - start;
+    if (len < 1 + 6 + 2 || end[-1] != '\r' || (len - 3) % 2) {
+        g_message("Bad ASCII frame length %zu, discard!", len);
+        return NULL;
+    }
+
+    size_t bytes = (len - 3) / 2;
+    const unsigned char *hex = start + 1;
+    uint8_t invalid = 0;
+    uint8_t lrc = 0;
+    size_t i = 0;
+
+    for (; i < bytes; i++) {
+        uint8_t high = hex_values[hex[2 * i]];
+        uint8_t low  = hex_values[hex[2 * i + 1]];
+
+        invalid |= high | low;
+        start[i] = high << 4 | low;
+        lrc += start[i];
+    }
+
+    if (invalid & 0xF0) {
+        g_message("Bad hex digit in ASCII frame, discard!");
+        return NULL;
+    }
+
+    /* The sum of all bytes including the LRC is 0 */
+    if (lrc) {
+        g_message("BAD LRC");
+        return NULL;
+    }
+
+    /* Same layout as an RTU frame for the parsers, CRC in place of LRC */
+    *size = bytes + 1;
+    modbus_add_crc16(start, *size);
+
+    return start;
+}
+
+/*
+ * Generate modbus ASCII LRC, two's complement of the byte sum
+ */
+uint8_t modbus_gen_lrc(const unsigned char *msg, size_t size)
+{
+    uint8_t sum = 0;
+
+    while (size--) {
+        sum += *msg++;
+    }
+
+    return -sum;
+}
+
 /*
  * Generate modbus RTU CRC16
  */
 uint16_t modbus_gen_crc16(const unsigned char* msg, size_t size)
+{
+    return modbus_update_crc16(0xFFFF, msg, size);
+}
+
+/*
+ * Continue a modbus RTU CRC16 over more data
+ */
+uint16_t modbus_update_crc16(uint16_t crc, const unsigned char *msg,
+                             size_t size)
 {
     unsigned char nTemp;
-    uint16_t wCRCWord = 0xFFFF;
+    uint16_t wCRCWord = crc;
 
     while (size--)
     {
@@ -377,7 +749,7 @@ int modbus_check_crc16(unsigned char *msg, size_t size)
     unsigned char crc1 = crc & 0xFF;
     unsigned char crc2 = (crc >> 8) & 0xFF;
 
-    g_message("Calc CRC 0x%02x 0x%02x input crc 0x%02x 0x%02x",
+    DBG_LOG("Calc CRC 0x%02x 0x%02x input crc 0x%02x 0x%02x",
         crc1, crc2, msg[size-2], msg[size-1]);
 
     if (crc1 != msg[size-2] || crc2 != msg[size-1]) {
@@ -11,33 +11,121 @@
 #include <stdint.h>
 #include <termios.h>
 
+#include "serial.h"
+
 /****************** CONSTANT AND MACRO SECTION ******************************/
 
-/****************** TYPE DEFINITION SECTION *********************************/
+/* Default time for the slave to start answering, and the shortest silence
+ * that ends a response. The silence is 3.5 characters of 11 bits at the
+ * configured baud rate, but never less than MODBUS_FRAME_END_MS.
+ */
+#define MODBUS_RESPONSE_TIMEOUT_MS (60)
+#define MODBUS_FRAME_END_MS (5)
 
-enum parity {
-    PARITY_NONE,
-    PARITY_ODD,
-    PARITY_EVEN
-};
+/* Max gap between characters of an ASCII frame, the end is the CR LF */
+#define MODBUS_ASCII_CHAR_TIMEOUT_MS (1000)
+
+/* Largest ASCII frame, the 256 byte RTU frame with 1 byte LRC in place of
+ * the CRC is ':', 2 * 255 hex digits and CR LF
+ */
+#define MODBUS_ASCII_FRAME_SIZE (2 * 256 + 1)
+
+/* Requests to address 0 go to all slaves, none of them answers */
+#define MODBUS_BROADCAST_ADDRESS (0)
+
+/****************** TYPE DEFINITION SECTION *********************************/
 
 /*
  * Forward declaration of modbus handle.
  */
 struct modbus;
 
+/*
+ * Framing on the line. Frames passed to and returned from this module are
+ * always in RTU layout with CRC, ASCII framing is only on the line.
+ */
+enum modbus_framing {
+    MODBUS_FRAMING_RTU,
+    MODBUS_FRAMING_ASCII    /* ':', hex digits, LRC, CR LF */
+};
+
+/*
+ * Outcome of the last response read
+ */
+enum modbus_error {
+    MODBUS_ERROR_NONE,
+    MODBUS_ERROR_TIMEOUT,   /* Nothing received, or the request not sent */
+    MODBUS_ERROR_CRC,       /* Bad CRC or LRC, or too short to check */
+    MODBUS_ERROR_FRAME,     /* Malformed response, e.g. a wrong byte count */
+    MODBUS_ERROR_EXCEPTION  /* Exception response, see exception code */
+};
+
+/*
+ * Receive time of a response in microseconds, monotonic and UTC
+ */
+struct modbus_rx_time {
+    int64_t first_us;
+    int64_t last_us;
+    int64_t first_utc_us;
+    int64_t last_utc_us;
+};
+
 
 /****************** GLOBAL VARIABLE DECLARATION SECTION *********************/
 
 /****************** EXPORTED FUNCTION DECLARATION SECTION *******************/
 
+/*
+ * Receive the response to modbus_read_input_registers() and return its n
+ * registers. A response with another number of registers than requested is
+ * a MODBUS_ERROR_FRAME.
+ */
 uint16_t *modbus_parse_input_registers(struct modbus *modbus, size_t *n);
 
 /*
- * Read incoming data and check CRC
+ * Parse register values from a decoded read registers response frame of
+ * size bytes including CRC. Returns NULL if the byte count in the frame
+ * does not fit its size.
+ */
+uint16_t *modbus_parse_registers_frame(const unsigned char *frame,
+                                       size_t size,
+                                       size_t *n);
+
+/*
+ * Read incoming response and check CRC. Waits up to
+ * MODBUS_RESPONSE_TIMEOUT_MS for the first byte, the response ends with
+ * 3.5 characters of silence. A hangup or read error ends it early.
  */
 unsigned char *modbus_eat_buffer(struct modbus *modbus);
 
+/*
+ * Decode a response of n bytes received at buf[1]. buf[0] must hold the
+ * expected device address, it is used in place of a missing address byte.
+ * Returns start of the frame with its length in size, or NULL if invalid.
+ */
+unsigned char *modbus_decode_frame(unsigned char *buf, size_t n, size_t *size);
+
+
+/*
+ * Send a request of size bytes in RTU layout, CRC space included, and read
+ * the response. Returns the decoded response with its length in resp_size,
+ * or NULL on timeout or a bad response.
+ */
+unsigned char *modbus_transact(struct modbus *modbus,
+                               unsigned char *req,
+                               size_t size,
+                               size_t *resp_size);
+
+/*
+ * Set time to wait for the first byte of a response, by default
+ * MODBUS_RESPONSE_TIMEOUT_MS
+ */
+void modbus_set_response_timeout(struct modbus *modbus, unsigned int ms);
+
+/*
+ * Get time to wait for the first byte of a response
+ */
+unsigned int modbus_get_response_timeout(struct modbus *modbus);
 
 /*
  * Read n input registers from speficied start register.
@@ -46,18 +134,51 @@ int modbus_read_input_registers(struct modbus *modbus,
                                 uint16_t start,
                                 uint16_t n);
 
+/*
+ * Write one holding register on all slaves at once, with function 0x06 to
+ * MODBUS_BROADCAST_ADDRESS. Returns when the request has left the port,
+ * there is no response.
+ */
+int modbus_broadcast_write_register(struct modbus *modbus,
+                                    uint16_t reg,
+                                    uint16_t value);
+
 /*
  * Retrieve modbus file desciptor
  */
 int modbus_get_fd(struct modbus *modbus);
 
+/*
+ * Get receive time of first and last byte of the last response, all 0 if
+ * nothing was received
+ */
+void modbus_get_rx_time(struct modbus *modbus, struct modbus_rx_time *time);
+
+/*
+ * Get outcome of the last response read, with the exception code of an
+ * exception response in exception if not NULL
+ */
+enum modbus_error modbus_get_error(struct modbus *modbus,
+                                   unsigned char *exception);
+
+/*
+ * Retrieve modbus device address
+ */
+unsigned char modbus_get_device_address(struct modbus *modbus);
+
+/*
+ * Set address of the slave that reads go to, for several slaves on a bus
+ */
+void modbus_set_device_address(struct modbus *modbus, unsigned char address);
+
 /*
  * Close modbus device
  */
 void modbus_close_device(struct modbus **modbus);
 
 /*
- * Initialize modbus device
+ * Initialize modbus device, returns NULL if the port could not be set up.
+ * Does not touch any shared state, so it may be called from any thread.
  */
 struct modbus *modbus_init_device(const char *path,
                                   unsigned char device_adress,
@@ -65,11 +186,48 @@ struct modbus *modbus_init_device(const char *path,
                                   speed_t baud,
                                   int stop_bit);
 
+/*
+ * Set framing, RTU by default. ASCII also switches the port to 7 data bits
+ * if the port supports it. Returns -1 if the port settings can not be read.
+ */
+int modbus_set_framing(struct modbus *modbus, enum modbus_framing framing);
+
+/*
+ * Get framing
+ */
+enum modbus_framing modbus_get_framing(struct modbus *modbus);
+
 /*
  * write modbus cmd message
  */
 int modbus_write_message(int fd, unsigned char *msg, size_t size);
 
+/*
+ * Write a frame of size bytes in RTU layout, CRC space included, with the
+ * framing of the device. The CRC or LRC is filled in.
+ */
+int modbus_send_frame(struct modbus *modbus, unsigned char *msg, size_t size);
+
+/*
+ * Encode a frame of size bytes in RTU layout, CRC space included, as an
+ * ASCII frame. out must hold 2 * size + 1 bytes. Returns the length.
+ */
+size_t modbus_ascii_encode(const unsigned char *msg, size_t size, char *out);
+
+/*
+ * Decode an ASCII frame of n characters in place, into RTU layout with a
+ * CRC in place of the LRC. Characters before the ':' are skipped. Returns
+ * start of the frame with its length in size, or NULL if the frame is
+ * incomplete, not hex or fails the LRC.
+ */
+unsigned char *modbus_ascii_decode(unsigned char *buf, size_t n,
+                                   size_t *size);
+
+/*
+ * Generate modbus ASCII LRC
+ */
+uint8_t modbus_gen_lrc(const unsigned char *msg, size_t size);
+
 /*
  * Add CRC16 in two last bytes of buffer
  */
@@ -85,5 +243,12 @@ int modbus_check_crc16(unsigned char *msg, size_t size);
  */
 uint16_t modbus_gen_crc16(const unsigned char* msg, size_t size);
 
+/*
+ * Continue a modbus RTU CRC16, crc is the result over the preceding data.
+ * Allows reusing the CRC of an unchanged frame prefix.
+ */
+uint16_t modbus_update_crc16(uint16_t crc, const unsigned char *msg,
+                             size_t size);
+
 #endif /* MODBUS_H */
 /****************** END OF FILE modbus.h *******************************/
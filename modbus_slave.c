@@ -0,0 +1,610 @@
+/*
+ * modbus RTU slave
+ */
+
+/****************** INCLUDE FILES SECTION ***********************************/
+
+#include <glib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+
+#include "modbus_slave.h"
+#include "modbus.h"
+#include "capture.h"
+#include "debug.h"
+
+/****************** CONSTANT AND MACRO SECTION ******************************/
+
+/* Register count limits of the read and write multiple requests */
+#define MAX_READ_REGISTERS (125)
+#define MAX_WRITE_REGISTERS (123)
+
+/* A read can touch this many blocks when not aligned to a block */
+#define MAX_SEGMENTS (MAX_READ_REGISTERS / MODBUS_SLAVE_BLOCK + 2)
+
+#define EXCEPTION_ILLEGAL_FUNCTION (0x01)
+#define EXCEPTION_ILLEGAL_ADDRESS (0x02)
+#define EXCEPTION_ILLEGAL_VALUE (0x03)
+
+#define BROADCAST_ADDRESS (0x00)
+
+/****************** TYPE DEFINITION SECTION *********************************/
+
+/*
+ * Read response, valid for as long as no block it covers changed after
+ * stamp. crc_at holds the CRC of the frame up to each block of registers.
+ */
+struct cached_response {
+    unsigned char function;         /* 0 for unused entry */
+    guint16 start;
+    guint16 count;
+    guint32 stamp;
+    uint16_t crc_at[MAX_SEGMENTS];
+    unsigned char frame[MODBUS_SLAVE_FRAME_SIZE];
+    gsize len;
+};
+
+struct modbus_slave {
+    struct modbus *modbus;
+    int fd;
+    unsigned char address;
+    guint frame_gap_us;
+
+    GThread *thread;
+    int wake[2];                    /* Written to stop the thread */
+    gint lost;                      /* Thread ended on a port failure */
+
+    /* Image, cache and counters are protected by lock */
+    GMutex lock;
+    guint16 n_registers;
+    unsigned char *image[MODBUS_SLAVE_N_TABLES];   /* Big endian */
+    guint32 *block_stamp[MODBUS_SLAVE_N_TABLES];   /* Stamp of last change */
+    guint32 stamp;
+    struct cached_response cache[MODBUS_SLAVE_CACHE_SIZE];
+    guint cache_next;
+    struct modbus_slave_stats stats;
+
+    /* Only used by the slave thread */
+    unsigned char rx[MODBUS_SLAVE_FRAME_SIZE];
+    gsize rx_len;
+    gboolean resync;                /* Ignore input until a frame gap */
+    unsigned char tx[MODBUS_SLAVE_FRAME_SIZE];
+};
+
+/****************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static guint16 get_be16(const unsigned char *p);
+
+static void set_be16(unsigned char *p, guint16 value);
+
+static void store_register(struct modbus_slave *slave,
+                           enum modbus_slave_table table,
+                           guint16 address,
+                           guint16 value);
+
+static gsize build_read(struct modbus_slave *slave,
+                        unsigned char function,
+                        guint16 start,
+                        guint16 count);
+
+static gsize build_exception(struct modbus_slave *slave,
+                             unsigned char function,
+                             unsigned char code);
+
+static gsize handle_request(struct modbus_slave *slave,
+                            unsigned char *frame,
+                            gsize len);
+
+static gsize expected_length(const unsigned char *rx, gsize len);
+
+static void process(struct modbus_slave *slave, gsize len, gint64 rx_us);
+
+static gpointer slave_thread(gpointer data);
+
+/****************** LOCAL FUNCTION DEFINITION SECTION ***********************/
+
+static guint16 get_be16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static void set_be16(unsigned char *p, guint16 value)
+{
+    p[0] = (value >> 8) & 0xFF;
+    p[1] = value & 0xFF;
+}
+
+/*
+ * Store register and stamp its block if it changed, lock must be held
+ */
+static void store_register(struct modbus_slave *slave,
+                           enum modbus_slave_table table,
+                           guint16 address,
+                           guint16 value)
+{
+    unsigned char *p = &slave->image[table][2 * address];
+
+    if (get_be16(p) == value) {
+        return;
+    }
+
+    set_be16(p, value);
+    slave->block_stamp[table][address / MODBUS_SLAVE_BLOCK] = ++slave->stamp;
+}
+
+/*
+ * Assemble read response in tx from the cache, lock must be held
+ */
+static gsize build_read(struct modbus_slave *slave,
+                        unsigned char function,
+                        guint16 start,
+                        guint16 count)
+{
+    enum modbus_slave_table table = function == 0x03 ?
+        MODBUS_SLAVE_HOLDING : MODBUS_SLAVE_INPUT;
+    const guint32 *block_stamp = slave->block_stamp[table];
+    guint first_block = start / MODBUS_SLAVE_BLOCK;
+    guint n_segments = (start + count - 1) / MODBUS_SLAVE_BLOCK -
+        first_block + 1;
+    struct cached_response *entry = NULL;
+    guint segment = 0;
+    guint i = 0;
+
+    for (; i < MODBUS_SLAVE_CACHE_SIZE; i++) {
+        struct cached_response *c = &slave->cache[i];
+
+        if (c->function == function && c->start == start &&
+            c->count == count) {
+            entry = c;
+            break;
+        }
+    }
+
+    if (entry) {
+        /* Everything up to the first changed block is still valid */
+        while (segment < n_segments &&
+               (gint32) (block_stamp[first_block + segment] -
+                         entry->stamp) <= 0) {
+            segment++;
+        }
+
+        if (segment == n_segments) {
+            slave->stats.cache_hits++;
+            memcpy(slave->tx, entry->frame, entry->len);
+            return entry->len;
+        }
+
+        slave->stats.cache_updates++;
+    } else {
+        entry = &slave->cache[slave->cache_next++ % MODBUS_SLAVE_CACHE_SIZE];
+        entry->function = function;
+        entry->start    = start;
+        entry->count    = count;
+        entry->len      = 3 + 2 * count + 2;
+
+        entry->frame[0] = slave->address;
+        entry->frame[1] = function;
+        entry->frame[2] = 2 * count;
+        entry->crc_at[0] = modbus_gen_crc16(entry->frame, 3);
+    }
+
+    uint16_t crc = entry->crc_at[segment];
+
+    for (; segment < n_segments; segment++) {
+        guint block = first_block + segment;
+        guint from = MAX(start, block * MODBUS_SLAVE_BLOCK);
+        guint to = MIN(start + count, (block + 1) * MODBUS_SLAVE_BLOCK);
+        unsigned char *dst = &entry->frame[3 + 2 * (from - start)];
+        gsize n = 2 * (to - from);
+
+        entry->crc_at[segment] = crc;
+        memcpy(dst, &slave->image[table][2 * from], n);
+        crc = modbus_update_crc16(crc, dst, n);
+    }
+
+    entry->frame[entry->len - 2] = crc & 0xFF;
+    entry->frame[entry->len - 1] = (crc >> 8) & 0xFF;
+    entry->stamp = slave->stamp;
+
+    memcpy(slave->tx, entry->frame, entry->len);
+
+    return entry->len;
+}
+
+static gsize build_exception(struct modbus_slave *slave,
+                             unsigned char function,
+                             unsigned char code)
+{
+    slave->stats.exceptions++;
+
+    slave->tx[0] = slave->address;
+    slave->tx[1] = function | 0x80;
+    slave->tx[2] = code;
+    modbus_add_crc16(slave->tx, 5);
+
+    return 5;
+}
+
+/*
+ * Handle a complete request, returns length of response in tx, 0 for none
+ */
+static gsize handle_request(struct modbus_slave *slave,
+                            unsigned char *frame,
+                            gsize len)
+{
+    /* Whatever follows in the same burst is not framed right either */
+    if (len < 4 || modbus_check_crc16(frame, len) < 0) {
+        g_mutex_lock(&slave->lock);
+        slave->stats.crc_errors++;
+        g_mutex_unlock(&slave->lock);
+        slave->resync = TRUE;
+        return 0;
+    }
+
+    /* Traffic for other slaves on the bus */
+    if (frame[0] != slave->address && frame[0] != BROADCAST_ADDRESS) {
+        return 0;
+    }
+
+    gboolean broadcast = frame[0] == BROADCAST_ADDRESS;
+    unsigned char function = frame[1];
+    guint16 start = len >= 6 ? get_be16(&frame[2]) : 0;
+    guint16 count = len >= 6 ? get_be16(&frame[4]) : 0;
+    gsize n = 0;
+    guint i = 0;
+
+    g_mutex_lock(&slave->lock);
+    slave->stats.requests++;
+
+    switch (function) {
+        case 0x03:
+        case 0x04:
+            if (broadcast) {
+                break;
+            } else if (len != 8 || count < 1 ||
+                       count > MAX_READ_REGISTERS) {
+                n = build_exception(slave, function,
+                    EXCEPTION_ILLEGAL_VALUE);
+            } else if (start + count > slave->n_registers) {
+                n = build_exception(slave, function,
+                    EXCEPTION_ILLEGAL_ADDRESS);
+            } else {
+                n = build_read(slave, function, start, count);
+            }
+            break;
+        case 0x06:
+            /* start and count are address and value here */
+            if (len != 8) {
+                n = build_exception(slave, function,
+                    EXCEPTION_ILLEGAL_VALUE);
+            } else if (start >= slave->n_registers) {
+                n = build_exception(slave, function,
+                    EXCEPTION_ILLEGAL_ADDRESS);
+            } else {
+                store_register(slave, MODBUS_SLAVE_HOLDING, start, count);
+
+                /* Response echoes the request */
+                memcpy(slave->tx, frame, len);
+                n = len;
+            }
+            break;
+        case 0x10:
+            if (len < 9 || count < 1 || count > MAX_WRITE_REGISTERS ||
+                frame[6] != 2 * count || len != 9 + frame[6]) {
+                n = build_exception(slave, function,
+                    EXCEPTION_ILLEGAL_VALUE);
+            } else if (start + count > slave->n_registers) {
+                n = build_exception(slave, function,
+                    EXCEPTION_ILLEGAL_ADDRESS);
+            } else {
+                for (; i < count; i++) {
+                    store_register(slave, MODBUS_SLAVE_HOLDING, start + i,
+                        get_be16(&frame[7 + 2 * i]));
+                }
+
+                slave->tx[0] = slave->address;
+                slave->tx[1] = function;
+                set_be16(&slave->tx[2], start);
+                set_be16(&slave->tx[4], count);
+                modbus_add_crc16(slave->tx, 8);
+                n = 8;
+            }
+            break;
+        default:
+            n = build_exception(slave, function, EXCEPTION_ILLEGAL_FUNCTION);
+            break;
+    }
+
+    g_mutex_unlock(&slave->lock);
+
+    /* Broadcasts are never answered */
+    return broadcast ? 0 : n;
+}
+
+/*
+ * Length of the request starting at rx, 0 if not known (yet)
+ */
+static gsize expected_length(const unsigned char *rx, gsize len)
+{
+    if (len < 2) {
+        return 0;
+    }
+
+    switch (rx[1]) {
+        case 0x03:
+        case 0x04:
+        case 0x06:
+            return 8;
+        case 0x10:
+            return len < 7 ? 0 : 9 + rx[6];
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Handle the first len bytes of rx and remove them
+ */
+static void process(struct modbus_slave *slave, gsize len, gint64 rx_us)
+{
+    gsize n = handle_request(slave, slave->rx, len);
+    gsize written = 0;
+
+    while (written < n) {
+        ssize_t r = write(slave->fd, &slave->tx[written], n - written);
+
+        if (r < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (r < 0) {
+            g_warning("Failed to write response: %s", strerror(errno));
+            break;
+        }
+        written += r;
+    }
+
+    if (n) {
+        gint64 latency = g_get_monotonic_time() - rx_us;
+
+        capture_record(CAPTURE_DIR_TX, slave->tx, written);
+
+        g_mutex_lock(&slave->lock);
+        slave->stats.total_latency_us += latency;
+        slave->stats.max_latency_us = MAX(slave->stats.max_latency_us,
+            latency);
+        g_mutex_unlock(&slave->lock);
+    }
+
+    slave->rx_len -= len;
+    memmove(slave->rx, &slave->rx[len], slave->rx_len);
+
+    if (slave->resync && slave->rx_len) {
+        g_mutex_lock(&slave->lock);
+        slave->stats.discarded += slave->rx_len;
+        g_mutex_unlock(&slave->lock);
+        slave->rx_len = 0;
+    }
+}
+
+static gpointer slave_thread(gpointer data)
+{
+    struct modbus_slave *slave = data;
+    gint64 rx_us = 0;
+
+    for (;;) {
+        struct pollfd fds[2] = {
+            { .fd = slave->fd,      .events = POLLIN },
+            { .fd = slave->wake[0], .events = POLLIN },
+        };
+
+        /* Wait for the rest of a partial frame, or the end of a burst
+         * being skipped, at most one frame gap
+         */
+        int timeout = slave->rx_len || slave->resync ?
+            (int) ((slave->frame_gap_us + 999) / 1000) : -1;
+        int r = poll(fds, 2, timeout);
+
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r < 0 || fds[1].revents) {
+            break;
+        }
+
+        /* A hung up port, e.g. an unplugged USB adapter, never recovers */
+        if (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL) &&
+            !(fds[0].revents & POLLIN)) {
+            g_warning("Modbus slave port hung up");
+            g_atomic_int_set(&slave->lost, TRUE);
+            break;
+        }
+
+        if (r == 0) {
+            /* Frame ended, unknown function codes only end here */
+            if (expected_length(slave->rx, slave->rx_len) == 0 &&
+                slave->rx_len >= 4) {
+                process(slave, slave->rx_len, rx_us);
+            }
+
+            if (slave->rx_len) {
+                g_mutex_lock(&slave->lock);
+                slave->stats.discarded += slave->rx_len;
+                g_mutex_unlock(&slave->lock);
+                slave->rx_len = 0;
+            }
+            slave->resync = FALSE;
+            continue;
+        }
+
+        ssize_t n = read(slave->fd, &slave->rx[slave->rx_len],
+            sizeof(slave->rx) - slave->rx_len);
+
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (n <= 0) {
+            g_warning("Modbus slave port failed: %s",
+                n ? strerror(errno) : "end of file");
+            g_atomic_int_set(&slave->lost, TRUE);
+            break;
+        }
+
+        rx_us = g_get_monotonic_time();
+        capture_record(CAPTURE_DIR_RX, &slave->rx[slave->rx_len], n);
+
+        if (slave->resync) {
+            g_mutex_lock(&slave->lock);
+            slave->stats.discarded += n;
+            g_mutex_unlock(&slave->lock);
+            continue;
+        }
+        slave->rx_len += n;
+
+        /* Answer as soon as a request is complete, no need for the gap */
+        for (;;) {
+            gsize len = expected_length(slave->rx, slave->rx_len);
+
+            if (len == 0 || len > slave->rx_len) {
+                break;
+            }
+            process(slave, len, rx_us);
+        }
+
+        if (slave->rx_len == sizeof(slave->rx)) {
+            g_mutex_lock(&slave->lock);
+            slave->stats.discarded += slave->rx_len;
+            g_mutex_unlock(&slave->lock);
+            slave->rx_len = 0;
+        }
+    }
+
+    return NULL;
+}
+
+/****************** EXPORTED FUNCTION DEFINITION SECTION *******************/
+
+struct modbus_slave *modbus_slave_new(struct modbus *modbus,
+                                      guint16 n_registers,
+                                      guint frame_gap_us)
+{
+    g_assert(modbus);
+
+    struct modbus_slave *slave = g_new0(struct modbus_slave, 1);
+    guint n_blocks = (n_registers + MODBUS_SLAVE_BLOCK - 1) /
+        MODBUS_SLAVE_BLOCK;
+    guint table = 0;
+
+    if (pipe(slave->wake)) {
+        g_warning("Failed to create pipe: %s", strerror(errno));
+        g_free(slave);
+        return NULL;
+    }
+
+    slave->modbus       = modbus;
+    slave->fd           = modbus_get_fd(modbus);
+    slave->address      = modbus_get_device_address(modbus);
+    slave->frame_gap_us = frame_gap_us;
+    slave->n_registers  = n_registers;
+    g_mutex_init(&slave->lock);
+
+    for (; table < MODBUS_SLAVE_N_TABLES; table++) {
+        slave->image[table] = g_new0(unsigned char, 2 * n_registers);
+        slave->block_stamp[table] = g_new0(guint32, n_blocks);
+    }
+
+    slave->thread = g_thread_new("modbus-slave", slave_thread, slave);
+
+    g_message("Modbus slave 0x%02x serving %u registers", slave->address,
+        n_registers);
+
+    return slave;
+}
+
+void modbus_slave_free(struct modbus_slave **slave)
+{
+    if (!slave || !*slave) {
+        return;
+    }
+
+    struct modbus_slave *s = *slave;
+    guint table = 0;
+
+    if (write(s->wake[1], "", 1) == 1) {
+        g_thread_join(s->thread);
+    }
+
+    close(s->wake[0]);
+    close(s->wake[1]);
+    modbus_close_device(&s->modbus);
+
+    for (; table < MODBUS_SLAVE_N_TABLES; table++) {
+        g_free(s->image[table]);
+        g_free(s->block_stamp[table]);
+    }
+
+    g_mutex_clear(&s->lock);
+    g_free(s);
+    *slave = NULL;
+}
+
+gboolean modbus_slave_port_lost(struct modbus_slave *slave)
+{
+    g_assert(slave);
+
+    return g_atomic_int_get(&slave->lost);
+}
+
+gboolean modbus_slave_set_register(struct modbus_slave *slave,
+                                   enum modbus_slave_table table,
+                                   guint16 address,
+                                   guint16 value)
+{
+    g_assert(slave);
+    g_assert(table < MODBUS_SLAVE_N_TABLES);
+
+    if (address >= slave->n_registers) {
+        return FALSE;
+    }
+
+    g_mutex_lock(&slave->lock);
+    store_register(slave, table, address, value);
+    g_mutex_unlock(&slave->lock);
+
+    return TRUE;
+}
+
+gboolean modbus_slave_get_register(struct modbus_slave *slave,
+                                   enum modbus_slave_table table,
+                                   guint16 address,
+                                   guint16 *value)
+{
+    g_assert(slave);
+    g_assert(value);
+    g_assert(table < MODBUS_SLAVE_N_TABLES);
+
+    if (address >= slave->n_registers) {
+        return FALSE;
+    }
+
+    g_mutex_lock(&slave->lock);
+    *value = get_be16(&slave->image[table][2 * address]);
+    g_mutex_unlock(&slave->lock);
+
+    return TRUE;
+}
+
+void modbus_slave_get_stats(struct modbus_slave *slave,
+                            struct modbus_slave_stats *stats)
+{
+    g_assert(slave);
+    g_assert(stats);
+
+    g_mutex_lock(&slave->lock);
+    *stats = slave->stats;
+    g_mutex_unlock(&slave->lock);
+}
+
+/****************** END OF FILE modbus_slave.c *******************************/
@@ -0,0 +1,114 @@
+/*
+ * modbus RTU slave
+ *
+ * Answers read holding registers (0x03), read input registers (0x04),
+ * write single register (0x06) and write multiple registers (0x10) from a
+ * register image. The image can be updated at any time from any thread.
+ *
+ * Requests are served from a thread of its own so that a busy main loop
+ * never delays a response. A request is answered as soon as its last byte
+ * is in, its length follows from the function code, the inter-frame gap is
+ * only used to resynchronize after garbage or foreign traffic.
+ *
+ * Read responses are kept in a small cache. Repeated reads of unchanged
+ * registers are answered with the cached frame as is. When only some
+ * registers changed, the data and CRC are only redone from the first
+ * changed block of registers onwards.
+ */
+
+#ifndef MODBUS_SLAVE_H
+#define MODBUS_SLAVE_H
+
+/****************** INCLUDE FILES SECTION ***********************************/
+
+#include <glib.h>
+#include <stdint.h>
+
+#include "modbus.h"
+
+/****************** CONSTANT AND MACRO SECTION ******************************/
+
+/* Largest RTU frame */
+#define MODBUS_SLAVE_FRAME_SIZE (256)
+
+/* Registers per block, the granularity of cached CRCs */
+#define MODBUS_SLAVE_BLOCK (16)
+
+/* Number of cached read responses */
+#define MODBUS_SLAVE_CACHE_SIZE (8)
+
+/****************** TYPE DEFINITION SECTION *********************************/
+
+enum modbus_slave_table {
+    MODBUS_SLAVE_HOLDING,   /* Read with 0x03, written with 0x06 / 0x10 */
+    MODBUS_SLAVE_INPUT,     /* Read with 0x04 */
+    MODBUS_SLAVE_N_TABLES
+};
+
+/*
+ * Slave counters
+ */
+struct modbus_slave_stats {
+    guint64 requests;       /* Requests to us, including broadcasts */
+    guint64 exceptions;     /* Exception responses sent */
+    guint64 crc_errors;
+    guint64 discarded;      /* Bytes dropped while resynchronizing */
+    guint64 cache_hits;     /* Read responses sent without any work */
+    guint64 cache_updates;  /* Read responses partially redone */
+    gint64 max_latency_us;  /* Last request byte read to response written */
+    gint64 total_latency_us;
+};
+
+/*
+ * Forward declaration of slave handle.
+ */
+struct modbus_slave;
+
+/****************** EXPORTED FUNCTION DECLARATION SECTION *******************/
+
+/*
+ * Start answering requests to the device address of modbus. Takes over
+ * the modbus device, it is closed by modbus_slave_free(). frame_gap_us is
+ * the silence that ends a frame, 3.5 characters at the used baud rate.
+ * Returns NULL on failure.
+ */
+struct modbus_slave *modbus_slave_new(struct modbus *modbus,
+                                      guint16 n_registers,
+                                      guint frame_gap_us);
+
+/*
+ * Stop answering requests and close the device.
+ */
+void modbus_slave_free(struct modbus_slave **slave);
+
+/*
+ * Returns TRUE once the port failed or hung up. Requests are no longer
+ * answered, free the slave and open the port again.
+ */
+gboolean modbus_slave_port_lost(struct modbus_slave *slave);
+
+/*
+ * Set a register in the image. Returns FALSE if address is out of range.
+ */
+gboolean modbus_slave_set_register(struct modbus_slave *slave,
+                                   enum modbus_slave_table table,
+                                   guint16 address,
+                                   guint16 value);
+
+/*
+ * Get a register from the image, e.g. one written by the master. Returns
+ * FALSE if address is out of range.
+ */
+gboolean modbus_slave_get_register(struct modbus_slave *slave,
+                                   enum modbus_slave_table table,
+                                   guint16 address,
+                                   guint16 *value);
+
+/*
+ * Get slave counters.
+ */
+void modbus_slave_get_stats(struct modbus_slave *slave,
+                            struct modbus_slave_stats *stats);
+
+#endif /* MODBUS_SLAVE_H */
+/****************** END OF FILE modbus_slave.h *******************************/
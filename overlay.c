@@ -11,7 +11,9 @@
 
 #include "overlay.h"
 #include "debug.h"
+#include "startup.h"
 #include "metadata_pair.h"
+#include "profile.h"
 
 /** @file overlay.c
  * @Brief Overlay implementation
@@ -23,30 +25,150 @@
 #define OVERLAY_WIDTH 700
 #define OVERLAY_HEIGHT 400
 
+/* Limits and granularity of the overlay size fitted to the text */
+#define OVERLAY_MAX_WIDTH 1920
+#define OVERLAY_MAX_HEIGHT 1080
+#define OVERLAY_SIZE_STEP 16
+
+/* Longest headline, including the trailing ':' */
+#define OVERLAY_TEXT_SIZE 260
+
+#define FONT_SIZE 40
+#define LINE_FIRST_BASELINE 40
+#define LINE_SPACING 50
+#define LINE_METADATA_BASELINE 90
+
+/* Map a palette index to the cairo color value used in palette mode */
+#define PALETTE_VALUE(index) ((((index) << 4) + (index)) / 255.0)
+
 #define ANIMATION_FPS 1
 
+/* Number of stream resolutions to keep pre-scaled overlay content for */
+#define OVERLAY_CACHE_SIZE 8
+
 /******************** LOCAL VARIABLE DECLARATION SECTION **********************/
 
+/**
+ * Overlay colors. Used as palette in palette mode and as plain colors in
+ * ARGB32 mode.
+ */
+enum overlay_color
+{
+    COLOR_TRANSPARENT,
+    COLOR_TEXT,
+    COLOR_WARNING,
+    COLOR_ALARM,
+    N_COLORS
+};
+
+static const struct axoverlay_palette_color overlay_palette[N_COLORS] = {
+    [COLOR_TRANSPARENT] = { 0, 0, 0, 0, FALSE },
+    [COLOR_TEXT]        = { 0, 0, 0, 255, FALSE },
+    [COLOR_WARNING]     = { 255, 160, 0, 255, FALSE },
+    [COLOR_ALARM]       = { 220, 0, 0, 255, FALSE },
+};
+
+/* Text color of each line style */
+static const enum overlay_color style_colors[] = {
+    [OVERLAY_STYLE_NORMAL]  = COLOR_TEXT,
+    [OVERLAY_STYLE_WARNING] = COLOR_WARNING,
+    [OVERLAY_STYLE_ALARM]   = COLOR_ALARM,
+    [OVERLAY_STYLE_HIDDEN]  = COLOR_TRANSPARENT,
+};
+
+/**
+ * Overlay content pre-scaled for one stream resolution.
+ */
+typedef struct overlay_cache_entry
+{
+    gint width;
+    gint height;
+    guint generation;
+    cairo_surface_t *surface;
+} overlay_cache_entry;
+
 typedef struct overlay
 {
     gint animation_timer;
+    guint redraw_idle;
     gint overlay_id;
     GList *cur_list;
-    gchar *analytic_text;
+    gchar analytic_text[OVERLAY_TEXT_SIZE];
     struct timespec start;
     struct timespec stop;
     gint timeout_us;
     gboolean timer_elapsed;
+
+    /* Content is rendered once per change into master and then only blitted
+     * to each stream, scaled versions are cached per stream resolution.
+     */
+    gint width;
+    gint height;
+    gboolean palette;
+    guint generation;
+    guint sized_generation;
+    guint master_generation;
+    cairo_surface_t *master;
+    overlay_cache_entry cache[OVERLAY_CACHE_SIZE];
+    guint cache_next;
 } overlay;
 
 /******************** LOCAL FUNCTION DECLARATION SECTION **********************/
 
+/**
+ * Draw overlay text into cr.
+ */
+static void render_content(const overlay_handle handle, cairo_t *cr);
+
+/**
+ * Set source color of cr in the colorspace of the overlay.
+ */
+static void set_color(const overlay_handle handle, cairo_t *cr,
+                      enum overlay_color color);
+
+/**
+ * Select font and font options used for all text.
+ */
+static void set_font(const overlay_handle handle, cairo_t *cr);
+
+/**
+ * Resize overlay to fit the current text, if content changed.
+ */
+static void fit_to_content(const overlay_handle handle);
+
+/**
+ * Format of cached surfaces for the colorspace of the overlay.
+ */
+static cairo_format_t surface_format(const overlay_handle handle);
+
+/**
+ * Get master surface, re-rendered if content changed since last call.
+ */
+static cairo_surface_t *get_master(const overlay_handle handle);
+
+/**
+ * Get content scaled to width x height from the per resolution cache.
+ */
+static cairo_surface_t *get_scaled(const overlay_handle handle,
+                                   gint width, gint height);
+
+/**
+ * Release master and all cached surfaces.
+ */
+static void clear_cache(const overlay_handle handle);
+
+/**
+ * Redraw as soon as the main loop is idle, e.g. when content changed.
+ */
+static void schedule_redraw(const overlay_handle handle);
+
 static void reset_clock(const overlay_handle handle)
 {
     g_assert(handle);
 
     clock_gettime(CLOCK_MONOTONIC, &handle->start);
     handle->timer_elapsed = FALSE;
+    handle->generation++;
 }
 
 static void check_elapsed_time(const overlay_handle handle)
@@ -59,8 +181,9 @@ static void check_elapsed_time(const overlay_handle handle)
     double result = (stop->tv_sec - start->tv_sec) * 1e6 + 
         (stop->tv_nsec - start->tv_nsec) / 1e3;
 
-    if ((int) result >= handle->timeout_us) {
+    if ((int) result >= handle->timeout_us && !handle->timer_elapsed) {
         handle->timer_elapsed = TRUE;
+        handle->generation++;
     }
 }
 
@@ -73,6 +196,7 @@ static gboolean update_overlay_cb(gpointer data)
     overlay_handle handle = data;
 
     check_elapsed_time(handle);
+    fit_to_content(handle);
 
     /* Request a redraw of the overlay */
     axoverlay_redraw(&error);
@@ -89,37 +213,70 @@ static gboolean update_overlay_cb(gpointer data)
     return G_SOURCE_CONTINUE;
 }
 
-static void render_overlay_cb(gpointer render_context, gint id,
-                   struct axoverlay_stream_data *stream,
-                   enum axoverlay_position_type postype, gfloat overlay_x,
-                   gfloat overlay_y, gint overlay_width, gint overlay_height,
-                   gpointer user_data)
+static gboolean redraw_idle_cb(gpointer data)
 {
-    cairo_t *cr = render_context;
+    overlay_handle handle = data;
 
-    if (user_data == NULL) {
-        return;
+    handle->redraw_idle = 0;
+    update_overlay_cb(handle);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void schedule_redraw(const overlay_handle handle)
+{
+    if (!handle->redraw_idle) {
+        handle->redraw_idle = profile_idle_add("overlay redraw",
+                                               redraw_idle_cb, handle);
     }
+}
 
-    overlay_handle handle = user_data;
+static void set_color(const overlay_handle handle, cairo_t *cr,
+                      enum overlay_color color)
+{
+    if (handle->palette) {
+        gdouble value = PALETTE_VALUE(color);
+        cairo_set_source_rgba(cr, value, value, value, value);
+    } else {
+        const struct axoverlay_palette_color *c = &overlay_palette[color];
+        cairo_set_source_rgba(cr, c->red / 255.0, c->green / 255.0,
+            c->blue / 255.0, c->alpha / 255.0);
+    }
+}
 
+static void set_font(const overlay_handle handle, cairo_t *cr)
+{
+    cairo_select_font_face(cr, "sans-serif",
+      CAIRO_FONT_SLANT_NORMAL,
+      CAIRO_FONT_WEIGHT_BOLD);
+    cairo_set_font_size(cr, FONT_SIZE);
+
+    /* Anti-aliased edges would turn into random palette indexes */
+    if (handle->palette) {
+        cairo_font_options_t *options = cairo_font_options_create();
+        cairo_font_options_set_antialias(options, CAIRO_ANTIALIAS_NONE);
+        cairo_set_font_options(cr, options);
+        cairo_font_options_destroy(options);
+    }
+}
+
+static void render_content(const overlay_handle handle, cairo_t *cr)
+{
     /* Clear background */
-    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 0.0);
+    set_color(handle, cr, COLOR_TRANSPARENT);
     cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-    cairo_rectangle(cr, 0, 0, OVERLAY_WIDTH, OVERLAY_HEIGHT);
+    cairo_rectangle(cr, 0, 0, handle->width, handle->height);
     cairo_fill(cr);
 
     /* Draw the text */
-    cairo_set_source_rgba(cr, 0, 0, 0, 1.0);
+    set_color(handle, cr, COLOR_TEXT);
     cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    set_font(handle, cr);
 
-    cairo_select_font_face(cr, "sans-serif",
-      CAIRO_FONT_SLANT_NORMAL,
-      CAIRO_FONT_WEIGHT_BOLD);
-    cairo_set_font_size(cr, 40);
-
-    cairo_move_to(cr, 0, 40);
-    cairo_show_text(cr, handle->analytic_text);
+    cairo_move_to(cr, 0, LINE_FIRST_BASELINE);
+    if (handle->analytic_text[0]) {
+        cairo_show_text(cr, handle->analytic_text);
+    }
 
     /* Don't add metadata in case the timer elapsed */
     if (handle->timer_elapsed == TRUE) {
@@ -127,18 +284,250 @@ static void render_overlay_cb(gpointer render_context, gint id,
     }
 
     GList *list = handle->cur_list;
-    int offset = 90;
+    int offset = LINE_METADATA_BASELINE;
     for (; list != NULL; list = list->next) {
         mdp_item_pair *item_pair = list->data;
+
+        if (item_pair->style == OVERLAY_STYLE_HIDDEN) {
+            continue;
+        }
+
         gchar *text = g_strdup_printf("%s : %s", item_pair->name,
             item_pair->value);
 
+        set_color(handle, cr, style_colors[item_pair->style]);
         cairo_move_to(cr, 0, offset);
         cairo_show_text(cr, text);
-        offset += 50;
+        offset += LINE_SPACING;
+
+        g_free(text);
+    }
+}
+
+static void fit_to_content(const overlay_handle handle)
+{
+    GError *error = NULL;
+
+    if (handle->sized_generation == handle->generation) {
+        return;
+    }
+    handle->sized_generation = handle->generation;
+
+    /* Measure the text with the same font settings used for rendering */
+    cairo_surface_t *surface =
+        cairo_image_surface_create(CAIRO_FORMAT_A8, 1, 1);
+    cairo_t *cr = cairo_create(surface);
+    set_font(handle, cr);
+
+    cairo_font_extents_t font_extents;
+    cairo_text_extents_t extents;
+    cairo_font_extents(cr, &font_extents);
+
+    gdouble width = 0;
+    gdouble baseline = LINE_FIRST_BASELINE;
+
+    if (handle->analytic_text[0]) {
+        cairo_text_extents(cr, handle->analytic_text, &extents);
+        width = MAX(width, extents.x_advance);
+    }
+
+    GList *list = handle->timer_elapsed ? NULL : handle->cur_list;
+    guint n_lines = 0;
+    for (; list != NULL; list = list->next) {
+        mdp_item_pair *item_pair = list->data;
+
+        if (item_pair->style == OVERLAY_STYLE_HIDDEN) {
+            continue;
+        }
+
+        gchar *text = g_strdup_printf("%s : %s", item_pair->name,
+            item_pair->value);
+
+        cairo_text_extents(cr, text, &extents);
+        width = MAX(width, extents.x_advance);
+        n_lines++;
 
         g_free(text);
     }
+
+    if (n_lines) {
+        baseline = LINE_METADATA_BASELINE + (n_lines - 1) * LINE_SPACING;
+    }
+
+    cairo_destroy(cr);
+    cairo_surface_destroy(surface);
+
+    /* Round up to limit the number of resizes while values change */
+    gint new_width = ((gint) width + OVERLAY_SIZE_STEP) /
+        OVERLAY_SIZE_STEP * OVERLAY_SIZE_STEP;
+    gint new_height = ((gint) (baseline + font_extents.descent) +
+        OVERLAY_SIZE_STEP) / OVERLAY_SIZE_STEP * OVERLAY_SIZE_STEP;
+
+    new_width  = CLAMP(new_width, OVERLAY_SIZE_STEP, OVERLAY_MAX_WIDTH);
+    new_height = CLAMP(new_height, OVERLAY_SIZE_STEP, OVERLAY_MAX_HEIGHT);
+
+    if (new_width == handle->width && new_height == handle->height) {
+        return;
+    }
+
+    struct axoverlay_overlay_data data;
+    axoverlay_get_overlay_data(handle->overlay_id, &data, &error);
+
+    if (error == NULL) {
+        data.width  = new_width;
+        data.height = new_height;
+        axoverlay_update_overlay_data(handle->overlay_id, &data, &error);
+    }
+
+    if (error != NULL) {
+        ERR("Failed to resize overlay (%d): %s\n", error->code,
+            error->message);
+        g_error_free(error);
+        return;
+    }
+
+    DBG_LOG("Overlay resized to %dx%d", new_width, new_height);
+
+    handle->width  = new_width;
+    handle->height = new_height;
+
+    /* Surfaces of the old size are useless now */
+    clear_cache(handle);
+}
+
+static cairo_format_t surface_format(const overlay_handle handle)
+{
+    /* In palette mode only the index matters, it is carried in alpha */
+    return handle->palette ? CAIRO_FORMAT_A8 : CAIRO_FORMAT_ARGB32;
+}
+
+static cairo_surface_t *get_master(const overlay_handle handle)
+{
+    if (!handle->master) {
+        handle->master = cairo_image_surface_create(surface_format(handle),
+            handle->width, handle->height);
+        handle->master_generation = handle->generation - 1;
+    }
+
+    if (handle->master_generation != handle->generation) {
+        cairo_t *cr = cairo_create(handle->master);
+        render_content(handle, cr);
+        cairo_destroy(cr);
+        cairo_surface_flush(handle->master);
+
+        handle->master_generation = handle->generation;
+    }
+
+    return handle->master;
+}
+
+static cairo_surface_t *get_scaled(const overlay_handle handle,
+                                   gint width, gint height)
+{
+    cairo_surface_t *master = get_master(handle);
+
+    if (width == handle->width && height == handle->height) {
+        return master;
+    }
+
+    /* Find cached entry for this resolution or evict the oldest one */
+    overlay_cache_entry *entry = NULL;
+    guint i = 0;
+    for (; i < OVERLAY_CACHE_SIZE; i++) {
+        if (handle->cache[i].surface &&
+            handle->cache[i].width == width &&
+            handle->cache[i].height == height) {
+            entry = &handle->cache[i];
+            break;
+        }
+    }
+
+    if (!entry) {
+        entry = &handle->cache[handle->cache_next];
+        handle->cache_next = (handle->cache_next + 1) % OVERLAY_CACHE_SIZE;
+
+        if (entry->surface) {
+            cairo_surface_destroy(entry->surface);
+        }
+
+        entry->surface = cairo_image_surface_create(surface_format(handle),
+            width, height);
+        entry->width  = width;
+        entry->height = height;
+        entry->generation = handle->generation - 1;
+    }
+
+    if (entry->generation != handle->generation) {
+        cairo_t *cr = cairo_create(entry->surface);
+
+        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+        cairo_scale(cr, (double) width / handle->width,
+            (double) height / handle->height);
+        cairo_set_source_surface(cr, master, 0, 0);
+        cairo_pattern_set_filter(cairo_get_source(cr),
+            handle->palette ? CAIRO_FILTER_NEAREST : CAIRO_FILTER_GOOD);
+        cairo_paint(cr);
+        cairo_destroy(cr);
+        cairo_surface_flush(entry->surface);
+
+        entry->generation = handle->generation;
+    }
+
+    return entry->surface;
+}
+
+static void clear_cache(const overlay_handle handle)
+{
+    guint i = 0;
+    for (; i < OVERLAY_CACHE_SIZE; i++) {
+        if (handle->cache[i].surface) {
+            cairo_surface_destroy(handle->cache[i].surface);
+            handle->cache[i].surface = NULL;
+        }
+    }
+
+    if (handle->master) {
+        cairo_surface_destroy(handle->master);
+        handle->master = NULL;
+    }
+}
+
+static void render_overlay_cb(gpointer render_context, gint id,
+                   struct axoverlay_stream_data *stream,
+                   enum axoverlay_position_type postype, gfloat overlay_x,
+                   gfloat overlay_y, gint overlay_width, gint overlay_height,
+                   gpointer user_data)
+{
+    cairo_t *cr = render_context;
+
+    if (user_data == NULL) {
+        return;
+    }
+
+    overlay_handle handle = user_data;
+
+    /* Called from within axoverlay, not a source of our own */
+    static gint profile_id = -1;
+    if (profile_id < 0) {
+        profile_id = profile_register("overlay render");
+    }
+    gint64 start = profile_begin();
+
+    /* Content is rendered at most once per change, each stream only gets a
+     * copy scaled to its overlay size.
+     */
+    cairo_surface_t *surface = get_scaled(handle, overlay_width,
+        overlay_height);
+
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(cr, surface, 0, 0);
+    cairo_paint(cr);
+
+    profile_end(profile_id, start);
+
+    if (handle->cur_list) {
+        startup_mark(STARTUP_FIRST_OVERLAY);
+    }
 }
 
 
@@ -150,7 +539,7 @@ static void render_overlay_cb(gpointer render_context, gint id,
 /**
  * Initialize overlays
  */
-overlay_handle overlay_init()
+overlay_handle overlay_init(gboolean palette)
 {
     GError *error = NULL;
 
@@ -171,15 +560,34 @@ overlay_handle overlay_init()
         settings.backend = AXOVERLAY_CAIRO_IMAGE_BACKEND;
     axoverlay_init(&settings, &error);
     
+    /* Every failure from here on releases the library, so that a retry can
+     * initialize it again
+     */
     if (error != NULL) {
         ERR("Failed to initialize axoverlay: %s", error->message);
         g_error_free(error);
+        axoverlay_cleanup();
         return NULL;
     }
 
     overlay_handle handle   = g_new0(overlay, 1);
+    handle->palette = palette;
+
+    if (palette) {
+        enum overlay_color color = 0;
+        for (; color < N_COLORS && error == NULL; color++) {
+            struct axoverlay_palette_color c = overlay_palette[color];
+            axoverlay_set_palette_color(color, &c, &error);
+        }
+
+        if (error != NULL) {
+            ERR("Failed to set palette, using ARGB32: %s", error->message);
+            g_clear_error(&error);
+            handle->palette = FALSE;
+        }
+    }
 
-    /* Create an overlay */
+    /* Create an overlay, it is resized to fit the text later on */
     struct axoverlay_overlay_data data;
     axoverlay_init_overlay_data(&data);
     data.postype = AXOVERLAY_CUSTOM_SOURCE;
@@ -187,33 +595,31 @@ overlay_handle overlay_init()
     data.x = 0.0;
     data.y = 0.0;
     data.width = OVERLAY_WIDTH;
-    data.height = OVERLAY_WIDTH;
-    data.colorspace = AXOVERLAY_COLORSPACE_ARGB32;
+    data.height = OVERLAY_HEIGHT;
+    data.colorspace = handle->palette ? AXOVERLAY_COLORSPACE_4BIT_PALETTE :
+        AXOVERLAY_COLORSPACE_ARGB32;
     data.scale_to_stream = TRUE;
+    handle->width  = data.width;
+    handle->height = data.height;
     handle->overlay_id = axoverlay_create_overlay(&data, handle, &error);
     if (error != NULL) {
-        printf("Failed to create first overlay: %s", error->message);
+        ERR("Failed to create first overlay: %s", error->message);
+        clear_cache(handle);
         g_free(handle);
         g_error_free(error);
-        return NULL;
-    }
-
-        /* Draw overlays */
-    axoverlay_redraw(&error);
-    if (error != NULL) {
-        printf("Failed to draw overlays: %s", error->message);
-        axoverlay_destroy_overlay(handle->overlay_id, &error);
         axoverlay_cleanup();
-        g_free(handle);
-        g_error_free(error);
         return NULL;
     }
 
+    /* Draw overlays from the main loop, not to hold up the rest of
+     * startup. Redraw failures are recovered by the animation timer.
+     */
+    schedule_redraw(handle);
+
     /**
      * Initialize state
      */
     handle->cur_list        = NULL;
-    handle->analytic_text   = NULL;
     handle->timeout_us      = 6e6;
     handle->timer_elapsed   = TRUE;
 
@@ -221,7 +627,8 @@ overlay_handle overlay_init()
 
     /* Start animation timer */
     handle->animation_timer = 
-        g_timeout_add(1000/ANIMATION_FPS, update_overlay_cb, handle);
+        profile_timeout_add("overlay update", 1000/ANIMATION_FPS,
+                            update_overlay_cb, handle);
 
     return handle;
 }
@@ -240,8 +647,13 @@ void overlay_cleanup(overlay_handle *handle_p)
 
     overlay_handle handle = *handle_p;
 
-    g_free(handle->analytic_text);
+    if (handle->redraw_idle) {
+        g_source_remove(handle->redraw_idle);
+    }
+    g_source_remove(handle->animation_timer);
+
     axoverlay_destroy_overlay(handle->overlay_id, NULL);
+    clear_cache(handle);
 
     /* The data list is owned by our creator so do not free that */
 
@@ -264,9 +676,8 @@ gboolean overlay_set_data(const overlay_handle handle,
         return FALSE;
     }
 
-    g_free(handle->analytic_text);
-    
-    handle->analytic_text = g_strdup_printf("%s:", analytic);
+    g_snprintf(handle->analytic_text, sizeof(handle->analytic_text), "%s:",
+        analytic);
 
     GList *new_list = NULL;
 
@@ -276,12 +687,13 @@ gboolean overlay_set_data(const overlay_handle handle,
 
         item_pair->name  = g_strdup(src_pair->name);
         item_pair->value = g_strdup(src_pair->value);
+        item_pair->style = CLAMP(src_pair->style, OVERLAY_STYLE_NORMAL,
+            OVERLAY_STYLE_HIDDEN);
 
         new_list = g_list_append(new_list, item_pair); 
     }
 
     mdp_item_pair *item_pair = g_try_new0(mdp_item_pair, 1);
-    mdp_item_pair *src_pair = list->data;
 
     item_pair->name  = g_strdup("UTC Time");
     item_pair->value = g_strdup(utc_time);
@@ -292,6 +704,7 @@ gboolean overlay_set_data(const overlay_handle handle,
     handle->cur_list = new_list;
 
     reset_clock(handle);
+    schedule_redraw(handle);
 
     return TRUE;
 }
\ No newline at end of file
@@ -6,14 +6,31 @@
  *
  */
 
+/**
+ * Style of a metadata line, see mdp_item_pair.
+ */
+enum overlay_style
+{
+    OVERLAY_STYLE_NORMAL,
+    OVERLAY_STYLE_WARNING,
+    OVERLAY_STYLE_ALARM,
+    OVERLAY_STYLE_HIDDEN
+};
+
 /**
  * Forward-declared handle for MDP object.
  */
 typedef struct overlay* overlay_handle;
 
 /**
+ * Create overlay and initialize axoverlay.
+ *
+ * @param palette Use a 4-bit palette overlay instead of ARGB32. Uses an
+ *                eighth of the memory and compositing bandwidth.
+ *
+ * @return Overlay handle or NULL on error.
  */
-overlay_handle overlay_init();
+overlay_handle overlay_init(gboolean palette);
 
 /**
  * Cleanup Metadata Push framework and deallocate resources.
@@ -0,0 +1,473 @@
+#include <glib.h>
+#include <string.h>
+#include <stdlib.h>
+#include <termios.h>
+
+#include "probe.h"
+#include "debug.h"
+
+/** @file probe.c
+ * @Brief Slave capability probing implementation
+ *
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+/* Latencies kept for the median */
+#define PROBE_MAX_SAMPLES (64)
+
+#define EXCEPTION_ILLEGAL_FUNCTION (0x01)
+
+/******************** LOCAL VARIABLE DECLARATION SECTION **********************/
+
+enum stage
+{
+    STAGE_FUNCTIONS,
+    STAGE_READ_SIZE,
+    STAGE_GAP,
+    STAGE_DONE
+};
+
+struct probe
+{
+    struct probe_result result;
+    guint16 start;
+    enum stage stage;
+    guint index;                /* Request or gap being tried */
+    gboolean reads;             /* The polled read works */
+    guint16 lo;                 /* Read size search, lo is known good */
+    guint16 hi;
+    gboolean answered;
+    guint tries;                /* Transactions in a row at the tried gap */
+    gint64 last_rx_us;          /* End of the last of them */
+
+    guint32 latencies[PROBE_MAX_SAMPLES];
+    guint n_latencies;
+};
+
+/**
+ * Harmless requests to find the supported function codes. The first one
+ * is the read used for polling, a slave not answering it is not probed
+ * further.
+ */
+static const struct {
+    guint8 function;
+    guint8 data[4];
+    guint8 len;
+    gboolean at_start;          /* data starts with the start register */
+} requests[] = {
+    { 0x03, { 0x00, 0x00, 0x00, 0x01 }, 4, TRUE },  /* Holding registers */
+    { 0x04, { 0x00, 0x00, 0x00, 0x01 }, 4, TRUE },  /* Input registers */
+    { 0x01, { 0x00, 0x00, 0x00, 0x01 }, 4, FALSE }, /* Coils */
+    { 0x02, { 0x00, 0x00, 0x00, 0x01 }, 4, FALSE }, /* Discrete inputs */
+    { 0x08, { 0x00, 0x00, 0xA5, 0x5A }, 4, FALSE }, /* Return query data */
+    { 0x11, { 0 }, 0, FALSE },                      /* Report server id */
+    { 0x2B, { 0x0E, 0x01, 0x00 }, 3, FALSE },       /* Device id, basic */
+};
+
+/* Inter-frame delays tried, longest first */
+static const guint32 gaps_us[] = { 50000, 20000, 10000, 5000, 2000, 1000, 0 };
+
+static struct probe_result cache[PROBE_CACHE_SIZE];
+static guint n_cache = 0;
+static guint32 cache_generation = 0;
+
+/******************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static unsigned char *transact(struct probe *probe, struct modbus *modbus,
+                               guint8 function, const guint8 *data,
+                               gsize len, gsize *size);
+
+static gboolean read_registers(struct probe *probe, struct modbus *modbus,
+                               guint16 n);
+
+static void parse_device_id(struct probe *probe, const unsigned char *resp,
+                            gsize size);
+
+static void step_functions(struct probe *probe, struct modbus *modbus);
+
+static void step_read_size(struct probe *probe, struct modbus *modbus);
+
+static void step_gap(struct probe *probe, struct modbus *modbus);
+
+static void finish(struct probe *probe);
+
+static int compare_guint32(const void *a, const void *b);
+
+/******************** LOCAL FUNCTION DEFINTION SECTION ************************/
+
+/*
+ * Run one transaction, the response is returned only if it is from the
+ * probed slave and for the function asked for, exception or not.
+ */
+static unsigned char *transact(struct probe *probe, struct modbus *modbus,
+                               guint8 function, const guint8 *data,
+                               gsize len, gsize *size)
+{
+    unsigned char req[2 + 4 + 2];
+
+    g_assert(len <= 4);
+
+    req[0] = probe->result.address;
+    req[1] = function;
+    memcpy(&req[2], data, len);
+
+    gint64 sent_us = g_get_monotonic_time();
+    unsigned char *resp = modbus_transact(modbus, req, 2 + len + 2, size);
+
+    if (!resp || *size < 5 || resp[0] != probe->result.address ||
+        (resp[1] & 0x7F) != function) {
+        return NULL;
+    }
+
+    struct modbus_rx_time rx;
+    modbus_get_rx_time(modbus, &rx);
+
+    probe->answered = TRUE;
+    if (probe->n_latencies < PROBE_MAX_SAMPLES) {
+        probe->latencies[probe->n_latencies++] = MAX(rx.first_us - sent_us,
+                                                     0);
+    }
+
+    return resp;
+}
+
+static gboolean read_registers(struct probe *probe, struct modbus *modbus,
+                               guint16 n)
+{
+    guint8 data[4] = { probe->start >> 8, probe->start & 0xFF, n >> 8,
+                       n & 0xFF };
+    gsize size;
+    unsigned char *resp = transact(probe, modbus, 0x03, data, sizeof(data),
+                                   &size);
+
+    return resp && !(resp[1] & 0x80) && resp[2] == 2 * n &&
+        size == 5 + 2 * (gsize) n;
+}
+
+/*
+ * Pick vendor, product and revision out of a basic device identification
+ * response, objects are id, length and value after an 8 byte header
+ */
+static void parse_device_id(struct probe *probe, const unsigned char *resp,
+                            gsize size)
+{
+    gchar *texts[] = {
+        probe->result.vendor,
+        probe->result.product,
+        probe->result.revision,
+    };
+    gsize end = size - 2;       /* CRC */
+    gsize pos = 8;
+    guint n = size > 8 ? resp[7] : 0;
+    guint i = 0;
+
+    for (; i < n && pos + 2 <= end; i++) {
+        guint id = resp[pos];
+        gsize len = resp[pos + 1];
+
+        pos += 2;
+        if (pos + len > end) {
+            break;
+        }
+
+        if (id < G_N_ELEMENTS(texts)) {
+            gsize copy = MIN(len, PROBE_TEXT_SIZE - 1);
+            gsize j = 0;
+
+            for (; j < copy; j++) {
+                texts[id][j] = g_ascii_isprint(resp[pos + j]) ?
+                    resp[pos + j] : '?';
+            }
+            texts[id][copy] = '\0';
+        }
+        pos += len;
+    }
+}
+
+static void step_functions(struct probe *probe, struct modbus *modbus)
+{
+    guint8 data[4];
+    gsize size;
+
+    memcpy(data, requests[probe->index].data, sizeof(data));
+    if (requests[probe->index].at_start) {
+        data[0] = probe->start >> 8;
+        data[1] = probe->start & 0xFF;
+    }
+
+    guint8 function = requests[probe->index].function;
+    unsigned char *resp = transact(probe, modbus, function, data,
+                                   requests[probe->index].len, &size);
+
+    if (!resp) {
+        if (!probe->index) {
+            LOG("Slave 0x%02x does not answer, not probing",
+                probe->result.address);
+            probe->stage = STAGE_DONE;
+            return;
+        }
+    } else if (resp[1] & 0x80) {
+        /* It knows the function, just not with these arguments */
+        if (resp[2] != EXCEPTION_ILLEGAL_FUNCTION) {
+            probe->result.functions |= G_GUINT64_CONSTANT(1) << function;
+        }
+    } else {
+        probe->result.functions |= G_GUINT64_CONSTANT(1) << function;
+
+        if (function == 0x03) {
+            probe->reads = TRUE;
+        } else if (function == 0x2B) {
+            probe->result.device_id = TRUE;
+            parse_device_id(probe, resp, size);
+        }
+    }
+
+    if (++probe->index < G_N_ELEMENTS(requests)) {
+        return;
+    }
+
+    /* Most slaves take the largest read, try that first */
+    probe->index = 0;
+    probe->stage = probe->reads ? STAGE_READ_SIZE : STAGE_DONE;
+    probe->lo = 1;
+    probe->hi = PROBE_MAX_READ;
+}
+
+static void step_read_size(struct probe *probe, struct modbus *modbus)
+{
+    guint16 n = probe->hi == PROBE_MAX_READ && probe->lo == 1 ?
+        PROBE_MAX_READ : (probe->lo + probe->hi + 1) / 2;
+
+    if (read_registers(probe, modbus, n)) {
+        probe->lo = n;
+    } else {
+        probe->hi = n - 1;
+        /* A late answer must not end up in the next transaction */
+        tcflush(modbus_get_fd(modbus), TCIFLUSH);
+    }
+
+    if (probe->lo >= probe->hi) {
+        probe->result.max_read = probe->lo;
+        probe->stage = STAGE_GAP;
+    }
+}
+
+/*
+ * One transaction to start from, then PROBE_GAP_TRIES more each the tried
+ * delay after the end of the last response, one per step. The caller waits
+ * the delay between steps, see probe_get_delay().
+ */
+static void step_gap(struct probe *probe, struct modbus *modbus)
+{
+    struct modbus_rx_time rx;
+
+    /* Some other transaction since the last one, e.g. a poll, start over */
+    modbus_get_rx_time(modbus, &rx);
+    if (probe->tries && rx.last_us != probe->last_rx_us) {
+        probe->tries = 0;
+    }
+
+    if (!read_registers(probe, modbus, 1)) {
+        tcflush(modbus_get_fd(modbus), TCIFLUSH);
+        probe->stage = STAGE_DONE;
+        return;
+    }
+
+    modbus_get_rx_time(modbus, &rx);
+    probe->last_rx_us = rx.last_us;
+
+    if (probe->tries++ < PROBE_GAP_TRIES) {
+        return;
+    }
+
+    probe->tries = 0;
+    probe->result.min_gap_us = gaps_us[probe->index];
+
+    if (++probe->index == G_N_ELEMENTS(gaps_us)) {
+        probe->stage = STAGE_DONE;
+    }
+}
+
+static void finish(struct probe *probe)
+{
+    struct probe_result *r = &probe->result;
+
+    if (probe->n_latencies) {
+        qsort(probe->latencies, probe->n_latencies,
+              sizeof(probe->latencies[0]), compare_guint32);
+
+        r->latency_us = probe->latencies[probe->n_latencies / 2];
+        r->latency_max_us = probe->latencies[probe->n_latencies - 1];
+    }
+
+    /* Twice the slowest answer seen, rounded up to ms */
+    r->timeout_ms = CLAMP((2 * r->latency_max_us + 999) / 1000,
+                          PROBE_MIN_TIMEOUT_MS, PROBE_MAX_TIMEOUT_MS);
+    r->probed_utc_us = g_get_real_time();
+}
+
+static int compare_guint32(const void *a, const void *b)
+{
+    guint32 x = *(const guint32 *) a;
+    guint32 y = *(const guint32 *) b;
+
+    return (x > y) - (x < y);
+}
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+struct probe *probe_new(guint8 address, guint32 baud,
+                        enum modbus_framing framing, guint16 start)
+{
+    struct probe *probe = g_new0(struct probe, 1);
+
+    probe->result.address = address;
+    probe->result.baud    = baud;
+    probe->result.framing = framing;
+    probe->start          = start;
+    probe->stage          = STAGE_FUNCTIONS;
+
+    return probe;
+}
+
+void probe_free(struct probe **probe)
+{
+    if (!probe || !*probe) {
+        return;
+    }
+
+    g_free(*probe);
+    *probe = NULL;
+}
+
+gboolean probe_step(struct probe *probe, struct modbus *modbus)
+{
+    g_assert(probe);
+    g_assert(modbus);
+
+    if (probe->stage == STAGE_DONE) {
+        return FALSE;
+    }
+
+    switch (probe->stage) {
+        case STAGE_FUNCTIONS:
+            step_functions(probe, modbus);
+            break;
+        case STAGE_READ_SIZE:
+            step_read_size(probe, modbus);
+            break;
+        case STAGE_GAP:
+            step_gap(probe, modbus);
+            break;
+        case STAGE_DONE:
+            break;
+    }
+
+    if (probe->stage != STAGE_DONE) {
+        return TRUE;
+    }
+
+    finish(probe);
+
+    return FALSE;
+}
+
+gboolean probe_get_delay(const struct probe *probe, guint32 *delay_us)
+{
+    g_assert(probe);
+    g_assert(delay_us);
+
+    if (probe->stage != STAGE_GAP || !probe->tries) {
+        return FALSE;
+    }
+
+    *delay_us = gaps_us[probe->index];
+
+    return TRUE;
+}
+
+const struct probe_result *probe_get_result(struct probe *probe)
+{
+    g_assert(probe);
+    g_assert(probe->stage == STAGE_DONE);
+
+    return probe->answered ? &probe->result : NULL;
+}
+
+const struct probe_result *probe_lookup(guint8 address, guint32 baud,
+                                        enum modbus_framing framing)
+{
+    guint i = 0;
+
+    for (; i < n_cache; i++) {
+        if (cache[i].address == address && cache[i].baud == baud &&
+            cache[i].framing == framing) {
+            return &cache[i];
+        }
+    }
+
+    return NULL;
+}
+
+void probe_store(const struct probe_result *result)
+{
+    g_assert(result);
+
+    guint slot = n_cache;
+    guint i = 0;
+
+    for (; i < n_cache; i++) {
+        if (cache[i].address == result->address &&
+            cache[i].baud == result->baud &&
+            cache[i].framing == result->framing) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot == PROBE_CACHE_SIZE) {
+        slot = 0;
+        for (i = 1; i < n_cache; i++) {
+            if (cache[i].probed_utc_us < cache[slot].probed_utc_us) {
+                slot = i;
+            }
+        }
+    }
+
+    cache[slot] = *result;
+    n_cache = MAX(n_cache, slot + 1);
+    cache_generation++;
+}
+
+guint32 probe_generation(void)
+{
+    return cache_generation;
+}
+
+guint probe_get_cache(const struct probe_result **results)
+{
+    g_assert(results);
+
+    *results = cache;
+
+    return n_cache;
+}
+
+void probe_restore(const guchar *data, gsize len)
+{
+    g_assert(data || !len);
+
+    n_cache = MIN(len / sizeof(struct probe_result), PROBE_CACHE_SIZE);
+
+    guint i = 0;
+    for (; i < n_cache; i++) {
+        struct probe_result *r = &cache[i];
+
+        /* Copy out, the mapping gives no alignment guarantees */
+        memcpy(r, data + i * sizeof(*r), sizeof(*r));
+        r->vendor[sizeof(r->vendor) - 1] = '\0';
+        r->product[sizeof(r->product) - 1] = '\0';
+        r->revision[sizeof(r->revision) - 1] = '\0';
+    }
+}
@@ -0,0 +1,146 @@
+#ifndef INCLUSION_GUARD_PROBE_H
+#define INCLUSION_GUARD_PROBE_H
+
+#include <glib.h>
+
+#include "modbus.h"
+
+/** @file probe.h
+ * @Brief Slave capability probing
+ *
+ * Slaves differ in how many registers they return in one read, which
+ * function codes they implement and how fast they answer. A probe finds
+ * out with a short series of harmless requests, one step at a time so it
+ * can be interleaved with regular polling:
+ *
+ *   1. Function codes: read coils, discrete inputs, holding and input
+ *      registers, diagnostics echo, report server id and read device
+ *      identification (0x2B/0x0E), which also gives vendor and product.
+ *      A normal response or any exception but illegal function counts as
+ *      supported. Nothing is ever written.
+ *   2. Largest read at the start register accepted, with function 0x03
+ *      as sent by modbus_read_input_registers(),
+ *      by binary search over 1 to PROBE_MAX_READ.
+ *   3. Smallest delay between the end of a response and the next request
+ *      that still gives PROBE_GAP_TRIES good transactions in a row.
+ *
+ * Each step is a single transaction with the response timeout set on the
+ * port. The delays of stage 3 are left to the caller, see probe_get_delay().
+ *
+ * The response latency of all good transactions gives the response
+ * timeout to use. Results are cached per address, baud rate and framing
+ * and persisted in the state file, so a slave is probed only once.
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define PROBE_MAX_READ (125)
+
+/* Response timeout derived from the latency is kept within these limits */
+#define PROBE_MIN_TIMEOUT_MS (20)
+#define PROBE_MAX_TIMEOUT_MS (1000)
+
+/* Transactions in a row per tried inter-frame delay */
+#define PROBE_GAP_TRIES (4)
+
+/* Room for the slave at Address and CONFIG_MAX_SLAVES more, and spares */
+#define PROBE_CACHE_SIZE (32)
+#define PROBE_TEXT_SIZE (32)
+
+/******************** TYPE DEFINITION SECTION *********************************/
+
+/**
+ * Forward-declared probe handle.
+ */
+struct probe;
+
+/**
+ * Capabilities of one slave, as stored in the state file.
+ */
+struct probe_result
+{
+    guint8 address;
+    guint8 framing;             /* enum modbus_framing */
+    guint32 baud;
+
+    guint64 functions;          /* Bit n set if function code n works */
+    guint8 device_id;           /* 0x2B/0x0E works */
+    guint16 max_read;           /* Registers, 0 if reads fail */
+    guint32 min_gap_us;         /* Inter-frame delay, 0 if none is found */
+    guint32 latency_us;         /* Median request to first response byte */
+    guint32 latency_max_us;
+    guint32 timeout_ms;         /* Response timeout to use */
+
+    gchar vendor[PROBE_TEXT_SIZE];
+    gchar product[PROBE_TEXT_SIZE];
+    gchar revision[PROBE_TEXT_SIZE];
+
+    gint64 probed_utc_us;
+} __attribute__((packed));
+
+/******************** GLOBAL FUNCTION DECLARATION SECTION *********************/
+
+/**
+ * Create a probe for the slave on a port. Reads start at register start.
+ */
+struct probe *probe_new(guint8 address, guint32 baud,
+                        enum modbus_framing framing, guint16 start);
+
+/**
+ * Free probe.
+ */
+void probe_free(struct probe **probe);
+
+/**
+ * Run the next step on the port, one transaction.
+ *
+ * @return TRUE while there are more steps.
+ */
+gboolean probe_step(struct probe *probe, struct modbus *modbus);
+
+/**
+ * Check if the next step has to follow the last one after a delay, while
+ * trying inter-frame delays. Otherwise it can run any time later.
+ *
+ * @return TRUE with the delay in delay_us, or FALSE.
+ */
+gboolean probe_get_delay(const struct probe *probe, guint32 *delay_us);
+
+/**
+ * Get result of a finished probe.
+ *
+ * @return Result, or NULL if the slave never answered.
+ */
+const struct probe_result *probe_get_result(struct probe *probe);
+
+/**
+ * Look up cached result.
+ *
+ * @return Result or NULL if the slave has not been probed.
+ */
+const struct probe_result *probe_lookup(guint8 address, guint32 baud,
+                                        enum modbus_framing framing);
+
+/**
+ * Cache result, replacing the one of the same slave or the oldest.
+ */
+void probe_store(const struct probe_result *result);
+
+/**
+ * Get change counter of the cache.
+ */
+guint32 probe_generation(void);
+
+/**
+ * Get cached results for saving.
+ *
+ * @return Number of results in results.
+ */
+guint probe_get_cache(const struct probe_result **results);
+
+/**
+ * Restore cached results saved with probe_get_cache(), len bytes at data.
+ */
+void probe_restore(const guchar *data, gsize len);
+
+#endif // INCLUSION_GUARD_PROBE_H
@@ -0,0 +1,328 @@
+#include <glib.h>
+#include <glib-unix.h>
+#include <string.h>
+
+#include "profile.h"
+#include "debug.h"
+
+/** @file profile.c
+ * @Brief Main loop stall profiler implementation
+ *
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+/******************** LOCAL VARIABLE DECLARATION SECTION **********************/
+
+/**
+ * Callback of a source added through a wrapper
+ */
+struct profile_source
+{
+    gint id;
+    GSourceFunc func;
+    GUnixFDSourceFunc fd_func;
+    gpointer data;
+};
+
+static struct profile_stats stats[PROFILE_MAX_CALLBACKS];
+static gint n_stats = 0;
+
+/* Sources may be named from other threads, see profile_idle_add() */
+static GMutex register_lock;
+
+static struct
+{
+    GPollFunc poll;             /* Poll function of the context, NULL if off */
+    gint iteration;
+    gint64 woke_us;             /* Last return from poll */
+    guint64 stall_us;
+
+    /* Slowest callback of the running iteration, -1 if none */
+    gint slowest;
+    guint64 slowest_us;
+
+    gint64 logged_us;
+    guint suppressed;
+} loop = {
+    .iteration = -1,
+    .stall_us  = PROFILE_STALL_MS * 1000,
+    .slowest   = -1,
+};
+
+/******************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static struct profile_source *new_source(const gchar *name, GSourceFunc func,
+                                         gpointer data);
+
+static gboolean on_source(gpointer data);
+
+static gboolean on_fd_source(gint fd, GIOCondition condition, gpointer data);
+
+static void account(struct profile_stats *s, guint64 us);
+
+static gint on_poll(GPollFD *fds, guint n_fds, gint timeout);
+
+static void log_stall(guint64 us, gint64 now);
+
+static guint64 bucket_limit_us(guint bucket);
+
+static guint percentile_bucket(const struct profile_stats *s, guint percent);
+
+/******************** LOCAL FUNCTION DEFINTION SECTION ************************/
+
+static struct profile_source *new_source(const gchar *name, GSourceFunc func,
+                                         gpointer data)
+{
+    struct profile_source *source = g_new0(struct profile_source, 1);
+
+    source->id   = profile_register(name);
+    source->func = func;
+    source->data = data;
+
+    return source;
+}
+
+static gboolean on_source(gpointer data)
+{
+    struct profile_source *source = data;
+    gint64 start = profile_begin();
+    gboolean keep = source->func(source->data);
+
+    profile_end(source->id, start);
+
+    return keep;
+}
+
+static gboolean on_fd_source(gint fd, GIOCondition condition, gpointer data)
+{
+    struct profile_source *source = data;
+    gint64 start = profile_begin();
+    gboolean keep = source->fd_func(fd, condition, source->data);
+
+    profile_end(source->id, start);
+
+    return keep;
+}
+
+static void account(struct profile_stats *s, guint64 us)
+{
+    guint bucket = us ? g_bit_storage(us) : 0;
+
+    s->calls++;
+    s->total_us += us;
+    s->max_us = MAX(s->max_us, us);
+    s->buckets[MIN(bucket, PROFILE_BUCKETS - 1)]++;
+
+    if (us >= loop.stall_us) {
+        s->stalls++;
+    }
+}
+
+/*
+ * Everything between two polls is one iteration: prepare, check and
+ * dispatch of all ready sources
+ */
+static gint on_poll(GPollFD *fds, guint n_fds, gint timeout)
+{
+    gint64 now = g_get_monotonic_time();
+
+    if (loop.woke_us) {
+        guint64 us = now - loop.woke_us;
+
+        account(&stats[loop.iteration], us);
+        if (us >= loop.stall_us) {
+            log_stall(us, now);
+        }
+    }
+
+    loop.slowest    = -1;
+    loop.slowest_us = 0;
+
+    gint ret = loop.poll(fds, n_fds, timeout);
+
+    loop.woke_us = g_get_monotonic_time();
+
+    return ret;
+}
+
+static void log_stall(guint64 us, gint64 now)
+{
+    if (loop.logged_us &&
+        now - loop.logged_us < PROFILE_STALL_LOG_INTERVAL_S * G_USEC_PER_SEC) {
+        loop.suppressed++;
+        return;
+    }
+
+    LOG("Main loop stalled %llu ms, slowest callback %s %llu ms "
+        "(%u more stalls not logged)", (unsigned long long) us / 1000,
+        loop.slowest < 0 ? "(none)" : stats[loop.slowest].name,
+        (unsigned long long) loop.slowest_us / 1000, loop.suppressed);
+
+    loop.logged_us  = now;
+    loop.suppressed = 0;
+}
+
+static guint64 bucket_limit_us(guint bucket)
+{
+    return G_GUINT64_CONSTANT(1) << bucket;
+}
+
+static guint percentile_bucket(const struct profile_stats *s, guint percent)
+{
+    guint64 want = (s->calls * percent + 99) / 100;
+    guint64 seen = 0;
+    guint i = 0;
+
+    for (; i < PROFILE_BUCKETS - 1; i++) {
+        seen += s->buckets[i];
+        if (seen >= want) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+void profile_init(guint stall_ms)
+{
+    g_assert(stall_ms);
+
+    loop.stall_us  = (guint64) stall_ms * 1000;
+    loop.iteration = profile_register(PROFILE_ITERATION);
+
+    if (!loop.poll) {
+        loop.poll = g_main_context_get_poll_func(NULL);
+        g_main_context_set_poll_func(NULL, on_poll);
+    }
+}
+
+void profile_cleanup(void)
+{
+    if (loop.poll) {
+        g_main_context_set_poll_func(NULL, loop.poll);
+        loop.poll = NULL;
+    }
+    loop.woke_us = 0;
+}
+
+guint profile_timeout_add(const gchar *name, guint interval_ms,
+                          GSourceFunc func, gpointer data)
+{
+    return g_timeout_add_full(G_PRIORITY_DEFAULT, interval_ms, on_source,
+                              new_source(name, func, data), g_free);
+}
+
+guint profile_timeout_add_seconds(const gchar *name, guint interval_s,
+                                  GSourceFunc func, gpointer data)
+{
+    return g_timeout_add_seconds_full(G_PRIORITY_DEFAULT, interval_s,
+                                      on_source, new_source(name, func, data),
+                                      g_free);
+}
+
+guint profile_idle_add(const gchar *name, GSourceFunc func, gpointer data)
+{
+    return g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, on_source,
+                           new_source(name, func, data), g_free);
+}
+
+guint profile_fd_add(const gchar *name, gint fd, GIOCondition condition,
+                     GUnixFDSourceFunc func, gpointer data)
+{
+    struct profile_source *source = new_source(name, NULL, data);
+
+    source->fd_func = func;
+
+    return g_unix_fd_add_full(G_PRIORITY_DEFAULT, fd, condition,
+                              on_fd_source, source, g_free);
+}
+
+guint profile_signal_add(const gchar *name, gint signum, GSourceFunc func,
+                         gpointer data)
+{
+    return g_unix_signal_add_full(G_PRIORITY_DEFAULT, signum, on_source,
+                                  new_source(name, func, data), g_free);
+}
+
+gint profile_register(const gchar *name)
+{
+    g_assert(name);
+
+    g_mutex_lock(&register_lock);
+
+    gint n = g_atomic_int_get(&n_stats);
+    gint id = 0;
+
+    for (; id < n; id++) {
+        if (!strcmp(stats[id].name, name)) {
+            break;
+        }
+    }
+
+    if (id == n && n < PROFILE_MAX_CALLBACKS) {
+        stats[id].name = g_intern_string(name);
+        g_atomic_int_set(&n_stats, n + 1);
+    } else if (id == n) {
+        id = PROFILE_MAX_CALLBACKS - 1;
+    }
+
+    g_mutex_unlock(&register_lock);
+
+    return id;
+}
+
+gint64 profile_begin(void)
+{
+    return g_get_monotonic_time();
+}
+
+void profile_end(gint id, gint64 start)
+{
+    g_assert(id >= 0 && id < PROFILE_MAX_CALLBACKS);
+
+    guint64 us = MAX(g_get_monotonic_time() - start, 0);
+
+    account(&stats[id], us);
+
+    if (us > loop.slowest_us) {
+        loop.slowest    = id;
+        loop.slowest_us = us;
+    }
+}
+
+guint profile_get_stats(const struct profile_stats **result)
+{
+    g_assert(result);
+
+    *result = stats;
+
+    return g_atomic_int_get(&n_stats);
+}
+
+void profile_report(void)
+{
+    gint n = g_atomic_int_get(&n_stats);
+    gint i = 0;
+
+    LOG("Main loop callbacks, stall threshold %llu ms:",
+        (unsigned long long) loop.stall_us / 1000);
+
+    for (; i < n; i++) {
+        const struct profile_stats *s = &stats[i];
+
+        if (!s->calls) {
+            continue;
+        }
+
+        LOG("  %-24s %8llu calls, mean %6llu us, p50 < %7llu us, "
+            "p99 < %7llu us, max %7llu us, %llu stalls", s->name,
+            (unsigned long long) s->calls,
+            (unsigned long long) (s->total_us / s->calls),
+            (unsigned long long) bucket_limit_us(percentile_bucket(s, 50)),
+            (unsigned long long) bucket_limit_us(percentile_bucket(s, 99)),
+            (unsigned long long) s->max_us, (unsigned long long) s->stalls);
+    }
+}
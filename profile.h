@@ -0,0 +1,129 @@
+#ifndef INCLUSION_GUARD_PROFILE_H
+#define INCLUSION_GUARD_PROFILE_H
+
+#include <glib.h>
+#include <glib-unix.h>
+
+/** @file profile.h
+ * @Brief Main loop stall profiler
+ *
+ * Polling, the overlay, the port bridge and all sockets share the default
+ * main loop, a slow callback delays all the others. Sources are added
+ * through the wrappers below under a name, each dispatch is timed into a
+ * per-name histogram of log2 microsecond buckets. Callbacks run by
+ * libraries, like the axoverlay render callback, are timed with
+ * profile_begin() and profile_end().
+ *
+ * profile_init() hooks the poll function of the default main context to
+ * time whole loop iterations, an iteration taking longer than the stall
+ * threshold is logged with the name of the slowest callback in it.
+ *
+ * The cost is two clock reads per dispatch and per iteration. Sources
+ * must be added and callbacks timed from the main loop thread, except
+ * profile_idle_add() which may be used from any thread.
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+/* Iterations taking longer are logged as stalls */
+#define PROFILE_STALL_MS (50)
+
+/* Stalls are logged at most once per interval, the others counted */
+#define PROFILE_STALL_LOG_INTERVAL_S (10)
+
+/* Bucket n holds times of 2^(n-1) up to 2^n us, the last one all longer */
+#define PROFILE_BUCKETS (20)
+
+#define PROFILE_MAX_CALLBACKS (48)
+
+/* Name of the statistics of whole main loop iterations */
+#define PROFILE_ITERATION "(iteration)"
+
+/******************** TYPE DEFINITION SECTION *********************************/
+
+/**
+ * Run time statistics of one callback.
+ */
+struct profile_stats
+{
+    const gchar *name;
+    guint64 calls;
+    guint64 total_us;
+    guint64 max_us;
+    guint64 stalls;             /* Calls longer than the stall threshold */
+    guint32 buckets[PROFILE_BUCKETS];
+};
+
+/******************** GLOBAL FUNCTION DECLARATION SECTION *********************/
+
+/**
+ * Start timing main loop iterations, log those longer than stall_ms.
+ */
+void profile_init(guint stall_ms);
+
+/**
+ * Stop timing main loop iterations.
+ */
+void profile_cleanup(void);
+
+/**
+ * g_timeout_add() with timed dispatch.
+ */
+guint profile_timeout_add(const gchar *name, guint interval_ms,
+                          GSourceFunc func, gpointer data);
+
+/**
+ * g_timeout_add_seconds() with timed dispatch.
+ */
+guint profile_timeout_add_seconds(const gchar *name, guint interval_s,
+                                  GSourceFunc func, gpointer data);
+
+/**
+ * g_idle_add() with timed dispatch.
+ */
+guint profile_idle_add(const gchar *name, GSourceFunc func, gpointer data);
+
+/**
+ * g_unix_fd_add() with timed dispatch.
+ */
+guint profile_fd_add(const gchar *name, gint fd, GIOCondition condition,
+                     GUnixFDSourceFunc func, gpointer data);
+
+/**
+ * g_unix_signal_add() with timed dispatch.
+ */
+guint profile_signal_add(const gchar *name, gint signum, GSourceFunc func,
+                         gpointer data);
+
+/**
+ * Get statistics id of name, for timing with profile_begin().
+ *
+ * @return Id, names past PROFILE_MAX_CALLBACKS share the last one.
+ */
+gint profile_register(const gchar *name);
+
+/**
+ * Start timing a callback.
+ *
+ * @return Start time to pass to profile_end().
+ */
+gint64 profile_begin(void);
+
+/**
+ * Account the time since start to the statistics of id.
+ */
+void profile_end(gint id, gint64 start);
+
+/**
+ * Get statistics of all callbacks.
+ *
+ * @return Number of entries in stats.
+ */
+guint profile_get_stats(const struct profile_stats **stats);
+
+/**
+ * Log the statistics of all callbacks that ran.
+ */
+void profile_report(void);
+
+#endif // INCLUSION_GUARD_PROFILE_H
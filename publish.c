@@ -0,0 +1,475 @@
+#include <glib.h>
+#include <glib-unix.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "publish.h"
+#include "values.h"
+#include "profile.h"
+#include "debug.h"
+
+/** @file publish.c
+ * @Brief Sample publisher implementation
+ *
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+/******************** LOCAL VARIABLE DECLARATION SECTION **********************/
+
+/**
+ * Encoded frame, shared between all subscriber queues.
+ */
+struct frame
+{
+    gint refcount;
+    gsize len;
+    guchar data[];
+};
+
+struct subscriber
+{
+    int fd;
+    guint watch;            /* Hangup detection */
+    guint out_watch;        /* Writable, only while frames are queued */
+    struct frame *queue[PUBLISH_QUEUE_LEN];
+    guint head;
+    guint count;
+};
+
+struct publisher
+{
+    int fd;
+    gchar *path;
+    guint watch;
+
+    struct subscriber *subs[PUBLISH_MAX_SUBSCRIBERS];
+    guint n_subs;
+
+    struct publish_sample batch[VALUES_MAX_POINTS];
+    guint n_batch;
+    value_time received;
+    guint32 sequence;
+
+    struct frame *catalog;
+    guint catalog_points;   /* Points 0..n-1 are in the catalog */
+
+    struct publish_stats stats;
+};
+
+/**
+ * Publisher state, NULL when publishing is not enabled.
+ */
+static struct publisher *pub = NULL;
+
+/******************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static struct frame *frame_new(enum publish_frame_type type, guint count,
+                               gsize payload_len);
+
+static struct frame *frame_ref(struct frame *frame);
+
+static void frame_unref(struct frame *frame);
+
+static void update_catalog(void);
+
+static gboolean is_catalog(const struct frame *frame);
+
+static void enqueue(struct subscriber *sub, struct frame *frame);
+
+static gboolean flush(struct subscriber *sub);
+
+static void disconnect(struct subscriber *sub);
+
+static gboolean on_accept(gint fd, GIOCondition condition, gpointer data);
+
+static gboolean on_hangup(gint fd, GIOCondition condition, gpointer data);
+
+static gboolean on_writable(gint fd, GIOCondition condition, gpointer data);
+
+/******************** LOCAL FUNCTION DEFINTION SECTION ************************/
+
+static struct frame *frame_new(enum publish_frame_type type, guint count,
+                               gsize payload_len)
+{
+    gsize len = sizeof(struct publish_header) + payload_len;
+    struct frame *frame = g_malloc(sizeof(struct frame) + len);
+
+    frame->refcount = 1;
+    frame->len = len;
+
+    struct publish_header *hdr = (struct publish_header *) frame->data;
+    hdr->magic        = PUBLISH_MAGIC;
+    hdr->version      = PUBLISH_VERSION;
+    hdr->type         = type;
+    hdr->count        = count;
+    hdr->sequence     = pub->sequence;
+    hdr->reserved     = 0;
+    hdr->timestamp_us = g_get_monotonic_time();
+    memset(&hdr->received, 0, sizeof(hdr->received));
+
+    return frame;
+}
+
+static struct frame *frame_ref(struct frame *frame)
+{
+    frame->refcount++;
+
+    return frame;
+}
+
+static void frame_unref(struct frame *frame)
+{
+    if (frame && --frame->refcount == 0) {
+        g_free(frame);
+    }
+}
+
+static void update_catalog(void)
+{
+    guint n = values_count();
+    gsize len = 0;
+    guint i;
+
+    for (i = 0; i < n; i++) {
+        len += sizeof(struct publish_catalog_entry) +
+            strlen(values_get(i)->name);
+    }
+
+    struct frame *frame = frame_new(PUBLISH_TYPE_CATALOG, n, len);
+    guchar *p = frame->data + sizeof(struct publish_header);
+
+    for (i = 0; i < n; i++) {
+        const gchar *name = values_get(i)->name;
+        struct publish_catalog_entry entry = {
+            .point    = i,
+            .name_len = strlen(name),
+        };
+
+        memcpy(p, &entry, sizeof(entry));
+        p += sizeof(entry);
+        memcpy(p, name, entry.name_len);
+        p += entry.name_len;
+    }
+
+    frame_unref(pub->catalog);
+    pub->catalog = frame;
+    pub->catalog_points = n;
+
+    for (i = 0; i < pub->n_subs; i++) {
+        enqueue(pub->subs[i], frame);
+    }
+}
+
+static gboolean is_catalog(const struct frame *frame)
+{
+    const struct publish_header *hdr =
+        (const struct publish_header *) frame->data;
+
+    return hdr->type == PUBLISH_TYPE_CATALOG;
+}
+
+static void enqueue(struct subscriber *sub, struct frame *frame)
+{
+    /* Drop oldest, the poll path must never wait for a subscriber. A
+     * catalog stays, the samples after it can not be read without it,
+     * unless a newer one follows right away.
+     */
+    if (sub->count == PUBLISH_QUEUE_LEN) {
+        guint next = (sub->head + 1) % PUBLISH_QUEUE_LEN;
+        struct frame *oldest = sub->queue[sub->head];
+
+        if (is_catalog(oldest) && !is_catalog(sub->queue[next])) {
+            frame_unref(sub->queue[next]);
+            sub->queue[next] = oldest;
+        } else {
+            frame_unref(oldest);
+        }
+        sub->head = next;
+        sub->count--;
+        pub->stats.dropped++;
+    }
+
+    sub->queue[(sub->head + sub->count) % PUBLISH_QUEUE_LEN] =
+        frame_ref(frame);
+    sub->count++;
+}
+
+static gboolean flush(struct subscriber *sub)
+{
+    while (sub->count) {
+        struct frame *frame = sub->queue[sub->head];
+        ssize_t n = send(sub->fd, frame->data, frame->len,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!sub->out_watch) {
+                sub->out_watch = profile_fd_add("publish send", sub->fd,
+                    G_IO_OUT, on_writable, sub);
+            }
+            return TRUE;
+        }
+
+        if (n < 0) {
+            DBG_LOG("Subscriber fd=%d gone: %s", sub->fd, strerror(errno));
+            return FALSE;
+        }
+
+        frame_unref(frame);
+        sub->head = (sub->head + 1) % PUBLISH_QUEUE_LEN;
+        sub->count--;
+        pub->stats.sent++;
+    }
+
+    if (sub->out_watch) {
+        g_source_remove(sub->out_watch);
+        sub->out_watch = 0;
+    }
+
+    return TRUE;
+}
+
+static void disconnect(struct subscriber *sub)
+{
+    guint i;
+
+    for (i = 0; i < pub->n_subs; i++) {
+        if (pub->subs[i] == sub) {
+            pub->subs[i] = pub->subs[--pub->n_subs];
+            break;
+        }
+    }
+
+    if (sub->watch) {
+        g_source_remove(sub->watch);
+    }
+    if (sub->out_watch) {
+        g_source_remove(sub->out_watch);
+    }
+
+    while (sub->count) {
+        frame_unref(sub->queue[sub->head]);
+        sub->head = (sub->head + 1) % PUBLISH_QUEUE_LEN;
+        sub->count--;
+    }
+
+    close(sub->fd);
+    g_free(sub);
+
+    LOG("Subscriber disconnected, %u left", pub->n_subs);
+}
+
+static gboolean on_accept(gint fd, GIOCondition condition, gpointer data)
+{
+    int sub_fd = accept(fd, NULL, NULL);
+
+    if (sub_fd < 0) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (pub->n_subs >= PUBLISH_MAX_SUBSCRIBERS) {
+        ERR("Too many subscribers, rejecting connection");
+        close(sub_fd);
+        return G_SOURCE_CONTINUE;
+    }
+
+    fcntl(sub_fd, F_SETFL, fcntl(sub_fd, F_GETFL) | O_NONBLOCK);
+
+    struct subscriber *sub = g_new0(struct subscriber, 1);
+    sub->fd = sub_fd;
+    sub->watch = profile_fd_add("publish subscriber", sub_fd,
+        G_IO_IN | G_IO_HUP | G_IO_ERR, on_hangup, sub);
+    pub->subs[pub->n_subs++] = sub;
+
+    if (pub->catalog) {
+        enqueue(sub, pub->catalog);
+        if (!flush(sub)) {
+            disconnect(sub);
+            return G_SOURCE_CONTINUE;
+        }
+    }
+
+    LOG("Subscriber connected, %u in total", pub->n_subs);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_hangup(gint fd, GIOCondition condition, gpointer data)
+{
+    struct subscriber *sub = data;
+    char buf[64];
+
+    /* Subscribers are not expected to send anything, drain and ignore */
+    if (!(condition & (G_IO_HUP | G_IO_ERR)) &&
+        recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    sub->watch = 0;
+    disconnect(sub);
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean on_writable(gint fd, GIOCondition condition, gpointer data)
+{
+    struct subscriber *sub = data;
+
+    if (!flush(sub)) {
+        disconnect(sub);
+        return G_SOURCE_CONTINUE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+gboolean publish_init(const gchar *path)
+{
+    g_assert(path);
+
+    if (pub) {
+        return TRUE;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        ERR("Socket path %s too long", path);
+        return FALSE;
+    }
+    g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    if (fd < 0) {
+        ERR("Failed to create publish socket: %s", strerror(errno));
+        return FALSE;
+    }
+
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+        listen(fd, 8)) {
+        ERR("Failed to listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return FALSE;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    pub = g_new0(struct publisher, 1);
+    pub->fd    = fd;
+    pub->path  = g_strdup(path);
+    pub->watch = profile_fd_add("publish accept", fd, G_IO_IN, on_accept, NULL);
+
+    LOG("Publishing samples on %s", path);
+
+    return TRUE;
+}
+
+void publish_cleanup(void)
+{
+    if (!pub) {
+        return;
+    }
+
+    while (pub->n_subs) {
+        disconnect(pub->subs[0]);
+    }
+
+    g_source_remove(pub->watch);
+    close(pub->fd);
+    unlink(pub->path);
+
+    frame_unref(pub->catalog);
+    g_free(pub->path);
+    g_free(pub);
+    pub = NULL;
+}
+
+void publish_sample(gint point, gdouble value)
+{
+    if (!pub || point < 0 || pub->n_batch >= VALUES_MAX_POINTS) {
+        return;
+    }
+
+    const value_status *status = values_get_status(point);
+    struct publish_sample *sample = &pub->batch[pub->n_batch++];
+
+    sample->point     = point;
+    sample->quality   = status ? status->quality : VALUE_GOOD;
+    sample->exception = status ? status->exception : 0;
+    sample->value     = value;
+}
+
+void publish_set_received(const value_time *time)
+{
+    g_assert(time);
+
+    if (pub) {
+        pub->received = *time;
+    }
+}
+
+void publish_commit(void)
+{
+    if (!pub || !pub->n_batch) {
+        return;
+    }
+
+    guint i;
+
+    /* New points need to be in the catalog before their first sample */
+    for (i = 0; i < pub->n_batch; i++) {
+        if (pub->batch[i].point >= pub->catalog_points) {
+            update_catalog();
+            break;
+        }
+    }
+
+    pub->sequence++;
+
+    gsize len = pub->n_batch * sizeof(struct publish_sample);
+    struct frame *frame = frame_new(PUBLISH_TYPE_SAMPLES, pub->n_batch, len);
+    memcpy(frame->data + sizeof(struct publish_header), pub->batch, len);
+    ((struct publish_header *) frame->data)->received = pub->received;
+    memset(&pub->received, 0, sizeof(pub->received));
+    pub->n_batch = 0;
+    pub->stats.frames++;
+
+    /* Iterate backwards since flush failures remove subscribers */
+    for (i = pub->n_subs; i > 0; i--) {
+        struct subscriber *sub = pub->subs[i - 1];
+
+        enqueue(sub, frame);
+        if (!flush(sub)) {
+            disconnect(sub);
+        }
+    }
+
+    frame_unref(frame);
+}
+
+void publish_get_stats(struct publish_stats *stats)
+{
+    g_assert(stats);
+
+    if (!pub) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    *stats = pub->stats;
+    stats->subscribers = pub->n_subs;
+}
@@ -0,0 +1,124 @@
+#ifndef INCLUSION_GUARD_PUBLISH_H
+#define INCLUSION_GUARD_PUBLISH_H
+
+#include <glib.h>
+
+#include "values.h"
+
+/** @file publish.h
+ * @Brief Fan-out of sample batches to local subscribers over a Unix socket
+ *
+ * Subscribers connect to a SOCK_SEQPACKET Unix socket and receive one
+ * samples frame per poll cycle. Each frame is encoded once and shared by
+ * all subscribers. Every subscriber has its own bounded queue, when a slow
+ * subscriber's queue is full its oldest samples frame is dropped, so the
+ * poll path never waits for a subscriber. Catalog frames are never dropped
+ * unless superseded by the next one.
+ *
+ * A catalog frame mapping point ids to names is sent on connect and
+ * whenever a new point shows up. All integers are in host byte order.
+ * Samples carry the quality of the point, failed reads and points gone
+ * stale are sent as their last good value with the quality set.
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define PUBLISH_SOCKET_PATH "/tmp/rs232.sock"
+#define PUBLISH_MAGIC (0x504d5352) /* "RSMP" */
+#define PUBLISH_VERSION (3)
+
+/* Max number of frames queued per subscriber */
+#define PUBLISH_QUEUE_LEN (32)
+
+#define PUBLISH_MAX_SUBSCRIBERS (64)
+
+/******************** TYPE DEFINITION SECTION *********************************/
+
+enum publish_frame_type
+{
+    PUBLISH_TYPE_SAMPLES = 1,
+    PUBLISH_TYPE_CATALOG = 2
+};
+
+/**
+ * Header of every frame.
+ */
+struct publish_header
+{
+    guint32 magic;
+    guint8 version;
+    guint8 type;            /* enum publish_frame_type */
+    guint16 count;          /* Number of samples or catalog entries */
+    guint32 sequence;       /* Poll cycle, gaps mean dropped frames */
+    guint32 reserved;
+    gint64 timestamp_us;    /* Monotonic time of the poll cycle */
+    value_time received;    /* Receive time of the samples, 0 if unknown */
+} __attribute__((packed));
+
+/**
+ * Samples frame entry.
+ */
+struct publish_sample
+{
+    guint16 point;          /* Value cache point id */
+    guint8 quality;         /* enum value_quality, value is the last good */
+    guint8 exception;       /* Exception code, VALUE_EXCEPTION */
+    gdouble value;
+} __attribute__((packed));
+
+/**
+ * Catalog frame entry, followed by name_len bytes of name.
+ */
+struct publish_catalog_entry
+{
+    guint16 point;
+    guint8 name_len;
+} __attribute__((packed));
+
+/**
+ * Publisher counters.
+ */
+struct publish_stats
+{
+    guint subscribers;
+    guint64 frames;         /* Samples frames encoded */
+    guint64 sent;           /* Frames delivered, over all subscribers */
+    guint64 dropped;        /* Frames dropped, over all subscribers */
+};
+
+/******************** GLOBAL FUNCTION DECLARATION SECTION *********************/
+
+/**
+ * Start listening for subscribers on a Unix socket at path.
+ *
+ * @return TRUE on success, FALSE on any kind of error.
+ */
+gboolean publish_init(const gchar *path);
+
+/**
+ * Disconnect all subscribers and remove the socket.
+ */
+void publish_cleanup(void);
+
+/**
+ * Add a sample to the batch of the current poll cycle, with the current
+ * quality of the point.
+ */
+void publish_sample(gint point, gdouble value);
+
+/**
+ * Set receive time of the samples of the current poll cycle.
+ */
+void publish_set_received(const value_time *time);
+
+/**
+ * End of poll cycle, send the batch to all subscribers.
+ */
+void publish_commit(void);
+
+/**
+ * Get publisher counters.
+ */
+void publish_get_stats(struct publish_stats *stats);
+
+#endif // INCLUSION_GUARD_PUBLISH_H
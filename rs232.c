@@ -7,8 +7,11 @@
 */
 
 #include <glib.h>
+#include <glib-unix.h>
 #include <gio/gio.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
 
 /* Serial port includes */
 #include <stdio.h>
@@ -18,16 +21,228 @@
 #include <fcntl.h>
 
 #include "modbus.h"
+#include "modbus_slave.h"
 #include "overlay.h"
+#include "capture.h"
+#include "lineproto.h"
+#include "values.h"
+#include "events.h"
+#include "publish.h"
+#include "share.h"
+#include "state.h"
+#include "startup.h"
+#include "template.h"
+#include "derive.h"
+#include "alarm.h"
+#include "ticker.h"
+#include "config.h"
+#include "bridge.h"
+#include "probe.h"
+#include "profile.h"
+#include "metadata_pair.h"
 
-#define OVERLAY_BUF_SIZE (64)
-#define OVERLAY_STR_SIZE (OVERLAY_BUF_SIZE -1)
+/* Overlay text in modbus mode, see template.h for the syntax */
+#define OVERLAY_TEMPLATE "[{Reads}] REG1-bits: {REG1:b4} REG2-bits: {REG2:b8}"
+
+/* Serial traffic capture, dumped on SIGUSR1 and at exit */
+#define CAPTURE_RING_SIZE (256 * 1024)
+#define CAPTURE_PATH "/tmp/rs232.cap"
+
+/* Last known values, restored at startup */
+#define STATE_DIR "/usr/local/packages/rs232/localdata"
+#define STATE_PATH STATE_DIR "/rs232.state"
+
+/* Port, poll plan and overlay settings, reloaded when changed */
+#define CONFIG_PATH STATE_DIR "/rs232.conf"
+
+/* Use 4-bit palette overlay, saves memory and bandwidth for plain text */
+#define OVERLAY_PALETTE FALSE
+
+/* Let other local tools run modbus transactions on the port, see share.h */
+#define SHARE_SERIAL_PORT TRUE
+
+/* Raw access to the port for vendor tools, see bridge.h. Polling pauses
+ * while a session is active. Off by default, anyone who can connect can
+ * write to the port. Sessions go through the Unix socket, the TCP port on
+ * loopback is only opened with BRIDGE_OVER_TCP, e.g. for an SSH tunnel.
+ */
+#define BRIDGE_SERIAL_PORT FALSE
+#define BRIDGE_OVER_TCP FALSE
+
+/* Modbus poll period, kept on a fixed grid, and interval of the poll
+ * jitter report in the log
+ */
+#define POLL_INTERVAL_MS (500)
+#define JITTER_REPORT_INTERVAL_S (300)
+
+/* Polled registers go stale when not updated for this many poll intervals */
+#define POLL_STALE_CYCLES (3)
+
+/* Protocol spoken on the serial port */
+#define SERIAL_PROTOCOL PROTOCOL_MODBUS_RTU
+
+/* Port settings and overlay refresh interval for line protocol mode */
+#define LINE_DEVICE "/dev/ttyS1"
+#define LINE_BAUD B115200
+#define LINE_OVERLAY_INTERVAL_MS (500)
+
+/* Port settings and image size in modbus slave mode, frame gap is 3.5
+ * characters of 11 bits at SLAVE_BAUD. Registers are synced with the value
+ * cache every SLAVE_SYNC_INTERVAL_MS.
+ */
+#define SLAVE_DEVICE "/dev/ttyS1"
+#define SLAVE_ADDRESS (0x01)
+#define SLAVE_BAUD B9600
+#define SLAVE_FRAME_GAP_US (4010)
+#define SLAVE_REGISTERS (64)
+#define SLAVE_SYNC_INTERVAL_MS (100)
+
+/* Retry interval bounds when bringing up the serial port or overlay fails */
+#define STARTUP_RETRY_MIN_MS (500)
+#define STARTUP_RETRY_MAX_MS (10000)
+
+enum serial_protocol {
+    PROTOCOL_MODBUS_RTU,
+    PROTOCOL_MODBUS_SLAVE,
+    PROTOCOL_LINE
+};
+
+/**
+* Fields extracted in line protocol mode, here position and fix quality
+* from NMEA GGA sentences.
+*/
+static const struct lineproto_field line_fields[] = {
+    { "Time",       "$GPGGA", ',', 1 },
+    { "Latitude",   "$GPGGA", ',', 2 },
+    { "Longitude",  "$GPGGA", ',', 4 },
+    { "Satellites", "$GPGGA", ',', 7 },
+};
+
+/**
+* Registers served in modbus slave mode. Input registers follow the value
+* cache, holding registers written by the master show up as values.
+*/
+static const struct {
+    const gchar *point;
+    enum modbus_slave_table table;
+    guint16 address;
+} slave_registers[] = {
+    { "REG1",       MODBUS_SLAVE_INPUT,   0 },
+    { "REG2",       MODBUS_SLAVE_INPUT,   1 },
+    { "Setpoint",   MODBUS_SLAVE_HOLDING, 0 },
+    { "Mode",       MODBUS_SLAVE_HOLDING, 1 },
+};
+
+/**
+* Derived channels, see derive.h for the expression syntax. Here the two
+* input registers combined into one 32 bit value.
+*/
+static const struct derive_channel derived_channels[] = {
+    { "REG", "REG1 << 16 | REG2" },
+};
+
+/**
+* Alarm rules, alarms color the value lines in the overlay. In modbus mode
+* only points with rules get a line of their own.
+*/
+static const struct alarm_rule alarm_rules[] = {
+    /* point, condition, threshold, hysteresis, on/off delay ms, level,
+     * hide when normal */
+    { "REG1", ALARM_ABOVE, 8, 1, 2000, 5000, ALARM_LEVEL_WARNING, FALSE },
+    { "REG1", ALARM_ABOVE, 12, 1, 0, 5000, ALARM_LEVEL_CRITICAL, FALSE },
+};
+
+/**
+* Result of opening the serial port in a worker thread
+*/
+struct serial_open {
+    struct modbus *modbus;  /* PROTOCOL_MODBUS_RTU, PROTOCOL_MODBUS_SLAVE */
+    int fd;                 /* PROTOCOL_LINE */
+
+    /* PROTOCOL_MODBUS_RTU port settings, copied on the main thread */
+    gchar device[CONFIG_DEVICE_SIZE];
+    speed_t baud;
+    enum parity parity;
+    guint address;
+    enum modbus_framing framing;
+    guint generation;       /* port_generation when started */
+};
+
+/**
+* Compiled-in configuration, see config.h for overriding it in CONFIG_PATH
+*/
+static const struct config default_config = {
+    .device           = "/dev/ttyS1",
+    .baud             = 9600,
+    .parity           = PARITY_EVEN,
+    .address          = 0x01,
+    .framing          = MODBUS_FRAMING_RTU,
+    .poll_interval_ms = POLL_INTERVAL_MS,
+    .register_start   = 10,
+    .registers        = { "REG1", "REG2" },
+    .n_registers      = 2,
+    .latch_value      = 1,
+    .latch_delay_ms   = 50,
+    .overlay_template = OVERLAY_TEMPLATE,
+};
 
 /**
 * Handle for overlay instance
 */
 static overlay_handle ovl_handle = NULL;
 
+/**
+* Compiled OVERLAY_TEMPLATE
+*/
+static struct template *overlay_template = NULL;
+
+/**
+* Serial port, NULL until opened
+*/
+static struct modbus *modbus = NULL;
+static struct lineproto *lp = NULL;
+static struct modbus_slave *slave = NULL;
+
+/**
+* Modbus poll timer
+*/
+static struct ticker *poll_ticker = NULL;
+
+/**
+* Bumped when the port settings change, a port opened with older settings
+* is closed and opened again
+*/
+static guint port_generation = 0;
+
+/**
+* Time of the last successful poll, and set by a configuration reload, to
+* log the polling gap across the reload
+*/
+static gint64 last_poll_us = 0;
+static gboolean reloaded = FALSE;
+
+/**
+* Capability probe of a slave while it runs, the addresses probed or found
+* in the cache since the port opened, and the read plan of the selected
+* slave: registers per read and delay between the reads of a poll
+*/
+static struct probe *probe = NULL;
+static guint probe_timer = 0;
+static guint probe_address = 0;
+static guint64 probe_tried[4];
+static guint read_max = PROBE_MAX_READ;
+static guint read_gap_us = 0;
+
+/**
+* Pending read of the snapshots latched by a broadcast, see LatchRegister
+*/
+static guint latch_timer = 0;
+
+static gboolean serial_opening = FALSE;
+static guint serial_retry_timer = 0;
+static guint serial_retry_ms = 0;
+static guint overlay_retry_ms = 0;
+
 
 /*********************** INTERNAL FUNCTION DECLARATIONS ***********************/
 
@@ -41,31 +256,604 @@ static int lily_init_modbus(struct modbus **modbus);
 
 /*
  *
- * Timer function used to poll humidity / temperature data
+ * Read n input registers from start in reads of at most read_max registers.
+ * Returns the registers, NULL on failure with the cause in error, and the
+ * time of the whole reply.
+ */
+static uint16_t *read_registers(struct modbus *m, guint start, guint n,
+                                value_time *received,
+                                enum modbus_error *error);
+
+/*
+ *
+ * Run the next step of the capability probe, starting one for the next
+ * slave of the poll plan not probed yet
+ */
+static void run_probe_step(struct modbus *m);
+
+/*
+ *
+ * Timer function used to run a probe step that has to follow the last one
+ * after a delay
+ */
+static gboolean on_probe_timer(gpointer user_data);
+
+/*
+ *
+ * Run the probe step once a transaction of a local client is done
+ */
+static void on_shared_probe(gpointer user_data);
+
+/*
+ *
+ * Create a probe for the first slave not tried since the port opened
+ *
+ * @return FALSE if all slaves are tried.
+ */
+static gboolean start_probe(const struct config *config);
+
+/*
+ *
+ * Read the registers of the slaves in config->slaves into the value cache
+ *
+ * @return Number of slaves that answered.
+ */
+static guint read_slaves(struct modbus *m, const struct config *config);
+
+/*
+ *
+ * Address reads to a slave with its probed response timeout and read plan,
+ * the defaults until it is probed
+ */
+static void select_slave(struct modbus *m, guint address);
+
+/*
+ *
+ * Log probed capabilities of a slave
+ */
+static void log_capabilities(const struct probe_result *caps);
+
+/*
+ *
+ * Open and configure the modbus serial port, called from a worker thread.
+ */
+static struct modbus *lily_open_modbus(const struct serial_open *port);
+
+/*
+ *
+ * Store a register value in the value cache, events and sample publisher
+ */
+static void store_register(const char *name, uint16_t value,
+                           const value_time *received);
+
+/*
+ *
+ * Set quality of the register points of a slave from a read error, with
+ * the exception code of the last response of m. The primary slave's points
+ * have no address suffix.
+ */
+static void mark_failed(struct modbus *m, const struct config *config,
+                        guint address, gboolean primary,
+                        enum modbus_error error);
+
+/*
+ *
+ * Hand the last value and new quality of a point to events and subscribers
+ */
+static void export_quality(gint point);
+
+/*
+ *
+ * Update the modbus mode overlay with a good poll received at received,
+ * NULL only shows changed quality marks and alarms
+ */
+static void update_overlay(const value_time *received);
+
+/*
+ *
+ * Update derived values and alarms from the changed values, then hand all
+ * of them to events and subscribers
+ */
+static void commit_values(void);
+
+/*
+ *
+ * Hand the values of a finished poll cycle to events and subscribers
+ */
+static void end_poll_cycle(void);
+
+/*
+ *
+ * Hand a derived value with changed value or quality to subscribers
+ */
+static void store_derived(gint point, gdouble value);
+
+/*
+ *
+ * Log alarm level changes
+ */
+static void on_alarm(gint point, enum alarm_level level);
+
+/*
+ *
+ * Tick function used to poll humidity / temperature data
+ */
+static void on_poll_tick(gpointer user_data);
+
+/**
+ * (Re)start polling at the configured interval.
+ */
+static void start_polling(void);
+
+/**
+ * Apply changed parts of a reloaded configuration.
+ */
+static void on_config_changed(const struct config *config, guint changed);
+
+/*
+ *
+ * Timer function used to poll when no ticker is available
  */
 static gboolean
 on_timeout(gpointer user_data);
 
+/*
+ *
+ * Timer function used to log the achieved poll period
+ */
+static gboolean
+on_jitter_report(gpointer user_data);
+
+/*
+ *
+ * Format UTC receive time for the overlay
+ */
+static const gchar *format_received(const value_time *received);
+
+/*
+ *
+ * Poll once the bus is free of shared transactions
+ */
+static void on_shared_poll(gpointer user_data);
+
+/*
+ *
+ * Start a poll cycle, with a broadcast latch if configured
+ */
+static void start_poll_cycle(struct modbus **modbus);
+
+/*
+ *
+ * Timer function used to read the slaves once their snapshots are latched
+ */
+static gboolean on_latched(gpointer user_data);
+
+static void on_shared_latched(gpointer user_data);
+
+/**
+ * File descriptor for port sharing, -1 if local clients can not use it.
+ */
+static int shared_fd(void);
+
+/**
+ * Pause polling and port sharing while a bridge session is active.
+ */
+static void on_bridge_session(gboolean active, gpointer user_data);
+
+/*
+ *
+ * Timer function used to sync the value cache with the slave register image
+ */
+static gboolean
+on_slave_sync(gpointer user_data);
+
+/*
+ *
+ * Open serial port in a worker thread, result is handled in the main loop
+ */
+static void start_serial(void);
+
+static gpointer serial_open_thread(gpointer data);
+
+static gboolean on_serial_opened(gpointer user_data);
+
+static gboolean on_serial_retry(gpointer user_data);
+
+/*
+ *
+ * Open the serial port again after the retry interval, reason is logged
+ */
+static void retry_serial(const gchar *reason);
+
+/*
+ *
+ * Initialize overlay, retried in the background on failure
+ */
+static gboolean start_overlay(gpointer user_data);
+
+/*
+ *
+ * Double retry interval, within STARTUP_RETRY_MIN_MS..STARTUP_RETRY_MAX_MS
+ */
+static guint next_retry_interval(guint *retry_ms);
+
+/*
+ *
+ * Serial port input handler in line protocol mode
+ */
+static gboolean
+on_line_input(gint fd, GIOCondition condition, gpointer user_data);
+
+/*
+ *
+ * Timer function used to show line protocol values in the overlay
+ */
+static gboolean
+on_line_overlay(gpointer user_data);
+
+/*
+ *
+ * Show all values of the value cache in the overlay
+ */
+static void show_values(void);
+
+/*
+ *
+ * Overlay lines for values, styled after their alarm state
+ */
+static GList *value_lines(gboolean alarm_points_only);
+
+/*
+ *
+ * Signal handler used to dump the serial traffic capture and the main loop
+ * callback statistics
+ */
+static gboolean
+on_capture_dump(gpointer user_data);
+
+
+/*********************** INTERNAL FUNCTION DEFINITIONS ************************/
+
+static int lily_init_modbus(struct modbus **modbus)
+{
+    g_assert(modbus);
+
+    if (*modbus) {
+        bridge_set_fd(-1);
+        share_set_fd(-1);
+        modbus_close_device(modbus);
+    }
+    probe_free(&probe);
+    memset(probe_tried, 0, sizeof(probe_tried));
+
+    if (probe_timer) {
+        g_source_remove(probe_timer);
+        probe_timer = 0;
+    }
+
+    if (latch_timer) {
+        g_source_remove(latch_timer);
+        latch_timer = 0;
+    }
+
+    g_message("------------REINIT SERIAL PORT------------------------");
+
+    /* Polling pauses until the port has been reopened */
+    start_serial();
+
+    return 0;
+}
+
+static struct modbus *lily_open_modbus(const struct serial_open *port)
+{
+    struct modbus *m = modbus_init_device(port->device,
+                                          port->address,
+                                          port->parity,
+                                          port->baud,
+                                          0 /* No stop bit */);
+
+    if (m && modbus_set_framing(m, port->framing)) {
+        modbus_close_device(&m);
+    }
+
+    return m;
+}
+
+static uint16_t *read_registers(struct modbus *m, guint start, guint n,
+                                value_time *received,
+                                enum modbus_error *error)
+{
+    uint16_t *regs = g_new(uint16_t, n);
+    guint done = 0;
+
+    while (done < n) {
+        guint count = MIN(n - done, read_max);
+        size_t got = 0;
+        uint16_t *chunk = NULL;
+
+        if (done && read_gap_us) {
+            g_usleep(read_gap_us);
+        }
+
+        if (!modbus_read_input_registers(m, start + done, count)) {
+            chunk = modbus_parse_input_registers(m, &got);
+        }
+
+        if (!chunk) {
+            *error = modbus_get_error(m, NULL);
+            g_free(regs);
+            return NULL;
+        }
+        memcpy(regs + done, chunk, count * sizeof(*regs));
+        g_free(chunk);
+
+        /* Received from the first byte of the first reply to the last byte
+         * of the last one
+         */
+        struct modbus_rx_time rx;
+        modbus_get_rx_time(m, &rx);
+
+        if (!done) {
+            received->first_us     = rx.first_us;
+            received->first_utc_us = rx.first_utc_us;
+        }
+        received->last_us     = rx.last_us;
+        received->last_utc_us = rx.last_utc_us;
+
+        done += count;
+    }
+
+    return regs;
+}
+
+static guint read_slaves(struct modbus *m, const struct config *config)
+{
+    guint n_answered = 0;
+    guint k = 0;
+
+    for (; k < config->n_slaves; k++) {
+        guint address = config->slaves[k];
+        value_time received;
+
+        if (read_gap_us) {
+            g_usleep(read_gap_us);
+        }
+
+        select_slave(m, address);
+        enum modbus_error error;
+        uint16_t *regs = read_registers(m, config->register_start,
+                                        config->n_registers, &received,
+                                        &error);
+
+        /* One slave not answering does not take the others down */
+        if (!regs) {
+            g_message("No response from slave %u", address);
+            mark_failed(m, config, address, FALSE, error);
+            continue;
+        }
+
+        guint i = 0;
+        for (; i < config->n_registers; i++) {
+            gchar name[VALUES_NAME_SIZE];
+
+            g_snprintf(name, sizeof(name), "%s.%u", config->registers[i],
+                address);
+            store_register(name, regs[i], &received);
+        }
+        g_free(regs);
+        n_answered++;
+    }
+
+    select_slave(m, config->address);
+
+    return n_answered;
+}
+
+static void select_slave(struct modbus *m, guint address)
+{
+    const struct config *config = config_get();
+    const struct probe_result *caps = probe_lookup(address, config->baud,
+        config->framing);
+
+    modbus_set_device_address(m, address);
+    modbus_set_response_timeout(m, caps ? caps->timeout_ms :
+                                MODBUS_RESPONSE_TIMEOUT_MS);
+    read_max    = caps && caps->max_read ? caps->max_read : PROBE_MAX_READ;
+    read_gap_us = caps ? caps->min_gap_us : 0;
+}
+
+static void log_capabilities(const struct probe_result *caps)
+{
+    g_message("Slave 0x%02x: %s %s %s, functions 0x%016llx, %u registers "
+        "per read, %u us between reads, latency %u us (max %u us), "
+        "timeout %u ms", caps->address, caps->vendor, caps->product,
+        caps->revision, (unsigned long long) caps->functions,
+        caps->max_read, caps->min_gap_us, caps->latency_us,
+        caps->latency_max_us, caps->timeout_ms);
+}
+
+static gboolean start_probe(const struct config *config)
+{
+    guint k = 0;
+
+    /* The slave at Address first, then the others in the plan */
+    for (; k <= config->n_slaves; k++) {
+        guint address = k ? config->slaves[k - 1] : config->address;
+        guint64 bit = G_GUINT64_CONSTANT(1) << (address % 64);
+
+        if (probe_tried[address / 64] & bit) {
+            continue;
+        }
+        probe_tried[address / 64] |= bit;
+
+        /* A slave is probed once, then the cached result is used */
+        const struct probe_result *caps = probe_lookup(address,
+            config->baud, config->framing);
+
+        if (caps) {
+            log_capabilities(caps);
+            continue;
+        }
+
+        probe = probe_new(address, config->baud, config->framing,
+                          config->register_start);
+        probe_address = address;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void run_probe_step(struct modbus *m)
+{
+    const struct config *config = config_get();
+    guint32 delay_us;
+
+    if (probe_timer) {
+        g_source_remove(probe_timer);
+        probe_timer = 0;
+    }
+
+    if (!probe && !start_probe(config)) {
+        return;
+    }
+
+    select_slave(m, probe_address);
+
+    if (!probe_step(probe, m)) {
+        const struct probe_result *caps = probe_get_result(probe);
+
+        if (caps) {
+            probe_store(caps);
+            log_capabilities(caps);
+        }
+        probe_free(&probe);
+    }
+
+    /* Polls start at the slave at Address, with its plan if just probed */
+    select_slave(m, config->address);
+
+    /* Delays being tried are waited out on a timer, not on the main loop */
+    if (probe && probe_get_delay(probe, &delay_us)) {
+        probe_timer = profile_timeout_add("probe step",
+                                          (delay_us + 999) / 1000,
+                                          on_probe_timer, &modbus);
+    }
+}
+
+static gboolean on_probe_timer(gpointer user_data)
+{
+    struct modbus **modbus = user_data;
+
+    probe_timer = 0;
+
+    /* A poll in progress runs the next step itself when done */
+    if (*modbus && !latch_timer && !bridge_active() &&
+        share_claim(on_shared_probe, modbus)) {
+        run_probe_step(*modbus);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static void on_shared_probe(gpointer user_data)
+{
+    struct modbus **modbus = user_data;
+
+    if (*modbus && probe && !bridge_active()) {
+        run_probe_step(*modbus);
+    }
+}
+
+static void store_register(const char *name, uint16_t value,
+                           const value_time *received)
+{
+    const struct config *config = config_get();
+    gint point = values_add_point(name);
+
+    values_set_number(point, value);
+    values_set_received(point, received);
+    values_set_max_age(point, POLL_STALE_CYCLES * config->poll_interval_ms +
+                       (config->latch ? config->latch_delay_ms : 0));
+    events_update(point, value);
+    publish_sample(point, value);
+}
+
+static void mark_failed(struct modbus *m, const struct config *config,
+                        guint address, gboolean primary,
+                        enum modbus_error error)
+{
+    static const enum value_quality qualities[] = {
+        [MODBUS_ERROR_NONE]      = VALUE_GOOD,
+        [MODBUS_ERROR_TIMEOUT]   = VALUE_TIMEOUT,
+        [MODBUS_ERROR_CRC]       = VALUE_CRC_ERROR,
+        [MODBUS_ERROR_FRAME]     = VALUE_FRAME_ERROR,
+        [MODBUS_ERROR_EXCEPTION] = VALUE_EXCEPTION,
+    };
+    unsigned char exception = 0;
+    guint i = 0;
+
+    g_assert(error != MODBUS_ERROR_NONE);
+    modbus_get_error(m, &exception);
+
+    for (; i < config->n_registers; i++) {
+        gchar name[VALUES_NAME_SIZE];
+
+        if (primary) {
+            g_strlcpy(name, config->registers[i], sizeof(name));
+        } else {
+            g_snprintf(name, sizeof(name), "%s.%u", config->registers[i],
+                address);
+        }
+
+        /* Never read, nothing to mark */
+        gint point = values_lookup(name);
+        if (point < 0) {
+            continue;
+        }
+
+        values_set_quality(point, qualities[error], exception);
+        export_quality(point);
+    }
+}
+
+static void export_quality(gint point)
+{
+    gdouble number = values_get(point)->number;
 
-/*********************** INTERNAL FUNCTION DEFINITIONS ************************/
+    events_update(point, number);
+    publish_sample(point, number);
+}
 
-static int lily_init_modbus(struct modbus **modbus)
+static void store_derived(gint point, gdouble value)
 {
-    g_assert(modbus);
+    publish_sample(point, value);
+}
 
-    if (*modbus) {
-        modbus_close_device(modbus);
-    }
+static void on_alarm(gint point, enum alarm_level level)
+{
+    static const gchar *level_names[] = {
+        [ALARM_LEVEL_NONE]     = "cleared",
+        [ALARM_LEVEL_WARNING]  = "warning",
+        [ALARM_LEVEL_CRITICAL] = "critical",
+    };
 
-    g_message("------------REINIT SERIAL PORT------------------------");
+    g_message("Alarm on %s: %s (value %s)", values_get(point)->name,
+        level_names[level], values_get(point)->text);
+}
 
-    *modbus = modbus_init_device("/dev/ttyS1",
-                                 0x01,
-                                 PARITY_EVEN,
-                                 B9600,
-                                 0 /* No stop bit */);
+static void commit_values(void)
+{
+    derive_update();
+    alarm_update();
+    events_commit();
+    publish_commit();
+}
 
-    return 0;
+static void end_poll_cycle(void)
+{
+    startup_mark(STARTUP_FIRST_SAMPLE);
+    commit_values();
 }
 
 static float lily_read_humidity_data(struct modbus **modbus)
@@ -74,80 +862,635 @@ static float lily_read_humidity_data(struct modbus **modbus)
     g_assert(*modbus);
 
     struct modbus *m = *modbus;
-    /* Read input register starting at 0 and just the first register */
-    modbus_read_input_registers(m, 10, 2);
+    const struct config *config = config_get();
+    value_time received;
+    enum modbus_error error;
 
-    /* Wait for device to process data */
-    usleep(50000);
+    /* Read the configured block of input registers */
+    uint16_t *regs = read_registers(m, config->register_start,
+                                    config->n_registers, &received, &error);
 
     static unsigned int n_reads    = 0;
     static unsigned int n_failures = 0;
-    uint16_t reg1;
-    uint16_t reg2;
-
-    size_t nregs;
-    uint16_t *regs = modbus_parse_input_registers(m, &nregs);
 
     if (regs) {
-        reg1 = regs[0];
-        g_message("[%d, %d] Got Reg1 0x%04x",
-            n_reads % 10, n_failures % 5, reg1);
-
-        int bit1 = (reg1 & 0x01) != 0;
-        int bit2 = (reg1 & (0x01 << 1)) != 0;
-        int bit3 = (reg1 & (0x01 << 2)) != 0;
-        int bit4 = (reg1 & (0x01 << 3)) != 0;
-
-        /* Finally update the dynamic overlay with the humidity data */
-        char str[OVERLAY_BUF_SIZE];
-        g_snprintf(str, sizeof(str), "[%d] REG1-bits: %d%d%d%d", (++n_reads) % 10, bit1, bit2, bit3, bit4);
-
-        if (nregs > 1) {
-            reg2 = regs[1];
-            g_message("[%d] Got Reg2 0x%04x", n_reads % 10,
-                reg2);
-            
-            bit1 = (reg2 & 0x01) != 0;
-            bit2 = (reg2 & (0x01 << 1)) != 0;
-            bit3 = (reg2 & (0x01 << 2)) != 0;
-            bit4 = (reg2 & (0x01 << 3)) != 0;
-            int bit5 = (reg2 & (0x01 << 4)) != 0;
-            int bit6 = (reg2 & (0x01 << 5)) != 0;
-            int bit7 = (reg2 & (0x01 << 6)) != 0;
-            int bit8 = (reg2 & (0x01 << 7)) != 0;
-
-
-            snprintf(&str[strlen(str)], sizeof(str), " REG2-bits: %d%d%d%d%d%d%d%d",
-                bit1, bit2, bit3, bit4, bit5, bit6, bit7, bit8);
-        }
-
-        overlay_set_data(ovl_handle, NULL, "RS232", str);
-        g_free(regs);
+        publish_set_received(&received);
+
+        if (reloaded && last_poll_us) {
+            g_message("Polling gap across reload %lld ms",
+                (long long) (received.last_us - last_poll_us) / 1000);
+        }
+        reloaded = FALSE;
+        last_poll_us = received.last_us;
+
+        size_t i = 0;
+        for (; i < config->n_registers; i++) {
+            store_register(config->registers[i], regs[i], &received);
+            g_message("[%d, %d] Got %s 0x%04x", n_reads % 10,
+                n_failures % 5, config->registers[i], regs[i]);
+        }
     } else {
+        /* Keep the last values, marked with why they are not updated */
+        mark_failed(m, config, config->address, TRUE, error);
         n_failures++;
-        /* Re-init serial port in case something went wrong */
-        if (n_failures && n_failures % 5) {
-            lily_init_modbus(modbus);
-        }
+    }
+
+    /* The other slaves are read either way, their snapshots are latched
+     * already
+     */
+    guint n_answered = read_slaves(m, config) + (regs != NULL);
+
+    if (n_answered) {
+        /* Read counter, shows in the overlay that polling is alive */
+        values_set_number(values_add_point("Reads"), (++n_reads) % 10);
+        end_poll_cycle();
+    } else {
+        /* Derived channels and alarms take on the quality of the failed
+         * inputs
+         */
+        commit_values();
+    }
+
+    /* Finally update the dynamic overlay with the register data */
+    update_overlay(regs ? &received : NULL);
+    g_free(regs);
+
+    /* Re-init serial port in case something went wrong, once the cycle is
+     * done. A port some slave answered on is fine.
+     */
+    if (!n_answered && n_failures % 5) {
+        lily_init_modbus(modbus);
+    }
+
+    /* Probe the slaves a step at a time, after the poll to keep the
+     * sampling on its grid
+     */
+    if (*modbus) {
+        run_probe_step(*modbus);
     }
 
     return 0;
 }
 
+static void update_overlay(const value_time *received)
+{
+    static guint32 shown_alarms = 0;
+    static value_time shown_received;
+
+    if (!overlay_template) {
+        return;
+    }
+
+    /* Only fields that changed are rendered again */
+    gboolean changed = template_update(overlay_template) ||
+        alarm_generation() != shown_alarms;
+
+    /* A good poll always refreshes the time and restarts the overlay
+     * timeout, unchanged values would otherwise be hidden as if polling had
+     * stopped. Failures leave the timeout running.
+     */
+    if (received) {
+        shown_received = *received;
+    }
+
+    if (received || changed) {
+        GList *list = value_lines(TRUE);
+
+        shown_alarms = alarm_generation();
+        overlay_set_data(ovl_handle, list, format_received(&shown_received),
+            template_get_text(overlay_template));
+        mdp_destroy_list(&list);
+    }
+}
+
+static void on_poll_tick(gpointer user_data)
+{
+    g_assert(user_data);
+
+    struct modbus **modbus = user_data;
+
+    /* Values not updated in time go stale also when no poll gets through,
+     * e.g. while the port is reopened or a bridge session runs
+     */
+    if (values_expire(g_get_monotonic_time(), export_quality)) {
+        commit_values();
+        update_overlay(NULL);
+    }
+
+    /* Port is not open yet or being reopened, handed to a bridge session,
+     * or busy with a transaction of a local client, then polled as soon as
+     * that is done.
+     */
+    if (*modbus && !bridge_active() && share_claim(on_shared_poll, modbus)) {
+        start_poll_cycle(modbus);
+    }
+}
+
+static void start_poll_cycle(struct modbus **modbus)
+{
+    const struct config *config = config_get();
+
+    if (!config->latch) {
+        lily_read_humidity_data(modbus);
+        return;
+    }
+
+    /* Still waiting for the last snapshot, LatchDelay is longer than the
+     * poll interval
+     */
+    if (latch_timer) {
+        return;
+    }
+
+    /* All slaves take their snapshot at the same time, so their processing
+     * delays overlap and the reads after it are answered right away. The
+     * bus is free for shared transactions meanwhile.
+     */
+    if (modbus_broadcast_write_register(*modbus, config->latch_register,
+                                        config->latch_value)) {
+        lily_read_humidity_data(modbus);
+        return;
+    }
+
+    latch_timer = profile_timeout_add("poll latch", config->latch_delay_ms,
+                                      on_latched, modbus);
+}
+
+static gboolean on_latched(gpointer user_data)
+{
+    struct modbus **modbus = user_data;
+
+    latch_timer = 0;
+
+    if (*modbus && !bridge_active() &&
+        share_claim(on_shared_latched, modbus)) {
+        lily_read_humidity_data(modbus);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static void on_shared_latched(gpointer user_data)
+{
+    struct modbus **modbus = user_data;
+
+    if (*modbus && !bridge_active()) {
+        lily_read_humidity_data(modbus);
+    }
+}
+
 /*
  * This function will increase our timer and print the current value to stdout.
  */
 static gboolean
 on_timeout(gpointer user_data)
 {
-    g_assert(user_data);
+    on_poll_tick(user_data);
+
+    /* Return FALSE if the event source should be removed */
+    return TRUE;
+}
+
+static gboolean
+on_jitter_report(gpointer user_data)
+{
+    if (poll_ticker) {
+        ticker_report(poll_ticker, "Poll");
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void start_polling(void)
+{
+    static guint fallback = 0;
+    guint interval_ms = config_get()->poll_interval_ms;
+
+    if (poll_ticker) {
+        ticker_report(poll_ticker, "Poll");
+        ticker_free(&poll_ticker);
+    }
+    if (fallback) {
+        g_source_remove(fallback);
+        fallback = 0;
+    }
+
+    /* Poll on a fixed grid, a slow poll does not shift the next */
+    poll_ticker = ticker_new(interval_ms, on_poll_tick, &modbus);
+    if (!poll_ticker) {
+        fallback = profile_timeout_add("poll timeout", interval_ms, on_timeout,
+                                       &modbus);
+    }
+}
+
+static void on_config_changed(const struct config *config, guint changed)
+{
+    if (SERIAL_PROTOCOL != PROTOCOL_MODBUS_RTU) {
+        return;
+    }
+
+    reloaded = TRUE;
+
+    if (changed & CONFIG_OVERLAY) {
+        struct template *tpl = template_new(config->overlay_template);
+
+        /* Keep showing the old overlay rather than a broken one. A new
+         * template renders as changed, the next poll draws it.
+         */
+        if (tpl) {
+            template_free(&overlay_template);
+            overlay_template = tpl;
+        } else {
+            g_warning("Invalid overlay template, keeping the old one");
+        }
+    }
+
+    if (changed & CONFIG_PLAN) {
+        /* The register map is read on every poll, only the timer needs
+         * restarting and only when the interval changed.
+         */
+        if (!poll_ticker ||
+            ticker_get_period_ms(poll_ticker) != config->poll_interval_ms) {
+            start_polling();
+        }
+    }
+
+    if (changed & CONFIG_PORT) {
+        port_generation++;
+        lily_init_modbus(&modbus);
+    }
+}
+
+static const gchar *format_received(const value_time *received)
+{
+    static gchar text[32];
+    time_t seconds = received->last_utc_us / G_USEC_PER_SEC;
+    struct tm tm;
+
+    if (!received->last_utc_us || !gmtime_r(&seconds, &tm)) {
+        return "RS232";
+    }
+
+    gsize len = strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &tm);
+    g_snprintf(text + len, sizeof(text) - len, ".%03d",
+        (int) (received->last_utc_us / 1000 % 1000));
 
+    return text;
+}
+
+static void on_shared_poll(gpointer user_data)
+{
     struct modbus **modbus = user_data;
 
-    lily_read_humidity_data(modbus);
+    if (*modbus && !bridge_active()) {
+        start_poll_cycle(modbus);
+    }
+}
+
+static int shared_fd(void)
+{
+    /* Local clients send RTU frames, they can not share an ASCII port */
+    if (modbus_get_framing(modbus) != MODBUS_FRAMING_RTU) {
+        return -1;
+    }
+
+    return modbus_get_fd(modbus);
+}
 
-    /* Return FALSE if the event source should be removed */
-    return TRUE;
+static void on_bridge_session(gboolean active, gpointer user_data)
+{
+    if (active) {
+        g_message("Polling paused for bridge session");
+        share_set_fd(-1);
+        return;
+    }
+
+    if (modbus) {
+        /* Drop what the session left behind before polling again */
+        tcflush(modbus_get_fd(modbus), TCIOFLUSH);
+        share_set_fd(shared_fd());
+    }
+    g_message("Polling resumed after bridge session");
+}
+
+static guint next_retry_interval(guint *retry_ms)
+{
+    *retry_ms = CLAMP(*retry_ms * 2, STARTUP_RETRY_MIN_MS,
+        STARTUP_RETRY_MAX_MS);
+
+    return *retry_ms;
+}
+
+static gboolean
+on_slave_sync(gpointer user_data)
+{
+    static const value_time unknown = { 0 };
+    gboolean written = FALSE;
+    guint i = 0;
+
+    /* Port is not open yet */
+    if (!slave) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    /* The slave thread stopped on a port failure, open the port again */
+    if (modbus_slave_port_lost(slave)) {
+        modbus_slave_free(&slave);
+        retry_serial("Serial port lost");
+        return G_SOURCE_CONTINUE;
+    }
+
+    for (; i < G_N_ELEMENTS(slave_registers); i++) {
+        gint point = values_lookup(slave_registers[i].point);
+        guint16 value;
+
+        if (slave_registers[i].table == MODBUS_SLAVE_INPUT) {
+            if (point >= 0) {
+                modbus_slave_set_register(slave, MODBUS_SLAVE_INPUT,
+                    slave_registers[i].address,
+                    CLAMP(values_get(point)->number, 0, G_MAXUINT16));
+            }
+        } else if (modbus_slave_get_register(slave, MODBUS_SLAVE_HOLDING,
+                       slave_registers[i].address, &value) &&
+                   (point < 0 || values_get(point)->number != value)) {
+            /* Written by the master at some point since the last sync */
+            store_register(slave_registers[i].point, value, &unknown);
+            written = TRUE;
+        }
+    }
+
+    if (written) {
+        end_poll_cycle();
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void start_serial(void)
+{
+    /* Opening now, a pending retry would open the port a second time */
+    if (serial_retry_timer) {
+        g_source_remove(serial_retry_timer);
+        serial_retry_timer = 0;
+    }
+
+    if (serial_opening) {
+        return;
+    }
+    serial_opening = TRUE;
+
+    struct serial_open *result = g_new0(struct serial_open, 1);
+    const struct config *config = config_get();
+
+    result->fd         = -1;
+    g_strlcpy(result->device, config->device, sizeof(result->device));
+    result->baud       = config_speed(config->baud);
+    result->parity     = config->parity;
+    result->address    = config->address;
+    result->framing    = config->framing;
+    result->generation = port_generation;
+
+    g_thread_unref(g_thread_new("serial-open", serial_open_thread, result));
+}
+
+static gpointer serial_open_thread(gpointer data)
+{
+    struct serial_open *result = data;
+
+    /* Opening and configuring a tty can block, keep it off the main loop */
+    switch (SERIAL_PROTOCOL) {
+        case PROTOCOL_MODBUS_RTU:
+            result->modbus = lily_open_modbus(result);
+            break;
+        case PROTOCOL_MODBUS_SLAVE:
+            result->modbus = modbus_init_device(SLAVE_DEVICE,
+                                                SLAVE_ADDRESS,
+                                                PARITY_EVEN,
+                                                SLAVE_BAUD,
+                                                0 /* No stop bit */);
+            break;
+        case PROTOCOL_LINE:
+            result->fd = serial_open_tty(LINE_DEVICE);
+            if (result->fd >= 0 &&
+                serial_configure(result->fd, PARITY_NONE, LINE_BAUD, 0)) {
+                close(result->fd);
+                result->fd = -1;
+            }
+            break;
+    }
+
+    profile_idle_add("serial opened", on_serial_opened, result);
+
+    return NULL;
+}
+
+static gboolean on_serial_opened(gpointer user_data)
+{
+    struct serial_open *result = user_data;
+
+    serial_opening = FALSE;
+
+    /* Port settings changed while opening */
+    if (result->modbus && result->generation != port_generation) {
+        modbus_close_device(&result->modbus);
+        g_free(result);
+        start_serial();
+        return G_SOURCE_REMOVE;
+    }
+
+    if (!result->modbus && result->fd < 0) {
+        retry_serial("Serial port not available");
+        g_free(result);
+        return G_SOURCE_REMOVE;
+    }
+
+    /* The port is already open, keep it rather than leaking it */
+    if (modbus || slave || lp) {
+        g_warning("Serial port opened twice, closing the new one");
+        if (result->modbus) {
+            modbus_close_device(&result->modbus);
+        } else {
+            close(result->fd);
+        }
+        g_free(result);
+        return G_SOURCE_REMOVE;
+    }
+
+    /* The slave thread failing to start is retried like a failed open */
+    if (result->modbus && SERIAL_PROTOCOL == PROTOCOL_MODBUS_SLAVE) {
+        slave = modbus_slave_new(result->modbus, SLAVE_REGISTERS,
+                                 SLAVE_FRAME_GAP_US);
+        if (!slave) {
+            modbus_close_device(&result->modbus);
+            retry_serial("Modbus slave not started");
+            g_free(result);
+            return G_SOURCE_REMOVE;
+        }
+    }
+
+    serial_retry_ms = 0;
+    startup_mark(STARTUP_SERIAL_READY);
+
+    /* Slave mode is served by the slave thread from here on */
+    if (result->modbus && !slave) {
+        modbus = result->modbus;
+        select_slave(modbus, config_get()->address);
+
+        share_set_fd(shared_fd());
+        bridge_set_fd(modbus_get_fd(modbus));
+    } else if (!result->modbus) {
+        lp = lineproto_new(result->fd, line_fields,
+                           G_N_ELEMENTS(line_fields));
+        profile_fd_add("line input", result->fd, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                       on_line_input, lp);
+    }
+
+    g_free(result);
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean on_serial_retry(gpointer user_data)
+{
+    serial_retry_timer = 0;
+    start_serial();
+
+    return G_SOURCE_REMOVE;
+}
+
+static void retry_serial(const gchar *reason)
+{
+    g_warning("%s, retrying in %u ms", reason,
+        next_retry_interval(&serial_retry_ms));
+    if (serial_retry_timer) {
+        g_source_remove(serial_retry_timer);
+    }
+    serial_retry_timer = profile_timeout_add("serial retry", serial_retry_ms,
+                                             on_serial_retry, NULL);
+}
+
+static gboolean start_overlay(gpointer user_data)
+{
+    ovl_handle = overlay_init(OVERLAY_PALETTE);
+
+    if (!ovl_handle) {
+        g_warning("Overlay not available, retrying in %u ms",
+            next_retry_interval(&overlay_retry_ms));
+        profile_timeout_add("overlay retry", overlay_retry_ms, start_overlay,
+                            NULL);
+        return G_SOURCE_REMOVE;
+    }
+
+    overlay_retry_ms = 0;
+    startup_mark(STARTUP_OVERLAY_READY);
+
+    /* Show last known values until the first sample comes in */
+    if (values_count()) {
+        show_values();
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+on_line_input(gint fd, GIOCondition condition, gpointer user_data)
+{
+    g_assert(user_data);
+
+    struct lineproto *line = user_data;
+    gint n = lineproto_read(line);
+
+    if (n > 0) {
+        end_poll_cycle();
+    }
+
+    /* A read error or hangup, e.g. an unplugged USB adapter, stays readable
+     * forever, reopen the port instead
+     */
+    if (n < 0 || condition & (G_IO_HUP | G_IO_ERR)) {
+        close(lineproto_get_fd(line));
+        lineproto_free(&lp);
+        retry_serial("Serial port lost");
+        return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+on_line_overlay(gpointer user_data)
+{
+    static guint32 generation = 0;
+    static guint32 shown_alarms = 0;
+
+    /* Only touch the overlay when some value or alarm actually changed */
+    if (values_generation() == generation &&
+        alarm_generation() == shown_alarms) {
+        return G_SOURCE_CONTINUE;
+    }
+    generation = values_generation();
+    shown_alarms = alarm_generation();
+
+    show_values();
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void show_values(void)
+{
+    GList *list = value_lines(FALSE);
+
+    overlay_set_data(ovl_handle, list, "RS232", "RS232");
+    mdp_destroy_list(&list);
+}
+
+static GList *value_lines(gboolean alarm_points_only)
+{
+    GList *list = NULL;
+    guint i = 0;
+    for (; i < values_count(); i++) {
+        const value_point *point = values_get(i);
+
+        if (alarm_points_only && !alarm_has_rules(i)) {
+            continue;
+        }
+
+        mdp_item_pair *item_pair = g_new0(mdp_item_pair, 1);
+
+        item_pair->name  = g_strdup(point->name);
+        const value_status *status = values_get_status(i);
+
+        if (status->quality == VALUE_EXCEPTION) {
+            item_pair->value = g_strdup_printf("%s (exception 0x%02x)",
+                point->text, status->exception);
+        } else if (status->quality != VALUE_GOOD) {
+            item_pair->value = g_strdup_printf("%s (%s)", point->text,
+                values_quality_name(status->quality));
+        } else {
+            item_pair->value = g_strdup(point->text);
+        }
+
+        if (!alarm_get_visible(i)) {
+            item_pair->style = OVERLAY_STYLE_HIDDEN;
+        } else if (alarm_get_level(i) == ALARM_LEVEL_CRITICAL) {
+            item_pair->style = OVERLAY_STYLE_ALARM;
+        } else if (alarm_get_level(i) == ALARM_LEVEL_WARNING) {
+            item_pair->style = OVERLAY_STYLE_WARNING;
+        }
+
+        list = g_list_append(list, item_pair);
+    }
+
+    return list;
+}
+
+static gboolean
+on_capture_dump(gpointer user_data)
+{
+    capture_dump(CAPTURE_PATH);
+    profile_report();
+
+    return G_SOURCE_CONTINUE;
 }
 
 /*
@@ -159,21 +1502,94 @@ main(void)
     GMainLoop *loop;
     guint timer = 0;
 
+    startup_begin();
+
     loop    = g_main_loop_new(NULL, FALSE);
 
-    struct modbus *modbus = NULL;
+    /* Log main loop stalls and time every callback, see SIGUSR1 */
+    profile_init(PROFILE_STALL_MS);
+
+    capture_init(CAPTURE_RING_SIZE);
+    profile_signal_add("capture dump", SIGUSR1, on_capture_dump, NULL);
 
-    lily_init_modbus(&modbus);
-    ovl_handle = overlay_init();
+    events_init();
+    publish_init(PUBLISH_SOCKET_PATH);
 
-    /* Periodically call 'on_timeout()' every second */
-    g_timeout_add(500, on_timeout, &modbus);
+    /* Restore last known values, shown as soon as the overlay is up */
+    g_mkdir_with_parents(STATE_DIR, 0755);
+    state_init(STATE_PATH);
+    config_init(CONFIG_PATH, &default_config, on_config_changed);
+
+    derive_init(derived_channels, G_N_ELEMENTS(derived_channels),
+                store_derived);
+    alarm_init(alarm_rules, G_N_ELEMENTS(alarm_rules), on_alarm);
+
+    /* The serial port is opened in a worker thread while axoverlay is set
+     * up here, either one failing is retried in the background.
+     */
+    start_serial();
+    start_overlay(NULL);
+
+    switch (SERIAL_PROTOCOL) {
+        case PROTOCOL_MODBUS_RTU:
+            overlay_template =
+                template_new(config_get()->overlay_template);
+            if (!overlay_template) {
+                overlay_template = template_new(OVERLAY_TEMPLATE);
+            }
+
+            if (SHARE_SERIAL_PORT) {
+                share_init(SHARE_SOCKET_PATH);
+            }
+            if (BRIDGE_SERIAL_PORT) {
+                bridge_init(BRIDGE_OVER_TCP ? BRIDGE_TCP_PORT : 0,
+                            BRIDGE_SOCKET_PATH, on_bridge_session, NULL);
+            }
+
+            start_polling();
+            profile_timeout_add_seconds("jitter report",
+                                        JITTER_REPORT_INTERVAL_S,
+                                        on_jitter_report, NULL);
+            break;
+        case PROTOCOL_MODBUS_SLAVE:
+            profile_timeout_add("slave sync", SLAVE_SYNC_INTERVAL_MS,
+                                on_slave_sync, NULL);
+            profile_timeout_add("line overlay", LINE_OVERLAY_INTERVAL_MS,
+                                on_line_overlay, NULL);
+            break;
+        case PROTOCOL_LINE:
+            profile_timeout_add("line overlay", LINE_OVERLAY_INTERVAL_MS,
+                                on_line_overlay, NULL);
+            break;
+    }
 
     /* start the main loop */
     g_main_loop_run(loop);
 
     /* free up resources */
+    if (poll_ticker) {
+        ticker_report(poll_ticker, "Poll");
+        ticker_free(&poll_ticker);
+    }
+    profile_report();
+    profile_cleanup();
+    config_cleanup();
+    state_cleanup();
+    events_cleanup();
+    publish_cleanup();
+    capture_dump(CAPTURE_PATH);
+    capture_cleanup();
+    bridge_cleanup();
+    share_cleanup();
     modbus_close_device(&modbus);
+    modbus_slave_free(&slave);
+    template_free(&overlay_template);
+    derive_cleanup();
+    alarm_cleanup();
+    if (lp) {
+        close(lineproto_get_fd(lp));
+        lineproto_free(&lp);
+    }
     g_main_loop_unref(loop);
 
     return 0;
@@ -0,0 +1,279 @@
+/*
+* - RS 232 raw bridge benchmark -
+*
+* Relay a byte stream through the bridge between a Unix socket client and
+* one end of a pseudo terminal, with an echoing device on the other end.
+* The client sends at the given baud rate, or as fast as it can with -b 0,
+* and checks the echoed stream. Reports throughput each way and the CPU
+* time of the main loop running the bridge, with splice() and with the
+* ring buffer fallback.
+*
+* usage: rs232_bridgebench [-t seconds per round] [-b baud rate, 0 for max]
+*/
+
+#define _GNU_SOURCE
+
+#include <glib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bridge.h"
+#include "bench.h"
+
+#define BENCH_SOCKET_PATH "/tmp/rs232-bridgebench.sock"
+
+/* Client send interval when paced */
+#define BENCH_TICK_US (10000)
+
+struct bench_client {
+    GThread *thread;
+    guint seconds;
+    guint64 sent;
+    guint64 received;
+    guint64 bad;
+};
+
+/* Set to stop the device */
+static volatile gboolean stop = FALSE;
+
+/* Bytes per second sent by the client, 0 for as fast as possible */
+static guint rate = 0;
+
+/*********************** INTERNAL FUNCTION DECLARATIONS ***********************/
+
+/*
+ * Simulated device, echoes everything it receives
+ */
+static gpointer device_thread(gpointer data);
+
+/*
+ * Client thread, sends a counting byte pattern and checks the echo
+ */
+static gpointer client_thread(gpointer data);
+
+/*
+ * Run one benchmark round, with or without splice()
+ */
+static void run_round(int port, gboolean use_splice, guint seconds);
+
+static gboolean on_round_end(gpointer data);
+
+/*********************** INTERNAL FUNCTION DEFINITIONS ************************/
+
+static gpointer device_thread(gpointer data)
+{
+    int fd = GPOINTER_TO_INT(data);
+    unsigned char buf[4096];
+
+    while (!stop) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+
+        ssize_t n = read(fd, buf, sizeof(buf));
+        ssize_t done = 0;
+
+        while (n > 0 && done < n && !stop) {
+            ssize_t w = write(fd, buf + done, n - done);
+
+            if (w > 0) {
+                done += w;
+            } else {
+                pfd.events = POLLOUT;
+                poll(&pfd, 1, 10);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static gpointer client_thread(gpointer data)
+{
+    struct bench_client *client = data;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    unsigned char buf[16384];
+
+    g_strlcpy(addr.sun_path, BENCH_SOCKET_PATH, sizeof(addr.sun_path));
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        perror("connect");
+        return NULL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    gint64 start = g_get_monotonic_time();
+    gint64 end = start + client->seconds * G_USEC_PER_SEC;
+    gint64 now;
+
+    while ((now = g_get_monotonic_time()) < end) {
+        /* Bytes due by now at the paced rate */
+        guint64 due = rate ? (guint64) (now - start) * rate / G_USEC_PER_SEC :
+            client->received + sizeof(buf);
+        struct pollfd pfd = {
+            .fd = fd,
+            .events = POLLIN | (due > client->sent ? POLLOUT : 0),
+        };
+
+        poll(&pfd, 1, rate ? BENCH_TICK_US / 1000 : 10);
+
+        if ((pfd.revents & POLLOUT) && due > client->sent) {
+            gsize len = MIN(due - client->sent, sizeof(buf));
+            gsize i;
+
+            for (i = 0; i < len; i++) {
+                buf[i] = (client->sent + i) & 0xff;
+            }
+
+            ssize_t n = write(fd, buf, len);
+            if (n > 0) {
+                client->sent += n;
+            }
+        }
+
+        if (pfd.revents & POLLIN) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            ssize_t i;
+
+            for (i = 0; i < n; i++) {
+                if (buf[i] != ((client->received + i) & 0xff)) {
+                    client->bad++;
+                }
+            }
+            client->received += MAX(n, 0);
+        }
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+static gboolean on_round_end(gpointer data)
+{
+    g_main_loop_quit(data);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void run_round(int port, gboolean use_splice, guint seconds)
+{
+    struct bench_client client = { .seconds = seconds };
+    struct bridge_stats stats;
+    struct timespec cpu_start;
+    struct timespec cpu_end;
+    GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+
+    /* Drop the echo still in flight from the last round */
+    g_usleep(100000);
+    tcflush(port, TCIOFLUSH);
+
+    bridge_init(0, BENCH_SOCKET_PATH, NULL, NULL);
+    bridge_set_splice(use_splice);
+    bridge_set_fd(port);
+
+    client.thread = g_thread_new("client", client_thread, &client);
+
+    /* Keep running a little past the client to drain the echo */
+    g_timeout_add(seconds * 1000 + 200, on_round_end, loop);
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+    g_main_loop_run(loop);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+
+    g_thread_join(client.thread);
+    bridge_get_stats(&stats);
+    bridge_cleanup();
+    g_main_loop_unref(loop);
+
+    gdouble cpu = (cpu_end.tv_sec - cpu_start.tv_sec) +
+        (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e9;
+    guint64 bytes = stats.to_port + stats.to_client;
+
+    printf("%-7s %9.1f kB/s to port %9.1f kB/s to client  "
+        "CPU %5.2f %% (%6.1f ns/byte)  spliced %5.1f %%  "
+        "unechoed %llu bad %llu\n",
+        use_splice ? "splice" : "ring",
+        stats.to_port / 1000.0 / seconds,
+        stats.to_client / 1000.0 / seconds,
+        100.0 * cpu / seconds,
+        bytes ? cpu * 1e9 / bytes : 0,
+        bytes ? 100.0 * stats.spliced / bytes : 0,
+        (unsigned long long) (client.sent - client.received),
+        (unsigned long long) client.bad);
+}
+
+/*
+ * Our main function
+ */
+int
+main(int argc, char *argv[])
+{
+    guint seconds = 3;
+    guint baud = 921600;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:b:")) != -1) {
+        switch (opt) {
+            case 't':
+                seconds = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                baud = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-t seconds per round] "
+                    "[-b baud, 0 for max]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!seconds) {
+        fprintf(stderr, "invalid duration\n");
+        return EXIT_FAILURE;
+    }
+
+    /* 10 bits per character, 8N1 */
+    rate = baud / 10;
+
+    int master = bench_open_pty();
+    if (master < 0) {
+        return EXIT_FAILURE;
+    }
+
+    int port = bench_open_pts(master, O_NONBLOCK);
+    if (port < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (baud) {
+        printf("%u s per round, client sending at %u baud\n", seconds, baud);
+    } else {
+        printf("%u s per round, client sending as fast as possible\n",
+            seconds);
+    }
+
+    GThread *thread = g_thread_new("device", device_thread,
+        GINT_TO_POINTER(master));
+
+    run_round(port, TRUE, seconds);
+    run_round(port, FALSE, seconds);
+
+    stop = TRUE;
+    g_thread_join(thread);
+    close(port);
+    close(master);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,577 @@
+/*
+* - RS 232 behavioural checks -
+*
+* Checks of the parsers, the value cache and the modbus code that need no
+* device, run by make check. The invalid inputs checked log their errors
+* as warnings. Prints each failed check and exits with failure if there
+* was any.
+*
+* usage: rs232_check
+*/
+
+#define _GNU_SOURCE
+
+#include <glib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+
+#include "config.h"
+#include "derive.h"
+#include "modbus.h"
+#include "modbus_slave.h"
+#include "template.h"
+#include "values.h"
+#include "bench.h"
+
+#define CHECK(expr) check(expr, #expr, __FILE__, __LINE__)
+
+#define CHECK_ADDRESS (0x01)
+
+/* Frame end silence of the slave, the pseudo terminal has no line rate */
+#define CHECK_FRAME_GAP_US (4000)
+
+static guint n_checks = 0;
+static guint n_failed = 0;
+
+/*********************** INTERNAL FUNCTION DECLARATIONS ***********************/
+
+static void check(gboolean ok, const gchar *expr, const gchar *file,
+                  guint line);
+
+/*
+ * Parse text over a default configuration
+ */
+static gboolean parse(const gchar *text, struct config *config);
+
+/*
+ * Compile and render source once
+ */
+static gboolean render(const gchar *source, const gchar *expected);
+
+/*
+ * Read what arrives on fd until it is silent for 50 ms
+ */
+static size_t read_burst(int fd, unsigned char *buf, size_t size);
+
+/*
+ * Send a read request of two registers from m and answer it with the len
+ * bytes of reply, none to let it time out
+ */
+static uint16_t *read_reply(struct modbus *m, int master,
+                            const unsigned char *reply, size_t len,
+                            size_t *n);
+
+static void check_config(void);
+
+static void check_derive(void);
+
+static void check_modbus(void);
+
+static void check_slave(void);
+
+static void check_template(void);
+
+static void check_values(void);
+
+/*********************** INTERNAL FUNCTION DEFINITIONS ************************/
+
+static void check(gboolean ok, const gchar *expr, const gchar *file,
+                  guint line)
+{
+    n_checks++;
+
+    if (!ok) {
+        n_failed++;
+        fprintf(stderr, "%s:%u: check failed: %s\n", file, line, expr);
+    }
+}
+
+static gboolean parse(const gchar *text, struct config *config)
+{
+    static const struct config defaults = {
+        .device           = "/dev/ttyS1",
+        .baud             = 9600,
+        .parity           = PARITY_EVEN,
+        .address          = 1,
+        .poll_interval_ms = 500,
+        .registers        = { "REG1" },
+        .n_registers      = 1,
+    };
+
+    *config = defaults;
+
+    return config_parse(text, config);
+}
+
+static gboolean render(const gchar *source, const gchar *expected)
+{
+    struct template *tpl = template_new(source);
+
+    if (!tpl) {
+        return expected == NULL;
+    }
+
+    template_update(tpl);
+    gboolean ok = expected && !strcmp(template_get_text(tpl), expected);
+
+    if (!ok) {
+        fprintf(stderr, "'%s' rendered as '%s'\n", source,
+            template_get_text(tpl));
+    }
+    template_free(&tpl);
+
+    return ok;
+}
+
+static size_t read_burst(int fd, unsigned char *buf, size_t size)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    size_t got = 0;
+
+    while (got < size && poll(&pfd, 1, 50) > 0) {
+        ssize_t n = read(fd, buf + got, size - got);
+
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+
+    return got;
+}
+
+static void check_config(void)
+{
+    struct config a;
+    struct config b;
+
+    /* Every setting, quotes, blanks and comments */
+    CHECK(parse("# comment\n"
+                "\n"
+                "Device=\"/dev/ttyUSB0\"\n"
+                "  Baud = \"19200\"  \n"
+                "Parity=\"ODD\"\n"
+                "Address=\"0x10\"\n"
+                "Framing=\"ascii\"\n"
+                "PollInterval=\"250\"\n"
+                "RegisterStart=\"100\"\n"
+                "Registers=\"hum, temp,REG3\"\n"
+                "Slaves=\"2,3\"\n"
+                "LatchRegister=\"256\"\n"
+                "LatchValue=\"7\"\n"
+                "LatchDelay=\"40\"\n"
+                "OverlayTemplate=\"Hum {hum:.1f}%\"\n", &a));
+    CHECK(!strcmp(a.device, "/dev/ttyUSB0"));
+    CHECK(a.baud == 19200);
+    CHECK(a.parity == PARITY_ODD);
+    CHECK(a.address == 16);
+    CHECK(a.framing == MODBUS_FRAMING_ASCII);
+    CHECK(a.poll_interval_ms == 250);
+    CHECK(a.register_start == 100);
+    CHECK(a.n_registers == 3);
+    CHECK(!strcmp(a.registers[1], "temp"));
+    CHECK(a.n_slaves == 2 && a.slaves[0] == 2 && a.slaves[1] == 3);
+    CHECK(a.latch && a.latch_register == 256);
+    CHECK(a.latch_value == 7 && a.latch_delay_ms == 40);
+    CHECK(!strcmp(a.overlay_template, "Hum {hum:.1f}%"));
+
+    /* A blank slave list and no latch */
+    CHECK(parse("Slaves=\"\"\nLatchRegister=\"none\"\n", &a));
+    CHECK(a.n_slaves == 0 && !a.latch);
+
+    /* Invalid lines fail the parse, valid ones around them still apply */
+    CHECK(!parse("Baud=\"12345\"\n", &a));
+    CHECK(!parse("Address=\"0\"\n", &a));
+    CHECK(!parse("Address=\"248\"\n", &a));
+    CHECK(!parse("Parity=\"mark\"\n", &a));
+    CHECK(!parse("PollInterval=\"5\"\n", &a));
+    CHECK(!parse("Registers=\"REG1,,REG2\"\n", &a));
+    CHECK(!parse("Slaves=\"2,0\"\n", &a));
+    CHECK(!parse("Device=\"\"\n", &a));
+    CHECK(!parse("Unknown=\"1\"\n", &a));
+    CHECK(!parse("Address \"2\"\nBaud=\"4800\"\n", &a));
+    CHECK(a.baud == 4800);
+
+    /* Only the parts that differ are reported */
+    parse("", &a);
+    parse("", &b);
+    CHECK(config_diff(&a, &b) == 0);
+    parse("Baud=\"19200\"\n", &b);
+    CHECK(config_diff(&a, &b) == CONFIG_PORT);
+    parse("Registers=\"REG2\"\n", &b);
+    CHECK(config_diff(&a, &b) == CONFIG_PLAN);
+    parse("OverlayTemplate=\"x\"\nSlaves=\"5\"\n", &b);
+    CHECK(config_diff(&a, &b) == (CONFIG_PLAN | CONFIG_OVERLAY));
+}
+
+static void check_derive(void)
+{
+    static const struct derive_channel channels[] = {
+        { "sum",    "A + B * 2" },
+        { "group",  "(A + B) * 2" },
+        { "neg",    "-A - -B" },
+        { "bits",   "0x0f & B | 1 << 4" },
+        { "shift",  "B >> 1" },
+        { "mod",    "7 % 4" },
+        { "funcs",  "max(abs(-A), sqrt(16)) + min(1, 2) + pow(2, 3)" },
+        { "expo",   "exp(log(B)) * 1e1" },
+        { "chain",  "sum / 2" },
+        { "bad1",   "A +" },
+        { "bad2",   "(A" },
+        { "bad3",   "foo(A)" },
+        { "bad4",   "max(A)" },
+        { "bad5",   "A $ B" },
+        { "late",   "C + 1" },
+        { "badbits", "-A & 1" },
+        { "badshift", "1 << 32" },
+        { "wrap",   "0xffffffff << 4 >> 28" },
+    };
+
+    values_clear();
+    gint a = values_add_point("A");
+    gint b = values_add_point("B");
+
+    CHECK(derive_init(channels, G_N_ELEMENTS(channels), NULL) ==
+          G_N_ELEMENTS(channels) - 5);
+    CHECK(values_lookup("bad1") < 0);
+
+    values_set_number(a, 3);
+    values_set_number(b, 6);
+    derive_update();
+
+    CHECK(values_get(values_lookup("sum"))->number == 15);
+    CHECK(values_get(values_lookup("group"))->number == 18);
+    CHECK(values_get(values_lookup("neg"))->number == 3);
+    CHECK(values_get(values_lookup("bits"))->number == 22);
+    CHECK(values_get(values_lookup("shift"))->number == 3);
+    CHECK(values_get(values_lookup("mod"))->number == 3);
+    CHECK(values_get(values_lookup("funcs"))->number == 13);
+    CHECK(fabs(values_get(values_lookup("expo"))->number - 60) < 1e-9);
+    CHECK(values_get(values_lookup("chain"))->number == 7.5);
+    CHECK(values_get(values_lookup("badbits"))->changes == 0);
+    CHECK(values_get(values_lookup("badshift"))->changes == 0);
+    CHECK(values_get(values_lookup("wrap"))->number == 15);
+
+    /* Only channels with a changed input are evaluated */
+    CHECK(derive_update() == 0);
+    values_set_number(a, 5);
+    CHECK(derive_update() > 0);
+    CHECK(values_get(values_lookup("chain"))->number == 8.5);
+
+    /* A channel waits for its inputs to exist */
+    CHECK(values_get(values_lookup("late"))->changes == 0);
+    values_set_number(values_add_point("C"), 1);
+    derive_update();
+    CHECK(values_get(values_lookup("late"))->number == 2);
+
+    /* Bad inputs make the channels reading them bad, down the chain */
+    gint sum = values_lookup("sum");
+    gint chain = values_lookup("chain");
+
+    values_set_quality(b, VALUE_TIMEOUT, 0);
+    derive_update();
+    CHECK(values_get_status(sum)->quality == VALUE_TIMEOUT);
+    CHECK(values_get_status(chain)->quality == VALUE_TIMEOUT);
+    CHECK(values_get(sum)->number == 17);
+    CHECK(values_get_status(values_lookup("mod"))->quality == VALUE_GOOD);
+
+    values_set_number(b, 6);
+    derive_update();
+    CHECK(values_get_status(chain)->quality == VALUE_GOOD);
+
+    /* A channel with no room left in the value cache is dropped */
+    values_clear();
+    gchar name[16];
+    guint n = 0;
+    for (;; n++) {
+        g_snprintf(name, sizeof(name), "P%u", n);
+        if (values_add_point(name) < 0) {
+            break;
+        }
+    }
+    CHECK(n == VALUES_MAX_POINTS);
+    CHECK(derive_init(channels, 1, NULL) == 0);
+
+    derive_cleanup();
+    values_clear();
+}
+
+static uint16_t *read_reply(struct modbus *m, int master,
+                            const unsigned char *reply, size_t len,
+                            size_t *n)
+{
+    unsigned char request[8];
+
+    modbus_read_input_registers(m, 0x10, 2);
+    read_burst(master, request, sizeof(request));
+
+    if (len && write(master, reply, len) != (ssize_t) len) {
+        return NULL;
+    }
+
+    return modbus_parse_input_registers(m, n);
+}
+
+static void check_modbus(void)
+{
+    unsigned char good[]      = { CHECK_ADDRESS, 0x03, 4, 0, 1, 0, 2, 0, 0 };
+    unsigned char short_[]    = { CHECK_ADDRESS, 0x03, 2, 0, 1, 0, 0 };
+    unsigned char odd[]       = { CHECK_ADDRESS, 0x03, 3, 0, 1, 0, 0, 0 };
+    unsigned char exception[] = { CHECK_ADDRESS, 0x83, 0x02, 0, 0 };
+    unsigned char exception_code = 0;
+    uint16_t *regs;
+    size_t n = 0;
+
+    modbus_add_crc16(good, sizeof(good));
+    modbus_add_crc16(short_, sizeof(short_));
+    modbus_add_crc16(odd, sizeof(odd));
+    modbus_add_crc16(exception, sizeof(exception));
+
+    int master = bench_open_pty();
+    CHECK(master >= 0);
+    if (master < 0) {
+        return;
+    }
+    bench_make_raw(master);
+
+    struct modbus *m = modbus_init_device(ptsname(master), CHECK_ADDRESS,
+        PARITY_NONE, B115200, 0);
+    CHECK(m != NULL);
+    if (!m) {
+        close(master);
+        return;
+    }
+    modbus_set_response_timeout(m, 50);
+
+    /* modbus.c dumps every frame on stdout */
+    int saved = bench_mute_stdout();
+
+    regs = read_reply(m, master, good, sizeof(good), &n);
+    CHECK(regs && n == 2 && regs[0] == 1 && regs[1] == 2);
+    CHECK(modbus_get_error(m, NULL) == MODBUS_ERROR_NONE);
+    g_free(regs);
+
+    /* Fewer registers than requested is a malformed reply */
+    CHECK(!read_reply(m, master, short_, sizeof(short_), &n) && !n);
+    CHECK(modbus_get_error(m, NULL) == MODBUS_ERROR_FRAME);
+
+    CHECK(!read_reply(m, master, odd, sizeof(odd), &n));
+    CHECK(modbus_get_error(m, NULL) == MODBUS_ERROR_FRAME);
+
+    good[4] ^= 0x01;
+    CHECK(!read_reply(m, master, good, sizeof(good), &n));
+    CHECK(modbus_get_error(m, NULL) == MODBUS_ERROR_CRC);
+
+    CHECK(!read_reply(m, master, exception, sizeof(exception), &n));
+    CHECK(modbus_get_error(m, &exception_code) == MODBUS_ERROR_EXCEPTION);
+    CHECK(exception_code == 0x02);
+
+    CHECK(!read_reply(m, master, NULL, 0, &n));
+    CHECK(modbus_get_error(m, NULL) == MODBUS_ERROR_TIMEOUT);
+
+    /* A port hung up halfway through a reply ends it instead of spinning */
+    modbus_read_input_registers(m, 0x10, 2);
+    read_burst(master, good, sizeof(good));
+    CHECK(write(master, good, 4) == 4);
+    close(master);
+    CHECK(!modbus_parse_input_registers(m, &n));
+    CHECK(modbus_get_error(m, NULL) != MODBUS_ERROR_NONE);
+
+    bench_unmute_stdout(saved);
+
+    modbus_close_device(&m);
+}
+
+static void check_slave(void)
+{
+    unsigned char request[8] = { CHECK_ADDRESS, 0x03, 0x00, 0x00,
+                                 0x00, 0x02 };
+    unsigned char burst[2 * sizeof(request)];
+    unsigned char resp[MODBUS_SLAVE_FRAME_SIZE];
+    struct modbus_slave_stats stats;
+
+    int master = bench_open_pty();
+    CHECK(master >= 0);
+    if (master < 0) {
+        return;
+    }
+    bench_make_raw(master);
+
+    struct modbus *modbus = modbus_init_device(ptsname(master),
+        CHECK_ADDRESS, PARITY_NONE, B115200, 0);
+    struct modbus_slave *slave = modbus ?
+        modbus_slave_new(modbus, 16, CHECK_FRAME_GAP_US) : NULL;
+
+    CHECK(slave != NULL);
+    if (!slave) {
+        close(master);
+        return;
+    }
+
+    modbus_add_crc16(request, sizeof(request));
+
+    /* A request in the same burst as a CRC error is not answered, the
+     * slave waits for the frame end silence to find the next frame
+     */
+    memcpy(burst, request, sizeof(request));
+    burst[6] ^= 0xFF;
+    memcpy(burst + sizeof(request), request, sizeof(request));
+
+    CHECK(write(master, burst, sizeof(burst)) == sizeof(burst));
+    CHECK(read_burst(master, resp, sizeof(resp)) == 0);
+
+    /* After the silence requests are answered again */
+    CHECK(write(master, request, sizeof(request)) == sizeof(request));
+    size_t n = read_burst(master, resp, sizeof(resp));
+    CHECK(n == 9 && !modbus_check_crc16(resp, n));
+
+    modbus_slave_get_stats(slave, &stats);
+    CHECK(stats.crc_errors == 1);
+    CHECK(stats.requests == 1);
+
+    /* A hung up port stops the slave and is reported */
+    CHECK(!modbus_slave_port_lost(slave));
+    close(master);
+
+    guint waited_ms = 0;
+    while (!modbus_slave_port_lost(slave) && waited_ms++ < 1000) {
+        g_usleep(1000);
+    }
+    CHECK(modbus_slave_port_lost(slave));
+
+    modbus_slave_free(&slave);
+}
+
+static void check_template(void)
+{
+    values_clear();
+    gint hum = values_add_point("hum");
+    gint reg = values_add_point("REG1");
+    gint text = values_add_point("name");
+
+    values_set_number(hum, 42.25);
+    values_set_number(reg, 0x2a);
+    values_set_text(text, "12.5kg", 6);
+
+    CHECK(render("Hum {hum:.1f}%", "Hum 42.2%"));
+    CHECK(render("{hum:d} {REG1:x} {REG1:b8}", "42 002a 01010100"));
+    CHECK(render("{name} {name:d}", "12.5kg 12"));
+    CHECK(render("{{literal}} {missing}!", "{literal} !"));
+    CHECK(render("plain", "plain"));
+
+    CHECK(render("{hum", NULL));
+    CHECK(render("{hum:q}", NULL));
+    CHECK(render("{hum:b0}", NULL));
+    CHECK(render("{hum:.f}", NULL));
+    CHECK(render("{:d}", NULL));
+
+    /* Bad points show their last value with a mark */
+    values_set_quality(reg, VALUE_CRC_ERROR, 0);
+    CHECK(render("{REG1:d}", "42" TEMPLATE_BAD_MARK));
+    values_set_number(reg, 0x2a);
+
+    /* Only changed values change the text */
+    struct template *tpl = template_new("{hum:.1f} {REG1:d}");
+
+    CHECK(tpl != NULL);
+    if (tpl) {
+        CHECK(template_update(tpl));
+        CHECK(!template_update(tpl));
+        values_set_number(reg, 7);
+        CHECK(template_update(tpl));
+        CHECK(!strcmp(template_get_text(tpl), "42.2 7"));
+        template_free(&tpl);
+    }
+}
+
+static void check_values(void)
+{
+    values_clear();
+    CHECK(!values_any_bad());
+
+    gint a = values_add_point("A");
+    gint b = values_add_point("B");
+    gint c = -1;
+    guint i;
+
+    CHECK(values_add_point("A") == a);
+
+    /* Fill past one bitmap word */
+    for (i = 0; i < 70; i++) {
+        gchar name[VALUES_NAME_SIZE];
+
+        g_snprintf(name, sizeof(name), "P%u", i);
+        c = values_add_point(name);
+    }
+    CHECK(c == 71);
+
+    values_set_number(a, 1);
+    values_set_number(b, 2);
+    values_set_number(c, 3);
+    CHECK(!values_any_bad());
+
+    guint32 generation = values_generation();
+
+    values_set_quality(c, VALUE_EXCEPTION, 0x02);
+    CHECK(values_generation() != generation);
+    CHECK(values_any_bad());
+    CHECK(values_get_bad()[c / 64] == G_GUINT64_CONSTANT(1) << (c % 64));
+    CHECK(values_get_bad()[0] == 0);
+    CHECK(values_get_status(c)->exception == 0x02);
+    CHECK(values_get_status(c)->failures == 1);
+    CHECK(values_get(c)->number == 3);
+
+    /* The same quality again is no change, but another failure */
+    generation = values_generation();
+    values_set_quality(c, VALUE_EXCEPTION, 0x02);
+    CHECK(values_generation() == generation);
+    CHECK(values_get_status(c)->failures == 2);
+
+    values_set_quality(a, VALUE_FRAME_ERROR, 0x02);
+    CHECK(values_get_status(a)->exception == 0);
+    CHECK(values_get_bad()[0] == 1);
+
+    /* An update, even to the same value, makes a point good again */
+    values_set_number(c, 3);
+    values_set_number(a, 1);
+    CHECK(!values_any_bad());
+    CHECK(values_get_status(c)->failures == 0);
+
+    /* Only good points older than their max age go stale */
+    values_set_max_age(a, 1);
+    values_set_max_age(b, 1);
+    values_set_quality(b, VALUE_TIMEOUT, 0);
+    CHECK(values_expire(g_get_monotonic_time() + 2000, NULL) == 1);
+    CHECK(values_get_status(a)->quality == VALUE_STALE);
+    CHECK(values_get_status(b)->quality == VALUE_TIMEOUT);
+    CHECK(values_expire(g_get_monotonic_time() + 2000, NULL) == 0);
+
+    CHECK(!strcmp(values_quality_name(VALUE_STALE), "stale"));
+    CHECK(!strcmp(values_quality_name(VALUE_FRAME_ERROR), "bad frame"));
+    CHECK(!strcmp(values_quality_name(VALUE_FRAME_ERROR + 1), "?"));
+}
+
+/*
+ * Our main function
+ */
+int
+main(int argc, char *argv[])
+{
+    bench_quiet_log();
+
+    check_config();
+    check_derive();
+    check_modbus();
+    check_slave();
+    check_template();
+    check_values();
+
+    printf("%u checks, %u failed\n", n_checks, n_failed);
+
+    return n_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
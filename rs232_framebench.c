@@ -0,0 +1,301 @@
+/*
+* - RS 232 modbus framing benchmark -
+*
+* Poll input registers through a pseudo terminal from a simulated slave
+* answering in RTU and then in ASCII framing. The slave starts a response
+* after the time the request takes on a bus at the given baud rate and
+* sends it at that rate, 8E1 for RTU and 7E1 for ASCII. Reports transactions and
+* registers per second for each framing, and the CPU cost of the CRC and
+* of the LRC with hex codec per frame.
+*
+* usage: rs232_framebench [-t seconds per round] [-b baud rate]
+*                         [-n registers per read]
+*/
+
+#define _GNU_SOURCE
+
+#include <glib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+
+#include "modbus.h"
+#include "bench.h"
+
+#define BENCH_ADDRESS (0x01)
+#define BENCH_CODEC_FRAMES (200000)
+
+/* Set to stop the slave */
+static volatile gboolean stop = FALSE;
+
+/* Framing of the slave */
+static volatile enum modbus_framing slave_framing = MODBUS_FRAMING_RTU;
+
+static guint baud = 9600;
+
+/*********************** INTERNAL FUNCTION DECLARATIONS ***********************/
+
+/*
+ * Simulated slave, answers read input registers requests in either framing
+ */
+static gpointer slave_thread(gpointer data);
+
+/*
+ * Build a read registers response for request in RTU layout with CRC
+ */
+static size_t build_response(const unsigned char *request,
+                             unsigned char *resp);
+
+/*
+ * Run one polling round in the given framing
+ */
+static void run_round(struct modbus *m, enum modbus_framing framing,
+                      guint n_regs, guint seconds);
+
+/*
+ * Time the CRC check against LRC with hex encode and decode
+ */
+static void run_codec(guint n_regs);
+
+/*********************** INTERNAL FUNCTION DEFINITIONS ************************/
+
+static size_t build_response(const unsigned char *request,
+                             unsigned char *resp)
+{
+    guint n = MIN(request[4] << 8 | request[5], 125);
+    guint start = request[2] << 8 | request[3];
+    guint i;
+
+    resp[0] = request[0];
+    resp[1] = request[1];
+    resp[2] = 2 * n;
+    for (i = 0; i < n; i++) {
+        resp[3 + 2 * i] = (start + i) >> 8;
+        resp[4 + 2 * i] = (start + i) & 0xFF;
+    }
+    modbus_add_crc16(resp, 5 + 2 * n);
+
+    return 5 + 2 * n;
+}
+
+static gpointer slave_thread(gpointer data)
+{
+    int fd = GPOINTER_TO_INT(data);
+    unsigned char req[MODBUS_ASCII_FRAME_SIZE];
+    unsigned char resp[256];
+    char text[MODBUS_ASCII_FRAME_SIZE];
+    gsize got = 0;
+
+    while (!stop) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+
+        /* Drop garbage that never became a frame */
+        if (got == sizeof(req)) {
+            got = 0;
+        }
+
+        ssize_t r = read(fd, req + got, sizeof(req) - got);
+        if (r <= 0) {
+            continue;
+        }
+        got += r;
+
+        gboolean ascii = slave_framing == MODBUS_FRAMING_ASCII;
+        unsigned char *frame = req;
+        size_t size = 8;
+
+        /* Whole request in, ASCII ends with LF and RTU is 8 bytes */
+        if (ascii) {
+            if (req[got - 1] != '\n') {
+                continue;
+            }
+            frame = modbus_ascii_decode(req, got, &size);
+        } else if (got < 8) {
+            continue;
+        } else if (modbus_check_crc16(req, 8) < 0) {
+            frame = NULL;
+        }
+
+        size_t request_chars = got;
+        got = 0;
+
+        if (!frame || size != 8) {
+            continue;
+        }
+
+        size_t len = build_response(frame, resp);
+        const void *out = resp;
+
+        if (ascii) {
+            len = modbus_ascii_encode(resp, len, text);
+            out = text;
+        }
+
+        /* Time on the bus, 10 bits per ASCII and 11 per RTU character.
+         * The response starts after the request and goes out at line rate,
+         * in pieces well within the RTU frame end silence.
+         */
+        guint char_us = (ascii ? 10 : 11) * 1000000 / baud;
+
+        g_usleep(request_chars * char_us);
+        bench_write_paced(fd, out, len, char_us);
+    }
+
+    return NULL;
+}
+
+static void run_round(struct modbus *m, enum modbus_framing framing,
+                      guint n_regs, guint seconds)
+{
+    if (modbus_set_framing(m, framing)) {
+        fprintf(stderr, "failed to set framing\n");
+        exit(EXIT_FAILURE);
+    }
+
+    slave_framing = framing;
+
+    guint64 transactions = 0;
+    guint64 failures = 0;
+    gint64 start = g_get_monotonic_time();
+    gint64 end = start + seconds * G_USEC_PER_SEC;
+
+    /* modbus.c dumps every frame on stdout, keep that out of the report */
+    int saved = bench_mute_stdout();
+
+    while (g_get_monotonic_time() < end) {
+        size_t n = 0;
+        uint16_t *regs = NULL;
+
+        if (!modbus_read_input_registers(m, 0x10, n_regs)) {
+            regs = modbus_parse_input_registers(m, &n);
+        }
+
+        if (regs && n == n_regs && regs[0] == 0x10) {
+            transactions++;
+        } else {
+            failures++;
+        }
+        g_free(regs);
+    }
+
+    bench_unmute_stdout(saved);
+
+    gdouble elapsed = (g_get_monotonic_time() - start) / 1e6;
+
+    printf("%-5s %7.1f transactions/s  %8.1f registers/s  "
+        "%6.2f ms per read  failures %llu\n",
+        framing == MODBUS_FRAMING_ASCII ? "ASCII" : "RTU",
+        transactions / elapsed, transactions * n_regs / elapsed,
+        transactions ? 1000.0 * elapsed / transactions : 0,
+        (unsigned long long) failures);
+}
+
+static void run_codec(guint n_regs)
+{
+    unsigned char request[8] = { BENCH_ADDRESS, 0x04, 0x00, 0x10,
+                                 n_regs >> 8, n_regs & 0xFF };
+    unsigned char resp[256];
+    unsigned char buf[MODBUS_ASCII_FRAME_SIZE];
+    char text[MODBUS_ASCII_FRAME_SIZE];
+    size_t size = 0;
+    guint ok = 0;
+    guint i;
+
+    modbus_add_crc16(request, sizeof(request));
+    size_t len = build_response(request, resp);
+
+    gint64 start = g_get_monotonic_time();
+    for (i = 0; i < BENCH_CODEC_FRAMES; i++) {
+        ok += modbus_check_crc16(resp, len) == 0;
+    }
+    gint64 crc_ns = (g_get_monotonic_time() - start) * 1000;
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < BENCH_CODEC_FRAMES; i++) {
+        size_t n = modbus_ascii_encode(resp, len, text);
+
+        memcpy(buf, text, n);
+        ok += modbus_ascii_decode(buf, n, &size) != NULL;
+    }
+    gint64 ascii_ns = (g_get_monotonic_time() - start) * 1000;
+
+    printf("%zu byte response: CRC check %.1f ns, "
+        "ASCII encode + decode with LRC and CRC %.1f ns (%.2f ns/char)%s\n",
+        len, (gdouble) crc_ns / BENCH_CODEC_FRAMES,
+        (gdouble) ascii_ns / BENCH_CODEC_FRAMES,
+        (gdouble) ascii_ns / BENCH_CODEC_FRAMES / (2 * len + 1),
+        ok == 2 * BENCH_CODEC_FRAMES ? "" : " FAILED");
+}
+
+/*
+ * Our main function
+ */
+int
+main(int argc, char *argv[])
+{
+    guint seconds = 3;
+    guint n_regs = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:b:n:")) != -1) {
+        switch (opt) {
+            case 't':
+                seconds = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                baud = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                n_regs = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-t seconds per round] "
+                    "[-b baud] [-n registers per read]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!seconds || !baud || !n_regs || n_regs > 125) {
+        fprintf(stderr, "invalid duration, baud rate or register count\n");
+        return EXIT_FAILURE;
+    }
+
+    bench_quiet_log();
+
+    int master = bench_open_pty();
+    if (master < 0) {
+        return EXIT_FAILURE;
+    }
+
+    printf("%u s per round, %u registers per read, simulated bus at %u "
+        "baud\n", seconds, n_regs, baud);
+
+    GThread *thread = g_thread_new("slave", slave_thread,
+        GINT_TO_POINTER(master));
+
+    struct modbus *m = modbus_init_device(ptsname(master), BENCH_ADDRESS,
+                                          PARITY_EVEN, B9600, 0);
+    if (!m) {
+        fprintf(stderr, "failed to open %s\n", ptsname(master));
+        return EXIT_FAILURE;
+    }
+
+    run_round(m, MODBUS_FRAMING_RTU, n_regs, seconds);
+    run_round(m, MODBUS_FRAMING_ASCII, n_regs, seconds);
+    run_codec(n_regs);
+
+    stop = TRUE;
+    g_thread_join(thread);
+    modbus_close_device(&m);
+    close(master);
+
+    return EXIT_SUCCESS;
+}
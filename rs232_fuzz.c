@@ -0,0 +1,315 @@
+/*
+* - RS 232 parser fuzz targets -
+*
+* libFuzzer style targets for the CRC check, the RTU and ASCII frame
+* decoders and the register parser. No serial port is involved, inputs go straight into
+* the parser functions.
+*
+* Built with libFuzzer (make fuzz) FUZZ_TARGET selects one target per
+* binary. Otherwise the built-in driver runs all targets, on the given
+* corpus files or on random mutations of valid frames. Build with
+* -fsanitize=address to catch out of bounds reads.
+*
+* usage: rs232_fuzz [-n iterations] [-s seed] [corpus-file...]
+*/
+
+#include <glib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "modbus.h"
+#include "bench.h"
+
+#define FUZZ_CRC (1)
+#define FUZZ_DECODE (2)
+#define FUZZ_PARSE (3)
+#define FUZZ_ASCII (4)
+
+#define FUZZ_MAX_INPUT (512)
+
+/*********************** INTERNAL FUNCTION DECLARATIONS ***********************/
+
+/*
+ * Bitwise CRC16, reference for the table driven one
+ */
+static uint16_t reference_crc16(const unsigned char *msg, size_t size);
+
+/*
+ * Exact size copy of the input, so reading past the end is caught
+ */
+static unsigned char *copy_input(const uint8_t *data, size_t size);
+
+/* libFuzzer builds use one target each */
+G_GNUC_UNUSED static void fuzz_crc(const uint8_t *data, size_t size);
+
+G_GNUC_UNUSED static void fuzz_decode(const uint8_t *data, size_t size);
+
+G_GNUC_UNUSED static void fuzz_parse(const uint8_t *data, size_t size);
+
+G_GNUC_UNUSED static void fuzz_ascii(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/*********************** INTERNAL FUNCTION DEFINITIONS ************************/
+
+static uint16_t reference_crc16(const unsigned char *msg, size_t size)
+{
+    uint16_t crc = 0xFFFF;
+
+    while (size--) {
+        int bit = 0;
+
+        crc ^= *msg++;
+        for (; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+
+    return crc;
+}
+
+static unsigned char *copy_input(const uint8_t *data, size_t size)
+{
+    unsigned char *copy = g_malloc(MAX(size, 1));
+
+    memcpy(copy, data, size);
+
+    return copy;
+}
+
+static void fuzz_crc(const uint8_t *data, size_t size)
+{
+    unsigned char *msg = copy_input(data, size);
+
+    uint16_t crc = modbus_gen_crc16(msg, size);
+    g_assert(crc == reference_crc16(msg, size));
+
+    /* Resuming at any split point gives the same CRC */
+    size_t split = size ? data[0] % (size + 1) : 0;
+    g_assert(crc == modbus_update_crc16(modbus_gen_crc16(msg, split),
+        msg + split, size - split));
+
+    if (size > 2) {
+        gboolean valid = (msg[size - 2] | msg[size - 1] << 8) ==
+            reference_crc16(msg, size - 2);
+
+        g_assert(valid == (modbus_check_crc16(msg, size) == 0));
+
+        modbus_add_crc16(msg, size);
+        g_assert(modbus_check_crc16(msg, size) == 0);
+    }
+
+    g_free(msg);
+}
+
+static void fuzz_decode(const uint8_t *data, size_t size)
+{
+    /* data[0] is the expected address, the rest is what was received */
+    if (size < 1) {
+        return;
+    }
+
+    unsigned char *buf = copy_input(data, size);
+    size_t frame_size = 0;
+    unsigned char *frame = modbus_decode_frame(buf, size - 1, &frame_size);
+
+    if (frame) {
+        g_assert(frame >= buf);
+        g_assert(frame + frame_size <= buf + size);
+
+        size_t nregs = 0;
+        uint16_t *regs = modbus_parse_registers_frame(frame, frame_size,
+            &nregs);
+
+        g_assert(!regs || 5 + 2 * nregs <= frame_size);
+        g_free(regs);
+    }
+
+    g_free(buf);
+}
+
+static void fuzz_parse(const uint8_t *data, size_t size)
+{
+    unsigned char *frame = copy_input(data, size);
+    size_t nregs = 0;
+    uint16_t *regs = modbus_parse_registers_frame(frame, size, &nregs);
+
+    if (regs) {
+        size_t i = 0;
+
+        g_assert(5 + 2 * nregs <= size);
+        for (; i < nregs; i++) {
+            g_assert(regs[i] == (frame[3 + 2 * i] << 8 | frame[4 + 2 * i]));
+        }
+    }
+
+    g_free(regs);
+    g_free(frame);
+}
+
+static void fuzz_ascii(const uint8_t *data, size_t size)
+{
+    unsigned char *buf = copy_input(data, size);
+    size_t frame_size = 0;
+    unsigned char *frame = modbus_ascii_decode(buf, size, &frame_size);
+
+    if (frame) {
+        g_assert(frame >= buf);
+        g_assert(frame + frame_size <= buf + size);
+        g_assert(modbus_check_crc16(frame, frame_size) == 0);
+
+        /* Encoding and decoding again gives the same frame */
+        unsigned char *text = g_malloc(2 * frame_size + 1);
+        size_t len = modbus_ascii_encode(frame, frame_size, (char *) text);
+        size_t again_size = 0;
+        unsigned char *again = modbus_ascii_decode(text, len, &again_size);
+
+        g_assert(len <= size);
+        g_assert(again && again_size == frame_size);
+        g_assert(!memcmp(again, frame, frame_size));
+        g_free(text);
+
+        size_t nregs = 0;
+        uint16_t *regs = modbus_parse_registers_frame(frame, frame_size,
+            &nregs);
+
+        g_assert(!regs || 5 + 2 * nregs <= frame_size);
+        g_free(regs);
+    }
+
+    g_free(buf);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+#if !defined(FUZZ_TARGET) || FUZZ_TARGET == FUZZ_CRC
+    fuzz_crc(data, size);
+#endif
+#if !defined(FUZZ_TARGET) || FUZZ_TARGET == FUZZ_DECODE
+    fuzz_decode(data, size);
+#endif
+#if !defined(FUZZ_TARGET) || FUZZ_TARGET == FUZZ_PARSE
+    fuzz_parse(data, size);
+#endif
+#if !defined(FUZZ_TARGET) || FUZZ_TARGET == FUZZ_ASCII
+    fuzz_ascii(data, size);
+#endif
+
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+/*
+ * Flip bytes, truncate or extend
+ */
+static void mutate(uint8_t *input, size_t *size)
+{
+    guint mutations = rand() % 4;
+    guint j;
+
+    for (j = 0; j < mutations; j++) {
+        switch (rand() % 3) {
+            case 0:
+                if (*size) {
+                    input[rand() % *size] = rand();
+                }
+                break;
+            case 1:
+                *size = rand() % (*size + 1);
+                break;
+            default:
+                while (*size < FUZZ_MAX_INPUT && rand() % 4) {
+                    input[(*size)++] = rand();
+                }
+                break;
+        }
+    }
+}
+
+/*
+ * Our main function, a minimal driver for builds without libFuzzer
+ */
+int
+main(int argc, char *argv[])
+{
+    unsigned long iterations = 100000;
+    unsigned int seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n iterations] [-s seed] "
+                    "[corpus-file...]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    bench_quiet_log();
+
+    if (optind < argc) {
+        for (; optind < argc; optind++) {
+            gchar *contents;
+            gsize len;
+
+            if (!g_file_get_contents(argv[optind], &contents, &len, NULL)) {
+                fprintf(stderr, "failed to read %s\n", argv[optind]);
+                return EXIT_FAILURE;
+            }
+
+            LLVMFuzzerTestOneInput((const uint8_t *) contents, len);
+            g_free(contents);
+        }
+
+        printf("%d corpus files OK\n", argc - optind);
+        return EXIT_SUCCESS;
+    }
+
+    srand(seed);
+
+    unsigned long i = 0;
+    for (; i < iterations; i++) {
+        uint8_t input[FUZZ_MAX_INPUT];
+        guint count = 1 + rand() % 125;
+        size_t size = 5 + 2 * count;
+        guint j;
+
+        /* Valid read input registers response with address in front */
+        input[0] = 0x01;
+        input[1] = 0x01;
+        input[2] = 0x04;
+        input[3] = 2 * count;
+        for (j = 0; j < 2 * count; j++) {
+            input[4 + j] = rand();
+        }
+        modbus_add_crc16(&input[1], size);
+
+        /* Same frame in ASCII, at most 2 * 255 + 1 characters */
+        uint8_t ascii[FUZZ_MAX_INPUT];
+        size_t ascii_size = modbus_ascii_encode(&input[1], size,
+            (char *) ascii);
+
+        size += 1;
+        mutate(input, &size);
+        mutate(ascii, &ascii_size);
+
+        LLVMFuzzerTestOneInput(input, size);
+        LLVMFuzzerTestOneInput(input + 1, size ? size - 1 : 0);
+        LLVMFuzzerTestOneInput(ascii, ascii_size);
+    }
+
+    printf("%lu iterations OK\n", iterations);
+
+    return EXIT_SUCCESS;
+}
+
+#endif /* FUZZ_LIBFUZZER */
@@ -0,0 +1,266 @@
+/*
+* - RS 232 modbus broadcast latch benchmark -
+*
+* Poll several simulated slaves sharing one bus through a pseudo terminal,
+* first one after the other and then with a broadcast write that latches a
+* snapshot on all of them followed by back to back reads. A slave needs a
+* fixed processing delay to answer a read, or to take a snapshot, after
+* which reads of the snapshot are answered after a short turnaround.
+* Requests and responses take the time they would on a bus at the given
+* baud rate, 8E1. Reports poll cycles and register samples per second in
+* each mode.
+*
+* usage: rs232_latchbench [-t seconds per round] [-b baud rate]
+*                         [-n registers per read] [-s slaves]
+*                         [-d processing delay in ms]
+*/
+
+#define _GNU_SOURCE
+
+#include <glib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+
+#include "modbus.h"
+#include "bench.h"
+
+#define BENCH_MAX_SLAVES (16)
+#define BENCH_LATCH_REGISTER (0x0100)
+
+/* Time for a slave to answer a read of its snapshot */
+#define BENCH_TURNAROUND_US (1000)
+
+/* Set to stop the slaves */
+static volatile gboolean stop = FALSE;
+
+static guint baud = 9600;
+static guint processing_us = 50000;
+
+/*********************** INTERNAL FUNCTION DECLARATIONS ***********************/
+
+/*
+ * Simulated bus of slaves 1 to n, answer read holding registers requests
+ * and take a snapshot on a broadcast write of BENCH_LATCH_REGISTER
+ */
+static gpointer bus_thread(gpointer data);
+
+/*
+ * Run one polling round, with or without the broadcast latch
+ */
+static void run_round(struct modbus *m, gboolean latch, guint n_slaves,
+                      guint n_regs, guint seconds);
+
+/*********************** INTERNAL FUNCTION DEFINITIONS ************************/
+
+static gpointer bus_thread(gpointer data)
+{
+    int fd = GPOINTER_TO_INT(data);
+    gint64 latched_us[BENCH_MAX_SLAVES + 1] = { 0 };
+    guint char_us = 11 * 1000000 / baud;
+    unsigned char req[8];
+    unsigned char resp[256];
+    gsize got = 0;
+
+    while (!stop) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+        if (poll(&pfd, 1, 100) <= 0) {
+            got = 0;
+            continue;
+        }
+
+        ssize_t r = read(fd, req + got, sizeof(req) - got);
+        if (r <= 0) {
+            continue;
+        }
+        got += r;
+
+        /* Both requests used are 8 bytes */
+        if (got < sizeof(req)) {
+            continue;
+        }
+        got = 0;
+
+        if (modbus_check_crc16(req, sizeof(req)) < 0) {
+            continue;
+        }
+
+        /* The request takes its time on the bus */
+        g_usleep(sizeof(req) * char_us);
+        gint64 now = g_get_monotonic_time();
+
+        if (req[0] == MODBUS_BROADCAST_ADDRESS && req[1] == 0x06 &&
+            (req[2] << 8 | req[3]) == BENCH_LATCH_REGISTER) {
+            guint i;
+
+            for (i = 1; i <= BENCH_MAX_SLAVES; i++) {
+                latched_us[i] = now;
+            }
+            continue;
+        }
+
+        if (req[1] != 0x03 || !req[0] || req[0] > BENCH_MAX_SLAVES) {
+            continue;
+        }
+
+        /* A snapshot is answered once taken, anything else is measured
+         * first
+         */
+        gint64 ready_us = latched_us[req[0]] ?
+            latched_us[req[0]] + processing_us : now + processing_us;
+
+        latched_us[req[0]] = 0;
+        now = g_get_monotonic_time();
+        g_usleep(MAX(ready_us - now, 0) + BENCH_TURNAROUND_US);
+
+        guint n = MIN(req[4] << 8 | req[5], 125);
+        guint i;
+
+        resp[0] = req[0];
+        resp[1] = req[1];
+        resp[2] = 2 * n;
+        for (i = 0; i < n; i++) {
+            resp[3 + 2 * i] = req[0];
+            resp[4 + 2 * i] = i;
+        }
+        modbus_add_crc16(resp, 5 + 2 * n);
+
+        bench_write_paced(fd, resp, 5 + 2 * n, char_us);
+    }
+
+    return NULL;
+}
+
+static void run_round(struct modbus *m, gboolean latch, guint n_slaves,
+                      guint n_regs, guint seconds)
+{
+    guint64 cycles = 0;
+    guint64 samples = 0;
+    guint64 failures = 0;
+    gint64 start = g_get_monotonic_time();
+    gint64 end = start + seconds * G_USEC_PER_SEC;
+
+    /* modbus.c dumps every frame on stdout, keep that out of the report */
+    int saved = bench_mute_stdout();
+
+    while (g_get_monotonic_time() < end) {
+        guint address;
+
+        /* The application waits for the snapshot on a timer */
+        if (latch) {
+            modbus_broadcast_write_register(m, BENCH_LATCH_REGISTER, 1);
+            g_usleep(processing_us);
+        }
+
+        for (address = 1; address <= n_slaves; address++) {
+            size_t n = 0;
+            uint16_t *regs = NULL;
+
+            modbus_set_device_address(m, address);
+            if (!modbus_read_input_registers(m, 0, n_regs)) {
+                regs = modbus_parse_input_registers(m, &n);
+            }
+
+            if (regs && n == n_regs && regs[0] >> 8 == address) {
+                samples += n;
+            } else {
+                failures++;
+            }
+            g_free(regs);
+        }
+        cycles++;
+    }
+
+    bench_unmute_stdout(saved);
+
+    gdouble elapsed = (g_get_monotonic_time() - start) / 1e6;
+
+    printf("%-10s %6.2f cycles/s  %8.1f samples/s  %7.1f ms per cycle  "
+        "failures %llu\n", latch ? "latch" : "sequential",
+        cycles / elapsed, samples / elapsed,
+        cycles ? 1000.0 * elapsed / cycles : 0,
+        (unsigned long long) failures);
+}
+
+/*
+ * Our main function
+ */
+int
+main(int argc, char *argv[])
+{
+    guint seconds = 3;
+    guint n_regs = 10;
+    guint n_slaves = 4;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:b:n:s:d:")) != -1) {
+        switch (opt) {
+            case 't':
+                seconds = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                baud = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                n_regs = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                n_slaves = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                processing_us = strtoul(optarg, NULL, 0) * 1000;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-t seconds per round] "
+                    "[-b baud] [-n registers per read] [-s slaves] "
+                    "[-d processing delay in ms]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!seconds || !baud || !n_regs || n_regs > 125 || !n_slaves ||
+        n_slaves > BENCH_MAX_SLAVES) {
+        fprintf(stderr, "invalid duration, baud rate, register or slave "
+            "count\n");
+        return EXIT_FAILURE;
+    }
+
+    bench_quiet_log();
+
+    int master = bench_open_pty();
+    if (master < 0) {
+        return EXIT_FAILURE;
+    }
+
+    printf("%u s per round, %u slaves, %u registers per read, %u ms "
+        "processing, simulated bus at %u baud\n", seconds, n_slaves, n_regs,
+        processing_us / 1000, baud);
+
+    GThread *thread = g_thread_new("bus", bus_thread,
+        GINT_TO_POINTER(master));
+
+    struct modbus *m = modbus_init_device(ptsname(master), 1, PARITY_EVEN,
+                                          B9600, 0);
+    if (!m) {
+        fprintf(stderr, "failed to open %s\n", ptsname(master));
+        return EXIT_FAILURE;
+    }
+
+    /* Slow answers are expected without a snapshot */
+    modbus_set_response_timeout(m, processing_us / 1000 + 100);
+
+    run_round(m, FALSE, n_slaves, n_regs, seconds);
+    run_round(m, TRUE, n_slaves, n_regs, seconds);
+
+    stop = TRUE;
+    g_thread_join(thread);
+    modbus_close_device(&m);
+    close(master);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,196 @@
+/*
+* - RS 232 parser microbenchmark -
+*
+* Time the CRC check, the frame decoder and the register parser on valid,
+* corrupt, truncated and lying (byte count larger than the frame) read
+* registers responses of several sizes. Reports ns per frame, to keep
+* parser hardening from costing throughput.
+*
+* usage: rs232_parsebench [-n iterations]
+*/
+
+#include <glib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "modbus.h"
+#include "bench.h"
+
+#define BENCH_ADDRESS (0x01)
+
+enum bench_input {
+    INPUT_VALID,
+    INPUT_CORRUPT,      /* One data byte flipped */
+    INPUT_TRUNCATED,    /* Second half missing */
+    INPUT_LYING,        /* Valid CRC, byte count beyond the frame */
+    N_INPUTS
+};
+
+static const char *input_names[N_INPUTS] = {
+    [INPUT_VALID]     = "valid",
+    [INPUT_CORRUPT]   = "corrupt",
+    [INPUT_TRUNCATED] = "truncated",
+    [INPUT_LYING]     = "lying",
+};
+
+/* Keeps the compiler from dropping the work */
+static volatile size_t sink;
+
+/*********************** INTERNAL FUNCTION DECLARATIONS ***********************/
+
+/*
+ * Build response with count registers as received, address in buf[0]
+ */
+static size_t build_input(unsigned char *buf, guint count,
+                          enum bench_input input);
+
+/*
+ * Run one stage over the input, returns ns per frame
+ */
+static double run_crc(unsigned char *buf, size_t n, unsigned long iterations);
+
+static double run_decode(unsigned char *buf, size_t n,
+                         unsigned long iterations);
+
+static double run_parse(unsigned char *buf, size_t n,
+                        unsigned long iterations);
+
+/*********************** INTERNAL FUNCTION DEFINITIONS ************************/
+
+static size_t build_input(unsigned char *buf, guint count,
+                          enum bench_input input)
+{
+    size_t size = 5 + 2 * count;
+    guint i = 0;
+
+    buf[0] = BENCH_ADDRESS;
+    buf[1] = BENCH_ADDRESS;
+    buf[2] = 0x04;
+    buf[3] = 2 * count;
+    for (; i < 2 * count; i++) {
+        buf[4 + i] = i;
+    }
+
+    switch (input) {
+        case INPUT_VALID:
+            modbus_add_crc16(&buf[1], size);
+            break;
+        case INPUT_CORRUPT:
+            modbus_add_crc16(&buf[1], size);
+            buf[4] ^= 0x10;
+            break;
+        case INPUT_TRUNCATED:
+            modbus_add_crc16(&buf[1], size);
+            size = size / 2;
+            break;
+        case INPUT_LYING:
+            buf[3] = 2 * count + 2;
+            modbus_add_crc16(&buf[1], size);
+            break;
+        default:
+            break;
+    }
+
+    return size;
+}
+
+static double run_crc(unsigned char *buf, size_t n, unsigned long iterations)
+{
+    gint64 start = g_get_monotonic_time();
+    unsigned long i = 0;
+
+    for (; i < iterations; i++) {
+        sink = modbus_check_crc16(&buf[1], n);
+    }
+
+    return (g_get_monotonic_time() - start) * 1000.0 / iterations;
+}
+
+static double run_decode(unsigned char *buf, size_t n,
+                         unsigned long iterations)
+{
+    gint64 start = g_get_monotonic_time();
+    unsigned long i = 0;
+    size_t size;
+
+    for (; i < iterations; i++) {
+        sink = (size_t) modbus_decode_frame(buf, n, &size);
+    }
+
+    return (g_get_monotonic_time() - start) * 1000.0 / iterations;
+}
+
+static double run_parse(unsigned char *buf, size_t n,
+                        unsigned long iterations)
+{
+    gint64 start = g_get_monotonic_time();
+    unsigned long i = 0;
+
+    for (; i < iterations; i++) {
+        size_t size;
+        size_t nregs = 0;
+        unsigned char *frame = modbus_decode_frame(buf, n, &size);
+
+        if (frame) {
+            uint16_t *regs = modbus_parse_registers_frame(frame, size,
+                &nregs);
+            g_free(regs);
+        }
+        sink = nregs;
+    }
+
+    return (g_get_monotonic_time() - start) * 1000.0 / iterations;
+}
+
+/*
+ * Our main function
+ */
+int
+main(int argc, char *argv[])
+{
+    static const guint counts[] = { 2, 32, 125 };
+    unsigned long iterations = 1000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!iterations) {
+        fprintf(stderr, "invalid iteration count\n");
+        return EXIT_FAILURE;
+    }
+
+    bench_quiet_log();
+
+    printf("%lu iterations, ns per frame\n", iterations);
+    printf("regs  input        crc   decode  decode+parse\n");
+
+    guint c = 0;
+    for (; c < G_N_ELEMENTS(counts); c++) {
+        enum bench_input input = 0;
+
+        for (; input < N_INPUTS; input++) {
+            /* buf[0] holds the address, see modbus_decode_frame() */
+            unsigned char buf[1 + 5 + 2 * 125];
+            size_t n = build_input(buf, counts[c], input);
+
+            printf("%4u  %-9s %6.1f  %7.1f  %12.1f\n", counts[c],
+                input_names[input],
+                n > 2 ? run_crc(buf, n, iterations) : 0.0,
+                run_decode(buf, n, iterations),
+                run_parse(buf, n, iterations));
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
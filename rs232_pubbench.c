@@ -0,0 +1,221 @@
+/*
+* - RS 232 publish benchmark -
+*
+* Measure sample publishing cost on the poll path with 1 to 32 local
+* subscribers, a part of them deliberately slow. Reports poll cycles per
+* second, publish_commit() latency and delivered / dropped frames.
+*
+* usage: rs232_pubbench [-n cycles] [-p points] [-s max subscribers]
+*                       [-l slow subscribers in percent]
+*/
+
+#include <glib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "publish.h"
+#include "values.h"
+
+#define BENCH_SOCKET_PATH "/tmp/rs232-pubbench.sock"
+
+/* Time a slow subscriber spends on each frame */
+#define SLOW_FRAME_US (2000)
+
+struct bench_subscriber {
+    GThread *thread;
+    gboolean slow;
+    guint64 frames;
+    guint64 gaps;
+};
+
+/*********************** INTERNAL FUNCTION DECLARATIONS ***********************/
+
+/*
+ * Subscriber thread, reads frames until the publisher goes away
+ */
+static gpointer subscriber_thread(gpointer data);
+
+static int compare_gint64(const void *a, const void *b);
+
+/*
+ * Run one benchmark round with n_subs subscribers
+ */
+static void run_round(guint n_subs, guint n_slow, guint cycles, guint points);
+
+/*********************** INTERNAL FUNCTION DEFINITIONS ************************/
+
+static gpointer subscriber_thread(gpointer data)
+{
+    struct bench_subscriber *sub = data;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    guchar buf[65536];
+    guint32 last_sequence = 0;
+
+    g_strlcpy(addr.sun_path, BENCH_SOCKET_PATH, sizeof(addr.sun_path));
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        perror("subscriber connect");
+        return NULL;
+    }
+
+    for (;;) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+
+        if (n <= 0) {
+            break;
+        }
+
+        struct publish_header *hdr = (struct publish_header *) buf;
+        if (hdr->type != PUBLISH_TYPE_SAMPLES) {
+            continue;
+        }
+
+        if (last_sequence && hdr->sequence != last_sequence + 1) {
+            sub->gaps++;
+        }
+        last_sequence = hdr->sequence;
+        sub->frames++;
+
+        if (sub->slow) {
+            usleep(SLOW_FRAME_US);
+        }
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+static int compare_gint64(const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *) a;
+    gint64 y = *(const gint64 *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void run_round(guint n_subs, guint n_slow, guint cycles, guint points)
+{
+    struct bench_subscriber *subs = g_new0(struct bench_subscriber, n_subs);
+    gint64 *latency = g_new0(gint64, cycles);
+    struct publish_stats stats;
+    guint i;
+
+    publish_init(BENCH_SOCKET_PATH);
+
+    for (i = 0; i < n_subs; i++) {
+        subs[i].slow = i < n_slow;
+        subs[i].thread = g_thread_new("subscriber", subscriber_thread,
+            &subs[i]);
+    }
+
+    /* Wait for all subscribers to connect */
+    do {
+        g_main_context_iteration(NULL, FALSE);
+        publish_get_stats(&stats);
+    } while (stats.subscribers < n_subs);
+
+    gint64 start = g_get_monotonic_time();
+
+    for (i = 0; i < cycles; i++) {
+        guint p = 0;
+        for (; p < points; p++) {
+            publish_sample(p, i + p);
+        }
+
+        gint64 t0 = g_get_monotonic_time();
+        publish_commit();
+        latency[i] = g_get_monotonic_time() - t0;
+
+        /* Let the main loop serve subscribers that were not writable */
+        g_main_context_iteration(NULL, FALSE);
+    }
+
+    gint64 elapsed = g_get_monotonic_time() - start;
+
+    publish_get_stats(&stats);
+    publish_cleanup();
+
+    guint64 frames = 0;
+    guint64 gaps = 0;
+    for (i = 0; i < n_subs; i++) {
+        g_thread_join(subs[i].thread);
+        frames += subs[i].frames;
+        gaps += subs[i].gaps;
+    }
+
+    qsort(latency, cycles, sizeof(gint64), compare_gint64);
+
+    printf("%3u subs (%2u slow): %8.0f cycles/s  commit p50 %4lld us  "
+        "p99 %4lld us  max %5lld us  received %8llu  dropped %8llu\n",
+        n_subs, n_slow, cycles / (elapsed / 1e6),
+        (long long) latency[cycles / 2],
+        (long long) latency[cycles * 99 / 100],
+        (long long) latency[cycles - 1],
+        (unsigned long long) frames,
+        (unsigned long long) stats.dropped);
+
+    g_free(latency);
+    g_free(subs);
+}
+
+/*
+ * Our main function
+ */
+int
+main(int argc, char *argv[])
+{
+    guint cycles = 20000;
+    guint points = 64;
+    guint max_subs = 32;
+    guint slow_percent = 25;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:s:l:")) != -1) {
+        switch (opt) {
+            case 'n':
+                cycles = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                points = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                max_subs = strtoul(optarg, NULL, 0);
+                break;
+            case 'l':
+                slow_percent = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n cycles] [-p points] "
+                    "[-s max subscribers] [-l slow percent]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!cycles || !points || points > VALUES_MAX_POINTS) {
+        fprintf(stderr, "invalid cycle or point count\n");
+        return EXIT_FAILURE;
+    }
+
+    guint p = 0;
+    for (; p < points; p++) {
+        gchar name[VALUES_NAME_SIZE];
+        g_snprintf(name, sizeof(name), "P%u", p);
+        values_add_point(name);
+    }
+
+    printf("%u cycles of %u samples\n", cycles, points);
+
+    guint n_subs = 1;
+    for (; n_subs <= max_subs; n_subs *= 2) {
+        run_round(n_subs, n_subs * slow_percent / 100, cycles, points);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,210 @@
+/*
+* - RS 232 replay -
+*
+* Feed a serial traffic capture through the frame decoder and register
+* parser at full CPU speed. Used as parser throughput benchmark and to run
+* regression corpora recorded from field units.
+*
+* usage: rs232_replay [-n iterations] [-d] [-v] capture-file
+*
+*   -n  Replay the capture this many times (default 1)
+*   -d  Print decoded registers of each response frame (first iteration)
+*   -v  Do not silence log messages from the parser
+*/
+
+#include <glib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "modbus.h"
+#include "capture.h"
+#include "bench.h"
+
+#define REPLAY_BUFSIZE (1024)
+
+struct replay_stats {
+    unsigned long frames;
+    unsigned long valid;
+    unsigned long invalid;
+    unsigned long registers;
+    unsigned long bytes;
+};
+
+/*********************** INTERNAL FUNCTION DECLARATIONS ***********************/
+
+/*
+ * Decode and parse one accumulated response
+ */
+static void replay_frame(unsigned char *buf, size_t n, uint64_t ts_ns,
+                         gboolean dump, struct replay_stats *stats);
+
+/*
+ * Replay all records of a capture once
+ */
+static void replay_capture(struct capture_reader *reader, gboolean dump,
+                           struct replay_stats *stats);
+
+/*********************** INTERNAL FUNCTION DEFINITIONS ************************/
+
+static void replay_frame(unsigned char *buf, size_t n, uint64_t ts_ns,
+                         gboolean dump, struct replay_stats *stats)
+{
+    size_t size;
+    size_t nregs = 0;
+    uint16_t *regs = NULL;
+
+    stats->frames++;
+
+    unsigned char *frame = modbus_decode_frame(buf, n, &size);
+
+    if (frame) {
+        regs = modbus_parse_registers_frame(frame, size, &nregs);
+    }
+
+    if (regs) {
+        stats->valid++;
+        stats->registers += nregs;
+    } else {
+        stats->invalid++;
+    }
+
+    if (dump) {
+        printf("%llu.%06llu %s", (unsigned long long) ts_ns / 1000000000ULL,
+            (unsigned long long) (ts_ns / 1000) % 1000000ULL,
+            regs ? "OK  " : "BAD ");
+
+        size_t i = 0;
+        for (; i < nregs; i++) {
+            printf(" 0x%04x", regs[i]);
+        }
+        printf("\n");
+    }
+
+    g_free(regs);
+}
+
+static void replay_capture(struct capture_reader *reader, gboolean dump,
+                           struct replay_stats *stats)
+{
+    /* buf[0] is reserved for the device address, see modbus_decode_frame() */
+    unsigned char buf[REPLAY_BUFSIZE + 1];
+    size_t n = 0;
+    uint64_t ts_ns = 0;
+    struct capture_record record;
+
+    buf[0] = 0;
+
+    capture_reader_rewind(reader);
+
+    while (capture_reader_next(reader, &record)) {
+        /* A file not written by capture_dump() may hold empty records */
+        if (!record.len) {
+            continue;
+        }
+
+        if (record.dir == CAPTURE_DIR_TX) {
+            /* A new request ends the response to the previous one */
+            if (n) {
+                replay_frame(buf, n, ts_ns, dump, stats);
+                n = 0;
+            }
+
+            buf[0] = record.data[0];
+            continue;
+        }
+
+        if (!n) {
+            ts_ns = record.ts_ns;
+        }
+
+        size_t len = MIN(record.len, REPLAY_BUFSIZE - n);
+        memcpy(&buf[1 + n], record.data, len);
+        n += len;
+        stats->bytes += record.len;
+    }
+
+    if (n) {
+        replay_frame(buf, n, ts_ns, dump, stats);
+    }
+}
+
+/*
+ * Our main function
+ */
+int
+main(int argc, char *argv[])
+{
+    unsigned long iterations = 1;
+    gboolean dump = FALSE;
+    gboolean verbose = FALSE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:dv")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                dump = TRUE;
+                break;
+            case 'v':
+                verbose = TRUE;
+                break;
+            default:
+                fprintf(stderr,
+                    "usage: %s [-n iterations] [-d] [-v] capture-file\n",
+                    argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc || !iterations) {
+        fprintf(stderr, "usage: %s [-n iterations] [-d] [-v] capture-file\n",
+            argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (!verbose) {
+        bench_quiet_log();
+    }
+
+    struct capture_reader *reader = capture_reader_open(argv[optind]);
+
+    if (!reader) {
+        return EXIT_FAILURE;
+    }
+
+    struct replay_stats stats = {0,};
+    struct timespec start;
+    struct timespec stop;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    unsigned long i = 0;
+    for (; i < iterations; i++) {
+        replay_capture(reader, dump && i == 0, &stats);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    double elapsed_ns = (stop.tv_sec - start.tv_sec) * 1e9 +
+        (stop.tv_nsec - start.tv_nsec);
+
+    printf("frames: %lu valid: %lu invalid: %lu registers: %lu bytes: %lu\n",
+        stats.frames, stats.valid, stats.invalid, stats.registers,
+        stats.bytes);
+
+    if (stats.frames) {
+        printf("%.1f ns/frame, %.0f frames/s, %.2f MB/s\n",
+            elapsed_ns / stats.frames,
+            stats.frames / (elapsed_ns / 1e9),
+            stats.bytes / (elapsed_ns / 1e3));
+    }
+
+    capture_reader_close(&reader);
+
+    return EXIT_SUCCESS;
+}
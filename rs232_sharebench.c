@@ -0,0 +1,291 @@
+/*
+* - RS 232 port sharing benchmark -
+*
+* Share one end of a pseudo terminal between 1 to 32 local clients that
+* poll the same input registers, while a simulated slave on the other end
+* answers with the delays of a real bus. Reports requests served to the
+* clients against transactions run on the bus.
+*
+* usage: rs232_sharebench [-t seconds per round] [-s max clients]
+*                         [-b baud rate of simulated bus]
+*/
+
+#define _GNU_SOURCE
+
+#include <glib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "share.h"
+#include "modbus.h"
+#include "bench.h"
+
+#define BENCH_SOCKET_PATH "/tmp/rs232-sharebench.sock"
+#define BENCH_ADDRESS (0x01)
+#define BENCH_REGISTERS (10)
+
+struct bench_client {
+    GThread *thread;
+    guint id;
+    guint64 requests;
+    guint64 bad;
+};
+
+/* Set to stop the clients of a round, and the slave */
+static volatile gboolean stop_clients = FALSE;
+static volatile gboolean stop = FALSE;
+
+/* Time per byte on the simulated bus */
+static guint byte_us = 0;
+
+/*********************** INTERNAL FUNCTION DECLARATIONS ***********************/
+
+/*
+ * Simulated slave, answers read input registers after the time the request
+ * and response would take on the bus
+ */
+static gpointer slave_thread(gpointer data);
+
+/*
+ * Client thread, polls the same registers as all other clients
+ */
+static gpointer client_thread(gpointer data);
+
+/*
+ * Run one benchmark round with n_clients clients
+ */
+static void run_round(int port, guint n_clients, guint seconds);
+
+/*********************** INTERNAL FUNCTION DEFINITIONS ************************/
+
+static gpointer slave_thread(gpointer data)
+{
+    int fd = GPOINTER_TO_INT(data);
+    unsigned char req[8];
+    unsigned char resp[SHARE_FRAME_SIZE];
+    gsize got = 0;
+
+    while (!stop) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+
+        ssize_t n = read(fd, &req[got], sizeof(req) - got);
+        if (n <= 0) {
+            continue;
+        }
+        got += n;
+
+        if (got < sizeof(req)) {
+            continue;
+        }
+        got = 0;
+
+        if (modbus_check_crc16(req, sizeof(req)) < 0 || req[1] != 0x04) {
+            continue;
+        }
+
+        guint count = MIN(req[5], BENCH_REGISTERS);
+        gsize len = 3 + 2 * count + 2;
+        guint i = 0;
+
+        resp[0] = req[0];
+        resp[1] = req[1];
+        resp[2] = 2 * count;
+        for (; i < count; i++) {
+            resp[3 + 2 * i] = 0;
+            resp[4 + 2 * i] = i;
+        }
+        modbus_add_crc16(resp, len);
+
+        /* Request, turnaround of 3.5 characters and response on the bus */
+        usleep(byte_us * (sizeof(req) + 4 + len));
+
+        if (write(fd, resp, len) != (ssize_t) len) {
+            perror("slave write");
+        }
+    }
+
+    return NULL;
+}
+
+static gpointer client_thread(gpointer data)
+{
+    struct bench_client *client = data;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    unsigned char packet[sizeof(struct share_header) + SHARE_FRAME_SIZE];
+    struct share_header hdr = { .tag = 0 };
+
+    g_strlcpy(addr.sun_path, BENCH_SOCKET_PATH, sizeof(addr.sun_path));
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        perror("client connect");
+        return NULL;
+    }
+
+    while (!stop_clients) {
+        unsigned char *req = packet + sizeof(hdr);
+
+        hdr.tag++;
+        memcpy(packet, &hdr, sizeof(hdr));
+        req[0] = BENCH_ADDRESS;
+        req[1] = 0x04;
+        req[2] = 0;
+        req[3] = 0;
+        req[4] = 0;
+        req[5] = BENCH_REGISTERS;
+        modbus_add_crc16(req, 8);
+
+        if (send(fd, packet, sizeof(hdr) + 8, 0) < 0) {
+            break;
+        }
+
+        ssize_t n = recv(fd, packet, sizeof(packet), 0);
+        if (n <= 0) {
+            break;
+        }
+
+        struct share_header *resp = (struct share_header *) packet;
+        gsize len = n - sizeof(hdr);
+
+        /* Round is over */
+        if (resp->status == SHARE_CLOSED) {
+            break;
+        }
+
+        if (resp->tag != hdr.tag || resp->status != SHARE_OK ||
+            len != 3 + 2 * BENCH_REGISTERS + 2 ||
+            modbus_check_crc16(packet + sizeof(hdr), len) < 0) {
+            client->bad++;
+        } else {
+            client->requests++;
+        }
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+static void run_round(int port, guint n_clients, guint seconds)
+{
+    struct bench_client *clients = g_new0(struct bench_client, n_clients);
+    struct share_stats stats;
+    guint i;
+
+    share_init(BENCH_SOCKET_PATH);
+    share_set_fd(port);
+    stop_clients = FALSE;
+
+    for (i = 0; i < n_clients; i++) {
+        clients[i].id = i;
+        clients[i].thread = g_thread_new("client", client_thread,
+            &clients[i]);
+    }
+
+    gint64 end = g_get_monotonic_time() + seconds * G_USEC_PER_SEC;
+
+    while (g_get_monotonic_time() < end) {
+        g_main_context_iteration(NULL, FALSE);
+        g_usleep(100);
+    }
+
+    stop_clients = TRUE;
+    share_get_stats(&stats);
+    share_cleanup();
+
+    guint64 requests = 0;
+    guint64 bad = 0;
+    for (i = 0; i < n_clients; i++) {
+        g_thread_join(clients[i].thread);
+        requests += clients[i].requests;
+        bad += clients[i].bad;
+    }
+
+    printf("%3u clients: %7.1f requests/s  %6.1f transactions/s  "
+        "coalesced %5.1f %%  timeouts %llu  bad %llu\n",
+        n_clients, requests / (double) seconds,
+        stats.transactions / (double) seconds,
+        stats.requests ? 100.0 * stats.coalesced / stats.requests : 0,
+        (unsigned long long) stats.timeouts,
+        (unsigned long long) bad);
+
+    g_free(clients);
+}
+
+/*
+ * Our main function
+ */
+int
+main(int argc, char *argv[])
+{
+    guint seconds = 2;
+    guint max_clients = 32;
+    guint baud = 9600;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:s:b:")) != -1) {
+        switch (opt) {
+            case 't':
+                seconds = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                max_clients = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                baud = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-t seconds per round] "
+                    "[-s max clients] [-b baud]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!seconds || !baud || max_clients > SHARE_MAX_CLIENTS) {
+        fprintf(stderr, "invalid duration, baud rate or client count\n");
+        return EXIT_FAILURE;
+    }
+
+    /* 11 bits per character with parity and stop bit */
+    byte_us = 11 * 1000000 / baud;
+
+    int master = bench_open_pty();
+    if (master < 0) {
+        return EXIT_FAILURE;
+    }
+
+    int slave = bench_open_pts(master, 0);
+    if (slave < 0) {
+        return EXIT_FAILURE;
+    }
+
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+    printf("%u s per round, simulated bus at %u baud\n", seconds, baud);
+
+    GThread *thread = g_thread_new("slave", slave_thread,
+        GINT_TO_POINTER(slave));
+
+    guint n_clients = 1;
+    for (; n_clients <= max_clients; n_clients *= 2) {
+        run_round(master, n_clients, seconds);
+    }
+
+    stop = TRUE;
+    g_thread_join(thread);
+    close(slave);
+    close(master);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,266 @@
+/*
+* - RS 232 modbus slave benchmark -
+*
+* Run the modbus slave on one end of a pseudo terminal and act as master on
+* the other end. A mix of read and write requests is sent while another
+* thread keeps changing the register image. Reports request to response
+* latency as seen by the master and how often responses came from the cache.
+*
+* usage: rs232_slavebench [-n requests] [-c registers per read]
+*                         [-u register updates per ms]
+*/
+
+#define _GNU_SOURCE
+
+#include <glib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+
+#include "modbus.h"
+#include "modbus_slave.h"
+#include "serial.h"
+#include "bench.h"
+
+#define BENCH_ADDRESS (0x01)
+#define BENCH_REGISTERS (1024)
+
+/* Time to wait for a response before counting it as lost */
+#define RESPONSE_TIMEOUT_MS (1000)
+
+struct bench_updater {
+    struct modbus_slave *slave;
+    guint per_ms;
+    volatile gboolean stop;
+};
+
+/*********************** INTERNAL FUNCTION DECLARATIONS ***********************/
+
+/*
+ * Updater thread, changes input registers until told to stop
+ */
+static gpointer updater_thread(gpointer data);
+
+static int compare_gint64(const void *a, const void *b);
+
+/*
+ * Send request and read the whole response, returns response length or -1
+ */
+static int transact(int fd, unsigned char *req, size_t len,
+                    unsigned char *resp, size_t expected);
+
+/*********************** INTERNAL FUNCTION DEFINITIONS ************************/
+
+static gpointer updater_thread(gpointer data)
+{
+    struct bench_updater *u = data;
+    guint16 value = 0;
+
+    while (!u->stop) {
+        guint i = 0;
+        for (; i < u->per_ms; i++, value++) {
+            modbus_slave_set_register(u->slave, MODBUS_SLAVE_INPUT,
+                (value * 7) % BENCH_REGISTERS, value);
+        }
+        usleep(1000);
+    }
+
+    return NULL;
+}
+
+static int compare_gint64(const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *) a;
+    gint64 y = *(const gint64 *) b;
+
+    return (x > y) - (x < y);
+}
+
+static int transact(int fd, unsigned char *req, size_t len,
+                    unsigned char *resp, size_t expected)
+{
+    size_t got = 0;
+
+    modbus_add_crc16(req, len);
+
+    if (write(fd, req, len) != (ssize_t) len) {
+        return -1;
+    }
+
+    while (got < expected) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+        if (poll(&pfd, 1, RESPONSE_TIMEOUT_MS) <= 0) {
+            return -1;
+        }
+
+        ssize_t n = read(fd, &resp[got], expected - got);
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+
+        /* Exception responses are shorter */
+        if (got >= 5 && (resp[1] & 0x80)) {
+            return 5;
+        }
+    }
+
+    return got;
+}
+
+/*
+ * Our main function
+ */
+int
+main(int argc, char *argv[])
+{
+    guint requests = 20000;
+    guint count = 64;
+    guint per_ms = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:u:")) != -1) {
+        switch (opt) {
+            case 'n':
+                requests = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                count = strtoul(optarg, NULL, 0);
+                break;
+            case 'u':
+                per_ms = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n requests] "
+                    "[-c registers per read] [-u updates per ms]\n",
+                    argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!requests || !count || count > 125) {
+        fprintf(stderr, "invalid request or register count\n");
+        return EXIT_FAILURE;
+    }
+
+    int master = bench_open_pty();
+    if (master < 0) {
+        return EXIT_FAILURE;
+    }
+
+    bench_make_raw(master);
+
+    struct modbus *modbus = modbus_init_device(ptsname(master),
+        BENCH_ADDRESS, PARITY_NONE, B115200, 0);
+    if (!modbus) {
+        return EXIT_FAILURE;
+    }
+
+    /* No real line, any gap is long enough */
+    struct modbus_slave *slave = modbus_slave_new(modbus, BENCH_REGISTERS,
+        2000);
+    if (!slave) {
+        return EXIT_FAILURE;
+    }
+
+    struct bench_updater updater = { .slave = slave, .per_ms = per_ms };
+    GThread *thread = g_thread_new("updater", updater_thread, &updater);
+
+    gint64 *latency = g_new0(gint64, requests);
+    guint lost = 0;
+    guint bad = 0;
+    guint i;
+
+    printf("%u requests, %u registers per read, %u updates per ms\n",
+        requests, count, per_ms);
+
+    gint64 start = g_get_monotonic_time();
+
+    for (i = 0; i < requests; i++) {
+        unsigned char req[MODBUS_SLAVE_FRAME_SIZE];
+        unsigned char resp[MODBUS_SLAVE_FRAME_SIZE];
+        guint16 addr = (i % 4) * count;
+        size_t len = 8;
+        size_t expected = 8;
+
+        req[0] = BENCH_ADDRESS;
+
+        /* Mostly reads, like a PLC polling its inputs */
+        switch (i % 16) {
+            case 0:
+                req[1] = 0x06;
+                req[2] = addr >> 8;
+                req[3] = addr & 0xFF;
+                req[4] = i >> 8;
+                req[5] = i & 0xFF;
+                break;
+            case 1:
+                req[1] = 0x10;
+                req[2] = addr >> 8;
+                req[3] = addr & 0xFF;
+                req[4] = 0;
+                req[5] = 4;
+                req[6] = 8;
+                memset(&req[7], i & 0xFF, 8);
+                len = 9 + 8;
+                break;
+            default:
+                req[1] = i % 2 ? 0x04 : 0x03;
+                req[2] = addr >> 8;
+                req[3] = addr & 0xFF;
+                req[4] = 0;
+                req[5] = count;
+                expected = 3 + 2 * count + 2;
+                break;
+        }
+
+        gint64 t0 = g_get_monotonic_time();
+        int n = transact(master, req, len, resp, expected);
+        latency[i] = g_get_monotonic_time() - t0;
+
+        if (n < 0) {
+            lost++;
+        } else if (n != (int) expected ||
+                   modbus_check_crc16(resp, n) < 0) {
+            bad++;
+        }
+    }
+
+    gint64 elapsed = g_get_monotonic_time() - start;
+
+    updater.stop = TRUE;
+    g_thread_join(thread);
+
+    struct modbus_slave_stats stats;
+    modbus_slave_get_stats(slave, &stats);
+    modbus_slave_free(&slave);
+    close(master);
+
+    qsort(latency, requests, sizeof(gint64), compare_gint64);
+
+    printf("%8.0f requests/s  p50 %4lld us  p99 %4lld us  max %5lld us  "
+        "lost %u  bad %u\n",
+        requests / (elapsed / 1e6),
+        (long long) latency[requests / 2],
+        (long long) latency[requests * 99 / 100],
+        (long long) latency[requests - 1],
+        lost, bad);
+    printf("slave: %llu requests  %llu cache hits  %llu partial  "
+        "%llu exceptions  %llu crc errors  mean %.1f us  max %lld us\n",
+        (unsigned long long) stats.requests,
+        (unsigned long long) stats.cache_hits,
+        (unsigned long long) stats.cache_updates,
+        (unsigned long long) stats.exceptions,
+        (unsigned long long) stats.crc_errors,
+        stats.requests ? (double) stats.total_latency_us / stats.requests : 0,
+        (long long) stats.max_latency_us);
+
+    g_free(latency);
+
+    return lost || bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+/*
+ * serial port utility functions
+ */
+
+/****************** INCLUDE FILES SECTION ***********************************/
+
+#include <glib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "serial.h"
+
+/****************** CONSTANT AND MACRO SECTION ******************************/
+
+/****************** TYPE DEFINITION SECTION *********************************/
+
+/****************** GLOBAL VARIABLE DECLARATION SECTION *********************/
+
+/****************** EXPORTED FUNCTION DEFINITION SECTION *******************/
+
+/* open serial port for read and write */
+int serial_open_tty(const char *path)
+{
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NDELAY);
+
+    if (fd < 0) {
+        g_warning("Failed to open serial port %s: %s", path, strerror(errno));
+    } else {
+        g_message("%s() [%s:%d] - Opened serial port fd=%d",
+                        __FUNCTION__, __FILE__, __LINE__, fd);
+    }
+
+    return fd;
+}
+
+/*
+ * Configure serial port for raw 8 bit transfers
+ */
+int serial_configure(int fd, enum parity par, speed_t baud, int stop_bit)
+{
+    /* Configure serial port according to desired settings */
+    struct termios ts = {0,};
+
+    if (tcgetattr(fd, &ts)) {
+        g_warning("Failed to get serial port settings: %s", strerror(errno));
+        return -1;
+    }
+
+    /* Set input and output baud rate the same */
+    cfsetispeed(&ts, baud);
+    cfsetospeed(&ts, baud);
+
+    /* Only local ownership of port, allow read.*/
+    ts.c_cflag |= (CLOCAL | CREAD);
+
+    /* Add extra stop bit if requested */
+    if (stop_bit) {
+        ts.c_cflag |= CSTOPB;
+    } else {
+        ts.c_cflag &= ~CSTOPB;
+    }
+
+    /* Setup parity bit according to input configuration */
+    switch (par) {
+        case PARITY_NONE:
+            ts.c_cflag &= ~PARENB;
+            break;
+        case PARITY_ODD:
+            ts.c_cflag |= (PARENB | PARODD);
+            break;
+        case PARITY_EVEN:
+            ts.c_cflag |= PARENB;
+            ts.c_cflag &= ~PARODD;
+            break;
+        default:
+            g_warning("Unknown parity %d", par);
+            return -1;
+    }
+
+    /* Set 8 bit data size */
+    ts.c_cflag &= ~CSIZE; /* Mask the character size bits */
+    ts.c_cflag |= CS8;    /* Select 8 data bits */
+
+    /* Make raw */
+    ts.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+
+    /* Raw input, no CR/NL translation or software flow control */
+    ts.c_iflag &= ~(IXON | IXOFF | IXANY | ICRNL | INLCR | IGNCR | ISTRIP);
+
+    /* Raw output, no post processing of data */
+    ts.c_oflag &= ~OPOST;
+
+    /* Physically commit changes to serial port immediately */
+    if (tcsetattr(fd, TCSANOW, &ts)) {
+        g_warning("Failed to configure TTY terminal: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Bits per second of a termios speed constant
+ */
+unsigned int serial_speed_bps(speed_t baud)
+{
+    switch (baud) {
+        case B1200:   return 1200;
+        case B2400:   return 2400;
+        case B4800:   return 4800;
+        case B9600:   return 9600;
+        case B19200:  return 19200;
+        case B38400:  return 38400;
+        case B57600:  return 57600;
+        case B115200: return 115200;
+        case B230400: return 230400;
+        case B460800: return 460800;
+        case B921600: return 921600;
+        default:      return 0;
+    }
+}
+
+
+/****************** END OF FILE serial.c *******************************/
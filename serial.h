@@ -0,0 +1,42 @@
+/*
+ * serial port utility functions
+ */
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+/****************** INCLUDE FILES SECTION ***********************************/
+
+#include <termios.h>
+
+/****************** CONSTANT AND MACRO SECTION ******************************/
+
+/****************** TYPE DEFINITION SECTION *********************************/
+
+enum parity {
+    PARITY_NONE,
+    PARITY_ODD,
+    PARITY_EVEN
+};
+
+/****************** GLOBAL VARIABLE DECLARATION SECTION *********************/
+
+/****************** EXPORTED FUNCTION DECLARATION SECTION *******************/
+
+/*
+ * Open serial port for non-blocking read and write, returns -1 on failure
+ */
+int serial_open_tty(const char *path);
+
+/*
+ * Configure serial port for raw 8 bit transfers, returns -1 on failure
+ */
+int serial_configure(int fd, enum parity par, speed_t baud, int stop_bit);
+
+/*
+ * Bits per second of a termios speed constant, 0 if unknown
+ */
+unsigned int serial_speed_bps(speed_t baud);
+
+#endif /* SERIAL_H */
+/****************** END OF FILE serial.h *******************************/
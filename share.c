@@ -0,0 +1,606 @@
+#include <glib.h>
+#include <glib-unix.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "share.h"
+#include "modbus.h"
+#include "capture.h"
+#include "profile.h"
+#include "debug.h"
+
+/** @file share.c
+ * @Brief Serial port sharing implementation
+ *
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+/* Max number of queued transactions, over all clients */
+#define SHARE_QUEUE_LEN (SHARE_MAX_CLIENTS * SHARE_MAX_PENDING)
+
+/* Max number of requests served by one transaction */
+#define SHARE_MAX_WAITERS (16)
+
+#define BROADCAST_ADDRESS (0x00)
+
+/******************** LOCAL VARIABLE DECLARATION SECTION **********************/
+
+struct client
+{
+    int fd;
+    guint watch;
+    guint pending;          /* Requests waiting for a response */
+};
+
+struct waiter
+{
+    struct client *client;  /* NULL once the client disconnected */
+    guint32 tag;
+};
+
+struct transaction
+{
+    guchar request[SHARE_FRAME_SIZE];
+    gsize len;
+    struct waiter waiters[SHARE_MAX_WAITERS];
+    guint n_waiters;
+};
+
+struct share
+{
+    int fd;
+    gchar *path;
+    guint watch;
+
+    struct client *clients[SHARE_MAX_CLIENTS];
+    guint n_clients;
+
+    struct transaction *queue[SHARE_QUEUE_LEN];
+    guint head;
+    guint count;
+
+    /* Transaction on the bus */
+    struct transaction *current;
+    guchar response[SHARE_FRAME_SIZE];
+    gsize response_len;
+    guint port_watch;
+    guint timer;
+
+    int port;               /* -1 while closed */
+
+    share_func claim;
+    gpointer claim_data;
+
+    struct share_stats stats;
+};
+
+/**
+ * Port sharing state, NULL when sharing is not enabled.
+ */
+static struct share *share = NULL;
+
+/******************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static void reply(struct client *client, guint32 tag,
+                  enum share_status status,
+                  const guchar *frame, gsize len);
+
+static void submit(struct client *client, guint32 tag,
+                   const guchar *frame, gsize len);
+
+static void kick(void);
+
+static void start(struct transaction *t);
+
+static void finish(enum share_status status);
+
+static void fail_queued(enum share_status status);
+
+static gsize response_length(const guchar *frame, gsize len);
+
+static void disconnect(struct client *client);
+
+static gboolean on_accept(gint fd, GIOCondition condition, gpointer data);
+
+static gboolean on_client_input(gint fd, GIOCondition condition,
+                                gpointer data);
+
+static gboolean on_port_input(gint fd, GIOCondition condition, gpointer data);
+
+static gboolean on_timeout(gpointer data);
+
+/******************** LOCAL FUNCTION DEFINTION SECTION ************************/
+
+static void reply(struct client *client, guint32 tag,
+                  enum share_status status,
+                  const guchar *frame, gsize len)
+{
+    guchar packet[sizeof(struct share_header) + SHARE_FRAME_SIZE];
+    struct share_header hdr = { .tag = tag, .status = status };
+
+    memcpy(packet, &hdr, sizeof(hdr));
+    memcpy(packet + sizeof(hdr), frame, len);
+
+    /* Never wait for a client, the bus is waiting */
+    if (send(client->fd, packet, sizeof(hdr) + len,
+             MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        DBG_LOG("Response to client fd=%d dropped: %s", client->fd,
+            strerror(errno));
+        share->stats.dropped++;
+    }
+}
+
+static void submit(struct client *client, guint32 tag,
+                   const guchar *frame, gsize len)
+{
+    struct transaction *t = NULL;
+    guint i;
+
+    /* Reads of coils, inputs and registers have no side effects */
+    if (frame[1] >= 0x01 && frame[1] <= 0x04) {
+        for (i = 0; i < share->count; i++) {
+            struct transaction *q =
+                share->queue[(share->head + i) % SHARE_QUEUE_LEN];
+
+            if (q->len == len && q->n_waiters < SHARE_MAX_WAITERS &&
+                !memcmp(q->request, frame, len)) {
+                t = q;
+                share->stats.coalesced++;
+                break;
+            }
+        }
+    }
+
+    if (!t) {
+        t = g_new0(struct transaction, 1);
+        memcpy(t->request, frame, len);
+        t->len = len;
+
+        share->queue[(share->head + share->count) % SHARE_QUEUE_LEN] = t;
+        share->count++;
+    }
+
+    t->waiters[t->n_waiters].client = client;
+    t->waiters[t->n_waiters].tag = tag;
+    t->n_waiters++;
+
+    client->pending++;
+    share->stats.requests++;
+
+    kick();
+}
+
+/*
+ * Start next queued transaction if the bus is free
+ */
+static void kick(void)
+{
+    while (!share->current && share->port >= 0) {
+        /* The application goes first, it has waited for one transaction */
+        if (share->claim) {
+            share_func claim = share->claim;
+
+            share->claim = NULL;
+            claim(share->claim_data);
+            continue;
+        }
+
+        if (!share->count) {
+            return;
+        }
+
+        struct transaction *t = share->queue[share->head];
+        share->head = (share->head + 1) % SHARE_QUEUE_LEN;
+        share->count--;
+
+        start(t);
+    }
+}
+
+static void start(struct transaction *t)
+{
+    guchar stale[SHARE_FRAME_SIZE];
+
+    share->current = t;
+    share->response_len = 0;
+    share->stats.transactions++;
+
+    /* Drop leftovers of an earlier transaction that timed out */
+    while (read(share->port, stale, sizeof(stale)) > 0) {
+    }
+
+    if (write(share->port, t->request, t->len) != (ssize_t) t->len) {
+        ERR("Failed to write shared request: %s", strerror(errno));
+        finish(SHARE_TIMEOUT);
+        return;
+    }
+    capture_record(CAPTURE_DIR_TX, t->request, t->len);
+
+    if (t->request[0] == BROADCAST_ADDRESS) {
+        share->timer = profile_timeout_add("share turnaround",
+            SHARE_TURNAROUND_MS, on_timeout, NULL);
+        return;
+    }
+
+    share->port_watch = profile_fd_add("share port", share->port, G_IO_IN,
+        on_port_input, NULL);
+    share->timer = profile_timeout_add("share timeout",
+        SHARE_RESPONSE_TIMEOUT_MS, on_timeout, NULL);
+}
+
+/*
+ * Hand the response of the current transaction to all its clients
+ */
+static void finish(enum share_status status)
+{
+    struct transaction *t = share->current;
+    guint i;
+
+    if (share->port_watch) {
+        g_source_remove(share->port_watch);
+        share->port_watch = 0;
+    }
+    if (share->timer) {
+        g_source_remove(share->timer);
+        share->timer = 0;
+    }
+
+    if (status == SHARE_TIMEOUT) {
+        share->stats.timeouts++;
+    }
+
+    for (i = 0; i < t->n_waiters; i++) {
+        struct client *client = t->waiters[i].client;
+
+        if (client) {
+            reply(client, t->waiters[i].tag, status, share->response,
+                  status == SHARE_OK ? share->response_len : 0);
+            client->pending--;
+        }
+    }
+
+    g_free(t);
+    share->current = NULL;
+
+    kick();
+}
+
+static void fail_queued(enum share_status status)
+{
+    while (share->count) {
+        struct transaction *t = share->queue[share->head];
+        guint i;
+
+        share->head = (share->head + 1) % SHARE_QUEUE_LEN;
+        share->count--;
+
+        for (i = 0; i < t->n_waiters; i++) {
+            struct client *client = t->waiters[i].client;
+
+            if (client) {
+                reply(client, t->waiters[i].tag, status, NULL, 0);
+                client->pending--;
+                share->stats.rejected++;
+            }
+        }
+        g_free(t);
+    }
+}
+
+/*
+ * Length of the response starting at frame, 0 if not known (yet)
+ */
+static gsize response_length(const guchar *frame, gsize len)
+{
+    if (len < 2) {
+        return 0;
+    }
+
+    if (frame[1] & 0x80) {
+        return 5;
+    }
+
+    switch (frame[1]) {
+        case 0x01:
+        case 0x02:
+        case 0x03:
+        case 0x04:
+            return len < 3 ? 0 : 5 + frame[2];
+        case 0x05:
+        case 0x06:
+        case 0x0F:
+        case 0x10:
+            return 8;
+        default:
+            /* Unknown function, completed by the timeout */
+            return 0;
+    }
+}
+
+static void disconnect(struct client *client)
+{
+    guint i;
+
+    for (i = 0; i < share->n_clients; i++) {
+        if (share->clients[i] == client) {
+            share->clients[i] = share->clients[--share->n_clients];
+            break;
+        }
+    }
+
+    /* Queued requests still run, there may be other waiters */
+    if (client->pending) {
+        guint j;
+
+        for (i = 0; i <= share->count; i++) {
+            struct transaction *t = i < share->count ?
+                share->queue[(share->head + i) % SHARE_QUEUE_LEN] :
+                share->current;
+
+            for (j = 0; t && j < t->n_waiters; j++) {
+                if (t->waiters[j].client == client) {
+                    t->waiters[j].client = NULL;
+                }
+            }
+        }
+    }
+
+    if (client->watch) {
+        g_source_remove(client->watch);
+    }
+
+    close(client->fd);
+    g_free(client);
+
+    share->stats.clients = share->n_clients;
+
+    LOG("Bus client disconnected, %u left", share->n_clients);
+}
+
+static gboolean on_accept(gint fd, GIOCondition condition, gpointer data)
+{
+    int client_fd = accept(fd, NULL, NULL);
+
+    if (client_fd < 0) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (share->n_clients >= SHARE_MAX_CLIENTS) {
+        ERR("Too many bus clients, rejecting connection");
+        close(client_fd);
+        return G_SOURCE_CONTINUE;
+    }
+
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+
+    struct client *client = g_new0(struct client, 1);
+    client->fd = client_fd;
+    client->watch = profile_fd_add("share client", client_fd,
+        G_IO_IN | G_IO_HUP | G_IO_ERR, on_client_input, client);
+    share->clients[share->n_clients++] = client;
+    share->stats.clients = share->n_clients;
+
+    LOG("Bus client connected, %u in total", share->n_clients);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_client_input(gint fd, GIOCondition condition,
+                                gpointer data)
+{
+    struct client *client = data;
+    guchar packet[sizeof(struct share_header) + SHARE_FRAME_SIZE + 1];
+    struct share_header hdr;
+
+    ssize_t n = recv(fd, packet, sizeof(packet), MSG_DONTWAIT);
+
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (n <= 0) {
+        client->watch = 0;
+        disconnect(client);
+        return G_SOURCE_REMOVE;
+    }
+
+    if ((gsize) n < sizeof(hdr)) {
+        share->stats.rejected++;
+        return G_SOURCE_CONTINUE;
+    }
+
+    memcpy(&hdr, packet, sizeof(hdr));
+
+    guchar *frame = packet + sizeof(hdr);
+    gsize len = n - sizeof(hdr);
+    enum share_status status = SHARE_OK;
+
+    if (len < 4 || len > SHARE_FRAME_SIZE ||
+        modbus_check_crc16(frame, len) < 0) {
+        status = SHARE_INVALID;
+    } else if (share->port < 0) {
+        status = SHARE_CLOSED;
+    } else if (client->pending >= SHARE_MAX_PENDING ||
+               share->count >= SHARE_QUEUE_LEN) {
+        status = SHARE_BUSY;
+    }
+
+    if (status != SHARE_OK) {
+        share->stats.rejected++;
+        reply(client, hdr.tag, status, NULL, 0);
+        return G_SOURCE_CONTINUE;
+    }
+
+    submit(client, hdr.tag, frame, len);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_port_input(gint fd, GIOCondition condition, gpointer data)
+{
+    ssize_t n = read(fd, share->response + share->response_len,
+                     sizeof(share->response) - share->response_len);
+
+    if (n <= 0) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    capture_record(CAPTURE_DIR_RX, share->response + share->response_len, n);
+    share->response_len += n;
+
+    gsize len = response_length(share->response, share->response_len);
+
+    if (len && share->response_len >= len) {
+        share->response_len = len;
+        share->port_watch = 0;
+        finish(modbus_check_crc16(share->response, len) < 0 ?
+            SHARE_TIMEOUT : SHARE_OK);
+        return G_SOURCE_REMOVE;
+    }
+
+    if (share->response_len == sizeof(share->response)) {
+        share->port_watch = 0;
+        finish(SHARE_TIMEOUT);
+        return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_timeout(gpointer data)
+{
+    gboolean valid = share->response_len >= 4 &&
+        modbus_check_crc16(share->response, share->response_len) == 0;
+
+    share->timer = 0;
+
+    /* Broadcasts have no response, unknown functions end here */
+    if (share->current->request[0] == BROADCAST_ADDRESS || valid) {
+        finish(SHARE_OK);
+    } else {
+        finish(SHARE_TIMEOUT);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+gboolean share_init(const gchar *path)
+{
+    g_assert(path);
+
+    if (share) {
+        return TRUE;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        ERR("Socket path %s too long", path);
+        return FALSE;
+    }
+    g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    if (fd < 0) {
+        ERR("Failed to create bus socket: %s", strerror(errno));
+        return FALSE;
+    }
+
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+        listen(fd, 8)) {
+        ERR("Failed to listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return FALSE;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    share = g_new0(struct share, 1);
+    share->fd    = fd;
+    share->path  = g_strdup(path);
+    share->port  = -1;
+    share->watch = profile_fd_add("share accept", fd, G_IO_IN, on_accept, NULL);
+
+    LOG("Sharing serial port on %s", path);
+
+    return TRUE;
+}
+
+void share_cleanup(void)
+{
+    if (!share) {
+        return;
+    }
+
+    share->claim = NULL;
+    share_set_fd(-1);
+
+    while (share->n_clients) {
+        disconnect(share->clients[0]);
+    }
+
+    g_source_remove(share->watch);
+    close(share->fd);
+    unlink(share->path);
+
+    g_free(share->path);
+    g_free(share);
+    share = NULL;
+}
+
+void share_set_fd(int fd)
+{
+    if (!share) {
+        return;
+    }
+
+    if (fd < 0) {
+        share->port = -1;
+
+        if (share->current) {
+            finish(SHARE_CLOSED);
+        }
+        fail_queued(SHARE_CLOSED);
+        return;
+    }
+
+    share->port = fd;
+    kick();
+}
+
+gboolean share_claim(share_func func, gpointer data)
+{
+    g_assert(func);
+
+    if (!share || !share->current) {
+        return TRUE;
+    }
+
+    share->claim = func;
+    share->claim_data = data;
+
+    return FALSE;
+}
+
+void share_get_stats(struct share_stats *stats)
+{
+    g_assert(stats);
+
+    if (!share) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    *stats = share->stats;
+}
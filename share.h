@@ -0,0 +1,113 @@
+#ifndef INCLUSION_GUARD_SHARE_H
+#define INCLUSION_GUARD_SHARE_H
+
+#include <glib.h>
+
+/** @file share.h
+ * @Brief Local clients sharing the modbus serial port
+ *
+ * Only one master can drive the bus, so the port is owned by the
+ * application and other local tools run their modbus transactions through
+ * a SOCK_SEQPACKET Unix socket. A request packet is a share_header followed
+ * by a complete RTU request including CRC. The response packet carries the
+ * same tag, a status and the RTU response including CRC, if any.
+ *
+ * Transactions are queued first come, first served and run one at a time,
+ * interleaved with the application's own polling. A client can have at most
+ * SHARE_MAX_PENDING requests queued, so one busy client can not starve the
+ * others. Identical read requests that are queued at the same time are run
+ * as one bus transaction and the response goes to all of their clients.
+ *
+ * Responses to a client that does not read its socket are dropped.
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define SHARE_SOCKET_PATH "/tmp/rs232-bus.sock"
+
+/* Largest RTU frame */
+#define SHARE_FRAME_SIZE (256)
+
+#define SHARE_MAX_CLIENTS (32)
+
+/* Max number of queued requests per client */
+#define SHARE_MAX_PENDING (4)
+
+/* Time for a slave to answer, and to process a broadcast */
+#define SHARE_RESPONSE_TIMEOUT_MS (500)
+#define SHARE_TURNAROUND_MS (100)
+
+/******************** TYPE DEFINITION SECTION *********************************/
+
+enum share_status
+{
+    SHARE_OK,
+    SHARE_TIMEOUT,          /* No valid response from the slave */
+    SHARE_INVALID,          /* Malformed request or bad CRC */
+    SHARE_BUSY,             /* Too many requests queued */
+    SHARE_CLOSED            /* Serial port not open */
+};
+
+/**
+ * Header of every request and response packet.
+ */
+struct share_header
+{
+    guint32 tag;            /* Chosen by the client, echoed in the response */
+    guint8 status;          /* enum share_status, 0 in requests */
+    guint8 reserved[3];
+} __attribute__((packed));
+
+/**
+ * Port sharing counters.
+ */
+struct share_stats
+{
+    guint clients;
+    guint64 requests;       /* Requests accepted */
+    guint64 transactions;   /* Transactions run on the bus */
+    guint64 coalesced;      /* Requests that joined a queued transaction */
+    guint64 timeouts;
+    guint64 rejected;       /* Invalid, busy or closed */
+    guint64 dropped;        /* Responses not deliverable to the client */
+};
+
+/**
+ * Called when the bus has been claimed, see share_claim().
+ */
+typedef void (*share_func)(gpointer data);
+
+/******************** GLOBAL FUNCTION DECLARATION SECTION *********************/
+
+/**
+ * Start accepting clients on a Unix socket at path.
+ *
+ * @return TRUE on success, FALSE on any kind of error.
+ */
+gboolean share_init(const gchar *path);
+
+/**
+ * Fail all queued requests, disconnect clients and remove the socket.
+ */
+void share_cleanup(void);
+
+/**
+ * Set file descriptor of the serial port, -1 while it is closed. Queued
+ * requests fail when the port is closed.
+ */
+void share_set_fd(int fd);
+
+/**
+ * Claim the bus for a transaction of the application. Returns TRUE if the
+ * bus is free, the caller can then use it right away. Otherwise func is
+ * called once the running transaction is done, before any queued one. A
+ * newer claim replaces an older one that is still waiting.
+ */
+gboolean share_claim(share_func func, gpointer data);
+
+/**
+ * Get port sharing counters.
+ */
+void share_get_stats(struct share_stats *stats);
+
+#endif // INCLUSION_GUARD_SHARE_H
@@ -0,0 +1,73 @@
+#include <glib.h>
+
+#include "startup.h"
+#include "debug.h"
+
+/** @file startup.c
+ * @Brief Startup milestone instrumentation implementation
+ *
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+/******************** LOCAL VARIABLE DECLARATION SECTION **********************/
+
+static const gchar *milestone_names[STARTUP_N_MILESTONES] = {
+    [STARTUP_OVERLAY_READY] = "overlay ready",
+    [STARTUP_SERIAL_READY]  = "serial port ready",
+    [STARTUP_FIRST_SAMPLE]  = "first sample",
+    [STARTUP_FIRST_OVERLAY] = "first overlay",
+};
+
+static gint64 start_us = 0;
+
+/* Monotonic time a milestone was reached, 0 if not yet */
+static gint64 reached_us[STARTUP_N_MILESTONES];
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+void startup_begin(void)
+{
+    guint i = 0;
+
+    start_us = g_get_monotonic_time();
+
+    for (; i < STARTUP_N_MILESTONES; i++) {
+        reached_us[i] = 0;
+    }
+}
+
+void startup_mark(enum startup_milestone milestone)
+{
+    g_assert(milestone < STARTUP_N_MILESTONES);
+
+    if (reached_us[milestone] || !start_us) {
+        return;
+    }
+    reached_us[milestone] = g_get_monotonic_time();
+
+    LOG("Startup: %s after %lld ms", milestone_names[milestone],
+        (long long) startup_elapsed(milestone) / 1000);
+
+    if (milestone != STARTUP_FIRST_SAMPLE &&
+        milestone != STARTUP_FIRST_OVERLAY) {
+        return;
+    }
+
+    if (reached_us[STARTUP_FIRST_SAMPLE] && reached_us[STARTUP_FIRST_OVERLAY]) {
+        LOG("Startup: time to first sample %lld ms, to first overlay %lld ms",
+            (long long) startup_elapsed(STARTUP_FIRST_SAMPLE) / 1000,
+            (long long) startup_elapsed(STARTUP_FIRST_OVERLAY) / 1000);
+    }
+}
+
+gint64 startup_elapsed(enum startup_milestone milestone)
+{
+    g_assert(milestone < STARTUP_N_MILESTONES);
+
+    if (!reached_us[milestone]) {
+        return -1;
+    }
+
+    return reached_us[milestone] - start_us;
+}
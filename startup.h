@@ -0,0 +1,46 @@
+#ifndef INCLUSION_GUARD_STARTUP_H
+#define INCLUSION_GUARD_STARTUP_H
+
+#include <glib.h>
+
+/** @file startup.h
+ * @Brief Startup milestone instrumentation
+ *
+ * Records the time from process start to a few milestones, each one is
+ * logged the first time it is reached. Once both a first sample and a
+ * first overlay have been seen a one line summary is logged, that is what
+ * to look at when tuning startup.
+ */
+
+/******************** TYPE DEFINITION SECTION *********************************/
+
+enum startup_milestone
+{
+    STARTUP_OVERLAY_READY,      /* axoverlay initialized */
+    STARTUP_SERIAL_READY,       /* Serial port opened and configured */
+    STARTUP_FIRST_SAMPLE,       /* First value read from the device */
+    STARTUP_FIRST_OVERLAY,      /* First overlay with content rendered */
+    STARTUP_N_MILESTONES
+};
+
+/******************** GLOBAL FUNCTION DECLARATION SECTION *********************/
+
+/**
+ * Set process start time, call first thing in main().
+ */
+void startup_begin(void);
+
+/**
+ * Record that a milestone was reached, only the first call per milestone
+ * is recorded. Main thread only.
+ */
+void startup_mark(enum startup_milestone milestone);
+
+/**
+ * Get time from start to milestone in us.
+ *
+ * @return Elapsed time or -1 if the milestone has not been reached yet.
+ */
+gint64 startup_elapsed(enum startup_milestone milestone);
+
+#endif // INCLUSION_GUARD_STARTUP_H
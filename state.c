@@ -0,0 +1,283 @@
+#include <glib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "state.h"
+#include "values.h"
+#include "probe.h"
+#include "profile.h"
+#include "debug.h"
+
+/** @file state.c
+ * @Brief Persisted state implementation
+ *
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+/******************** LOCAL VARIABLE DECLARATION SECTION **********************/
+
+struct state_header
+{
+    gchar magic[8];
+    guint32 version;
+    guint32 n_sections;
+    gint64 saved_us;
+} __attribute__((packed));
+
+struct state_section_header
+{
+    guint32 tag;
+    guint32 len;
+} __attribute__((packed));
+
+/**
+ * Value cache entry as stored in STATE_SECTION_VALUES.
+ */
+struct state_value
+{
+    gchar name[VALUES_NAME_SIZE];
+    gdouble number;
+    guint8 numeric;
+    gchar text[VALUES_TEXT_SIZE];
+} __attribute__((packed));
+
+static gchar *state_path = NULL;
+static guint state_timer = 0;
+static guint32 saved_generation = 0;
+static guint32 saved_probe_generation = 0;
+static gint64 saved_at_us = 0;
+
+/******************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static gboolean state_load(const gchar *path);
+
+static void restore_values(const guchar *data, gsize len);
+
+static gboolean on_state_timer(gpointer data);
+
+/******************** LOCAL FUNCTION DEFINTION SECTION ************************/
+
+static void restore_values(const guchar *data, gsize len)
+{
+    gsize n = len / sizeof(struct state_value);
+    gsize i = 0;
+
+    for (; i < n; i++) {
+        struct state_value sv;
+
+        /* Copy out, the mapping gives no alignment guarantees */
+        memcpy(&sv, data + i * sizeof(sv), sizeof(sv));
+        sv.name[sizeof(sv.name) - 1] = '\0';
+        sv.text[sizeof(sv.text) - 1] = '\0';
+
+        gint id = values_add_point(sv.name);
+
+        if (sv.numeric) {
+            values_set_number(id, sv.number);
+        } else {
+            values_set_text(id, sv.text, strlen(sv.text));
+        }
+        values_set_stale(id);
+    }
+}
+
+static gboolean state_load(const gchar *path)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        LOG("No saved state in %s", path);
+        return FALSE;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(struct state_header)) {
+        close(fd);
+        return FALSE;
+    }
+
+    gsize size = st.st_size;
+    const guchar *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        ERR("Failed to map %s: %s", path, strerror(errno));
+        return FALSE;
+    }
+
+    struct state_header hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+
+    if (memcmp(hdr.magic, STATE_MAGIC, sizeof(hdr.magic)) ||
+        hdr.version != STATE_VERSION) {
+        ERR("Ignoring %s, not a version %d state file", path, STATE_VERSION);
+        munmap((void *) map, size);
+        return FALSE;
+    }
+
+    gsize pos = sizeof(hdr);
+    guint32 i = 0;
+
+    for (; i < hdr.n_sections; i++) {
+        struct state_section_header section;
+
+        if (size - pos < sizeof(section)) {
+            break;
+        }
+        memcpy(&section, map + pos, sizeof(section));
+        pos += sizeof(section);
+
+        if (section.len > size - pos) {
+            ERR("Truncated section %u in %s", section.tag, path);
+            break;
+        }
+
+        switch (section.tag) {
+            case STATE_SECTION_VALUES:
+                restore_values(map + pos, section.len);
+                break;
+            case STATE_SECTION_PROBE:
+                probe_restore(map + pos, section.len);
+                break;
+            default:
+                break;
+        }
+
+        pos += section.len;
+    }
+
+    munmap((void *) map, size);
+
+    LOG("Restored %u values saved %lld s ago from %s", values_count(),
+        (long long) (g_get_real_time() - hdr.saved_us) / G_USEC_PER_SEC,
+        path);
+
+    return TRUE;
+}
+
+static gboolean on_state_timer(gpointer data)
+{
+    gint64 now = g_get_monotonic_time();
+
+    if (now - saved_at_us >= (gint64) STATE_MIN_INTERVAL_S * G_USEC_PER_SEC) {
+        state_save();
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+gboolean state_init(const gchar *path)
+{
+    g_assert(path);
+
+    g_free(state_path);
+    state_path = g_strdup(path);
+
+    gboolean restored = state_load(path);
+
+    /* Restoring is not a change worth saving */
+    saved_generation = values_generation();
+    saved_probe_generation = probe_generation();
+    saved_at_us = g_get_monotonic_time();
+
+    if (!state_timer) {
+        state_timer = profile_timeout_add_seconds("state save",
+            STATE_CHECK_INTERVAL_S, on_state_timer, NULL);
+    }
+
+    return restored;
+}
+
+gboolean state_save(void)
+{
+    if (!state_path || (values_generation() == saved_generation &&
+                        probe_generation() == saved_probe_generation)) {
+        return TRUE;
+    }
+
+    const struct probe_result *probed;
+    guint n_probed = probe_get_cache(&probed);
+    gsize probe_len = n_probed * sizeof(struct probe_result);
+
+    guint n = values_count();
+    gsize values_len = n * sizeof(struct state_value);
+    gsize len = sizeof(struct state_header) +
+        2 * sizeof(struct state_section_header) + values_len + probe_len;
+    guchar *buf = g_malloc0(len);
+
+    struct state_header hdr = {
+        .version    = STATE_VERSION,
+        .n_sections = 2,
+        .saved_us   = g_get_real_time(),
+    };
+    memcpy(hdr.magic, STATE_MAGIC, sizeof(hdr.magic));
+    memcpy(buf, &hdr, sizeof(hdr));
+
+    struct state_section_header section = {
+        .tag = STATE_SECTION_VALUES,
+        .len = values_len,
+    };
+    memcpy(buf + sizeof(hdr), &section, sizeof(section));
+
+    guchar *p = buf + sizeof(hdr) + sizeof(section);
+    guint i = 0;
+    for (; i < n; i++) {
+        const value_point *point = values_get(i);
+        struct state_value sv;
+
+        memset(&sv, 0, sizeof(sv));
+        g_strlcpy(sv.name, point->name, sizeof(sv.name));
+        g_strlcpy(sv.text, point->text, sizeof(sv.text));
+        sv.number  = point->number;
+        sv.numeric = point->numeric;
+
+        memcpy(p, &sv, sizeof(sv));
+        p += sizeof(sv);
+    }
+
+    section.tag = STATE_SECTION_PROBE;
+    section.len = probe_len;
+    memcpy(p, &section, sizeof(section));
+    memcpy(p + sizeof(section), probed, probe_len);
+
+    /* g_file_set_contents() writes a temp file and renames it into place */
+    GError *error = NULL;
+    gboolean ok = g_file_set_contents(state_path, (const gchar *) buf, len,
+        &error);
+    g_free(buf);
+
+    if (!ok) {
+        ERR("Failed to save state: %s", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    saved_generation = values_generation();
+    saved_probe_generation = probe_generation();
+    saved_at_us = g_get_monotonic_time();
+
+    DBG_LOG("Saved %u values to %s", n, state_path);
+
+    return TRUE;
+}
+
+void state_cleanup(void)
+{
+    if (state_timer) {
+        g_source_remove(state_timer);
+        state_timer = 0;
+    }
+
+    state_save();
+
+    g_free(state_path);
+    state_path = NULL;
+}
@@ -0,0 +1,66 @@
+#ifndef INCLUSION_GUARD_STATE_H
+#define INCLUSION_GUARD_STATE_H
+
+#include <glib.h>
+
+/** @file state.h
+ * @Brief Persisted last known state for instant startup
+ *
+ * The value cache is saved to a small versioned binary file and restored
+ * at startup, restored values are marked stale until the first successful
+ * poll updates them. Saves are coalesced: the file is written at most once
+ * per STATE_MIN_INTERVAL_S and only when something changed since the last
+ * save, to keep flash wear down.
+ *
+ * File layout (host byte order):
+ *
+ *   header:  "RS232STA" (8 bytes), uint32 version, uint32 section count,
+ *            int64 realtime of save in us
+ *   section: uint32 tag, uint32 length, length bytes of data
+ *
+ * Unknown sections are skipped when loading. Cached slave capabilities
+ * from probe.h are kept in their own section, so a slave is not probed
+ * again after a restart.
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define STATE_MAGIC "RS232STA"
+#define STATE_VERSION (1)
+
+/* Minimum time between two writes of the state file */
+#define STATE_MIN_INTERVAL_S (300)
+
+/* How often to check whether the state needs saving */
+#define STATE_CHECK_INTERVAL_S (10)
+
+/******************** TYPE DEFINITION SECTION *********************************/
+
+enum state_section
+{
+    STATE_SECTION_VALUES = 1,
+    STATE_SECTION_PROBE = 2
+};
+
+/******************** GLOBAL FUNCTION DECLARATION SECTION *********************/
+
+/**
+ * Restore state from path and start coalesced saving to it.
+ *
+ * @return TRUE if a previous state was restored.
+ */
+gboolean state_init(const gchar *path);
+
+/**
+ * Write the state file now if anything changed since the last save.
+ *
+ * @return TRUE on success or if nothing needed saving.
+ */
+gboolean state_save(void);
+
+/**
+ * Save pending changes and stop saving.
+ */
+void state_cleanup(void);
+
+#endif // INCLUSION_GUARD_STATE_H
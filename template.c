@@ -0,0 +1,365 @@
+#include <glib.h>
+#include <glib/gprintf.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "template.h"
+#include "values.h"
+#include "debug.h"
+
+/** @file template.c
+ * @Brief Overlay text template implementation
+ *
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define SEGMENT_TEXT_SIZE VALUES_TEXT_SIZE
+
+/* Bits of a register rendered by the bN format at most */
+#define MAX_BITS (32)
+
+/******************** LOCAL VARIABLE DECLARATION SECTION **********************/
+
+enum segment_type
+{
+    SEGMENT_LITERAL,
+    SEGMENT_TEXT,           /* {name} */
+    SEGMENT_FIXED,          /* {name:.Nf} */
+    SEGMENT_INT,            /* {name:d} */
+    SEGMENT_HEX,            /* {name:x} */
+    SEGMENT_BITS            /* {name:bN} */
+};
+
+struct segment
+{
+    enum segment_type type;
+    guint arg;                      /* Decimals or number of bits */
+    gchar name[VALUES_NAME_SIZE];
+    gint point;                     /* Value cache id, -1 until it exists */
+    guint32 changes;                /* Point changes when last rendered */
+    guint8 quality;                 /* Point quality when last rendered */
+    gboolean rendered;
+    gsize len;
+    gchar text[SEGMENT_TEXT_SIZE];  /* Literal or rendered field */
+};
+
+struct template
+{
+    struct segment segments[TEMPLATE_MAX_SEGMENTS];
+    guint n_segments;
+    gboolean composed;
+    gsize len;
+    gchar text[TEMPLATE_TEXT_SIZE];
+};
+
+/******************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static struct segment *add_segment(struct template *tpl,
+                                   enum segment_type type);
+
+static gboolean add_literal(struct template *tpl, const gchar *text,
+                            gsize len);
+
+static gboolean add_field(struct template *tpl, const gchar *field,
+                          gsize len);
+
+static gsize render_field(const struct segment *seg, const value_point *point,
+                          gboolean bad, gchar *buf);
+
+static void compose(struct template *tpl);
+
+/******************** LOCAL FUNCTION DEFINTION SECTION ************************/
+
+static struct segment *add_segment(struct template *tpl,
+                                   enum segment_type type)
+{
+    if (tpl->n_segments >= TEMPLATE_MAX_SEGMENTS) {
+        ERR("Template has more than %d segments", TEMPLATE_MAX_SEGMENTS);
+        return NULL;
+    }
+
+    struct segment *seg = &tpl->segments[tpl->n_segments++];
+    seg->type  = type;
+    seg->point = -1;
+
+    return seg;
+}
+
+static gboolean add_literal(struct template *tpl, const gchar *text,
+                            gsize len)
+{
+    /* Long literals are split over several segments */
+    while (len) {
+        struct segment *seg = add_segment(tpl, SEGMENT_LITERAL);
+
+        if (!seg) {
+            return FALSE;
+        }
+
+        seg->len = MIN(len, sizeof(seg->text) - 1);
+        memcpy(seg->text, text, seg->len);
+        seg->text[seg->len] = '\0';
+
+        text += seg->len;
+        len  -= seg->len;
+    }
+
+    return TRUE;
+}
+
+static gboolean add_field(struct template *tpl, const gchar *field,
+                          gsize len)
+{
+    const gchar *colon = memchr(field, ':', len);
+    gsize name_len = colon ? (gsize) (colon - field) : len;
+    const gchar *format = colon ? colon + 1 : NULL;
+    gsize format_len = colon ? len - name_len - 1 : 0;
+
+    if (name_len == 0 || name_len >= VALUES_NAME_SIZE) {
+        ERR("Bad field name '%.*s' in template", (int) len, field);
+        return FALSE;
+    }
+
+    enum segment_type type = SEGMENT_TEXT;
+    guint arg = 0;
+    gchar *end = NULL;
+
+    if (format_len == 0) {
+        type = SEGMENT_TEXT;
+    } else if (format_len == 1 && format[0] == 'd') {
+        type = SEGMENT_INT;
+    } else if (format_len == 1 && format[0] == 'x') {
+        type = SEGMENT_HEX;
+    } else if (format[0] == '.' && format_len >= 3 &&
+               format[format_len - 1] == 'f') {
+        type = SEGMENT_FIXED;
+        arg  = strtoul(format + 1, &end, 10);
+        if (end != format + format_len - 1 || arg > 9) {
+            type = SEGMENT_LITERAL;
+        }
+    } else if (format[0] == 'b' && format_len >= 2) {
+        type = SEGMENT_BITS;
+        arg  = strtoul(format + 1, &end, 10);
+        if (end != format + format_len || arg == 0 || arg > MAX_BITS) {
+            type = SEGMENT_LITERAL;
+        }
+    } else {
+        type = SEGMENT_LITERAL;
+    }
+
+    /* Literal marks a format that did not parse */
+    if (type == SEGMENT_LITERAL) {
+        ERR("Bad format '%.*s' in template", (int) format_len, format);
+        return FALSE;
+    }
+
+    struct segment *seg = add_segment(tpl, type);
+
+    if (!seg) {
+        return FALSE;
+    }
+
+    seg->arg = arg;
+    memcpy(seg->name, field, name_len);
+    seg->name[name_len] = '\0';
+
+    return TRUE;
+}
+
+static gsize render_field(const struct segment *seg, const value_point *point,
+                          gboolean bad, gchar *buf)
+{
+    gint n = 0;
+    guint32 bits = (guint32) (gint64) point->number;
+    guint i = 0;
+
+    /* Numeric formats of a non-numeric value show it as received */
+    enum segment_type type = point->numeric ? seg->type : SEGMENT_TEXT;
+
+    switch (type) {
+        case SEGMENT_FIXED:
+            n = g_snprintf(buf, SEGMENT_TEXT_SIZE, "%.*f", seg->arg,
+                point->number);
+            break;
+        case SEGMENT_INT:
+            n = g_snprintf(buf, SEGMENT_TEXT_SIZE, "%lld",
+                (long long) point->number);
+            break;
+        case SEGMENT_HEX:
+            n = g_snprintf(buf, SEGMENT_TEXT_SIZE, "%04x", bits);
+            break;
+        case SEGMENT_BITS:
+            for (; i < seg->arg; i++) {
+                buf[i] = (bits >> i) & 0x01 ? '1' : '0';
+            }
+            buf[i] = '\0';
+            n = i;
+            break;
+        default:
+            n = g_strlcpy(buf, point->text, SEGMENT_TEXT_SIZE);
+            break;
+    }
+
+    n = MIN((gsize) MAX(n, 0), SEGMENT_TEXT_SIZE - 1);
+
+    if (bad) {
+        n += g_strlcpy(buf + n, TEMPLATE_BAD_MARK, SEGMENT_TEXT_SIZE - n);
+    }
+
+    return MIN((gsize) n, SEGMENT_TEXT_SIZE - 1);
+}
+
+static void compose(struct template *tpl)
+{
+    gsize pos = 0;
+    guint i = 0;
+
+    for (; i < tpl->n_segments; i++) {
+        const struct segment *seg = &tpl->segments[i];
+        gsize n = MIN(seg->len, sizeof(tpl->text) - 1 - pos);
+
+        memcpy(&tpl->text[pos], seg->text, n);
+        pos += n;
+    }
+
+    tpl->text[pos] = '\0';
+    tpl->len = pos;
+    tpl->composed = TRUE;
+}
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+struct template *template_new(const gchar *source)
+{
+    g_assert(source);
+
+    struct template *tpl = g_new0(struct template, 1);
+    const gchar *p = source;
+    const gchar *literal = p;
+
+    while (*p) {
+        /* Escaped brace, keep the first one as part of the literal */
+        if ((p[0] == '{' && p[1] == '{') || (p[0] == '}' && p[1] == '}')) {
+            if (!add_literal(tpl, literal, p + 1 - literal)) {
+                goto error;
+            }
+            p += 2;
+            literal = p;
+            continue;
+        }
+
+        if (*p == '}') {
+            ERR("Unmatched '}' at offset %d in template", (int) (p - source));
+            goto error;
+        }
+
+        if (*p != '{') {
+            p++;
+            continue;
+        }
+
+        const gchar *end = strchr(p, '}');
+
+        if (!end) {
+            ERR("Unterminated field at offset %d in template",
+                (int) (p - source));
+            goto error;
+        }
+
+        if (!add_literal(tpl, literal, p - literal) ||
+            !add_field(tpl, p + 1, end - p - 1)) {
+            goto error;
+        }
+
+        p = end + 1;
+        literal = p;
+    }
+
+    if (!add_literal(tpl, literal, p - literal)) {
+        goto error;
+    }
+
+    return tpl;
+
+error:
+    g_free(tpl);
+
+    return NULL;
+}
+
+void template_free(struct template **tpl)
+{
+    if (!tpl) {
+        return;
+    }
+
+    g_free(*tpl);
+    *tpl = NULL;
+}
+
+gboolean template_update(struct template *tpl)
+{
+    g_assert(tpl);
+
+    gboolean changed = FALSE;
+    guint i = 0;
+
+    for (; i < tpl->n_segments; i++) {
+        struct segment *seg = &tpl->segments[i];
+
+        if (seg->type == SEGMENT_LITERAL) {
+            continue;
+        }
+
+        /* Points show up once first read, resolve until then */
+        if (seg->point < 0) {
+            seg->point = values_lookup(seg->name);
+        }
+
+        const value_point *point = values_get(seg->point);
+
+        if (!point) {
+            seg->point = -1;
+            continue;
+        }
+
+        guint8 quality = values_get_status(seg->point)->quality;
+
+        if (seg->rendered && seg->changes == point->changes &&
+            seg->quality == quality) {
+            continue;
+        }
+        seg->changes  = point->changes;
+        seg->quality  = quality;
+        seg->rendered = TRUE;
+
+        gchar buf[SEGMENT_TEXT_SIZE];
+        gsize len = render_field(seg, point, quality != VALUE_GOOD, buf);
+
+        /* A change below the shown precision does not change the text */
+        if (len == seg->len && memcmp(buf, seg->text, len) == 0) {
+            continue;
+        }
+
+        memcpy(seg->text, buf, len);
+        seg->text[len] = '\0';
+        seg->len = len;
+        changed = TRUE;
+    }
+
+    if (!changed && tpl->composed) {
+        return FALSE;
+    }
+
+    compose(tpl);
+
+    return TRUE;
+}
+
+const gchar *template_get_text(const struct template *tpl)
+{
+    g_assert(tpl);
+
+    return tpl->text;
+}
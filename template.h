@@ -0,0 +1,72 @@
+#ifndef INCLUSION_GUARD_TEMPLATE_H
+#define INCLUSION_GUARD_TEMPLATE_H
+
+#include <glib.h>
+
+#include "values.h"
+
+/** @file template.h
+ * @Brief Precompiled overlay text templates
+ *
+ * A template such as "Hum {hum:.1f}% bits {REG1:b4}" is parsed once into a
+ * list of segments, literal text and value cache fields. Rendering only
+ * formats the fields whose value changed since the last render and joins
+ * the segments into a fixed size buffer, nothing is allocated after
+ * template_new().
+ *
+ * Field syntax is {name} or {name:format} where format is one of:
+ *
+ *   (none)  value as received
+ *   .Nf     number with N decimals
+ *   d       integer
+ *   x       hexadecimal integer, four digits
+ *   bN      lowest N bits, least significant bit first
+ *
+ * Use {{ and }} for literal braces. Fields whose point does not exist yet
+ * render as nothing, output that does not fit is truncated. Fields of
+ * points that are not VALUE_GOOD show their last value followed by
+ * TEMPLATE_BAD_MARK.
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define TEMPLATE_MAX_SEGMENTS (32)
+#define TEMPLATE_TEXT_SIZE (256)
+
+/* Appended to fields of stale or failed points */
+#define TEMPLATE_BAD_MARK "?"
+
+/******************** TYPE DEFINITION SECTION *********************************/
+
+/**
+ * Forward declaration of compiled template.
+ */
+struct template;
+
+/******************** GLOBAL FUNCTION DECLARATION SECTION *********************/
+
+/**
+ * Compile template source.
+ *
+ * @return Template or NULL on syntax error.
+ */
+struct template *template_new(const gchar *source);
+
+/**
+ * Destroy template.
+ */
+void template_free(struct template **tpl);
+
+/**
+ * Re-render fields whose values changed.
+ *
+ * @return TRUE if the text changed since the last call.
+ */
+gboolean template_update(struct template *tpl);
+
+/**
+ * Get rendered text, valid until the next template_update().
+ */
+const gchar *template_get_text(const struct template *tpl);
+
+#endif // INCLUSION_GUARD_TEMPLATE_H
@@ -0,0 +1,220 @@
+#include <glib.h>
+#include <glib-unix.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "ticker.h"
+#include "profile.h"
+#include "debug.h"
+
+/** @file ticker.c
+ * @Brief Periodic timer implementation
+ *
+ */
+
+/******************** LOCAL VARIABLE DECLARATION SECTION **********************/
+
+struct ticker
+{
+    int fd;
+    guint watch;
+    ticker_func func;
+    gpointer data;
+
+    gint64 start_us;            /* Deadline n is start_us + n * period_us */
+    gint64 period_us;
+    guint64 expirations;        /* Deadlines passed since start */
+    gint64 last_us;             /* Time of last callback */
+
+    struct ticker_stats stats;
+};
+
+/******************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static void reset_stats(struct ticker *ticker);
+
+static gint64 percentile(const struct ticker_stats *stats, guint permille);
+
+static gboolean on_tick(gint fd, GIOCondition condition, gpointer data);
+
+/******************** LOCAL FUNCTION DEFINTION SECTION ************************/
+
+static void reset_stats(struct ticker *ticker)
+{
+    memset(&ticker->stats, 0, sizeof(ticker->stats));
+    ticker->stats.period_min_us = G_MAXINT64;
+}
+
+/*
+ * Upper bound of the lateness bucket holding the given fraction of ticks
+ */
+static gint64 percentile(const struct ticker_stats *stats, guint permille)
+{
+    guint64 total = 0;
+    guint64 sum = 0;
+    guint i;
+
+    for (i = 0; i < TICKER_BUCKETS; i++) {
+        total += stats->late_buckets[i];
+    }
+
+    for (i = 0; i < TICKER_BUCKETS; i++) {
+        sum += stats->late_buckets[i];
+
+        if (sum * 1000 >= total * permille) {
+            break;
+        }
+    }
+
+    return (gint64) 1 << MIN(i, TICKER_BUCKETS - 1);
+}
+
+static gboolean on_tick(gint fd, GIOCondition condition, gpointer data)
+{
+    struct ticker *ticker = data;
+    guint64 n = 0;
+
+    if (read(fd, &n, sizeof(n)) != sizeof(n) || !n) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    gint64 now = g_get_monotonic_time();
+    struct ticker_stats *stats = &ticker->stats;
+
+    ticker->expirations += n;
+
+    /* Lateness against the latest deadline, earlier ones were missed */
+    gint64 late = now - (ticker->start_us +
+        (gint64) ticker->expirations * ticker->period_us);
+    guint bucket = late > 0 ? 64 - __builtin_clzll(late) : 0;
+
+    stats->ticks++;
+    stats->missed += n - 1;
+    stats->late_max_us = MAX(stats->late_max_us, late);
+    stats->late_buckets[MIN(bucket, TICKER_BUCKETS - 1)]++;
+
+    if (ticker->last_us) {
+        gint64 period = now - ticker->last_us;
+
+        stats->period_min_us = MIN(stats->period_min_us, period);
+        stats->period_max_us = MAX(stats->period_max_us, period);
+        stats->period_sum_us += period;
+        stats->period_sum_sq_us += (gdouble) period * period;
+        stats->periods++;
+    }
+    ticker->last_us = now;
+
+    ticker->func(ticker->data);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+struct ticker *ticker_new(guint period_ms, ticker_func func, gpointer data)
+{
+    g_assert(period_ms);
+    g_assert(func);
+
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (fd < 0) {
+        ERR("Failed to create timer: %s", strerror(errno));
+        return NULL;
+    }
+
+    struct ticker *ticker = g_new0(struct ticker, 1);
+    struct timespec now;
+
+    /* g_get_monotonic_time() is CLOCK_MONOTONIC as well */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    ticker->fd        = fd;
+    ticker->func      = func;
+    ticker->data      = data;
+    ticker->period_us = (gint64) period_ms * 1000;
+    ticker->start_us  = (gint64) now.tv_sec * G_USEC_PER_SEC +
+        now.tv_nsec / 1000;
+    reset_stats(ticker);
+
+    gint64 first_us = ticker->start_us + ticker->period_us;
+    struct itimerspec spec = {
+        .it_value = {
+            .tv_sec  = first_us / G_USEC_PER_SEC,
+            .tv_nsec = (first_us % G_USEC_PER_SEC) * 1000,
+        },
+        .it_interval = {
+            .tv_sec  = period_ms / 1000,
+            .tv_nsec = (period_ms % 1000) * 1000000L,
+        },
+    };
+
+    if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL)) {
+        ERR("Failed to start timer: %s", strerror(errno));
+        close(fd);
+        g_free(ticker);
+        return NULL;
+    }
+
+    ticker->watch = profile_fd_add("poll tick", fd, G_IO_IN, on_tick, ticker);
+
+    return ticker;
+}
+
+void ticker_free(struct ticker **ticker)
+{
+    if (!ticker || !*ticker) {
+        return;
+    }
+
+    g_source_remove((*ticker)->watch);
+    close((*ticker)->fd);
+    g_free(*ticker);
+    *ticker = NULL;
+}
+
+void ticker_get_stats(struct ticker *ticker, struct ticker_stats *stats)
+{
+    g_assert(ticker);
+    g_assert(stats);
+
+    *stats = ticker->stats;
+}
+
+guint ticker_get_period_ms(struct ticker *ticker)
+{
+    g_assert(ticker);
+
+    return ticker->period_us / 1000;
+}
+
+void ticker_report(struct ticker *ticker, const gchar *name)
+{
+    g_assert(ticker);
+
+    const struct ticker_stats *stats = &ticker->stats;
+
+    if (!stats->periods) {
+        return;
+    }
+
+    gdouble mean = stats->period_sum_us / stats->periods;
+    gdouble var = stats->period_sum_sq_us / stats->periods - mean * mean;
+
+    LOG("%s period %.3f ms: mean %.3f sd %.3f min %.3f max %.3f ms, "
+        "lateness p50 < %lld us p99 < %lld us max %lld us, "
+        "%llu missed of %llu ticks",
+        name, ticker->period_us / 1000.0, mean / 1000,
+        sqrt(MAX(var, 0)) / 1000,
+        stats->period_min_us / 1000.0, stats->period_max_us / 1000.0,
+        (long long) percentile(stats, 500),
+        (long long) percentile(stats, 990),
+        (long long) stats->late_max_us,
+        (unsigned long long) stats->missed,
+        (unsigned long long) stats->ticks);
+
+    reset_stats(ticker);
+}
@@ -0,0 +1,81 @@
+#ifndef INCLUSION_GUARD_TICKER_H
+#define INCLUSION_GUARD_TICKER_H
+
+#include <glib.h>
+
+/** @file ticker.h
+ * @Brief Drift-free periodic timer on CLOCK_MONOTONIC
+ *
+ * Ticks are due at start + n * period, taken from a timerfd with an
+ * absolute first deadline. Time spent in the callback or in a busy main
+ * loop delays a tick but never shifts the ones after it, unlike
+ * g_timeout_add() which schedules each tick relative to the last
+ * dispatch. Ticks that are missed entirely are counted, not made up for.
+ *
+ * Every tick records its lateness and the achieved period, see
+ * ticker_report().
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+/* Lateness histogram buckets, bucket n holds lateness below 2^n us */
+#define TICKER_BUCKETS (24)
+
+/******************** TYPE DEFINITION SECTION *********************************/
+
+/**
+ * Forward-declared ticker handle.
+ */
+struct ticker;
+
+/**
+ * Called on every tick.
+ */
+typedef void (*ticker_func)(gpointer data);
+
+/**
+ * Ticker counters.
+ */
+struct ticker_stats
+{
+    guint64 ticks;
+    guint64 missed;             /* Ticks lost to a blocked main loop */
+    gint64 period_min_us;       /* Achieved period between callbacks */
+    gint64 period_max_us;
+    gdouble period_sum_us;
+    gdouble period_sum_sq_us;
+    guint64 periods;
+    gint64 late_max_us;         /* Callback time after deadline */
+    guint64 late_buckets[TICKER_BUCKETS];
+};
+
+/******************** GLOBAL FUNCTION DECLARATION SECTION *********************/
+
+/**
+ * Start calling func every period_ms, first after one period.
+ *
+ * @return Ticker handle or NULL on error.
+ */
+struct ticker *ticker_new(guint period_ms, ticker_func func, gpointer data);
+
+/**
+ * Stop ticking and free the ticker.
+ */
+void ticker_free(struct ticker **ticker);
+
+/**
+ * Get ticker counters.
+ */
+void ticker_get_stats(struct ticker *ticker, struct ticker_stats *stats);
+
+/**
+ * Get the period the ticker was started with.
+ */
+guint ticker_get_period_ms(struct ticker *ticker);
+
+/**
+ * Log the achieved period and lateness distribution since the last report.
+ */
+void ticker_report(struct ticker *ticker, const gchar *name);
+
+#endif // INCLUSION_GUARD_TICKER_H
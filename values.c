@@ -0,0 +1,297 @@
+#include <glib.h>
+#include <glib/gprintf.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "values.h"
+
+/** @file values.c
+ * @Brief Value cache implementation
+ *
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+/******************** LOCAL VARIABLE DECLARATION SECTION **********************/
+
+static value_point points[VALUES_MAX_POINTS];
+static value_status status[VALUES_MAX_POINTS];
+static guint64 bad[VALUES_BITMAP_WORDS];
+static guint n_points = 0;
+static guint32 generation = 0;
+
+/******************** LOCAL FUNCTION DECLARATION SECTION **********************/
+
+static void values_touch(gint id);
+
+static void set_quality(gint id, enum value_quality quality,
+                        guint8 exception);
+
+/******************** LOCAL FUNCTION DEFINTION SECTION ************************/
+
+static void values_touch(gint id)
+{
+    status[id].updated_us = g_get_monotonic_time();
+    status[id].failures   = 0;
+
+    set_quality(id, VALUE_GOOD, 0);
+}
+
+/*
+ * Quality changes count as changes for the overlay, the value does not
+ */
+static void set_quality(gint id, enum value_quality quality,
+                        guint8 exception)
+{
+    value_status *st = &status[id];
+
+    if (st->quality == quality && st->exception == exception) {
+        return;
+    }
+
+    st->quality   = quality;
+    st->exception = exception;
+
+    if (quality == VALUE_GOOD) {
+        bad[id / 64] &= ~(G_GUINT64_CONSTANT(1) << (id % 64));
+    } else {
+        bad[id / 64] |= G_GUINT64_CONSTANT(1) << (id % 64);
+    }
+    generation++;
+}
+
+/******************** GLOBAL FUNCTION DEFINTION SECTION ***********************/
+
+gint values_add_point(const gchar *name)
+{
+    g_assert(name);
+
+    gint id = values_lookup(name);
+
+    if (id >= 0) {
+        return id;
+    }
+
+    if (n_points >= VALUES_MAX_POINTS) {
+        return -1;
+    }
+
+    value_point *point = &points[n_points];
+    memset(point, 0, sizeof(*point));
+    memset(&status[n_points], 0, sizeof(status[n_points]));
+    g_strlcpy(point->name, name, sizeof(point->name));
+
+    return n_points++;
+}
+
+gint values_lookup(const gchar *name)
+{
+    g_assert(name);
+
+    guint i = 0;
+    for (; i < n_points; i++) {
+        if (strncmp(points[i].name, name, VALUES_NAME_SIZE) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+gboolean values_set_number(gint id, gdouble number)
+{
+    if (id < 0 || id >= n_points) {
+        return FALSE;
+    }
+
+    value_point *point = &points[id];
+    values_touch(id);
+
+    if (point->numeric && point->number == number) {
+        return FALSE;
+    }
+
+    point->number  = number;
+    point->numeric = TRUE;
+    g_snprintf(point->text, sizeof(point->text), "%g", number);
+    point->changes++;
+    generation++;
+
+    return TRUE;
+}
+
+gboolean values_set_text(gint id, const gchar *text, gsize len)
+{
+    g_assert(text);
+
+    if (id < 0 || id >= n_points) {
+        return FALSE;
+    }
+
+    value_point *point = &points[id];
+    values_touch(id);
+
+    len = MIN(len, sizeof(point->text) - 1);
+
+    if (strncmp(point->text, text, len) == 0 && point->text[len] == '\0') {
+        return FALSE;
+    }
+
+    memcpy(point->text, text, len);
+    point->text[len] = '\0';
+
+    /* Leading numbers with a trailing unit such as "12.5kg" count as numeric */
+    gchar *end = NULL;
+    point->number  = g_ascii_strtod(point->text, &end);
+    point->numeric = end != point->text;
+
+    point->changes++;
+    generation++;
+
+    return TRUE;
+}
+
+void values_set_stale(gint id)
+{
+    if (id < 0 || id >= n_points) {
+        return;
+    }
+
+    /* The value was not read by this run */
+    status[id].updated_us = 0;
+    set_quality(id, VALUE_STALE, 0);
+}
+
+void values_set_quality(gint id, enum value_quality quality, guint8 exception)
+{
+    if (id < 0 || id >= n_points) {
+        return;
+    }
+
+    if (quality != VALUE_GOOD && quality != VALUE_STALE &&
+        status[id].failures < G_MAXUINT16) {
+        status[id].failures++;
+    }
+
+    set_quality(id, quality, quality == VALUE_EXCEPTION ? exception : 0);
+}
+
+void values_set_max_age(gint id, guint32 max_age_ms)
+{
+    if (id < 0 || id >= n_points) {
+        return;
+    }
+
+    status[id].max_age_ms = max_age_ms;
+}
+
+guint values_expire(gint64 now, values_func expired)
+{
+    guint n = 0;
+    guint i = 0;
+
+    for (; i < n_points; i++) {
+        const value_status *st = &status[i];
+
+        /* Failed reads already tell why the value is old */
+        if (st->quality != VALUE_GOOD || !st->max_age_ms ||
+            now - st->updated_us <= (gint64) st->max_age_ms * 1000) {
+            continue;
+        }
+
+        set_quality(i, VALUE_STALE, 0);
+        n++;
+
+        if (expired) {
+            expired(i);
+        }
+    }
+
+    return n;
+}
+
+const value_status *values_get_status(gint id)
+{
+    if (id < 0 || id >= n_points) {
+        return NULL;
+    }
+
+    return &status[id];
+}
+
+const guint64 *values_get_bad(void)
+{
+    return bad;
+}
+
+gboolean values_any_bad(void)
+{
+    guint64 any = 0;
+    guint w = 0;
+
+    for (; w < VALUES_BITMAP_WORDS; w++) {
+        any |= bad[w];
+    }
+
+    return any != 0;
+}
+
+gint64 values_age_us(gint id, gint64 now)
+{
+    if (id < 0 || id >= n_points || !status[id].updated_us) {
+        return -1;
+    }
+
+    return now - status[id].updated_us;
+}
+
+const gchar *values_quality_name(enum value_quality quality)
+{
+    static const gchar *names[] = {
+        [VALUE_GOOD]        = "good",
+        [VALUE_STALE]       = "stale",
+        [VALUE_CRC_ERROR]   = "CRC error",
+        [VALUE_TIMEOUT]     = "timeout",
+        [VALUE_EXCEPTION]   = "exception",
+        [VALUE_FRAME_ERROR] = "bad frame",
+    };
+
+    return quality < G_N_ELEMENTS(names) ? names[quality] : "?";
+}
+
+void values_set_received(gint id, const value_time *time)
+{
+    g_assert(time);
+
+    if (id < 0 || id >= n_points) {
+        return;
+    }
+
+    points[id].received = *time;
+}
+
+const value_point *values_get(gint id)
+{
+    if (id < 0 || id >= n_points) {
+        return NULL;
+    }
+
+    return &points[id];
+}
+
+guint values_count(void)
+{
+    return n_points;
+}
+
+guint32 values_generation(void)
+{
+    return generation;
+}
+
+void values_clear(void)
+{
+    memset(bad, 0, sizeof(bad));
+    n_points = 0;
+    generation++;
+}
@@ -0,0 +1,201 @@
+#ifndef INCLUSION_GUARD_VALUES_H
+#define INCLUSION_GUARD_VALUES_H
+
+#include <glib.h>
+
+/** @file values.h
+ * @Brief Cache of the latest sampled value of every data point
+ *
+ * Protocol engines store what they read here and consumers such as the
+ * overlay pick values up from here, so neither side needs to know about the
+ * other. Points are addressed by a small integer id handed out by
+ * values_add_point() and stored in a fixed table, updating a value never
+ * allocates.
+ *
+ * Next to the values is a compact status table with the quality and age of
+ * every point, and a bitmap with a bit set for every point whose quality is
+ * not VALUE_GOOD, so e.g. "any bad points?" is a test of a few words.
+ * Storing a value makes it good, a failed read sets the cause and points
+ * given a max age go stale when not updated in time.
+ */
+
+/******************** MACRO DEFINITION SECTION ********************************/
+
+#define VALUES_MAX_POINTS (512)
+#define VALUES_NAME_SIZE (32)
+#define VALUES_TEXT_SIZE (48)
+
+/* Words in the bitmap of bad points */
+#define VALUES_BITMAP_WORDS (VALUES_MAX_POINTS / 64)
+
+/******************** TYPE DEFINITION SECTION *********************************/
+
+/**
+ * Receive time of a sample in microseconds, all 0 if not known.
+ */
+typedef struct value_time
+{
+    gint64 first_us;                /* Monotonic time of first byte */
+    gint64 last_us;                 /* Monotonic time of last byte */
+    gint64 first_utc_us;
+    gint64 last_utc_us;
+} value_time;
+
+/**
+ * Quality of a point.
+ */
+enum value_quality
+{
+    VALUE_GOOD,
+    VALUE_STALE,            /* Restored, or not updated within its max age */
+    VALUE_CRC_ERROR,        /* Last read got a reply with a bad checksum */
+    VALUE_TIMEOUT,          /* Last read got no reply */
+    VALUE_EXCEPTION,        /* Last read got an exception reply */
+    VALUE_FRAME_ERROR       /* Last read got a malformed or short reply */
+};
+
+/**
+ * Status of a single data point, the value is the last good one.
+ */
+typedef struct value_status
+{
+    gint64 updated_us;              /* Monotonic time of last update, 0 if
+                                     * not updated since start */
+    guint32 max_age_ms;             /* Stale when older, 0 never */
+    guint16 failures;               /* Failed reads since last update */
+    guint8 quality;                 /* enum value_quality */
+    guint8 exception;               /* Exception code, VALUE_EXCEPTION */
+} value_status;
+
+/**
+ * Called for a point, see values_expire().
+ */
+typedef void (*values_func)(gint id);
+
+/**
+ * A single data point.
+ */
+typedef struct value_point
+{
+    gchar name[VALUES_NAME_SIZE];
+    gdouble number;                 /* Numeric value, if numeric is TRUE */
+    gboolean numeric;
+    gchar text[VALUES_TEXT_SIZE];   /* Value as received / formatted */
+    guint32 changes;                /* Number of times the value changed */
+    value_time received;            /* Receive time of last update */
+} value_point;
+
+/******************** GLOBAL FUNCTION DECLARATION SECTION *********************/
+
+/**
+ * Add a point, or look up an existing point with the same name.
+ *
+ * @return Point id or -1 if the point table is full.
+ */
+gint values_add_point(const gchar *name);
+
+/**
+ * Look up a point by name.
+ *
+ * @return Point id or -1 if no such point exists.
+ */
+gint values_lookup(const gchar *name);
+
+/**
+ * Store a numeric value.
+ *
+ * @return TRUE if the value changed.
+ */
+gboolean values_set_number(gint id, gdouble number);
+
+/**
+ * Store a text value of len bytes, not necessarily NUL terminated. The text
+ * is also parsed as a number when possible.
+ *
+ * @return TRUE if the value changed.
+ */
+gboolean values_set_text(gint id, const gchar *text, gsize len);
+
+/**
+ * Mark value as stale, e.g. restored from a previous run. Cleared by the
+ * next update of the value.
+ */
+void values_set_stale(gint id);
+
+/**
+ * Set quality of a point whose read failed, with the exception code of
+ * VALUE_EXCEPTION. The value is kept, the next update makes it good again.
+ */
+void values_set_quality(gint id, enum value_quality quality, guint8 exception);
+
+/**
+ * Let a point go stale when not updated for max_age_ms, 0 never.
+ */
+void values_set_max_age(gint id, guint32 max_age_ms);
+
+/**
+ * Mark points not updated within their max age as VALUE_STALE, calling
+ * expired, if not NULL, for each of them.
+ *
+ * @return Number of points that went stale.
+ */
+guint values_expire(gint64 now, values_func expired);
+
+/**
+ * Get status of a point by id.
+ *
+ * @return The status or NULL for an invalid id.
+ */
+const value_status *values_get_status(gint id);
+
+/**
+ * Get bitmap of the points that are not VALUE_GOOD, point id bit of word
+ * id / 64, VALUES_BITMAP_WORDS words.
+ */
+const guint64 *values_get_bad(void);
+
+/**
+ * Check if any point is not VALUE_GOOD.
+ */
+gboolean values_any_bad(void);
+
+/**
+ * Get age of the value of a point at monotonic time now.
+ *
+ * @return Age in microseconds, -1 if not updated since start.
+ */
+gint64 values_age_us(gint id, gint64 now);
+
+/**
+ * Get short name of a quality, e.g. for the overlay.
+ */
+const gchar *values_quality_name(enum value_quality quality);
+
+/**
+ * Set receive time of the latest value, call after storing it.
+ */
+void values_set_received(gint id, const value_time *time);
+
+/**
+ * Get a point by id.
+ *
+ * @return The point or NULL for an invalid id.
+ */
+const value_point *values_get(gint id);
+
+/**
+ * Get number of points.
+ */
+guint values_count(void);
+
+/**
+ * Get the change generation, incremented whenever any value changes.
+ */
+guint32 values_generation(void);
+
+/**
+ * Remove all points.
+ */
+void values_clear(void);
+
+#endif // INCLUSION_GUARD_VALUES_H